@@ -0,0 +1,127 @@
+#ifndef BENCHBUS_H
+#define BENCHBUS_H
+
+#include <cstring>
+#include <fstream>
+
+#include "z80.h"
+#include "z80operations.h"
+
+/*
+ * Flat 64K RAM bus with the same timing as Z80sim, used by the benchmarks.
+ * The CP/M BDOS entry at 0x0005 is trapped like in Z80sim, but the console
+ * output is discarded.
+ */
+class BenchBus : public Z80operations
+{
+public:
+    uint64_t tstates;
+    uint8_t z80Ram[0x10000];
+    uint8_t z80Ports[0x10000];
+    // INT is active during the first 32 T-states of every period (0 = never)
+    uint32_t intPeriod;
+    bool finish;
+    Z80 cpu;
+
+    BenchBus() : tstates(0), intPeriod(0), finish(false), cpu(this) {
+        memset(z80Ram, 0, sizeof(z80Ram));
+        memset(z80Ports, 0xff, sizeof(z80Ports));
+    }
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        tstates += 4;
+        if (address == 0x0005 && cpu.getRegC() == 0) {
+            // BDOS 0 System Reset
+            finish = true;
+        }
+        return z80Ram[address];
+    }
+
+    uint8_t peek8(uint16_t address) override {
+        tstates += 3;
+        return z80Ram[address];
+    }
+
+    void poke8(uint16_t address, uint8_t value) override {
+        tstates += 3;
+        z80Ram[address] = value;
+    }
+
+    uint16_t peek16(uint16_t address) override {
+        uint8_t lsb = peek8(address);
+        uint8_t msb = peek8(address + 1);
+        return (msb << 8) | lsb;
+    }
+
+    void poke16(uint16_t address, RegisterPair word) override {
+        poke8(address, word.byte8.lo);
+        poke8(address + 1, word.byte8.hi);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        tstates += 4;
+        return z80Ports[port];
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        tstates += 4;
+        z80Ports[port] = value;
+    }
+
+    void addressOnBus(uint16_t address, int32_t wstates) override {
+        tstates += wstates;
+    }
+
+    void interruptHandlingTime(int32_t wstates) override {
+        tstates += wstates;
+    }
+
+    bool isActiveINT() override {
+        return intPeriod != 0 && tstates % intPeriod < 32;
+    }
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+    uint8_t breakpoint(uint16_t address, uint8_t opcode) override {
+        return opcode;
+    }
+#endif
+
+#ifdef WITH_EXEC_DONE
+    void execDone(void) override {}
+#endif
+
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override {}
+#endif
+
+    // Load a CP/M program at 0x100, with the same stubs as Z80sim
+    bool loadCPM(const char *fileName) {
+        std::ifstream f(fileName, std::ios::in | std::ios::binary);
+        if (!f.is_open()) {
+            return false;
+        }
+        f.read(reinterpret_cast<char *>(&z80Ram[0x100]), 0x10000 - 0x100);
+
+        z80Ram[0] = 0xC3;
+        z80Ram[1] = 0x00;
+        z80Ram[2] = 0x01; // JP 0x100 CP/M TPA
+        z80Ram[5] = 0xC9; // Return from BDOS call
+        return true;
+    }
+
+    // Load a raw image at 'address'
+    void load(uint16_t address, const uint8_t *code, size_t size) {
+        memcpy(&z80Ram[address], code, size);
+    }
+
+    // Execute until BDOS 0 or 'maxTstates', returns executed instructions
+    uint64_t run(uint64_t maxTstates) {
+        uint64_t instructions = 0;
+        while (!finish && tstates < maxTstates) {
+            cpu.execute();
+            instructions++;
+        }
+        return instructions;
+    }
+};
+#endif // BENCHBUS_H
@@ -0,0 +1,105 @@
+#include <cstring>
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+int openCounter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+}
+
+PerfCounters::PerfCounters() {
+    fds[CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds[INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[BRANCH_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    fds[L1I_MISSES] = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    memset(values, 0, sizeof(values));
+}
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void PerfCounters::start() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::stop() {
+    for (int idx = 0; idx < NUM_COUNTERS; idx++) {
+        values[idx] = 0;
+        if (fds[idx] < 0) {
+            continue;
+        }
+
+        ioctl(fds[idx], PERF_EVENT_IOC_DISABLE, 0);
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (read(fds[idx], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+            continue;
+        }
+        values[idx] = data[2] < data[1]
+                ? static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2])
+                : data[0];
+    }
+}
+
+#else
+
+PerfCounters::PerfCounters() {
+    for (int idx = 0; idx < NUM_COUNTERS; idx++) {
+        fds[idx] = -1;
+        values[idx] = 0;
+    }
+}
+
+PerfCounters::~PerfCounters() = default;
+
+void PerfCounters::start() {}
+
+void PerfCounters::stop() {}
+
+#endif // __linux__
+
+bool PerfCounters::anyAvailable() const {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *PerfCounters::name(Counter counter) {
+    static const char *const names[NUM_COUNTERS] = {
+        "cycles", "instructions", "branch-misses", "L1i-misses"
+    };
+    return names[counter];
+}
@@ -0,0 +1,41 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstdint>
+
+/*
+ * Host hardware counters read through Linux perf_event_open, user space
+ * only. Every counter is optional: if the kernel, the PMU or the
+ * permissions (perf_event_paranoid) don't allow it, it's reported as not
+ * available and the benchmarks fall back to wall time.
+ */
+class PerfCounters
+{
+public:
+    enum Counter {
+        CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1I_MISSES, NUM_COUNTERS
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool isAvailable(Counter counter) const { return fds[counter] >= 0; }
+    bool anyAvailable() const;
+
+    void start();
+    void stop();
+
+    // Value counted between the last start()/stop() pair, scaled when the
+    // kernel had to multiplex the counters
+    uint64_t value(Counter counter) const { return values[counter]; }
+
+    static const char *name(Counter counter);
+
+private:
+    int fds[NUM_COUNTERS];
+    uint64_t values[NUM_COUNTERS];
+};
+#endif // PERFCOUNTERS_H
@@ -0,0 +1,440 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "benchbus.h"
+#include "perfcounters.h"
+
+#ifndef Z80CPP_VERSION
+#define Z80CPP_VERSION "unknown"
+#endif
+
+using namespace std;
+
+namespace {
+
+struct Workload {
+    const char *name;
+    const char *description;
+    // Prepare the bus, false if the workload can't run (missing file...)
+    bool (*setup)(BenchBus &bus);
+};
+
+bool setupZexall(BenchBus &bus) {
+    return bus.loadCPM("zexall.bin");
+}
+
+bool setupZexdoc(BenchBus &bus) {
+    return bus.loadCPM("zexdoc.bin");
+}
+
+bool setupAlu(BenchBus &bus) {
+    static const uint8_t code[] = {
+        0x31, 0x00, 0xF0,   // LD SP,0xF000
+        0x3E, 0x5A,         // loop: LD A,0x5A
+        0x06, 0x37,         // LD B,0x37
+        0x80,               // ADD A,B
+        0x89,               // ADC A,C
+        0x92,               // SUB D
+        0x9B,               // SBC A,E
+        0xA4,               // AND H
+        0xAD,               // XOR L
+        0xB0,               // OR B
+        0xB9,               // CP C
+        0x3C,               // INC A
+        0x05,               // DEC B
+        0x07,               // RLCA
+        0x0F,               // RRCA
+        0x27,               // DAA
+        0xC3, 0x03, 0x00    // JP loop
+    };
+    bus.load(0x0000, code, sizeof(code));
+    return true;
+}
+
+bool setupLdir(BenchBus &bus) {
+    static const uint8_t code[] = {
+        0x31, 0x00, 0xF0,   // LD SP,0xF000
+        0x21, 0x00, 0x40,   // loop: LD HL,0x4000
+        0x11, 0x00, 0x80,   // LD DE,0x8000
+        0x01, 0x00, 0x20,   // LD BC,0x2000
+        0xED, 0xB0,         // LDIR
+        0x18, 0xF3          // JR loop
+    };
+    bus.load(0x0000, code, sizeof(code));
+    return true;
+}
+
+bool setupIndex(BenchBus &bus) {
+    static const uint8_t code[] = {
+        0x31, 0x00, 0xF0,           // LD SP,0xF000
+        0xDD, 0x21, 0x00, 0x80,     // LD IX,0x8000
+        0xFD, 0x21, 0x00, 0x90,     // LD IY,0x9000
+        0xDD, 0x7E, 0x01,           // loop: LD A,(IX+1)
+        0xFD, 0x86, 0x02,           // ADD A,(IY+2)
+        0xDD, 0x77, 0x03,           // LD (IX+3),A
+        0xFD, 0x34, 0x04,           // INC (IY+4)
+        0xDD, 0xCB, 0x05, 0x06,     // RLC (IX+5)
+        0xFD, 0xCB, 0x06, 0x5E,     // BIT 3,(IY+6)
+        0xDD, 0x2C,                 // INC IXL
+        0xFD, 0x2D,                 // DEC IYL
+        0xC3, 0x0B, 0x00            // JP loop
+    };
+    bus.load(0x0000, code, sizeof(code));
+    return true;
+}
+
+bool setupInterrupts(BenchBus &bus) {
+    static const uint8_t code[] = {
+        0x31, 0x00, 0xF0,   // LD SP,0xF000
+        0xED, 0x56,         // IM 1
+        0xFB,               // EI
+        0x3C,               // loop: INC A
+        0x80,               // ADD A,B
+        0xA9,               // XOR C
+        0x18, 0xFB          // JR loop
+    };
+    static const uint8_t isr[] = {
+        0xF5,               // PUSH AF
+        0xE5,               // PUSH HL
+        0x2A, 0x00, 0xC0,   // LD HL,(0xC000)
+        0x23,               // INC HL
+        0x22, 0x00, 0xC0,   // LD (0xC000),HL
+        0xE1,               // POP HL
+        0xF1,               // POP AF
+        0xFB,               // EI
+        0xED, 0x4D          // RETI
+    };
+    bus.load(0x0000, code, sizeof(code));
+    bus.load(0x0038, isr, sizeof(isr));
+    bus.intPeriod = 1000;
+    return true;
+}
+
+bool setupHalt(BenchBus &bus) {
+    static const uint8_t code[] = {
+        0x31, 0x00, 0xF0,   // LD SP,0xF000
+        0xED, 0x56,         // IM 1
+        0xFB,               // EI
+        0x76,               // loop: HALT
+        0x18, 0xFD          // JR loop
+    };
+    static const uint8_t isr[] = {
+        0xFB,               // EI
+        0xC9                // RET
+    };
+    bus.load(0x0000, code, sizeof(code));
+    bus.load(0x0038, isr, sizeof(isr));
+    // A ZX Spectrum 48K frame
+    bus.intPeriod = 69888;
+    return true;
+}
+
+const Workload workloads[] = {
+    { "zexall", "ZEXALL instruction exerciser (first N T-states)", setupZexall },
+    { "zexdoc", "ZEXDOC instruction exerciser, needs zexdoc.bin", setupZexdoc },
+    { "alu", "8-bit ALU and rotate loop", setupAlu },
+    { "ldir", "8 KB LDIR memory copies", setupLdir },
+    { "index", "IX/IY indexed loads, ALU and DD/FD CB opcodes", setupIndex },
+    { "interrupts", "IM 1 interrupt every 1000 T-states", setupInterrupts },
+    { "halt", "HALT waiting for a 50 Hz frame interrupt", setupHalt },
+};
+
+struct Stats {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+Stats statsOf(const vector<double> &samples) {
+    Stats stats = { 0.0, 0.0, samples[0], samples[0] };
+    for (double value : samples) {
+        stats.mean += value;
+        stats.min = min(stats.min, value);
+        stats.max = max(stats.max, value);
+    }
+    stats.mean /= samples.size();
+
+    if (samples.size() > 1) {
+        for (double value : samples) {
+            stats.stddev += (value - stats.mean) * (value - stats.mean);
+        }
+        stats.stddev = sqrt(stats.stddev / (samples.size() - 1));
+    }
+    return stats;
+}
+
+struct Result {
+    const Workload *workload;
+    uint32_t runs;
+    uint64_t tstates;
+    uint64_t instructions;
+    Stats mhz;
+    Stats ips;
+    // Mean per Z80 instruction, negative when not available
+    double perInstruction[PerfCounters::NUM_COUNTERS];
+    double cyclesPerTstate;
+};
+
+const PerfCounters::Counter allCounters[] = {
+    PerfCounters::CYCLES, PerfCounters::INSTRUCTIONS,
+    PerfCounters::BRANCH_MISSES, PerfCounters::L1I_MISSES
+};
+
+bool runWorkload(const Workload &workload, uint32_t runs, uint64_t maxTstates,
+        PerfCounters &counters, Result &result) {
+    vector<double> mhz, ips;
+    double totals[PerfCounters::NUM_COUNTERS] = {};
+
+    result.workload = &workload;
+    result.runs = runs;
+    for (uint32_t run = 0; run < runs; run++) {
+        auto bus = new BenchBus();
+        if (!workload.setup(*bus)) {
+            delete bus;
+            return false;
+        }
+
+        auto begin = chrono::steady_clock::now();
+        counters.start();
+        uint64_t instructions = bus->run(maxTstates);
+        counters.stop();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+        // Every run executes the same code, keep the last counts
+        result.tstates = bus->tstates;
+        result.instructions = instructions;
+        mhz.push_back(bus->tstates / seconds / 1e6);
+        ips.push_back(instructions / seconds);
+        for (PerfCounters::Counter counter : allCounters) {
+            totals[counter] += counters.value(counter);
+        }
+        delete bus;
+    }
+
+    result.mhz = statsOf(mhz);
+    result.ips = statsOf(ips);
+    for (PerfCounters::Counter counter : allCounters) {
+        result.perInstruction[counter] = counters.isAvailable(counter)
+                ? totals[counter] / runs / result.instructions : -1.0;
+    }
+    result.cyclesPerTstate = counters.isAvailable(PerfCounters::CYCLES)
+            ? totals[PerfCounters::CYCLES] / runs / result.tstates : -1.0;
+    return true;
+}
+
+void printResult(const Result &result) {
+    printf("%-10s %12llu %12llu %9.2f %6.2f%% %10.2f", result.workload->name,
+            static_cast<unsigned long long>(result.instructions),
+            static_cast<unsigned long long>(result.tstates),
+            result.mhz.mean, 100.0 * result.mhz.stddev / result.mhz.mean,
+            result.ips.mean / 1e6);
+
+    for (PerfCounters::Counter counter : allCounters) {
+        if (result.perInstruction[counter] < 0) {
+            printf(" %11s", "n/a");
+        } else {
+            printf(" %11.3f", result.perInstruction[counter]);
+        }
+    }
+
+    // Host cycles per T-state == host MHz needed per emulated MHz
+    if (result.cyclesPerTstate < 0) {
+        printf(" %11s\n", "n/a");
+    } else {
+        printf(" %11.3f\n", result.cyclesPerTstate);
+    }
+}
+
+// Empty field for the counters that are not available
+string counterField(double value) {
+    if (value < 0) {
+        return "";
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%.4f", value);
+    return text;
+}
+
+void writeCSV(ostream &out, const vector<Result> &results) {
+    out << "version,workload,runs,tstates,instructions,mhz_mean,mhz_stddev,mhz_min,mhz_max,"
+        << "ips_mean,ips_stddev,cycles_per_instr,host_instr_per_instr,"
+        << "branch_misses_per_instr,l1i_misses_per_instr,cycles_per_tstate\n";
+    for (const Result &result : results) {
+        out << Z80CPP_VERSION << ',' << result.workload->name << ',' << result.runs << ','
+            << result.tstates << ',' << result.instructions << ','
+            << result.mhz.mean << ',' << result.mhz.stddev << ','
+            << result.mhz.min << ',' << result.mhz.max << ','
+            << result.ips.mean << ',' << result.ips.stddev;
+        for (PerfCounters::Counter counter : allCounters) {
+            out << ',' << counterField(result.perInstruction[counter]);
+        }
+        out << ',' << counterField(result.cyclesPerTstate) << '\n';
+    }
+}
+
+void writeJSON(ostream &out, const vector<Result> &results) {
+    out << "{\n  \"version\": \"" << Z80CPP_VERSION << "\",\n  \"results\": [";
+    for (size_t idx = 0; idx < results.size(); idx++) {
+        const Result &result = results[idx];
+        out << (idx == 0 ? "\n" : ",\n")
+            << "    {\"workload\": \"" << result.workload->name << "\", \"runs\": " << result.runs
+            << ", \"tstates\": " << result.tstates << ", \"instructions\": " << result.instructions
+            << ",\n     \"mhz\": {\"mean\": " << result.mhz.mean << ", \"stddev\": " << result.mhz.stddev
+            << ", \"min\": " << result.mhz.min << ", \"max\": " << result.mhz.max << "}"
+            << ",\n     \"ips\": {\"mean\": " << result.ips.mean << ", \"stddev\": " << result.ips.stddev
+            << "}";
+        for (PerfCounters::Counter counter : allCounters) {
+            if (result.perInstruction[counter] >= 0) {
+                out << ", \"" << PerfCounters::name(counter) << "_per_instr\": "
+                    << result.perInstruction[counter];
+            }
+        }
+        if (result.cyclesPerTstate >= 0) {
+            out << ", \"cycles_per_tstate\": " << result.cyclesPerTstate;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Mean MHz per workload from a CSV written by -o
+bool readBaseline(const string &fileName, vector<pair<string, double>> &baseline) {
+    ifstream in(fileName);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    string line;
+    getline(in, line); // header
+    while (getline(in, line)) {
+        vector<string> fields;
+        size_t start = 0, comma;
+        while ((comma = line.find(',', start)) != string::npos) {
+            fields.push_back(line.substr(start, comma - start));
+            start = comma + 1;
+        }
+        fields.push_back(line.substr(start));
+        if (fields.size() > 5) {
+            baseline.push_back(make_pair(fields[1], atof(fields[5].c_str())));
+        }
+    }
+    return true;
+}
+
+void compare(const vector<Result> &results, const vector<pair<string, double>> &baseline) {
+    printf("\n%-10s %12s %12s %9s\n", "workload", "baseline MHz", "MHz", "speedup");
+    for (const Result &result : results) {
+        for (const auto &entry : baseline) {
+            if (entry.first == result.workload->name && entry.second > 0) {
+                printf("%-10s %12.2f %12.2f %8.3fx\n", result.workload->name, entry.second,
+                        result.mhz.mean, result.mhz.mean / entry.second);
+            }
+        }
+    }
+}
+
+void usage() {
+    cout << "Usage: z80bench [-t tstates] [-r runs] [-o results.csv|results.json]" << endl
+         << "                [-c baseline.csv] [workload...]" << endl << endl;
+    cout << "Workloads:" << endl;
+    for (const Workload &workload : workloads) {
+        printf("  %-10s %s\n", workload.name, workload.description);
+    }
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t maxTstates = 500000000;
+    uint32_t runs = 5;
+    string output;
+    vector<pair<string, double>> baseline;
+    vector<const Workload *> selected;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-t") == 0 && idx + 1 < argc) {
+            maxTstates = strtoull(argv[++idx], nullptr, 10);
+            continue;
+        }
+        if (strcmp(argv[idx], "-r") == 0 && idx + 1 < argc) {
+            runs = max(1ul, strtoul(argv[++idx], nullptr, 10));
+            continue;
+        }
+        if (strcmp(argv[idx], "-o") == 0 && idx + 1 < argc) {
+            output = argv[++idx];
+            continue;
+        }
+        if (strcmp(argv[idx], "-c") == 0 && idx + 1 < argc) {
+            if (!readBaseline(argv[++idx], baseline)) {
+                cout << "Can't read " << argv[idx] << endl;
+                return 1;
+            }
+            continue;
+        }
+
+        const Workload *found = nullptr;
+        for (const Workload &workload : workloads) {
+            if (strcmp(argv[idx], workload.name) == 0) {
+                found = &workload;
+            }
+        }
+        if (found == nullptr) {
+            usage();
+            return 1;
+        }
+        selected.push_back(found);
+    }
+
+    if (selected.empty()) {
+        for (const Workload &workload : workloads) {
+            selected.push_back(&workload);
+        }
+    }
+
+    PerfCounters counters;
+    if (!counters.anyAvailable()) {
+        cout << "Hardware counters not available, reporting wall time only" << endl;
+    }
+
+    printf("z80cpp %s, %u runs of %llu T-states\n", Z80CPP_VERSION, runs,
+            static_cast<unsigned long long>(maxTstates));
+    printf("%-10s %12s %12s %9s %7s %10s %11s %11s %11s %11s %11s\n",
+            "workload", "z80 instr", "T-states", "emu MHz", "stddev", "M instr/s",
+            "cyc/instr", "ins/instr", "brmiss/ins", "l1imiss/ins", "cyc/T-state");
+
+    vector<Result> results;
+    for (const Workload *workload : selected) {
+        Result result;
+        if (!runWorkload(*workload, runs, maxTstates, counters, result)) {
+            printf("%-10s skipped\n", workload->name);
+            continue;
+        }
+        printResult(result);
+        results.push_back(result);
+    }
+
+    if (!baseline.empty()) {
+        compare(results, baseline);
+    }
+
+    if (!output.empty()) {
+        ofstream out(output);
+        if (!out.is_open()) {
+            cout << "Can't write " << output << endl;
+            return 1;
+        }
+        if (output.size() > 5 && output.compare(output.size() - 5, 5, ".json") == 0) {
+            writeJSON(out, results);
+        } else {
+            writeCSV(out, results);
+        }
+    }
+}
@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "z80machine.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of the block I/O path of INIR/INDR/OTIR/OTDR.
+ *
+ * Two machines run a program full of block transfers, one byte by byte
+ * and one with Z80::setBlockIO(true), in slices of random T-state and
+ * instruction limits. After every slice the CPU state, T-states and
+ * instruction counts must match, and so must the device accesses (port,
+ * value and T-state) and the writes seen by a write hook, put in T-state
+ * order as the block path reads the devices before writing RAM, and the
+ * RAM and the opcode counters (WITH_OPCODE_STATS) at the end. Bursts to a
+ * device that switches the banks the CPU reads and writes must go the
+ * byte by byte way. Then a 512 byte sector read through INIR is timed
+ * both ways.
+ *
+ *     z80blockbench [-n slices]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+struct Access {
+    char kind;
+    uint16_t address;
+    uint8_t value;
+    uint64_t tstates;
+
+    bool operator==(const Access &other) const {
+        return kind == other.kind && address == other.address && value == other.value
+                && tstates == other.tstates;
+    }
+};
+
+bool earlier(const Access &one, const Access &other) {
+    return one.tstates < other.tstates;
+}
+
+// Reads depend on the port and the time, to catch any timing difference
+class LoggedPort : public Z80PortDevice {
+public:
+    LoggedPort(char name, vector<Access> &log) : name(name), log(log) {}
+
+    uint8_t in(uint16_t port, uint64_t tstates) override {
+        uint8_t value = static_cast<uint8_t>((port * 31 + tstates * 7) ^ (tstates >> 8));
+        log.push_back({ name, port, value, tstates });
+        return value;
+    }
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) override {
+        log.push_back({ static_cast<char>(name + 1), port, value, tstates });
+    }
+
+private:
+    char name;
+    vector<Access> &log;
+};
+
+// 0xFFF0-0xFFFF is ROM
+class RomHook : public Z80WriteHook {
+public:
+    explicit RomHook(vector<Access> &log) : log(log) {}
+
+    bool write(uint16_t address, uint8_t value, uint64_t tstates) override {
+        log.push_back({ 'W', address, value, tstates });
+        return false;
+    }
+
+private:
+    vector<Access> &log;
+};
+
+class Rig {
+public:
+    Z80Machine machine;
+    vector<Access> log;
+
+    explicit Rig(bool blockIO) : low('a', log), high('c', log), out('e', log), odd('g', log),
+            rom(log) {
+        // The input port is split on A15, B crosses it in the 256 byte bursts
+        machine.getPorts().map(0x80FF, 0x0010, &low);
+        machine.getPorts().map(0x80FF, 0x8010, &high);
+        // Writes to odd B values go to two devices
+        machine.getPorts().map(0x00FF, 0x0011, &out);
+        machine.getPorts().map(0x01FF, 0x0111, &odd);
+        machine.setWriteHook(0xFFF0, 0xFFFF, &rom);
+        machine.getCpu().setBlockIO(blockIO);
+    }
+
+private:
+    LoggedPort low, high, out, odd;
+    RomHook rom;
+};
+
+const uint8_t program[] = {
+    0xFB,                   // EI
+    0x31, 0x00, 0xC0,       // LD SP,C000h
+    0x21, 0x00, 0x80,       // loop: LD HL,8000h
+    0x01, 0x10, 0x00,       // LD BC,0010h
+    0xED, 0xB2,             // INIR, 256 bytes
+    0xED, 0xB2,             // INIR, 256 more
+    0x21, 0xF0, 0xFF,       // LD HL,FFF0h
+    0x01, 0x10, 0x40,       // LD BC,4010h
+    0xED, 0xB2,             // INIR, through the ROM and around to 0000h
+    0x21, 0xFF, 0x9F,       // LD HL,9FFFh
+    0x01, 0x10, 0x00,       // LD BC,0010h
+    0xED, 0xBA,             // INDR
+    0x21, 0x00, 0x80,       // LD HL,8000h
+    0x01, 0x11, 0x00,       // LD BC,0011h
+    0xED, 0xB3,             // OTIR
+    0x21, 0x00, 0x90,       // LD HL,9000h
+    0x01, 0x11, 0x03,       // LD BC,0311h
+    0xED, 0xBB,             // OTDR
+    0x01, 0x10, 0x01,       // LD BC,0110h
+    0xED, 0xB2,             // INIR, one byte
+    0x01, 0x10, 0x02,       // LD BC,0210h
+    0xED, 0xB2,             // INIR, two bytes
+    0xED, 0x5F,             // LD A,R
+    0x32, 0x00, 0xA0,       // LD (A000h),A
+    0xF5,                   // PUSH AF
+    0xD1,                   // POP DE
+    0xED, 0x53, 0x02, 0xA0, // LD (A002h),DE
+    0xC3, 0x04, 0x01        // JP loop
+};
+
+// Programs live at 0100h, the INIR around FFFFh overwrites 0000h-002Fh
+const uint16_t ORIGIN = 0x0100;
+
+void load(Z80Machine &machine, const uint8_t *code, size_t size) {
+    machine.getMemory().clear();
+    machine.getMemory().load(ORIGIN, code, size);
+    machine.reset();
+    machine.getCpu().setRegPC(ORIGIN);
+}
+
+uint64_t nextRandom(uint64_t &seed) {
+    seed += 0x9E3779B97F4A7C15ull;
+    uint64_t mix = seed;
+    mix = (mix ^ (mix >> 30)) * 0xBF58476D1CE4E5B9ull;
+    mix = (mix ^ (mix >> 27)) * 0x94D049BB133111EBull;
+    return mix ^ (mix >> 31);
+}
+
+bool sameCpu(const Z80 &one, const Z80 &other) {
+    Z80State state;
+    uint8_t first[Z80State::SERIALIZED_SIZE], second[Z80State::SERIALIZED_SIZE];
+    one.saveState(state);
+    state.serialize(first);
+    other.saveState(state);
+    state.serialize(second);
+    return memcmp(first, second, sizeof(first)) == 0;
+}
+
+// Returns the number of slices that don't match
+uint32_t check(uint32_t slices) {
+    Rig plain(false), block(true);
+    load(plain.machine, program, sizeof(program));
+    load(block.machine, program, sizeof(program));
+
+    uint64_t seed = 1;
+    uint64_t plainCount = 0, blockCount = 0;
+    uint32_t failures = 0;
+    for (uint32_t slice = 0; slice < slices; slice++) {
+        uint64_t value = nextRandom(seed);
+        uint64_t maxTstates = 0, maxInstructions = 0;
+        // Half the slices end on a T-state, half on an instruction count
+        if (value & 1) {
+            maxTstates = plain.machine.getTstates() + 1 + (value >> 1) % 12000;
+        } else {
+            maxInstructions = 1 + (value >> 1) % 600;
+        }
+        Z80Machine::StopReason plainReason = plain.machine.run(maxTstates, maxInstructions,
+                plainCount);
+        Z80Machine::StopReason blockReason = block.machine.run(maxTstates, maxInstructions,
+                blockCount);
+        stable_sort(plain.log.begin(), plain.log.end(), earlier);
+        stable_sort(block.log.begin(), block.log.end(), earlier);
+
+        if (plainReason != blockReason || plainCount != blockCount
+                || plain.machine.getTstates() != block.machine.getTstates()
+                || !sameCpu(plain.machine.getCpu(), block.machine.getCpu())
+                || plain.log != block.log) {
+            if (failures++ < 5) {
+                printf("Slice %u: %llu/%llu T-states, %llu/%llu instructions, "
+                        "%zu/%zu accesses, PC %04X/%04X\n", slice,
+                        static_cast<unsigned long long>(plain.machine.getTstates()),
+                        static_cast<unsigned long long>(block.machine.getTstates()),
+                        static_cast<unsigned long long>(plainCount),
+                        static_cast<unsigned long long>(blockCount),
+                        plain.log.size(), block.log.size(),
+                        plain.machine.getCpu().getRegPC(), block.machine.getCpu().getRegPC());
+            }
+            // Go on from the same point
+            block.machine.getMemory().load(0, plain.machine.getMemory().data(), 0x10000);
+            Z80State state;
+            plain.machine.getCpu().saveState(state);
+            block.machine.getCpu().loadState(state);
+            block.machine.setTstates(plain.machine.getTstates());
+            blockCount = plainCount;
+        }
+        plain.log.clear();
+        block.log.clear();
+    }
+
+    if (memcmp(plain.machine.getMemory().data(), block.machine.getMemory().data(), 0x10000)
+            != 0) {
+        printf("RAM doesn't match\n");
+        failures++;
+    }
+#ifdef WITH_OPCODE_STATS
+    // The iterations done by the bus are counted as if they had run one by one
+    const Z80OpcodeStats &plainStats = plain.machine.getCpu().getOpcodeStats();
+    const Z80OpcodeStats &blockStats = block.machine.getCpu().getOpcodeStats();
+    if (memcmp(&plainStats, &blockStats, sizeof(Z80OpcodeStats)) != 0) {
+        printf("Opcode stats don't match: INIR %llu/%llu, OTDR %llu/%llu, ED %llu/%llu\n",
+                static_cast<unsigned long long>(plainStats.ed[0xB2]),
+                static_cast<unsigned long long>(blockStats.ed[0xB2]),
+                static_cast<unsigned long long>(plainStats.ed[0xBB]),
+                static_cast<unsigned long long>(blockStats.ed[0xBB]),
+                static_cast<unsigned long long>(plainStats.main[0xED]),
+                static_cast<unsigned long long>(blockStats.main[0xED]));
+        failures++;
+    }
+#endif
+    printf("%u slices, %llu instructions, %llu T-states: %s\n", slices,
+            static_cast<unsigned long long>(plainCount),
+            static_cast<unsigned long long>(plain.machine.getTstates()),
+            failures == 0 ? "OK" : "FAIL");
+    return failures;
+}
+
+// Four 16K banks at C000h-FFFFh
+class BankedMachine : public Z80Machine {
+public:
+    uint8_t banks[4][0x4000];
+    uint32_t bank;
+
+    BankedMachine() : bank(0) {
+        for (uint32_t idx = 0; idx < sizeof(banks); idx++) {
+            banks[idx >> 14][idx & 0x3fff] = static_cast<uint8_t>(idx * 7 + (idx >> 14));
+        }
+    }
+
+    uint8_t peek8(uint16_t address) override {
+        if (address < 0xC000) {
+            return Z80Machine::peek8(address);
+        }
+        tstates += 3;
+        return banks[bank][address - 0xC000];
+    }
+
+    void poke8(uint16_t address, uint8_t value) override {
+        if (address < 0xC000) {
+            Z80Machine::poke8(address, value);
+            return;
+        }
+        tstates += 3;
+        banks[bank][address - 0xC000] = value;
+    }
+};
+
+// Every read or write selects the bank with the low bits of the value
+class Pager : public Z80PortDevice {
+public:
+    Pager(BankedMachine &machine, vector<Access> &log) : machine(machine), log(log) {}
+
+    uint8_t in(uint16_t port, uint64_t tstates) override {
+        uint8_t value = static_cast<uint8_t>(tstates * 5 + (tstates >> 3));
+        machine.bank = value & 3;
+        log.push_back({ 'p', port, value, tstates });
+        return value;
+    }
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) override {
+        machine.bank = value & 3;
+        log.push_back({ 'q', port, value, tstates });
+    }
+
+    bool changesMemory() const override { return true; }
+
+private:
+    BankedMachine &machine;
+    vector<Access> &log;
+};
+
+const uint8_t pagingLoop[] = {
+    0x21, 0x00, 0xC0,       // LD HL,C000h
+    0x01, 0xFD, 0x00,       // LD BC,00FDh
+    0xED, 0xB3,             // OTIR, each byte from the bank the previous one selected
+    0x21, 0x00, 0xE0,       // LD HL,E000h
+    0x01, 0xFD, 0x00,       // LD BC,00FDh
+    0xED, 0xB2,             // INIR, each byte to the bank it selects
+    0x76                    // HALT
+};
+
+// Bursts to a device that switches banks, with and without block I/O
+bool checkBanked() {
+    vector<Access> logs[2];
+    unique_ptr<BankedMachine> machines[2];
+    for (uint32_t blockIO = 0; blockIO < 2; blockIO++) {
+        machines[blockIO].reset(new BankedMachine);
+        BankedMachine &machine = *machines[blockIO];
+        Pager pager(machine, logs[blockIO]);
+        machine.getPorts().map(0x00FF, 0x00FD, &pager);
+        load(machine, pagingLoop, sizeof(pagingLoop));
+        machine.getCpu().setBlockIO(blockIO != 0);
+        uint64_t instructions = 0;
+        machine.run(0, 2000, instructions);
+    }
+
+    const BankedMachine &plain = *machines[0], &block = *machines[1];
+    bool ok = plain.getCpu().isHalted() && logs[0].size() == 512 && logs[0] == logs[1]
+            && plain.getTstates() == block.getTstates()
+            && sameCpu(plain.getCpu(), block.getCpu())
+            && memcmp(plain.banks, block.banks, sizeof(plain.banks)) == 0;
+    printf("Bursts to a bank switching device, %zu accesses: %s\n", logs[0].size(),
+            ok ? "OK" : "FAIL");
+    return ok;
+}
+
+// A disk controller: the sector buffer, with or without a block read
+class Sector : public Z80PortDevice {
+public:
+    explicit Sector(bool block) : block(block), position(0) {
+        for (uint32_t idx = 0; idx < sizeof(buffer); idx++) {
+            buffer[idx] = static_cast<uint8_t>(idx * 13);
+        }
+    }
+
+    uint8_t in(uint16_t port, uint64_t tstates) override {
+        uint8_t value = buffer[position];
+        position = (position + 1) % sizeof(buffer);
+        return value;
+    }
+
+    void inBlock(uint16_t port, uint8_t *data, size_t size, uint64_t tstates,
+            uint32_t step) override {
+        if (!block || position + size > sizeof(buffer)) {
+            Z80PortDevice::inBlock(port, data, size, tstates, step);
+            return;
+        }
+        memcpy(data, &buffer[position], size);
+        position = (position + size) % sizeof(buffer);
+    }
+
+private:
+    bool block;
+    uint8_t buffer[512];
+    size_t position;
+};
+
+const uint8_t sectorLoop[] = {
+    0x21, 0x00, 0x80,       // LD HL,8000h
+    0x01, 0x10, 0x00,       // LD BC,0010h
+    0xED, 0xB2,             // INIR
+    0xED, 0xB2,             // INIR
+    0xC3, 0x00, 0x01        // JP 0100h
+};
+
+// Host ns per byte of sector read
+double benchSector(bool blockIO, bool blockDevice) {
+    const uint64_t tstates = 200000000;
+    Z80Machine machine;
+    Sector sector(blockDevice);
+    machine.getPorts().map(0x00FF, 0x0010, &sector);
+    load(machine, sectorLoop, sizeof(sectorLoop));
+    machine.getCpu().setBlockIO(blockIO);
+
+    uint64_t instructions = 0;
+    auto begin = chrono::steady_clock::now();
+    machine.run(tstates, 0, instructions);
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+    // 21 T-states per byte, near enough
+    return ns / (machine.getTstates() / 21.0);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t slices = 3000;
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-n") == 0 && idx + 1 < argc) {
+            slices = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else {
+            printf("Usage: %s [-n slices]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    uint32_t failures = check(slices);
+    if (!checkBanked()) {
+        failures++;
+    }
+
+    printf("\nHost ns per byte, 512 byte sectors through INIR\n");
+    printf("%-24s %10.2f\n", "byte by byte", benchSector(false, false));
+    printf("%-24s %10.2f\n", "block, in() per byte", benchSector(true, false));
+    printf("%-24s %10.2f\n", "block, device inBlock()", benchSector(true, true));
+
+    return failures == 0 ? 0 : 1;
+}
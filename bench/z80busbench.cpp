@@ -0,0 +1,407 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "z80.h"
+#include "z80machine.h"
+#include "z80operations.h"
+
+using namespace std;
+
+/*
+ * Cost of the Z80operations callbacks, for bus implementers.
+ *
+ * The same instruction streams run against several buses, from a flat array
+ * with no timing to the kind of bus a real host has. The first table is the
+ * raw cost of every callback called through the interface, the second one
+ * the cost per instruction class. The last one compares two ways of
+ * watching writes to Spectrum video memory (0x4000-0x5AFF) on a Z80Machine:
+ * a poke8() override that checks the range and a Z80WriteHook. The port
+ * tables do the same for Spectrum style partially decoded ports: an if/else
+ * chain in inPort()/outPort() against a Z80PortMap.
+ */
+
+namespace {
+
+// Flat array, no timing at all
+class NullBus : public Z80operations
+{
+public:
+    uint8_t ram[0x10000];
+
+    NullBus() { memset(ram, 0, sizeof(ram)); }
+
+    uint8_t fetchOpcode(uint16_t address) override { return ram[address]; }
+    uint8_t peek8(uint16_t address) override { return ram[address]; }
+    void poke8(uint16_t address, uint8_t value) override { ram[address] = value; }
+    uint16_t peek16(uint16_t address) override {
+        return ram[address] | (ram[static_cast<uint16_t>(address + 1)] << 8);
+    }
+    void poke16(uint16_t address, RegisterPair word) override {
+        ram[address] = word.byte8.lo;
+        ram[static_cast<uint16_t>(address + 1)] = word.byte8.hi;
+    }
+    uint8_t inPort(uint16_t port) override { return 0xff; }
+    void outPort(uint16_t port, uint8_t value) override {}
+    void addressOnBus(uint16_t address, int32_t wstates) override {}
+    void interruptHandlingTime(int32_t wstates) override {}
+    bool isActiveINT() override { return false; }
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+    uint8_t breakpoint(uint16_t address, uint8_t opcode) override { return opcode; }
+#endif
+#ifdef WITH_EXEC_DONE
+    void execDone(void) override {}
+#endif
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override {}
+#endif
+};
+
+// Z80sim timing: T-states accounted in every callback
+class SimBus : public NullBus
+{
+public:
+    uint64_t tstates = 0;
+    uint8_t ports[0x10000] = {};
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        tstates += 4;
+        return ram[address];
+    }
+    uint8_t peek8(uint16_t address) override {
+        tstates += 3;
+        return ram[address];
+    }
+    void poke8(uint16_t address, uint8_t value) override {
+        tstates += 3;
+        ram[address] = value;
+    }
+    // Order matters, first the lsb, then the msb
+    uint16_t peek16(uint16_t address) override {
+        uint8_t lsb = peek8(address);
+        uint8_t msb = peek8(address + 1);
+        return (msb << 8) | lsb;
+    }
+    void poke16(uint16_t address, RegisterPair word) override {
+        poke8(address, word.byte8.lo);
+        poke8(address + 1, word.byte8.hi);
+    }
+    uint8_t inPort(uint16_t port) override {
+        tstates += 4;
+        return ports[port];
+    }
+    void outPort(uint16_t port, uint8_t value) override {
+        tstates += 4;
+        ports[port] = value;
+    }
+    void addressOnBus(uint16_t address, int32_t wstates) override { tstates += wstates; }
+    void interruptHandlingTime(int32_t wstates) override { tstates += wstates; }
+};
+
+// Z80sim timing plus a breakpoint check on every fetch and write, as
+// debuggers do
+class BreakpointBus : public SimBus
+{
+public:
+    uint8_t breakpoints[0x10000] = {};
+    uint32_t hits = 0;
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        if (breakpoints[address] & EXEC) {
+            hits++;
+        }
+        return SimBus::fetchOpcode(address);
+    }
+    void poke8(uint16_t address, uint8_t value) override {
+        if (breakpoints[address] & WRITE) {
+            hits++;
+        }
+        SimBus::poke8(address, value);
+    }
+
+    static const uint8_t EXEC = 0x01;
+    static const uint8_t WRITE = 0x02;
+};
+
+struct BusVariant {
+    const char *name;
+    NullBus *(*create)();
+};
+
+NullBus *createNull() { return new NullBus(); }
+NullBus *createSim() { return new SimBus(); }
+NullBus *createBreakpoint() {
+    auto bus = new BreakpointBus();
+    // Some breakpoints far away from the code, as a debugger would have
+    bus->breakpoints[0xF000] = BreakpointBus::EXEC;
+    bus->breakpoints[0xF100] = BreakpointBus::WRITE;
+    return bus;
+}
+
+const BusVariant variants[] = {
+    { "null", createNull },
+    { "z80sim", createSim },
+    { "breakpoint", createBreakpoint },
+};
+
+const uint32_t NUM_VARIANTS = sizeof(variants) / sizeof(variants[0]);
+
+double elapsedNs(chrono::steady_clock::time_point begin) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+}
+
+// ns per callback, called through the interface so it can't be devirtualized
+void benchCallbacks(const BusVariant &variant, double (&ns)[3]) {
+    const uint32_t calls = 20000000;
+    NullBus *bus = variant.create();
+    Z80operations *volatile opsPtr = bus;
+    Z80operations *ops = opsPtr;
+    volatile uint8_t sink = 0;
+    uint8_t acc = 0;
+
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t idx = 0; idx < calls; idx++) {
+        acc += ops->fetchOpcode(static_cast<uint16_t>(idx));
+    }
+    ns[0] = elapsedNs(begin) / calls;
+
+    begin = chrono::steady_clock::now();
+    for (uint32_t idx = 0; idx < calls; idx++) {
+        acc += ops->peek8(static_cast<uint16_t>(idx));
+    }
+    ns[1] = elapsedNs(begin) / calls;
+
+    begin = chrono::steady_clock::now();
+    for (uint32_t idx = 0; idx < calls; idx++) {
+        ops->poke8(static_cast<uint16_t>(idx | 0x8000), acc);
+    }
+    ns[2] = elapsedNs(begin) / calls;
+
+    sink = acc;
+    (void) sink;
+    delete bus;
+}
+
+struct InstructionClass {
+    const char *name;
+    const char *description;
+    vector<uint8_t> body;
+};
+
+const InstructionClass classes[] = {
+    { "register", "LD A,B / ADD A,C / INC B", { 0x78, 0x81, 0x04 } },
+    { "load", "LD A,(HL)", { 0x7E } },
+    { "store", "LD (HL),A", { 0x77 } },
+    { "stack", "PUSH BC / POP BC", { 0xC5, 0xC1 } },
+    { "io", "OUT (n),A / IN A,(n)", { 0xD3, 0xFE, 0xDB, 0xFE } },
+    { "indexed", "LD A,(IX+1) / LD (IX+2),A", { 0xDD, 0x7E, 0x01, 0xDD, 0x77, 0x02 } },
+    { "bitops", "RLC B / BIT 0,(HL)", { 0xCB, 0x00, 0xCB, 0x46 } },
+    { "block", "LDI", { 0xED, 0xA0 } },
+};
+
+// ns per instruction running 'body' repeated in a loop
+double benchClass(const BusVariant &variant, const InstructionClass &cls) {
+    static const uint8_t preamble[] = {
+        0x31, 0x00, 0x80,           // LD SP,0x8000
+        0x21, 0x00, 0x90,           // LD HL,0x9000
+        0x11, 0x00, 0xC0,           // LD DE,0xC000
+        0xDD, 0x21, 0x00, 0xA0      // LD IX,0xA000
+    };
+    const uint32_t repeat = 256;
+    const uint64_t instructions = 20000000;
+
+    NullBus *bus = variant.create();
+    uint16_t address = 0;
+    for (uint8_t byte : preamble) {
+        bus->ram[address++] = byte;
+    }
+    for (uint32_t idx = 0; idx < repeat; idx++) {
+        for (uint8_t byte : cls.body) {
+            bus->ram[address++] = byte;
+        }
+    }
+    bus->ram[address++] = 0xC3; // JP 0x0000
+    bus->ram[address++] = 0x00;
+    bus->ram[address++] = 0x00;
+
+    auto cpu = new Z80(bus);
+    auto begin = chrono::steady_clock::now();
+    for (uint64_t idx = 0; idx < instructions; idx++) {
+        cpu->execute();
+    }
+    double ns = elapsedNs(begin) / instructions;
+
+    delete cpu;
+    delete bus;
+    return ns;
+}
+
+// Spectrum style video memory watcher
+class VideoWatcher : public Z80WriteHook
+{
+public:
+    uint32_t writes = 0;
+
+    bool write(uint16_t address, uint8_t value, uint64_t tstates) override {
+        writes++;
+        return true;
+    }
+};
+
+// The same, the way hosts do it without hooks
+class OverrideMachine : public Z80Machine
+{
+public:
+    VideoWatcher watcher;
+
+    void poke8(uint16_t address, uint8_t value) override {
+        if (address >= 0x4000 && address <= 0x5AFF) {
+            watcher.write(address, value, tstates);
+        }
+        Z80Machine::poke8(address, value);
+    }
+};
+
+// ns per instruction of a LD (HL),A / INC L loop storing at 'base'
+double benchWrites(Z80Machine &machine, uint16_t base) {
+    const uint32_t repeat = 256;
+    const uint64_t instructions = 20000000;
+    vector<uint8_t> code = {
+        0x21, static_cast<uint8_t>(base), static_cast<uint8_t>(base >> 8)  // LD HL,base
+    };
+    for (uint32_t idx = 0; idx < repeat; idx++) {
+        code.push_back(0x77);   // LD (HL),A
+        code.push_back(0x2C);   // INC L
+    }
+    code.insert(code.end(), { 0xC3, 0x00, 0x00 });  // JP 0x0000
+
+    machine.getMemory().clear();
+    machine.getMemory().load(0, code.data(), code.size());
+    machine.reset();
+
+    uint64_t count = 0;
+    auto begin = chrono::steady_clock::now();
+    machine.run(0, instructions, count);
+    return elapsedNs(begin) / count;
+}
+
+// ULA (A0 low), Kempston joystick (A5 low, A0 high) and AY (A15, A1)
+class SpectrumPort : public Z80PortDevice
+{
+public:
+    uint8_t value;
+    uint32_t writes = 0;
+
+    explicit SpectrumPort(uint8_t value) : value(value) {}
+
+    uint8_t in(uint16_t port, uint64_t tstates) override { return value; }
+    void out(uint16_t port, uint8_t data, uint64_t tstates) override { writes++; }
+};
+
+class ChainMachine : public Z80Machine
+{
+public:
+    SpectrumPort ula { 0xBF }, kempston { 0x00 }, ay { 0x55 };
+
+    uint8_t inPort(uint16_t port) override {
+        uint8_t value = 0xff;
+        if ((port & 0x0001) == 0x0000) {
+            value = ula.in(port, tstates);
+        } else if ((port & 0x0021) == 0x0001) {
+            value = kempston.in(port, tstates);
+        } else if ((port & 0xC002) == 0xC000) {
+            value = ay.in(port, tstates);
+        }
+        tstates += 4;
+        return value;
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        if ((port & 0x0001) == 0x0000) {
+            ula.out(port, value, tstates);
+        } else if ((port & 0xC002) == 0xC000 || (port & 0xC002) == 0x8000) {
+            ay.out(port, value, tstates);
+        }
+        tstates += 4;
+    }
+};
+
+// ns per instruction of IN/OUT (C) to the ULA, Kempston and AY ports
+double benchPorts(Z80Machine &machine) {
+    const uint64_t instructions = 20000000;
+    const uint8_t code[] = {
+        0x01, 0xFE, 0x7F,       // LD BC,7FFEh
+        0xED, 0x78,             // IN A,(C)
+        0xED, 0x79,             // OUT (C),A
+        0x01, 0x1F, 0x00,       // LD BC,001Fh
+        0xED, 0x78,             // IN A,(C)
+        0x01, 0xFD, 0xFF,       // LD BC,FFFDh
+        0xED, 0x79,             // OUT (C),A
+        0xED, 0x78,             // IN A,(C)
+        0x06, 0xBF,             // LD B,BFh
+        0xED, 0x79,             // OUT (C),A
+        0xC3, 0x00, 0x00        // JP 0000h
+    };
+
+    machine.getMemory().clear();
+    machine.getMemory().load(0, code, sizeof(code));
+    machine.reset();
+
+    uint64_t count = 0;
+    auto begin = chrono::steady_clock::now();
+    machine.run(0, instructions, count);
+    return elapsedNs(begin) / count;
+}
+
+}
+
+int main() {
+    printf("Host ns per callback through Z80operations\n");
+    printf("%-12s %12s %12s %12s\n", "bus", "fetchOpcode", "peek8", "poke8");
+    for (const BusVariant &variant : variants) {
+        double ns[3];
+        benchCallbacks(variant, ns);
+        printf("%-12s %12.2f %12.2f %12.2f\n", variant.name, ns[0], ns[1], ns[2]);
+    }
+
+    printf("\nHost ns per instruction\n");
+    printf("%-10s", "class");
+    for (const BusVariant &variant : variants) {
+        printf(" %12s", variant.name);
+    }
+    printf("  %s\n", "instructions");
+
+    for (const InstructionClass &cls : classes) {
+        printf("%-10s", cls.name);
+        for (uint32_t idx = 0; idx < NUM_VARIANTS; idx++) {
+            printf(" %12.2f", benchClass(variants[idx], cls));
+        }
+        printf("  %s\n", cls.description);
+    }
+
+    printf("\nHost ns per instruction, LD (HL),A / INC L on a Z80Machine\n");
+    printf("%-10s %12s %12s\n", "writes", "RAM", "video");
+    Z80Machine plain;
+    printf("%-10s %12.2f %12s\n", "none", benchWrites(plain, 0x9000), "-");
+    OverrideMachine overridden;
+    printf("%-10s %12.2f %12.2f\n", "override", benchWrites(overridden, 0x9000),
+            benchWrites(overridden, 0x4000));
+    Z80Machine hooked;
+    VideoWatcher watcher;
+    hooked.setWriteHook(0x4000, 0x5AFF, &watcher);
+    printf("%-10s %12.2f %12.2f\n", "hook", benchWrites(hooked, 0x9000),
+            benchWrites(hooked, 0x4000));
+
+    printf("\nHost ns per instruction, IN/OUT (C) to three partially decoded ports\n");
+    ChainMachine chain;
+    printf("%-10s %12.2f\n", "if/else", benchPorts(chain));
+    Z80Machine mapped;
+    SpectrumPort ula(0xBF), kempston(0x00), ay(0x55);
+    mapped.getPorts().map(0x0001, 0x0000, &ula);
+    mapped.getPorts().map(0x0021, 0x0001, &kempston);
+    mapped.getPorts().map(0xC002, 0xC000, &ay);
+    mapped.getPorts().map(0xC002, 0x8000, &ay);
+    printf("%-10s %12.2f\n", "port map", benchPorts(mapped));
+}
@@ -0,0 +1,232 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "z80forkmachine.h"
+#include "z80machine.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of copy-on-write machine forking.
+ *
+ * A guest program fills 32K of tables, reads a key from a port and then
+ * walks 16K of them with it. The machine runs up to the key read and is
+ * forked once per key value; the forks run to the end on a pool of threads.
+ * Each one must end as a Z80Machine that got a full copy of the memory and
+ * the CPU state at the fork point. Also checks the page ownership rules.
+ *
+ *     z80forkbench [-j threads]
+ *
+ * The exit status is 1 if any check fails or any fork doesn't match.
+ */
+
+namespace {
+
+const uint16_t KEY_READ = 0x0119;
+
+const uint8_t program[] = {
+    0x31, 0x00, 0x00,       // LD SP,0000h
+    0x21, 0x00, 0x40,       // LD HL,4000h
+    0x01, 0x00, 0x80,       // LD BC,8000h
+    0x3E, 0x01,             // LD A,1
+    0x77,                   // fill: LD (HL),A
+    0x5F,                   // LD E,A
+    0x87,                   // ADD A,A
+    0x87,                   // ADD A,A
+    0x83,                   // ADD A,E
+    0x3C,                   // INC A
+    0x23,                   // INC HL
+    0x0B,                   // DEC BC
+    0x57,                   // LD D,A
+    0x78,                   // LD A,B
+    0xB1,                   // OR C
+    0x7A,                   // LD A,D
+    0x20, 0xF2,             // JR NZ,fill
+    0xDB, 0xFE,             // IN A,(FEh)
+    0x5F,                   // LD E,A
+    0x16, 0x00,             // LD D,0
+    0x21, 0x00, 0x40,       // LD HL,4000h
+    0x0E, 0x10,             // LD C,16
+    0x06, 0x00,             // outer: LD B,0
+    0x7E,                   // walk: LD A,(HL)
+    0x83,                   // ADD A,E
+    0x77,                   // LD (HL),A
+    0x5F,                   // LD E,A
+    0x19,                   // ADD HL,DE
+    0x7C,                   // LD A,H
+    0xE6, 0x3F,             // AND 3Fh
+    0xF6, 0x40,             // OR 40h
+    0x67,                   // LD H,A
+    0x10, 0xF3,             // DJNZ walk
+    0x0D,                   // DEC C
+    0x20, 0xEE,             // JR NZ,outer
+    0x7B,                   // LD A,E
+    0x32, 0x00, 0xC0,       // LD (C000h),A
+    0x76                    // HALT
+};
+
+class KeyFork : public Z80ForkMachine
+{
+public:
+    uint8_t key = 0;
+
+    unique_ptr<Z80ForkMachine> fork() override {
+        return unique_ptr<Z80ForkMachine>(new KeyFork(*this));
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        Z80ForkMachine::inPort(port);
+        return key;
+    }
+};
+
+class KeyMachine : public Z80Machine
+{
+public:
+    uint8_t key = 0;
+
+    uint8_t inPort(uint16_t port) override {
+        Z80Machine::inPort(port);
+        return key;
+    }
+};
+
+template <class Machine>
+void runToHalt(Machine &machine) {
+    Z80 &cpu = machine.getCpu();
+    while (!cpu.isHalted()) {
+        cpu.execute();
+    }
+}
+
+// After a copy neither side writes a shared page in place; the first
+// write gives the writer its own copy, even when the other side is gone
+bool checkOwnership() {
+    const uint32_t page = 0x1000 >> Z80PagedMemory::PAGE_SHIFT;
+    Z80PagedMemory parent;
+    parent.write(0x1000, 1);
+    bool ok = parent.isPrivate(page) && parent.getCopiedPages() == 1;
+    {
+        Z80PagedMemory child(parent);
+        ok = ok && !parent.isPrivate(page) && !child.isPrivate(page);
+        child.write(0x1000, 2);
+        ok = ok && child.isPrivate(page) && !parent.isPrivate(page)
+                && child.getCopiedPages() == 1 && parent.read(0x1000) == 1
+                && child.read(0x1000) == 2;
+    }
+    parent.write(0x1000, 3);
+    parent.write(0x1001, 4);
+    ok = ok && parent.isPrivate(page) && parent.getCopiedPages() == 2
+            && parent.read(0x1000) == 3 && parent.read(0x1001) == 4;
+    printf("Page ownership: %s\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+double micros(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t threads = thread::hardware_concurrency();
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-j") == 0 && idx + 1 < argc) {
+            threads = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else {
+            printf("Usage: %s [-j threads]\n", argv[0]);
+            return 2;
+        }
+    }
+    threads = max(threads, 1u);
+
+    bool ok = checkOwnership();
+
+    KeyFork base;
+    base.getMemory().load(0x0100, program, sizeof(program));
+    base.reset();
+    base.getCpu().setRegPC(0x0100);
+    while (base.getCpu().getRegPC() != KEY_READ) {
+        base.getCpu().execute();
+    }
+
+    // Fork once per key
+    vector<unique_ptr<Z80ForkMachine>> forks;
+    auto start = chrono::steady_clock::now();
+    for (uint32_t key = 0; key < 256; key++) {
+        forks.push_back(base.fork());
+        static_cast<KeyFork &>(*forks.back()).key = static_cast<uint8_t>(key);
+    }
+    double forkTime = micros(start) / forks.size();
+
+    start = chrono::steady_clock::now();
+    atomic<uint32_t> next(0);
+    vector<thread> pool;
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        pool.emplace_back([&] {
+            for (uint32_t job = next++; job < forks.size(); job = next++) {
+                runToHalt(*forks[job]);
+            }
+        });
+    }
+    for (thread &worker : pool) {
+        worker.join();
+    }
+    double runTime = micros(start);
+
+    // Reference: a flat machine per key with a full copy, like forking
+    // without copy-on-write would do
+    vector<uint8_t> image(Z80Memory::SIZE);
+    base.getMemory().save(0, image.data(), image.size());
+    Z80State state;
+    base.getCpu().saveState(state);
+
+    vector<unique_ptr<KeyMachine>> copies;
+    start = chrono::steady_clock::now();
+    for (uint32_t key = 0; key < 256; key++) {
+        copies.emplace_back(new KeyMachine());
+        KeyMachine &flat = *copies.back();
+        flat.getMemory().load(0, image.data(), image.size());
+        flat.getCpu().loadState(state);
+        flat.setTstates(base.getTstates());
+        flat.key = static_cast<uint8_t>(key);
+    }
+    double copyTime = micros(start) / copies.size();
+
+    uint32_t mismatches = 0;
+    uint64_t copied = 0;
+    vector<uint8_t> got(Z80Memory::SIZE);
+    for (uint32_t key = 0; key < 256; key++) {
+        KeyMachine &flat = *copies[key];
+        runToHalt(flat);
+
+        Z80ForkMachine &fork = *forks[key];
+        fork.getMemory().save(0, got.data(), got.size());
+        Z80State forkState, flatState;
+        fork.getCpu().saveState(forkState);
+        flat.getCpu().saveState(flatState);
+        uint8_t a[Z80State::SERIALIZED_SIZE], b[Z80State::SERIALIZED_SIZE];
+        forkState.serialize(a);
+        flatState.serialize(b);
+
+        if (fork.getTstates() != flat.getTstates() || memcmp(a, b, sizeof(a)) != 0
+                || memcmp(got.data(), flat.getMemory().data(), got.size()) != 0) {
+            printf("Fork with key %u doesn't match\n", key);
+            mismatches++;
+        }
+        copied += fork.getMemory().getCopiedPages();
+    }
+
+    printf("256 forks on %u threads: fork %.2f us, full copy %.2f us, %.1f of %u pages "
+            "copied per fork, run %.1f ms: %s\n", threads, forkTime, copyTime,
+            static_cast<double>(copied) / 256, Z80PagedMemory::PAGES, runTime / 1000,
+            mismatches == 0 ? "OK" : "MISMATCH");
+    return ok && mismatches == 0 ? 0 : 1;
+}
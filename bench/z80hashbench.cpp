@@ -0,0 +1,219 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "z80statehash.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of Z80StateHash and Z80LoopDetector.
+ *
+ * ZEXALL runs in slices of instructions, hashing the machine after each
+ * one. The incremental hash must match a full hash of the same state and
+ * the loop detector must stay quiet, ZEXALL never repeats a state, and
+ * two machines in the same state must hash the same. Then
+ * small guest programs that hang (a JR $, DI + HALT, a counter that wraps
+ * around) must be reported with the right loop period.
+ *
+ *     z80hashbench [-s slices] [zexall.bin]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint64_t SLICE = 10000;
+
+struct Hang {
+    const char *name;
+    vector<uint8_t> code;
+    // Instructions in the loop, with every sample
+    uint64_t period;
+};
+
+// Some work, then a jump to itself. R cycles every 128 fetches.
+const Hang jumpSelf = { "jr $", {
+    0x21, 0x00, 0x80,       // LD HL,8000h
+    0x06, 0x10,             // LD B,16
+    0x70,                   // loop: LD (HL),B
+    0x23,                   // INC HL
+    0x10, 0xFC,             // DJNZ loop
+    0x18, 0xFE              // JR $
+}, 128 };
+
+// A halted CPU fetches NOPs forever
+const Hang halt = { "di/halt", {
+    0xF3,                   // DI
+    0x76                    // HALT
+}, 128 };
+
+// HL counts to 65536 and is stored on every turn, 3 fetches per turn
+const Hang counter = { "counter", {
+    0x21, 0x00, 0x00,       // LD HL,0
+    0x23,                   // loop: INC HL
+    0x22, 0x00, 0x90,       // LD (9000h),HL
+    0x18, 0xFA              // JR loop
+}, 65536 * 3 };
+
+uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+double micros(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs the program in slices of 'slice' instructions until the detector
+// reports a loop, returns the loop period in instructions or 0
+uint64_t findLoop(const Hang &hang, uint64_t slice, uint64_t maxInstructions) {
+    Z80Machine machine;
+    machine.getMemory().clear();
+    machine.getMemory().load(0, hang.code.data(), hang.code.size());
+    machine.reset();
+
+    Z80StateHash hasher;
+    Z80LoopDetector detector;
+    uint64_t instructions = 0;
+    while (instructions < maxInstructions) {
+        if (detector.check(hasher.hash(machine), instructions)) {
+            return detector.getLoopPeriod();
+        }
+        machine.run(0, slice, instructions);
+    }
+    return 0;
+}
+
+}
+
+void bootZexall(Z80Machine &machine, const vector<uint8_t> &image) {
+    // A RET at the BDOS entry: no output, same instructions
+    machine.getMemory().clear();
+    machine.getMemory().load(0x100, image.data(), image.size());
+    uint8_t bdos[] = { 0xC9 };
+    machine.getMemory().load(0x0005, bdos, sizeof(bdos));
+    machine.reset();
+    machine.getCpu().setRegPC(0x100);
+    machine.getCpu().setRegSP(0xF000);
+}
+
+// A machine that ran ZEXALL and a fresh one given its state (with bit 7
+// of R flipped, the CPU never sees it) hash the same, incrementally or
+// not. One register or one byte of RAM apart, they don't.
+bool checkEqualStates(const vector<uint8_t> &image) {
+    Z80Machine one, other;
+    bootZexall(one, image);
+    Z80StateHash oneHasher, otherHasher;
+    oneHasher.hash(one);
+    uint64_t instructions = 0;
+    one.run(0, 50000, instructions);
+
+    Z80State state;
+    one.getCpu().saveState(state);
+    state.regR ^= 0x80;
+    other.getCpu().loadState(state);
+    other.getMemory().load(0, one.getMemory().data(), Z80Memory::SIZE);
+
+    uint64_t hash = oneHasher.hash(one);
+    bool ok = otherHasher.hash(other) == hash
+            && Z80StateHash::hashCpu(one.getCpu()) == Z80StateHash::hashCpu(other.getCpu());
+
+    other.getCpu().setRegA(state.regA ^ 0x01);
+    ok = ok && otherHasher.hash(other) != hash;
+    other.getCpu().setRegA(state.regA);
+    ok = ok && otherHasher.hash(other) == hash;
+    other.getMemory().write(0x8000, other.getMemory().read(0x8000) ^ 0x01);
+    ok = ok && otherHasher.hash(other) != hash;
+
+    printf("Equal states, equal hashes: %s\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t slices = 2000;
+    const char *fileName = "zexall.bin";
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-s") == 0 && idx + 1 < argc) {
+            slices = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else if (argv[idx][0] != '-') {
+            fileName = argv[idx];
+        } else {
+            printf("Usage: %s [-s slices] [zexall.bin]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    ifstream f(fileName, ios::in | ios::binary);
+    if (!f.is_open()) {
+        printf("Can't open %s\n", fileName);
+        return 2;
+    }
+    vector<uint8_t> image((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    bool ok = checkEqualStates(image);
+
+    Z80Machine machine;
+    bootZexall(machine, image);
+
+    Z80StateHash hasher;
+    Z80LoopDetector detector;
+    uint64_t instructions = 0;
+    double incremental = 0, full = 0;
+    uint64_t mismatches = 0;
+    for (uint32_t slice = 0; slice < slices; slice++) {
+        machine.run(0, SLICE, instructions);
+
+        auto start = chrono::steady_clock::now();
+        uint64_t hash = hasher.hash(machine);
+        incremental += micros(start);
+
+        start = chrono::steady_clock::now();
+        Z80StateHash fresh;
+        fresh.update(machine.getMemory(), Z80Memory::DirtyMap());
+        uint64_t check = fresh.combine(machine.getCpu());
+        full += micros(start);
+
+        if (hash != check) {
+            mismatches++;
+        }
+        if (detector.check(hash, instructions)) {
+            printf("ZEXALL reported as a loop at %llu instructions\n",
+                    static_cast<unsigned long long>(instructions));
+            ok = false;
+            break;
+        }
+    }
+    if (mismatches != 0) {
+        printf("%llu incremental hashes don't match\n", static_cast<unsigned long long>(mismatches));
+        ok = false;
+    }
+    printf("ZEXALL, %u slices of %llu instructions: %.2f pages/hash, %.2f us/hash incremental, "
+            "%.2f us full\n", slices, static_cast<unsigned long long>(SLICE),
+            static_cast<double>(hasher.getPagesHashed() - Z80Memory::PAGES) / (slices - 1),
+            incremental / slices, full / slices);
+
+    for (const Hang *hang : { &jumpSelf, &halt, &counter }) {
+        for (uint64_t slice : { 1, 100 }) {
+            auto start = chrono::steady_clock::now();
+            uint64_t period = findLoop(*hang, slice, 100000000);
+            // Sampled every 'slice' instructions, the lcm of both
+            uint64_t expected = hang->period / gcd(hang->period, slice) * slice;
+            bool found = period == expected;
+            printf("%-8s slice %3llu: period %llu (expected %llu), %.1f ms %s\n", hang->name,
+                    static_cast<unsigned long long>(slice), static_cast<unsigned long long>(period),
+                    static_cast<unsigned long long>(expected), micros(start) / 1000,
+                    found ? "OK" : "FAIL");
+            ok = ok && found;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
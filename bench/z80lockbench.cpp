@@ -0,0 +1,273 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "z80lockstep.h"
+#include "z80machine.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of the Z80Lockstep engine.
+ *
+ * Every routine runs from many input states (65536 by default), one at a
+ * time on the scalar core and in blocks of lanes on the lockstep engine.
+ * Lanes stopped by an unsupported instruction finish on the scalar core.
+ * All the registers, MEMPTR, Q, R and T-states of every state must match.
+ *
+ *     z80lockbench [-l lanes] [-s states]
+ *
+ * The exit status is 1 if any state doesn't match.
+ */
+
+namespace {
+
+struct Routine {
+    const char *name;
+    uint16_t origin;
+    vector<uint8_t> code;
+};
+
+// HL = B * C, shift and add. The JR NC diverges on every bit.
+const Routine mul8 = { "mul8", 0x8000, {
+    0x21, 0x00, 0x00,       // LD HL,0
+    0x16, 0x00,             // LD D,0
+    0x58,                   // LD E,B
+    0x06, 0x08,             // LD B,8
+    0x29,                   // loop: ADD HL,HL
+    0xCB, 0x21,             // SLA C
+    0x30, 0x01,             // JR NC,skip
+    0x19,                   // ADD HL,DE
+    0x10, 0xF8,             // skip: DJNZ loop
+    0x76                    // HALT
+} };
+
+// Bit count of A, a loop with a different trip count per lane, then some
+// flag juggling. EXX isn't supported, every lane finishes on the scalar core.
+const Routine popcount = { "popcount", 0x9000, {
+    0x06, 0x00,             // LD B,0
+    0xB7,                   // OR A
+    0x28, 0x06,             // JR Z,done
+    0x04,                   // loop: INC B
+    0x4F,                   // LD C,A
+    0x3D,                   // DEC A
+    0xA1,                   // AND C
+    0x20, 0xFA,             // JR NZ,loop
+    0x78,                   // done: LD A,B
+    0x37,                   // SCF
+    0x3F,                   // CCF
+    0x1F,                   // RRA
+    0xCE, 0x5A,             // ADC A,5Ah
+    0xFE, 0x80,             // CP 80h
+    0xDA, 0x18, 0x90,       // JP C,skip
+    0xEE, 0xFF,             // XOR FFh
+    0x2F,                   // skip: CPL
+    0xCB, 0x7F,             // BIT 7,A
+    0xCB, 0xC8,             // SET 1,B
+    0xD9,                   // EXX
+    0x04,                   // INC B
+    0x76                    // HALT
+} };
+
+// A bit of every supported instruction group, with memory operands
+const Routine mix = { "mix", 0xA100, {
+    0x3F,                   // CCF
+    0x37,                   // SCF
+    0x8E,                   // ADC A,(HL)
+    0x0F,                   // RRCA
+    0x17,                   // RLA
+    0x1F,                   // RRA
+    0x90,                   // SUB B
+    0x99,                   // SBC A,C
+    0xE2, 0x0D, 0xA1,       // JP PO,A10D
+    0xA2,                   // AND D
+    0xAB,                   // XOR E
+    0xF2, 0x12, 0xA1,       // A10D: JP P,A112
+    0xB3,                   // OR E
+    0x3C,                   // INC A
+    0xBA,                   // A112: CP D
+    0x0A,                   // LD A,(BC)
+    0x66,                   // LD H,(HL)
+    0x1A,                   // LD A,(DE)
+    0x2D,                   // DEC L
+    0x13,                   // INC DE
+    0x0B,                   // DEC BC
+    0x39,                   // ADD HL,SP
+    0x31, 0x34, 0x12,       // LD SP,1234h
+    0x3A, 0x00, 0xA0,       // LD A,(A000h)
+    0x86,                   // ADD A,(HL)
+    0xCB, 0x2A,             // SRA D
+    0xCB, 0x3B,             // SRL E
+    0xCB, 0x19,             // RR C
+    0xCB, 0x08,             // RRC B
+    0xCB, 0x37,             // SLL A
+    0xCB, 0xBC,             // RES 7,H
+    0xCB, 0x7C,             // BIT 7,H
+    0xCB, 0x47,             // BIT 0,A
+    0x28, 0x01,             // JR Z,A134
+    0x00,                   // NOP
+    0x21, 0x3A, 0xA1,       // A134: LD HL,A13A
+    0xFA, 0x3B, 0xA1,       // JP M,A13B
+    0x76,                   // A13A: HALT
+    0xE9                    // A13B: JP (HL)
+} };
+
+struct State {
+    uint8_t a, f, b, c, d, e, h, l, r;
+    bool q;
+    uint16_t pc, sp, wz;
+    uint64_t tstates;
+
+    bool operator==(const State &other) const {
+        return a == other.a && f == other.f && b == other.b && c == other.c
+                && d == other.d && e == other.e && h == other.h && l == other.l
+                && r == other.r && q == other.q && pc == other.pc && sp == other.sp
+                && wz == other.wz && tstates == other.tstates;
+    }
+};
+
+State capture(const Z80 &cpu, uint64_t tstates) {
+    return { cpu.getRegA(), cpu.getFlags(), cpu.getRegB(), cpu.getRegC(),
+        cpu.getRegD(), cpu.getRegE(), cpu.getRegH(), cpu.getRegL(), cpu.getRegR(),
+        cpu.isFlagQ(), cpu.getRegPC(), cpu.getRegSP(), cpu.getMemPtr(), tstates };
+}
+
+void printState(const char *title, const State &st) {
+    printf("  %-8s AF=%02X%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X PC=%04X SP=%04X "
+            "WZ=%04X R=%02X Q=%d T=%llu\n", title, st.a, st.f, st.b, st.c, st.d, st.e,
+            st.h, st.l, st.pc, st.sp, st.wz, st.r, st.q ? 1 : 0,
+            static_cast<unsigned long long>(st.tstates));
+}
+
+// Input state number 'idx', from the reset state
+void setInput(Z80 &cpu, const Routine &routine, uint32_t idx) {
+    cpu.setRegPC(routine.origin);
+    cpu.setRegA(idx >> 8);
+    cpu.setFlags(idx & 0xff);
+    cpu.setRegB(idx >> 8);
+    cpu.setRegC(idx & 0xff);
+    cpu.setRegDE(static_cast<uint16_t>(idx * 0x9E37 + 0x1234));
+    cpu.setRegHL(0xA000 | (idx & 0xff));
+}
+
+// Run on the scalar core until HALT
+void runScalar(Z80 &cpu) {
+    for (uint32_t count = 0; !cpu.isHalted() && count < 1000000; count++) {
+        cpu.execute();
+    }
+}
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool check(Z80Machine &machine, const Routine &routine, uint32_t states, uint32_t lanes) {
+    Z80 &cpu = machine.getCpu();
+    Z80Memory &memory = machine.getMemory();
+    memory.load(routine.origin, routine.code.data(), routine.code.size());
+
+    vector<State> expected(states);
+    auto start = chrono::steady_clock::now();
+    for (uint32_t idx = 0; idx < states; idx++) {
+        machine.reset();
+        setInput(cpu, routine, idx);
+        runScalar(cpu);
+        expected[idx] = capture(cpu, machine.getTstates());
+    }
+    double scalarTime = seconds(start);
+
+    Z80Lockstep engine(lanes);
+    engine.setMemory(memory.data());
+    const Z80Lockstep::Lanes &regs = engine.getLanes();
+
+    uint64_t steps = 0;
+    uint64_t peeled = 0;
+    uint32_t mismatches = 0;
+    double lockstepTime = 0.0;
+    for (uint32_t base = 0; base < states; base += lanes) {
+        uint32_t count = min(lanes, states - base);
+
+        start = chrono::steady_clock::now();
+        for (uint32_t lane = 0; lane < lanes; lane++) {
+            machine.reset();
+            setInput(cpu, routine, base + (lane < count ? lane : 0));
+            engine.loadLane(lane, cpu);
+        }
+        steps += engine.run();
+        lockstepTime += seconds(start);
+
+        for (uint32_t lane = 0; lane < count; lane++) {
+            uint64_t tstates = regs.tstates[lane];
+            if (regs.status[lane] == Z80Lockstep::UNSUPPORTED) {
+                // Peel it off to the scalar core
+                machine.reset();
+                engine.storeLane(lane, cpu);
+                runScalar(cpu);
+                tstates += machine.getTstates();
+                peeled++;
+            } else {
+                engine.storeLane(lane, cpu);
+            }
+
+            State got = capture(cpu, tstates);
+            if (!(got == expected[base + lane])) {
+                if (mismatches++ < 5) {
+                    printf("%s: state %u doesn't match\n", routine.name, base + lane);
+                    printState("scalar", expected[base + lane]);
+                    printState("lockstep", got);
+                }
+            }
+        }
+    }
+
+    printf("%-10s %6u states %5u lanes %9.2f %9.2f %7.2fx %8.1f %7llu %s\n",
+            routine.name, states, lanes, states / scalarTime / 1e6,
+            states / lockstepTime / 1e6, scalarTime / lockstepTime,
+            steps == 0 ? 0.0 : static_cast<double>(engine.getLaneInstructions()) / steps,
+            static_cast<unsigned long long>(peeled), mismatches == 0 ? "OK" : "MISMATCH");
+    return mismatches == 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t lanes = 256;
+    uint32_t states = 65536;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-l") == 0 && idx + 1 < argc) {
+            lanes = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else if (strcmp(argv[idx], "-s") == 0 && idx + 1 < argc) {
+            states = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else {
+            printf("Usage: %s [-l lanes] [-s states]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (lanes == 0 || states == 0) {
+        printf("Lanes and states must be greater than 0\n");
+        return 2;
+    }
+
+    // Memory operands read pseudo random data
+    Z80Machine machine;
+    uint32_t seed = 0x12345678;
+    for (uint32_t address = 0; address < Z80Memory::SIZE; address++) {
+        seed = seed * 1103515245 + 12345;
+        machine.getMemory().write(address, seed >> 24);
+    }
+
+    printf("%-10s %6s %12s %9s %9s %8s %8s %7s\n", "routine", "", "", "scalar",
+            "lockstep", "speedup", "lanes", "peeled");
+    printf("%-10s %6s %12s %9s %9s %8s %8s %7s\n", "", "", "", "Mstate/s",
+            "Mstate/s", "", "/step", "");
+
+    bool passed = true;
+    for (const Routine *routine : { &mul8, &popcount, &mix }) {
+        passed &= check(machine, *routine, states, lanes);
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "z80eventqueue.h"
+#include "z80machine.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of Z80EventQueue.
+ *
+ * A guest writes to a beeper and an AY in a loop; a peripheral folds
+ * every write into a checksum after some work per event. The peripheral
+ * runs inline in outPort(), on a thread fed through a mutex and a deque,
+ * and on a thread fed through a Z80EventQueue. All of them must see the
+ * same writes in the same order. Also checks a full queue in both modes.
+ *
+ *     z80queuebench [-t tstates] [-w work]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint8_t program[] = {
+    0x1C,                   // loop: INC E
+    0x7B,                   // LD A,E
+    0xD3, 0xFE,             // OUT (FEh),A
+    0x01, 0xFD, 0xFF,       // LD BC,FFFDh
+    0xED, 0x59,             // OUT (C),E
+    0x06, 0xBF,             // LD B,BFh
+    0xED, 0x79,             // OUT (C),A
+    0x82,                   // ADD A,D
+    0x57,                   // LD D,A
+    0xC3, 0x00, 0x00        // JP loop
+};
+
+// What the peripheral does with every write
+class Peripheral {
+public:
+    explicit Peripheral(uint32_t work) : work(work), events(0), checksum(0), state(1) {}
+
+    void apply(const Z80PortEvent &event) {
+        for (uint32_t idx = 0; idx < work; idx++) {
+            state = state * 6364136223846793005ull + event.value;
+        }
+        checksum = (checksum ^ (event.tstates * 0x9E3779B97F4A7C15ull
+                ^ (uint64_t(event.port) << 8) ^ event.value)) * 0x100000001B3ull;
+        events++;
+    }
+
+    uint64_t getEvents() const { return events; }
+    uint64_t getChecksum() const { return checksum ^ (state & 1); }
+
+private:
+    uint32_t work;
+    uint64_t events;
+    uint64_t checksum;
+    uint64_t state;
+};
+
+class InlinePort : public Z80PortDevice {
+public:
+    explicit InlinePort(Peripheral &peripheral) : peripheral(peripheral) {}
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) override {
+        peripheral.apply({ tstates, port, value });
+    }
+
+private:
+    Peripheral &peripheral;
+};
+
+class LockedPort : public Z80PortDevice {
+public:
+    mutex lock;
+    deque<Z80PortEvent> events;
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) override {
+        lock_guard<mutex> guard(lock);
+        events.push_back({ tstates, port, value });
+    }
+};
+
+struct Result {
+    uint64_t events;
+    uint64_t checksum;
+    double emulationMs;
+    double totalMs;
+};
+
+double millis(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs the guest with 'device' on the beeper and AY ports
+double runGuest(Z80PortDevice &device, uint64_t tstates) {
+    Z80Machine machine;
+    machine.getPorts().map(0x0001, 0x0000, &device);
+    machine.getPorts().map(0xC002, 0xC000, &device);
+    machine.getPorts().map(0xC002, 0x8000, &device);
+    machine.getMemory().load(0, program, sizeof(program));
+    machine.reset();
+
+    uint64_t instructions = 0;
+    auto begin = chrono::steady_clock::now();
+    machine.run(tstates, 0, instructions);
+    return millis(begin);
+}
+
+Result runInline(uint64_t tstates, uint32_t work) {
+    Peripheral peripheral(work);
+    InlinePort port(peripheral);
+    auto begin = chrono::steady_clock::now();
+    double emulation = runGuest(port, tstates);
+    return { peripheral.getEvents(), peripheral.getChecksum(), emulation, millis(begin) };
+}
+
+Result runLocked(uint64_t tstates, uint32_t work) {
+    Peripheral peripheral(work);
+    LockedPort port;
+    atomic<bool> done(false);
+    auto begin = chrono::steady_clock::now();
+    thread consumer([&]() {
+        deque<Z80PortEvent> batch;
+        for (;;) {
+            bool finished = done.load();
+            {
+                lock_guard<mutex> guard(port.lock);
+                batch.swap(port.events);
+            }
+            for (const Z80PortEvent &event : batch) {
+                peripheral.apply(event);
+            }
+            if (batch.empty()) {
+                if (finished) {
+                    break;
+                }
+                this_thread::yield();
+            }
+            batch.clear();
+        }
+    });
+    double emulation = runGuest(port, tstates);
+    done = true;
+    consumer.join();
+    return { peripheral.getEvents(), peripheral.getChecksum(), emulation, millis(begin) };
+}
+
+Result runQueued(uint64_t tstates, uint32_t work, uint64_t &stalls) {
+    Peripheral peripheral(work);
+    Z80EventQueue queue(8192);
+    Z80QueuedPort port(queue);
+    atomic<bool> done(false);
+    auto begin = chrono::steady_clock::now();
+    thread consumer([&]() {
+        Z80PortEvent batch[256];
+        for (;;) {
+            bool finished = done.load();
+            size_t count = queue.pop(batch, 256);
+            for (size_t idx = 0; idx < count; idx++) {
+                peripheral.apply(batch[idx]);
+            }
+            if (count == 0) {
+                if (finished) {
+                    break;
+                }
+                this_thread::yield();
+            }
+        }
+    });
+    double emulation = runGuest(port, tstates);
+    done = true;
+    consumer.join();
+    stalls = port.getStalls();
+    return { peripheral.getEvents(), peripheral.getChecksum(), emulation, millis(begin) };
+}
+
+// A ring of 8 gets 10 writes and a block of 3, with a late consumer or none
+bool checkFull(bool dropWhenFull) {
+    Z80EventQueue queue(8);
+    Z80QueuedPort port(queue, dropWhenFull);
+    thread consumer;
+    vector<Z80PortEvent> received;
+    if (!dropWhenFull) {
+        // Something has to make room, late
+        consumer = thread([&]() {
+            this_thread::sleep_for(chrono::milliseconds(20));
+            Z80PortEvent batch[4];
+            while (received.size() < 13) {
+                size_t count = queue.pop(batch, 4);
+                received.insert(received.end(), batch, batch + count);
+                this_thread::yield();
+            }
+        });
+    }
+    for (uint32_t idx = 0; idx < 10; idx++) {
+        port.out(0x00FE, static_cast<uint8_t>(idx), idx * 11);
+    }
+    const uint8_t block[3] = { 10, 11, 12 };
+    port.outBlock(0x03FE, block, 3, 110, 21);
+
+    if (dropWhenFull) {
+        Z80PortEvent batch[16];
+        size_t count = queue.pop(batch, 16);
+        received.assign(batch, batch + count);
+    } else {
+        consumer.join();
+    }
+
+    size_t expected = dropWhenFull ? 8 : 13;
+    bool ok = received.size() == expected && queue.size() == 0
+            && port.getDropped() == (dropWhenFull ? 5 : 0)
+            && (dropWhenFull ? port.getStalls() == 5 : port.getStalls() >= 1);
+    for (size_t idx = 0; ok && idx < received.size(); idx++) {
+        const Z80PortEvent &event = received[idx];
+        uint64_t tstates = idx < 10 ? idx * 11 : 110 + (idx - 10) * 21;
+        uint16_t address = idx < 10 ? 0x00FE : 0x03FE - (idx - 10) * 0x100;
+        ok = event.value == idx && event.tstates == tstates && event.port == address;
+    }
+    printf("Full ring, %s: %zu events, %llu stalls, %llu dropped: %s\n",
+            dropWhenFull ? "drop" : "wait", received.size(),
+            static_cast<unsigned long long>(port.getStalls()),
+            static_cast<unsigned long long>(port.getDropped()), ok ? "OK" : "FAIL");
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t tstates = 50000000;
+    uint32_t work = 40;
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-t") == 0 && idx + 1 < argc) {
+            tstates = strtoull(argv[++idx], nullptr, 10);
+        } else if (strcmp(argv[idx], "-w") == 0 && idx + 1 < argc) {
+            work = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else {
+            printf("Usage: %s [-t tstates] [-w work]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bool ok = checkFull(true);
+    ok = checkFull(false) && ok;
+
+    uint64_t stalls = 0;
+    Result inlined = runInline(tstates, work);
+    Result locked = runLocked(tstates, work);
+    Result queued = runQueued(tstates, work, stalls);
+
+    printf("\n%llu T-states, %llu port writes, %u work steps each\n",
+            static_cast<unsigned long long>(tstates),
+            static_cast<unsigned long long>(inlined.events), work);
+    printf("%-8s %14s %10s %s\n", "writes", "emulation ms", "total ms", "");
+    const Result *results[] = { &inlined, &locked, &queued };
+    const char *names[] = { "inline", "mutex", "queue" };
+    for (uint32_t idx = 0; idx < 3; idx++) {
+        bool same = results[idx]->events == inlined.events
+                && results[idx]->checksum == inlined.checksum;
+        ok = ok && same;
+        printf("%-8s %14.1f %10.1f %s\n", names[idx], results[idx]->emulationMs,
+                results[idx]->totalMs, same ? "OK" : "FAIL");
+    }
+    printf("Queue full %llu times\n", static_cast<unsigned long long>(stalls));
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "z80replay.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of the input record/replay log.
+ *
+ * A guest program mixes the values read from a port into memory, counts
+ * maskable interrupts and NMIs. It runs with a device returning random
+ * values, an INT line with random jitter and NMIs raised by the host loop
+ * at random points, all seeded from std::random_device, while the inputs
+ * are recorded. The log goes through a save/load round trip and it's
+ * replayed on a plain Z80Machine, which must end in exactly the same state.
+ * Damaged copies of the saved log must be refused by load().
+ *
+ *     z80replaybench [-t millions of T-states]
+ *
+ * The exit status is 1 if the replay doesn't match or a damaged log loads.
+ */
+
+namespace {
+
+const uint8_t program[] = {
+    // 0000h
+    0xC3, 0x00, 0x01,       // JP 0100h
+};
+
+const uint8_t intHandler[] = {
+    // 0038h
+    0xF5,                   // PUSH AF
+    0x3A, 0x00, 0x80,       // LD A,(8000h)
+    0x3C,                   // INC A
+    0x32, 0x00, 0x80,       // LD (8000h),A
+    0xF1,                   // POP AF
+    0xFB,                   // EI
+    0xED, 0x4D              // RETI
+};
+
+const uint8_t nmiHandler[] = {
+    // 0066h
+    0xE5,                   // PUSH HL
+    0x2A, 0x02, 0x80,       // LD HL,(8002h)
+    0x23,                   // INC HL
+    0x22, 0x02, 0x80,       // LD (8002h),HL
+    0xE1,                   // POP HL
+    0xED, 0x45              // RETN
+};
+
+const uint8_t mainLoop[] = {
+    // 0100h
+    0x31, 0x00, 0xFF,       // LD SP,FF00h
+    0xED, 0x56,             // IM 1
+    0xFB,                   // EI
+    0x21, 0x00, 0x90,       // LD HL,9000h
+    0xDB, 0xFE,             // loop: IN A,(FEh)
+    0xAE,                   // XOR (HL)
+    0x77,                   // LD (HL),A
+    0x23,                   // INC HL
+    0x7C,                   // LD A,H
+    0xE6, 0x0F,             // AND 0Fh
+    0xF6, 0x90,             // OR 90h
+    0x67,                   // LD H,A
+    0x18, 0xF3              // JR loop
+};
+
+const uint64_t FRAME = 69888;
+
+// Random port values and INT line, a frame interrupt 32 T-states long
+// with some jitter
+class NoisyMachine : public Z80Machine
+{
+public:
+    explicit NoisyMachine(uint32_t seed) : rng(seed), nextInt(FRAME) {
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        Z80Machine::inPort(port);
+        return static_cast<uint8_t>(rng());
+    }
+
+    bool isActiveINT() override {
+        if (tstates >= nextInt + 32) {
+            nextInt += FRAME + rng() % 64;
+        }
+        return tstates >= nextInt;
+    }
+
+    mt19937 rng;
+
+private:
+    uint64_t nextInt;
+};
+
+void loadProgram(Z80Machine &machine) {
+    Z80Memory &memory = machine.getMemory();
+    memory.load(0x0000, program, sizeof(program));
+    memory.load(0x0038, intHandler, sizeof(intHandler));
+    memory.load(0x0066, nmiHandler, sizeof(nmiHandler));
+    memory.load(0x0100, mainLoop, sizeof(mainLoop));
+    machine.reset();
+}
+
+// A truncated image and one whose payload size is far beyond the end of
+// the file must be refused, leaving 'log' as it was
+bool checkDamaged(const string &image, Z80InputLog &log) {
+    size_t events = log.getEventCount();
+    size_t size = log.getSize();
+
+    stringstream truncated(image.substr(0, image.size() - 1));
+    // Magic, version, 1 event and 2^62 bytes of payload
+    string huge("Z80I\x01\x01", 6);
+    huge += string(8, '\xff') + "\x3f" + image.substr(image.size() - 16);
+    stringstream oversized(huge);
+
+    bool ok = !log.load(truncated) && !log.load(oversized)
+            && log.getEventCount() == events && log.getSize() == size;
+    printf("Damaged logs refused: %s\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+bool sameState(Z80Machine &one, Z80Machine &other) {
+    uint8_t a[Z80State::SERIALIZED_SIZE], b[Z80State::SERIALIZED_SIZE];
+    Z80State state;
+    one.getCpu().saveState(state);
+    state.serialize(a);
+    other.getCpu().saveState(state);
+    state.serialize(b);
+
+    return one.getTstates() == other.getTstates() && memcmp(a, b, sizeof(a)) == 0
+            && memcmp(one.getMemory().data(), other.getMemory().data(), Z80Memory::SIZE) == 0;
+}
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t tstates = 200000000;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-t") == 0 && idx + 1 < argc) {
+            tstates = static_cast<uint64_t>(atoi(argv[++idx])) * 1000000;
+        } else {
+            printf("Usage: %s [-t millions of T-states]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    random_device entropy;
+    Z80Recorder<NoisyMachine> recorder(entropy());
+    loadProgram(recorder);
+
+    uint64_t instructions = 0;
+    auto start = chrono::steady_clock::now();
+    while (recorder.getTstates() < tstates) {
+        if (recorder.rng() % 8 == 0) {
+            recorder.triggerNMI();
+        }
+        recorder.run(recorder.getTstates() + 1000 + recorder.rng() % 20000, 0, instructions);
+    }
+    double recordTime = seconds(start);
+
+    stringstream file;
+    recorder.getLog().save(file);
+    Z80InputLog log;
+    if (!log.load(file)) {
+        printf("Can't load the saved log\n");
+        return 1;
+    }
+    bool passed = checkDamaged(file.str(), log);
+
+    Z80Replayer<Z80Machine> replayer(log);
+    loadProgram(replayer);
+    start = chrono::steady_clock::now();
+    replayer.run(recorder.getTstates(), 0, instructions);
+    double replayTime = seconds(start);
+
+    passed = passed && !replayer.isDiverged() && replayer.isFinished()
+            && sameState(recorder, replayer);
+
+    printf("%llu events in %zu bytes (%.2f bytes/event), %u interrupts, %u NMIs\n",
+            static_cast<unsigned long long>(log.getEventCount()), log.getSize(),
+            static_cast<double>(log.getSize()) / log.getEventCount(),
+            recorder.getMemory().read(0x8000),
+            recorder.getMemory().read(0x8002) | (recorder.getMemory().read(0x8003) << 8));
+    printf("record %.1f MHz, replay %.1f MHz: %s\n", recorder.getTstates() / recordTime / 1e6,
+            recorder.getTstates() / replayTime / 1e6,
+            replayer.isDiverged() ? "DIVERGED" : passed ? "OK" : "MISMATCH");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "z80rewind.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of the Z80Rewind buffer.
+ *
+ * Runs ZEXALL for a number of 70000 T-state frames, capturing a snapshot
+ * at the end of each one, then seeks back to several points (newest to
+ * oldest, each seek drops the later snapshots) and compares the CPU state,
+ * T-states and RAM against a second machine that ran straight there.
+ * Restoring a snapshot that isn't there must fail without touching the
+ * machine.
+ *
+ *     z80rewindbench [-f frames] [zexall.bin]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint64_t FRAME = 70000;
+const uint32_t SEEKS = 16;
+
+struct Reference {
+    uint64_t target;
+    uint64_t tstates;
+    uint8_t cpu[Z80State::SERIALIZED_SIZE];
+    vector<uint8_t> ram;
+};
+
+void boot(Z80Machine &machine, const vector<uint8_t> &image) {
+    machine.getMemory().load(0, image.data(), image.size());
+    machine.reset();
+}
+
+void capture(Z80Machine &machine, Reference &ref) {
+    Z80State state;
+    machine.getCpu().saveState(state);
+    state.serialize(ref.cpu);
+    ref.tstates = machine.getTstates();
+    ref.ram.assign(machine.getMemory().data(), machine.getMemory().data() + Z80Memory::SIZE);
+}
+
+// restore() of a snapshot that isn't there, the machine must be untouched
+bool checkMissing(Z80Machine &machine, Z80Rewind &rewind) {
+    Reference before, after;
+    capture(machine, before);
+    bool refused = !rewind.restore(rewind.getSnapshotCount())
+            && !rewind.restore(UINT32_MAX);
+
+    Z80Machine other;
+    Z80Rewind empty(other);
+    refused = refused && !empty.restore(0) && !empty.seek(0);
+
+    capture(machine, after);
+    return refused && after.tstates == before.tstates
+            && memcmp(after.cpu, before.cpu, sizeof(after.cpu)) == 0 && after.ram == before.ram;
+}
+
+double micros(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t frames = 1000;
+    const char *fileName = "zexall.bin";
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-f") == 0 && idx + 1 < argc) {
+            frames = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else if (argv[idx][0] != '-') {
+            fileName = argv[idx];
+        } else {
+            printf("Usage: %s [-f frames] [zexall.bin]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    ifstream f(fileName, ios::in | ios::binary);
+    if (!f.is_open()) {
+        printf("Can't open %s\n", fileName);
+        return 2;
+    }
+    if (frames < SEEKS) {
+        printf("At least %u frames are needed\n", SEEKS);
+        return 2;
+    }
+
+    // Console output is dropped, BDOS returns at once
+    vector<uint8_t> image(0x10000, 0);
+    f.read(reinterpret_cast<char *>(&image[0x100]), 0x10000 - 0x100);
+    image[0] = 0xC3;
+    image[1] = 0x00;
+    image[2] = 0x01; // JP 0x100 CP/M TPA
+    image[5] = 0xC9; // Return from BDOS call
+
+    Z80Machine machine;
+    boot(machine, image);
+    Z80Rewind rewind(machine);
+
+    uint64_t instructions = 0;
+    double captureTime = 0.0;
+    for (uint32_t frame = 0; frame <= frames; frame++) {
+        if (frame != 0) {
+            machine.run(frame * FRAME, 0, instructions);
+        }
+        auto start = chrono::steady_clock::now();
+        rewind.capture();
+        captureTime += micros(start);
+    }
+    size_t used = rewind.getMemoryUsed();
+    uint32_t count = rewind.getSnapshotCount();
+
+    // Targets between frames, spread over the run
+    vector<uint64_t> targets;
+    uint64_t seed = 12345;
+    for (uint32_t idx = 0; idx < SEEKS; idx++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t frame = frames * idx / SEEKS;
+        targets.push_back(frame * FRAME + (seed >> 33) % FRAME);
+    }
+
+    vector<Reference> refs(SEEKS);
+    Z80Machine straight;
+    boot(straight, image);
+    for (uint32_t idx = 0; idx < SEEKS; idx++) {
+        straight.run(targets[idx], 0, instructions);
+        refs[idx].target = targets[idx];
+        capture(straight, refs[idx]);
+    }
+
+    uint32_t mismatches = 0;
+    if (!checkMissing(machine, rewind)) {
+        printf("Restore of a missing snapshot wasn't refused\n");
+        mismatches++;
+    }
+    double seekTime = 0.0;
+    for (uint32_t idx = SEEKS; idx-- > 0; ) {
+        auto start = chrono::steady_clock::now();
+        bool reached = rewind.seek(targets[idx]);
+        seekTime += micros(start);
+
+        Reference got;
+        capture(machine, got);
+        if (!reached || got.tstates != refs[idx].tstates
+                || memcmp(got.cpu, refs[idx].cpu, sizeof(got.cpu)) != 0
+                || got.ram != refs[idx].ram) {
+            printf("Seek to T-state %llu doesn't match\n",
+                    static_cast<unsigned long long>(targets[idx]));
+            mismatches++;
+        }
+    }
+
+    printf("%u snapshots, %.1f KB (%.0f bytes/snapshot), capture %.2f us, seek %.1f us: %s\n",
+            count, used / 1024.0, static_cast<double>(used) / count, captureTime / count,
+            seekTime / SEEKS, mismatches == 0 ? "OK" : "MISMATCH");
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "z80machine.h"
+#include "z80sampler.h"
+
+using namespace std;
+
+/*
+ * Check and benchmark of Z80Sampler.
+ *
+ * A guest calls a long delay loop and a short one in turn, 4 to 1 in
+ * time. The hot address report must put the long loop first and the short
+ * one second in about that ratio, and the hot caller report must put the
+ * return address of the long call first. Then ZEXALL runs with and without
+ * sampling to measure the overhead of the deadline compare and the samples
+ * (the goal is under 2% with a period of 10000 T-states).
+ *
+ *     z80samplebench [-t tstates] [-p period] [zexall.bin]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint8_t program[] = {
+    0x31, 0x00, 0xF0,       // 0100: LD SP,F000h
+    0xCD, 0x10, 0x01,       // 0103: loop: CALL long
+    0xCD, 0x20, 0x01,       // 0106: CALL short
+    0x18, 0xF8,             // 0109: JR loop
+    0x00, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x00,             // 0110: long: LD B,0
+    0x10, 0xFE,             // 0112: DJNZ $
+    0xC9,                   // 0114: RET
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x40,             // 0120: short: LD B,64
+    0x10, 0xFE,             // 0122: DJNZ $
+    0xC9                    // 0124: RET
+};
+
+double millis(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs 'machine' for 'tstates', sampling if 'sampler' isn't null
+void run(Z80Machine &machine, uint64_t tstates, Z80Sampler *sampler) {
+    Z80 &cpu = machine.getCpu();
+    uint64_t end = machine.getTstates() + tstates;
+    if (sampler == nullptr) {
+        while (machine.getTstates() < end) {
+            cpu.execute();
+        }
+        return;
+    }
+
+    sampler->start(machine.getTstates());
+    uint64_t deadline = sampler->getDeadline();
+    while (machine.getTstates() < end) {
+        cpu.execute();
+        if (machine.getTstates() >= deadline) {
+            sampler->sample(cpu, machine.getMemory().data(), machine.getTstates());
+            deadline = sampler->getDeadline();
+        }
+    }
+}
+
+struct Line {
+    uint64_t samples;
+    uint16_t address;
+};
+
+// The CSV lines of a report
+vector<Line> parse(const string &report) {
+    vector<Line> lines;
+    istringstream in(report);
+    string text;
+    getline(in, text);
+    while (getline(in, text)) {
+        unsigned long long samples;
+        double percent;
+        unsigned address;
+        if (sscanf(text.c_str(), "%llu,%lf,0x%X", &samples, &percent, &address) == 3) {
+            lines.push_back({ samples, static_cast<uint16_t>(address) });
+        }
+    }
+    return lines;
+}
+
+bool checkReports(uint32_t period) {
+    Z80Machine machine;
+    machine.getMemory().clear();
+    machine.getMemory().load(0x100, program, sizeof(program));
+    machine.reset();
+    machine.getCpu().setRegPC(0x100);
+
+    // A small buffer, so it's folded several times
+    Z80Sampler sampler(period, 256);
+    run(machine, 200000000, &sampler);
+
+    ostringstream addresses, callers;
+    sampler.writeHotAddresses(addresses, 10);
+    sampler.writeHotCallers(callers, 10);
+    vector<Line> hot = parse(addresses.str());
+    vector<Line> calls = parse(callers.str());
+
+    double ratio = hot.size() < 2 ? 0 : static_cast<double>(hot[0].samples) / hot[1].samples;
+    bool ok = hot.size() >= 2 && hot[0].address == 0x0112 && hot[1].address == 0x0122
+            && ratio > 3.5 && ratio < 4.5
+            && !calls.empty() && calls[0].address == 0x0106
+            && sampler.getTotalSamples() == 200000000 / period;
+    printf("%llu samples: hottest %04X, then %04X (%.2f to 1), top caller %04X: %s\n",
+            static_cast<unsigned long long>(sampler.getTotalSamples()),
+            hot.empty() ? 0 : hot[0].address, hot.size() < 2 ? 0 : hot[1].address, ratio,
+            calls.empty() ? 0 : calls[0].address, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t tstates = 100000000;
+    uint32_t period = 10000;
+    const char *fileName = "zexall.bin";
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-t") == 0 && idx + 1 < argc) {
+            tstates = strtoull(argv[++idx], nullptr, 10);
+        } else if (strcmp(argv[idx], "-p") == 0 && idx + 1 < argc) {
+            period = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else if (argv[idx][0] != '-') {
+            fileName = argv[idx];
+        } else {
+            printf("Usage: %s [-t tstates] [-p period] [zexall.bin]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    ifstream f(fileName, ios::in | ios::binary);
+    if (!f.is_open()) {
+        printf("Can't open %s\n", fileName);
+        return 2;
+    }
+    vector<uint8_t> image((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+    bool ok = checkReports(period);
+
+    // Best of five, the runs alternate to spread any noise on both
+    double plain = 1e30, sampled = 1e30;
+    uint64_t samples = 0;
+    for (uint32_t round = 0; round < 5; round++) {
+        for (bool sampling : { false, true }) {
+            // ZEXALL, with a RET at the BDOS entry
+            Z80Machine machine;
+            machine.getMemory().clear();
+            machine.getMemory().load(0x100, image.data(), image.size());
+            uint8_t bdos[] = { 0xC9 };
+            machine.getMemory().load(0x0005, bdos, sizeof(bdos));
+            machine.reset();
+            machine.getCpu().setRegPC(0x100);
+            machine.getCpu().setRegSP(0xF000);
+
+            Z80Sampler sampler(period);
+            auto start = chrono::steady_clock::now();
+            run(machine, tstates, sampling ? &sampler : nullptr);
+            double elapsed = millis(start);
+            if (sampling) {
+                sampled = min(sampled, elapsed);
+                samples = sampler.getTotalSamples();
+            } else {
+                plain = min(plain, elapsed);
+            }
+        }
+    }
+    printf("ZEXALL, %llu T-states: %.1f ms plain, %.1f ms with %llu samples every %u T-states, "
+            "%+.2f%% overhead\n", static_cast<unsigned long long>(tstates), plain, sampled,
+            static_cast<unsigned long long>(samples), period, 100 * (sampled / plain - 1));
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,54 @@
+# Profile guided optimization driver, run by the 'pgo' target:
+#
+#   1. build an instrumented z80bench in BINARY_DIR
+#   2. run the benchmark workloads to collect the profiles
+#   3. rebuild z80cpp, z80cpp-static and the tools in the same directory
+#      with the profiles and LTO (object paths must match the profiles)
+#   4. compare the PGO z80bench against the plain one (PLAIN_BENCH)
+
+set (TRAIN_TSTATES 200000000)
+set (BENCH_TSTATES 300000000)
+set (BENCH_RUNS 3)
+
+# run_step(description [QUIET] command...) stops with an error if the
+# command fails; QUIET drops its standard output
+function (run_step description)
+    message (STATUS "PGO: ${description}")
+    set (command ${ARGN})
+    set (quiet "")
+    if (ARGV1 STREQUAL "QUIET")
+        list (REMOVE_AT command 0)
+        set (quiet OUTPUT_QUIET)
+    endif ()
+    execute_process (COMMAND ${command} RESULT_VARIABLE result ${quiet})
+    if (NOT result EQUAL 0)
+        message (FATAL_ERROR "PGO: ${description} failed (${result})")
+    endif ()
+endfunction ()
+
+file (REMOVE_RECURSE ${BINARY_DIR}/profile)
+
+run_step ("configure instrumented build"
+    ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BINARY_DIR} -DZ80CPP_PGO_PHASE=GENERATE)
+run_step ("build instrumented z80bench"
+    ${CMAKE_COMMAND} --build ${BINARY_DIR} --target z80bench)
+run_step ("train on the z80bench workloads" QUIET
+    ${CMAKE_COMMAND} -E chdir ${BINARY_DIR}
+    ${BINARY_DIR}/z80bench -t ${TRAIN_TSTATES} -r 1)
+message (STATUS "PGO: profiles collected in ${BINARY_DIR}/profile")
+
+run_step ("configure optimized build"
+    ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BINARY_DIR} -DZ80CPP_PGO_PHASE=USE)
+run_step ("build with profile and LTO"
+    ${CMAKE_COMMAND} --build ${BINARY_DIR})
+
+run_step ("benchmark plain build"
+    ${CMAKE_COMMAND} -E chdir ${PLAIN_DIR}
+    ${PLAIN_BENCH} -t ${BENCH_TSTATES} -r ${BENCH_RUNS} -o ${BINARY_DIR}/plain.csv)
+run_step ("benchmark PGO build"
+    ${CMAKE_COMMAND} -E chdir ${BINARY_DIR}
+    ${BINARY_DIR}/z80bench -t ${BENCH_TSTATES} -r ${BENCH_RUNS} -o ${BINARY_DIR}/pgo.csv
+    -c ${BINARY_DIR}/plain.csv)
+
+message (STATUS "PGO: libraries and tools built in ${BINARY_DIR}")
+
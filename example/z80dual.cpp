@@ -0,0 +1,308 @@
+/*
+ * Two Z80s under the Z80Scheduler, like the main and sound CPUs of an
+ * arcade board.
+ *
+ * The main CPU (4 MHz) sends the numbers 1 to 64 through a mailbox and the
+ * sound CPU (3.58 MHz) answers each one with 2n+1 through another. The main
+ * CPU adds the answers in shared RAM and the sound CPU counts them there.
+ * Every quantum runs sequentially and on one thread per CPU, and both runs
+ * must end in exactly the same state.
+ * First, a check that a byte sent and a byte written to shared RAM during
+ * a quantum only reach the other CPU in the next one.
+ *
+ *     z80dual [quantum...]
+ *
+ * The exit status is 0 when every run gets the right results and the
+ * sequential and threaded runs match.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "z80scheduler.h"
+
+using namespace std;
+
+namespace {
+
+const uint16_t SHARED_BASE = 0xC000;
+const uint32_t SHARED_SIZE = 0x100;
+const uint8_t DATA_PORT = 0x10;
+const uint8_t STATUS_PORT = 0x11;
+
+const uint32_t MAIN_HZ = 4000000;
+const uint32_t SOUND_HZ = 3579545;
+
+const vector<uint8_t> mainCode = {
+    0x31, 0x00, 0xF0,       // LD SP,F000h
+    0x06, 0x40,             // LD B,64
+    0x0E, 0x01,             // LD C,1
+    0x21, 0x00, 0x00,       // LD HL,0
+    0x79,                   // loop: LD A,C
+    0xD3, DATA_PORT,        // OUT (10h),A
+    0xDB, STATUS_PORT,      // wait: IN A,(11h)
+    0xB7,                   // OR A
+    0x28, 0xFB,             // JR Z,wait
+    0xDB, DATA_PORT,        // IN A,(10h)
+    0x5F,                   // LD E,A
+    0x16, 0x00,             // LD D,0
+    0x19,                   // ADD HL,DE
+    0x22, 0x00, 0xC0,       // LD (C000h),HL
+    0x0C,                   // INC C
+    0x10, 0xEC,             // DJNZ loop
+    0x76                    // HALT
+};
+
+const vector<uint8_t> soundCode = {
+    0x31, 0x00, 0xF0,       // LD SP,F000h
+    0xDB, STATUS_PORT,      // loop: IN A,(11h)
+    0xB7,                   // OR A
+    0x28, 0xFB,             // JR Z,loop
+    0xDB, DATA_PORT,        // IN A,(10h)
+    0x87,                   // ADD A,A
+    0x3C,                   // INC A
+    0xD3, DATA_PORT,        // OUT (10h),A
+    0x21, 0x02, 0xC0,       // LD HL,C002h
+    0x34,                   // INC (HL)
+    0x18, 0xEF              // JR loop
+};
+
+// For the visibility check: the sender sends a byte and writes it to
+// shared RAM early in the first quantum, the poller reads the RAM (last
+// value in H) and polls the mailbox until the byte arrives
+const vector<uint8_t> senderCode = {
+    0x3E, 0x05,             // LD A,5
+    0xD3, DATA_PORT,        // OUT (10h),A
+    0x32, 0x00, 0xC0,       // LD (C000h),A
+    0x76                    // HALT
+};
+
+const vector<uint8_t> pollerCode = {
+    0x11, 0x00, 0x00,       // LD DE,0
+    0x26, 0x00,             // LD H,0
+    0x13,                   // loop: INC DE
+    0x3A, 0x00, 0xC0,       // LD A,(C000h)
+    0x67,                   // LD H,A
+    0xDB, STATUS_PORT,      // IN A,(11h)
+    0xB7,                   // OR A
+    0x28, 0xF6,             // JR Z,loop
+    0xDB, DATA_PORT,        // IN A,(10h)
+    0x4F,                   // LD C,A
+    0x3A, 0x00, 0xC0,       // LD A,(C000h)
+    0x76                    // HALT
+};
+
+// Private RAM, SHARED_SIZE bytes of shared RAM at SHARED_BASE and a
+// mailbox on each direction
+class DualMachine : public Z80Machine
+{
+public:
+    DualMachine(uint32_t index, Z80SharedMemory &shared, Z80Mailbox &inbox,
+            Z80Mailbox &outbox) : index(index), shared(shared), inbox(inbox), outbox(outbox) {
+    }
+
+    uint8_t peek8(uint16_t address) override {
+        if (isShared(address)) {
+            tstates += 3;
+            return shared.read(index, address - SHARED_BASE);
+        }
+        return Z80Machine::peek8(address);
+    }
+
+    void poke8(uint16_t address, uint8_t value) override {
+        if (isShared(address)) {
+            tstates += 3;
+            shared.write(index, address - SHARED_BASE, value);
+            return;
+        }
+        Z80Machine::poke8(address, value);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        tstates += 4;
+        switch (port & 0xff) {
+            case DATA_PORT:
+                return inbox.receive();
+            case STATUS_PORT:
+                return inbox.available() ? 1 : 0;
+            default:
+                return 0xff;
+        }
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        tstates += 4;
+        if ((port & 0xff) == DATA_PORT) {
+            outbox.send(value);
+        }
+    }
+
+private:
+    uint32_t index;
+    Z80SharedMemory &shared;
+    Z80Mailbox &inbox;
+    Z80Mailbox &outbox;
+
+    static bool isShared(uint16_t address) {
+        return address >= SHARED_BASE && address < SHARED_BASE + SHARED_SIZE;
+    }
+};
+
+struct Result {
+    uint64_t time;
+    uint64_t tstates[2];
+    uint64_t instructions[2];
+    uint16_t af[2], bc[2], de[2], hl[2], pc[2];
+    uint16_t sum;
+    uint8_t count;
+    double seconds;
+
+    bool sameState(const Result &other) const {
+        for (int idx = 0; idx < 2; idx++) {
+            if (tstates[idx] != other.tstates[idx] || instructions[idx] != other.instructions[idx]
+                    || af[idx] != other.af[idx] || bc[idx] != other.bc[idx]
+                    || de[idx] != other.de[idx] || hl[idx] != other.hl[idx]
+                    || pc[idx] != other.pc[idx]) {
+                return false;
+            }
+        }
+        return time == other.time && sum == other.sum && count == other.count;
+    }
+};
+
+Result runDual(uint32_t quantum, bool threaded) {
+    Z80SharedMemory shared(SHARED_SIZE, 2);
+    Z80Mailbox toSound, toMain;
+
+    Z80Scheduler scheduler(quantum);
+    scheduler.setReferenceClock(MAIN_HZ);
+    scheduler.addResource(shared);
+    scheduler.addResource(toSound);
+    scheduler.addResource(toMain);
+
+    const vector<uint8_t> *code[] = { &mainCode, &soundCode };
+    for (uint32_t idx = 0; idx < 2; idx++) {
+        unique_ptr<Z80Machine> machine(idx == 0
+                ? new DualMachine(0, shared, toMain, toSound)
+                : new DualMachine(1, shared, toSound, toMain));
+        machine->getMemory().load(0x0000, code[idx]->data(), code[idx]->size());
+        scheduler.addMachine(move(machine), idx == 0 ? MAIN_HZ : SOUND_HZ);
+    }
+    scheduler.setThreaded(threaded);
+
+    auto start = chrono::steady_clock::now();
+    Z80 &mainCpu = scheduler.getMachine(0).getCpu();
+    while (!mainCpu.isHalted() && scheduler.getTime() < 100000000) {
+        scheduler.run(10000);
+    }
+
+    Result result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.time = scheduler.getTime();
+    for (uint32_t idx = 0; idx < 2; idx++) {
+        Z80Machine &machine = scheduler.getMachine(idx);
+        const Z80 &cpu = machine.getCpu();
+        result.tstates[idx] = machine.getTstates();
+        result.instructions[idx] = scheduler.getInstructions(idx);
+        result.af[idx] = cpu.getRegAF();
+        result.bc[idx] = cpu.getRegBC();
+        result.de[idx] = cpu.getRegDE();
+        result.hl[idx] = cpu.getRegHL();
+        result.pc[idx] = cpu.getRegPC();
+    }
+    result.sum = shared.data()[0] | (shared.data()[1] << 8);
+    result.count = shared.data()[2];
+    return result;
+}
+
+// A byte sent and a byte written in a quantum can't be seen by the other
+// CPU until the next one, whatever order the CPUs run in
+bool checkVisibility(uint32_t quantum) {
+    bool ok = true;
+    uint64_t polls = 0;
+    for (uint32_t run = 0; run < 4; run++) {
+        bool pollerFirst = run & 1;
+        bool threaded = run & 2;
+        Z80SharedMemory shared(SHARED_SIZE, 2);
+        Z80Mailbox toPoller, toSender;
+
+        Z80Scheduler scheduler(quantum);
+        scheduler.addResource(shared);
+        scheduler.addResource(toPoller);
+        scheduler.addResource(toSender);
+
+        uint32_t sender = pollerFirst ? 1 : 0;
+        uint32_t poller = 1 - sender;
+        for (uint32_t idx = 0; idx < 2; idx++) {
+            bool isSender = idx == sender;
+            unique_ptr<Z80Machine> machine(isSender
+                    ? new DualMachine(idx, shared, toSender, toPoller)
+                    : new DualMachine(idx, shared, toPoller, toSender));
+            const vector<uint8_t> &code = isSender ? senderCode : pollerCode;
+            machine->getMemory().load(0x0000, code.data(), code.size());
+            scheduler.addMachine(move(machine));
+        }
+        scheduler.setThreaded(threaded);
+
+        scheduler.run(quantum);
+        Z80Machine &pollerMachine = scheduler.getMachine(poller);
+        // Nothing of the sender seen yet
+        bool firstQuantum = scheduler.getMachine(sender).getCpu().isHalted()
+                && !pollerMachine.getCpu().isHalted() && pollerMachine.getCpu().getRegH() == 0;
+        scheduler.run(quantum);
+
+        const Z80 &cpu = pollerMachine.getCpu();
+        bool same = run == 0 || cpu.getRegDE() == polls;
+        polls = cpu.getRegDE();
+        bool passed = firstQuantum && cpu.isHalted() && cpu.getRegC() == 5 && cpu.getRegA() == 5 && same;
+        ok = ok && passed;
+        printf("Visibility, quantum %u, %s, %s: %llu polls: %s\n", quantum,
+                pollerFirst ? "poller first" : "sender first",
+                threaded ? "threaded" : "sequential",
+                static_cast<unsigned long long>(polls), passed ? "OK" : "FAIL");
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    vector<uint32_t> quanta;
+    for (int idx = 1; idx < argc; idx++) {
+        int quantum = atoi(argv[idx]);
+        if (quantum <= 0) {
+            printf("Usage: %s [quantum...]\n", argv[0]);
+            return 2;
+        }
+        quanta.push_back(static_cast<uint32_t>(quantum));
+    }
+    if (quanta.empty()) {
+        quanta = { 1, 10, 100, 1000, 10000 };
+    }
+
+    bool passed = checkVisibility(1000);
+
+    // Sum of 2n+1 for n = 1..64
+    const uint16_t expectedSum = 64 * 65 + 64;
+
+    printf("%8s %12s %12s %10s %10s  %s\n", "quantum", "main T", "sound T",
+            "seq (s)", "thr (s)", "result");
+
+    for (uint32_t quantum : quanta) {
+        Result sequential = runDual(quantum, false);
+        Result threaded = runDual(quantum, true);
+
+        bool correct = sequential.sum == expectedSum && sequential.count == 64;
+        bool same = sequential.sameState(threaded);
+        passed &= correct && same;
+
+        printf("%8u %12llu %12llu %10.3f %10.3f  %s\n", quantum,
+                static_cast<unsigned long long>(sequential.tstates[0]),
+                static_cast<unsigned long long>(sequential.tstates[1]),
+                sequential.seconds, threaded.seconds,
+                !correct ? "WRONG RESULT" : !same ? "THREADED RUN DIFFERS" : "OK");
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include "z80machine.h"
+#include "z80profiler.h"
+
+using namespace std;
+
+/*
+ * Z80CallProfiler: the shadow stack keyed by SP, the unwinding of frames
+ * whose return address is dropped and RETs used as computed jumps. A
+ * scripted sequence of events is fed by hand, and with a library built
+ * with WITH_FLOW_NOTIFY a short guest program is profiled too, fed by the
+ * core. The folded stacks and the report (calls, inclusive and exclusive
+ * T-states) must match values computed by hand.
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+bool compare(const char *name, const Z80CallProfiler &profiler, const string &folded,
+        const string &report) {
+    ostringstream foldedOut, reportOut;
+    profiler.writeFolded(foldedOut);
+    profiler.writeReport(reportOut);
+    bool ok = foldedOut.str() == folded && reportOut.str() == report;
+    printf("%s: %s\n", name, ok ? "OK" : "FAIL");
+    if (!ok) {
+        printf("%s%s", foldedOut.str().c_str(), reportOut.str().c_str());
+    }
+    return ok;
+}
+
+bool checkScripted() {
+    Z80CallProfiler profiler;
+    profiler.addLabel(0x8000, "main");
+    profiler.reset(0);
+
+    profiler.onFlow(Z80Flow::CALL, 0x8000, 0xEFFE, 100);
+    profiler.onFlow(Z80Flow::CALL, 0x9000, 0xEFFC, 150);
+    profiler.onFlow(Z80Flow::INT, 0x0038, 0xEFFA, 170);
+    profiler.onFlow(Z80Flow::RETI, 0x9010, 0xEFFC, 200);
+    // LD SP,F000h releases 9000h and main, no return is notified
+    profiler.sync(0xF000, 260);
+    // Below the root, a computed jump
+    profiler.onFlow(Z80Flow::RET, 0x1234, 0xEFFE, 300);
+    profiler.finish(400);
+
+    return compare("Scripted events", profiler,
+        "[root] 240\n"
+        "[root];main 50\n"
+        "[root];main;0x9000 80\n"
+        "[root];main;0x9000;[int]0x0038 30\n",
+        "calls,inclusive,exclusive,path\n"
+        "1,400,240,[root]\n"
+        "1,160,50,[root];main\n"
+        "1,110,80,[root];main;0x9000\n"
+        "1,30,30,[root];main;0x9000;[int]0x0038\n");
+}
+
+#ifdef WITH_FLOW_NOTIFY
+// The profiler fed by the core
+class ProfiledMachine : public Z80Machine {
+public:
+    Z80CallProfiler profiler;
+
+    ProfiledMachine() {
+        profiler.addLabel(0x0110, "outer");
+        profiler.addLabel(0x0120, "inner");
+        profiler.addLabel(0x0130, "drop");
+        cpu.setFlowNotify(true);
+    }
+
+    void flowNotify(Z80Flow event, uint16_t address) override {
+        profiler.onFlow(event, address, cpu.getRegSP(), tstates);
+    }
+};
+
+const uint8_t program[] = {
+    0x31, 0x00, 0xF0,       // 0100: LD SP,F000h
+    0xCD, 0x10, 0x01,       // 0103: CALL outer
+    0x76,                   // 0106: HALT
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xCD, 0x20, 0x01,       // 0110: outer: CALL inner
+    0xCD, 0x30, 0x01,       // 0113: CALL drop
+    0xC9,                   // 0116: RET
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x21, 0x25, 0x01,       // 0120: inner: LD HL,0125h
+    0xE5,                   // 0123: PUSH HL
+    0xC9,                   // 0124: RET, a computed jump to 0125h
+    0xC9,                   // 0125: RET
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xE1,                   // 0130: drop: POP HL
+    0xE9                    // 0131: JP (HL), back to outer without a RET
+};
+
+bool checkGuest() {
+    ProfiledMachine machine;
+    machine.getMemory().clear();
+    machine.getMemory().load(0x100, program, sizeof(program));
+    machine.reset();
+    machine.getCpu().setRegPC(0x100);
+    machine.profiler.reset(0);
+
+    // Up to the HALT included
+    uint64_t instructions = 0;
+    machine.run(0, 12, instructions);
+    machine.profiler.finish(machine.getTstates());
+
+    // LD SP 10, CALL 17 (27), CALL 17 (44), LD HL 10, PUSH 11, RET 10,
+    // RET 10 (85), CALL 17 (102), POP 10, JP (HL) 4, RET 10 (126), HALT 4.
+    // drop is only closed by the RET of outer, so it's charged for it.
+    return compare("Guest program", machine.profiler,
+        "[root] 31\n"
+        "[root];outer 34\n"
+        "[root];outer;inner 41\n"
+        "[root];outer;drop 24\n",
+        "calls,inclusive,exclusive,path\n"
+        "1,130,31,[root]\n"
+        "1,99,34,[root];outer\n"
+        "1,41,41,[root];outer;inner\n"
+        "1,24,24,[root];outer;drop\n");
+}
+#endif
+
+}
+
+int main() {
+    bool ok = checkScripted();
+#ifdef WITH_FLOW_NOTIFY
+    ok = checkGuest() && ok;
+#endif
+    return ok ? 0 : 1;
+}
@@ -2,7 +2,7 @@
 
 using namespace std;
 
-Z80sim::Z80sim() : cpu(this)
+Z80sim::Z80sim() : tstates(0), cpu(this)
 {
 
 }
@@ -77,6 +77,12 @@ bool Z80sim::isActiveINT() {
 void Z80sim::execDone(void) {}
 #endif
 
+#ifdef WITH_FLOW_NOTIFY
+void Z80sim::flowNotify(Z80Flow event, uint16_t address) {
+    profiler.onFlow(event, address, cpu.getRegSP(), tstates);
+}
+#endif
+
 uint8_t Z80sim::breakpoint(uint16_t address, uint8_t opcode) {
     // Emulate CP/M Syscall at address 5
 
@@ -137,6 +143,13 @@ void Z80sim::runTest(std::ifstream* f) {
     cpu.reset();
     finish = false;
 
+#ifdef WITH_FLOW_NOTIFY
+    ifstream labels("zexall.sym");
+    profiler.reset(tstates);
+    profiler.loadLabels(labels);
+    cpu.setFlowNotify(true);
+#endif
+
     z80Ram[0] = (uint8_t) 0xC3;
     z80Ram[1] = 0x00;
     z80Ram[2] = 0x01; // JP 0x100 CP/M TPA
@@ -145,6 +158,19 @@ void Z80sim::runTest(std::ifstream* f) {
     while (!finish) {
         cpu.execute();
     }
+
+#ifdef WITH_FLOW_NOTIFY
+    profiler.finish(tstates);
+    ofstream folded("zexall.folded");
+    profiler.writeFolded(folded);
+    cout << "Call graph written to zexall.folded" << endl;
+#endif
+
+#ifdef WITH_OPCODE_STATS
+    ofstream stats("opcode_stats.csv");
+    writeOpcodeStatsCSV(cpu.getOpcodeStats(), stats);
+    cout << "Opcode statistics written to opcode_stats.csv" << endl;
+#endif
 }
 
 int main() {
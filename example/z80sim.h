@@ -6,6 +6,7 @@
 
 #include "z80.h"
 #include "z80operations.h"
+#include "z80profiler.h"
 
 class Z80sim : public Z80operations
 {
@@ -15,6 +16,9 @@ private:
     uint8_t z80Ram[0x10000];
     uint8_t z80Ports[0x10000];
     volatile bool finish;
+#ifdef WITH_FLOW_NOTIFY
+    Z80CallProfiler profiler;
+#endif
 
 public:
     Z80sim();
@@ -41,6 +45,10 @@ public:
     void execDone(void) override;
 #endif
 
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override;
+#endif
+
     void runTest(std::ifstream* f);
 };
 #endif // Z80SIM_H
@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include "z80state.h"
+
+using namespace std;
+
+/*
+ * Z80State images: random states are serialized into heap buffers of
+ * exactly SERIALIZED_SIZE bytes (so an overrun is caught when built with
+ * -DZ80CPP_SANITIZE=ON) and read back, field by field. Truncated or
+ * damaged images must be refused without touching the state.
+ *
+ *     z80statetest [states]
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+Z80State randomState(mt19937 &random) {
+    uniform_int_distribution<uint32_t> word(0, 0xffff);
+    Z80State state;
+    memset(&state, 0, sizeof(state));
+    state.regA = word(random) & 0xff;
+    state.sz5h3pnFlags = word(random) & 0xfe;
+    state.carryFlag = word(random) & 1;
+    for (RegisterPair *pair : { &state.regBC, &state.regBCx, &state.regDE, &state.regDEx,
+            &state.regHL, &state.regHLx, &state.regAFx, &state.regPC, &state.regIX,
+            &state.regIY, &state.regSP, &state.memptr }) {
+        pair->word = word(random);
+    }
+    state.flagQ = word(random) & 1;
+    state.lastFlagQ = word(random) & 1;
+    state.regI = word(random) & 0xff;
+    state.regR = word(random) & 0xff;
+    for (bool *flag : { &state.regRbit7, &state.ffIFF1, &state.ffIFF2, &state.pendingEI,
+            &state.activeNMI, &state.halted, &state.pinReset }) {
+        *flag = word(random) & 1;
+    }
+    state.modeINT = static_cast<Z80State::IntMode>(word(random) % 3);
+    state.prefixOpcode = word(random) & 0xff;
+    return state;
+}
+
+bool sameState(const Z80State &a, const Z80State &b) {
+    return a.regA == b.regA && a.sz5h3pnFlags == b.sz5h3pnFlags && a.carryFlag == b.carryFlag
+            && a.regBC.word == b.regBC.word && a.regBCx.word == b.regBCx.word
+            && a.regDE.word == b.regDE.word && a.regDEx.word == b.regDEx.word
+            && a.regHL.word == b.regHL.word && a.regHLx.word == b.regHLx.word
+            && a.regAFx.word == b.regAFx.word && a.regPC.word == b.regPC.word
+            && a.regIX.word == b.regIX.word && a.regIY.word == b.regIY.word
+            && a.regSP.word == b.regSP.word && a.memptr.word == b.memptr.word
+            && a.flagQ == b.flagQ && a.lastFlagQ == b.lastFlagQ && a.regI == b.regI
+            && a.regR == b.regR && a.regRbit7 == b.regRbit7 && a.ffIFF1 == b.ffIFF1
+            && a.ffIFF2 == b.ffIFF2 && a.pendingEI == b.pendingEI
+            && a.activeNMI == b.activeNMI && a.modeINT == b.modeINT && a.halted == b.halted
+            && a.pinReset == b.pinReset && a.prefixOpcode == b.prefixOpcode;
+}
+
+// Images of 'states' random states read back as written
+bool checkRoundTrip(uint32_t states) {
+    mt19937 random(38);
+    unique_ptr<uint8_t[]> image(new uint8_t[Z80State::SERIALIZED_SIZE]);
+    unique_ptr<uint8_t[]> again(new uint8_t[Z80State::SERIALIZED_SIZE]);
+    uint32_t failed = 0;
+    for (uint32_t idx = 0; idx < states; idx++) {
+        Z80State state = randomState(random);
+        state.serialize(image.get());
+
+        Z80State restored;
+        memset(&restored, 0, sizeof(restored));
+        uint32_t length = image[6] | (image[7] << 8);
+        bool ok = length == Z80State::SERIALIZED_SIZE
+                && restored.deserialize(image.get(), Z80State::SERIALIZED_SIZE)
+                && sameState(state, restored);
+        restored.serialize(again.get());
+        if (!ok || memcmp(image.get(), again.get(), Z80State::SERIALIZED_SIZE) != 0) {
+            failed++;
+        }
+    }
+    printf("Round trip of %u states, %u byte images: %s\n", states, Z80State::SERIALIZED_SIZE,
+            failed == 0 ? "OK" : "FAIL");
+    return failed == 0;
+}
+
+// Truncated and damaged images
+bool checkRefused() {
+    mt19937 random(1);
+    Z80State state = randomState(random);
+    uint8_t image[Z80State::SERIALIZED_SIZE];
+    state.serialize(image);
+
+    Z80State original = randomState(random);
+    Z80State target = original;
+    bool ok = true;
+    for (size_t size = 0; size < sizeof(image); size++) {
+        unique_ptr<uint8_t[]> truncated(new uint8_t[size]);
+        memcpy(truncated.get(), image, size);
+        ok = ok && !target.deserialize(truncated.get(), size);
+    }
+
+    // Magic, version 0, a later version, a short length and IM 3
+    const struct {
+        size_t offset;
+        uint8_t value;
+    } damages[] = { { 0, 'z' }, { 4, 0 }, { 4, Z80State::VERSION + 1 },
+        { 6, Z80State::SERIALIZED_SIZE - 1 }, { 36, 3 } };
+    for (const auto &damage : damages) {
+        uint8_t damaged[sizeof(image)];
+        memcpy(damaged, image, sizeof(image));
+        damaged[damage.offset] = damage.value;
+        ok = ok && !target.deserialize(damaged, sizeof(damaged));
+    }
+    ok = ok && sameState(target, original);
+
+    printf("Truncated and damaged images refused: %s\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t states = argc > 1 ? static_cast<uint32_t>(atoi(argv[1])) : 100000;
+    bool ok = checkRoundTrip(states);
+    ok = checkRefused() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "z80machine.h"
+#include "z80stats.h"
+
+using namespace std;
+
+/*
+ * Opcode statistics: a known set of counters is exported as CSV and JSON
+ * and must come out row by row, without leaving the format of the stream
+ * changed. With a library built with WITH_OPCODE_STATS, a short guest
+ * program that goes through every decode table must produce those same
+ * counters.
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint8_t program[] = {
+    0x3E, 0x03,             // 0100: LD A,3
+    0x3D,                   // 0102: loop: DEC A
+    0x20, 0xFD,             // 0103: JR NZ,loop
+    0xCB, 0x00,             // 0105: RLC B
+    0xDD, 0x21, 0x00, 0x80, // 0107: LD IX,8000h
+    0xDD, 0xCB, 0x00, 0x06, // 010B: RLC (IX+0)
+    0xDD, 0xFD, 0x21, 0x00, 0x90,   // 010F: LD IY,9000h, the DD is ignored
+    0xFD, 0x47,             // 0114: LD B,A, the FD is ignored
+    0xED, 0x44,             // 0116: NEG
+    0x76                    // 0118: HALT
+};
+
+// Calls to Z80::execute() up to the HALT, the ignored DD is one of its own
+const uint64_t PROGRAM_INSTRUCTIONS = 15;
+
+// The counters of 'program', by hand
+Z80OpcodeStats expectedStats() {
+    Z80OpcodeStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.main[0x3E] = 1;
+    stats.main[0x3D] = 3;
+    stats.main[0x20] = 3;
+    stats.main[0xCB] = 1;
+    stats.cb[0x00] = 1;
+    // LD IX, RLC (IX+0) and the ignored DD, the FD after it isn't fetched
+    // through decodeOpcode
+    stats.main[0xDD] = 3;
+    stats.ddfd[0x21] = 2;
+    stats.ddfd[0xCB] = 1;
+    stats.ddfdcb[0x06] = 1;
+    stats.ddfd[0xFD] = 1;
+    stats.redundantPrefixes = 1;
+    // LD B,A after FD counts in ddfd and in main
+    stats.main[0xFD] = 1;
+    stats.ddfd[0x47] = 1;
+    stats.main[0x47] = 1;
+    stats.ddfdFallbacks = 1;
+    stats.main[0xED] = 1;
+    stats.ed[0x44] = 1;
+    stats.main[0x76] = 1;
+    return stats;
+}
+
+const char expectedCSV[] =
+    "table,opcode,count\n"
+    "main,0x20,3\n"
+    "main,0x3D,3\n"
+    "main,0x3E,1\n"
+    "main,0x47,1\n"
+    "main,0x76,1\n"
+    "main,0xCB,1\n"
+    "main,0xDD,3\n"
+    "main,0xED,1\n"
+    "main,0xFD,1\n"
+    "cb,0x00,1\n"
+    "ddfd,0x21,2\n"
+    "ddfd,0x47,1\n"
+    "ddfd,0xCB,1\n"
+    "ddfd,0xFD,1\n"
+    "ddfdcb,0x06,1\n"
+    "ed,0x44,1\n"
+    "prefix,redundant,1\n"
+    "prefix,fallback,1\n";
+
+// The 256 counters of "name": [...] in 'json'. False if they aren't there.
+bool decodeTable(const string &json, const char *name, uint64_t (&counters)[256]) {
+    size_t start = json.find("\"" + string(name) + "\": [");
+    if (start == string::npos) {
+        return false;
+    }
+    const char *text = json.c_str() + json.find('[', start) + 1;
+    for (uint32_t opCode = 0; opCode < 256; opCode++) {
+        char *end;
+        counters[opCode] = strtoull(text, &end, 10);
+        if (end == text || *end != (opCode == 255 ? ']' : ',')) {
+            return false;
+        }
+        text = end + 1;
+    }
+    return true;
+}
+
+// The number after "name": in 'json', or ~0 if it isn't there
+uint64_t decodeCounter(const string &json, const char *name) {
+    size_t start = json.find("\"" + string(name) + "\": ");
+    if (start == string::npos) {
+        return ~0ull;
+    }
+    return strtoull(json.c_str() + start + strlen(name) + 4, nullptr, 10);
+}
+
+bool checkExport() {
+    Z80OpcodeStats stats = expectedStats();
+
+    // The caller's fill and base must survive the export
+    ostringstream csv;
+    csv << setfill('*');
+    writeOpcodeStatsCSV(stats, csv);
+    csv << setw(4) << 10;
+    bool csvOk = csv.str() == string(expectedCSV) + "**10";
+    printf("CSV export: %s\n", csvOk ? "OK" : "FAIL");
+    if (!csvOk) {
+        printf("%s\n", csv.str().c_str());
+    }
+
+    ostringstream json;
+    writeOpcodeStatsJSON(stats, json);
+    Z80OpcodeStats decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    bool jsonOk = decodeTable(json.str(), "main", decoded.main)
+            && decodeTable(json.str(), "cb", decoded.cb)
+            && decodeTable(json.str(), "ddfd", decoded.ddfd)
+            && decodeTable(json.str(), "ddfdcb", decoded.ddfdcb)
+            && decodeTable(json.str(), "ed", decoded.ed);
+    decoded.redundantPrefixes = decodeCounter(json.str(), "redundantPrefixes");
+    decoded.ddfdFallbacks = decodeCounter(json.str(), "ddfdFallbacks");
+    jsonOk = jsonOk && memcmp(&decoded, &stats, sizeof(stats)) == 0;
+    printf("JSON export: %s\n", jsonOk ? "OK" : "FAIL");
+    return csvOk && jsonOk;
+}
+
+#ifdef WITH_OPCODE_STATS
+bool checkCounts() {
+    Z80Machine machine;
+    machine.getMemory().clear();
+    machine.getMemory().load(0x100, program, sizeof(program));
+    machine.reset();
+    machine.getCpu().setRegPC(0x100);
+
+    uint64_t instructions = 0;
+    machine.run(0, PROGRAM_INSTRUCTIONS, instructions);
+    Z80OpcodeStats expected = expectedStats();
+    const Z80OpcodeStats &stats = machine.getCpu().getOpcodeStats();
+
+    ostringstream csv;
+    writeOpcodeStatsCSV(stats, csv);
+    bool ok = machine.getCpu().isHalted()
+            && machine.getCpu().getRegPC() == 0x0119
+            && memcmp(&stats, &expected, sizeof(expected)) == 0;
+    printf("Guest program counters: %s\n", ok ? "OK" : "FAIL");
+    if (!ok) {
+        printf("%s", csv.str().c_str());
+    }
+    return ok;
+}
+#endif
+
+}
+
+int main() {
+    bool ok = checkExport();
+#ifdef WITH_OPCODE_STATS
+    ok = checkCounts() && ok;
+#endif
+    return ok ? 0 : 1;
+}
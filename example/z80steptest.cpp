@@ -0,0 +1,930 @@
+/*
+ * Single instruction test vectors, in the JSON format of the
+ * SingleStepTests Z80 corpus (one file per opcode, e.g. "dd cb __ 06.json").
+ *
+ * Every test has the initial CPU state and RAM, the expected final state
+ * and RAM, the bus activity of every T-state and the port accesses. The
+ * instruction runs on a Z80 with a recording bus (Z80Machine timing) and
+ * the runner checks all the registers (MEMPTR and the EI delay too), the
+ * RAM, the port reads and writes, the order, addresses and data of the
+ * memory and I/O accesses and the T-states. The bus of the core isn't
+ * cycle accurate, so the accesses are compared as a sequence and only the
+ * total time is compared against the cycles.
+ *
+ * Parsing the JSON is slow, so every file is converted once to a binary
+ * cache file that's memory mapped on the next runs, and rebuilt when the
+ * JSON file is newer. The files are spread over a pool of threads.
+ *
+ *     z80steptest [-j threads] [-c cachedir] [-v] file|dir...
+ *
+ * -v lists every failed test, not only the first one of each file. The
+ * exit status is 1 if any test failed.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "z80.h"
+
+using namespace std;
+
+namespace {
+
+/*
+ * Minimal JSON reader, just what the test files use: objects, arrays,
+ * integers, strings and null.
+ */
+struct JsonValue {
+    enum Type : uint8_t {
+        NUL, NUMBER, STRING, ARRAY, OBJECT
+    };
+
+    Type type = NUL;
+    int64_t number = 0;
+    string text;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> members;
+
+    const JsonValue *get(const char *key) const {
+        for (const auto &member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(const char *text, size_t size) : pos(text), end(text + size) {}
+
+    bool parse(JsonValue &value) {
+        skipSpaces();
+        if (pos == end) {
+            return false;
+        }
+
+        switch (*pos) {
+            case '{':
+                value.type = JsonValue::OBJECT;
+                pos++;
+                skipSpaces();
+                if (pos < end && *pos == '}') {
+                    pos++;
+                    return true;
+                }
+                while (true) {
+                    string key;
+                    skipSpaces();
+                    if (!parseString(key) || !expect(':')) {
+                        return false;
+                    }
+                    value.members.emplace_back(move(key), JsonValue());
+                    if (!parse(value.members.back().second)) {
+                        return false;
+                    }
+                    skipSpaces();
+                    if (pos < end && *pos == ',') {
+                        pos++;
+                        continue;
+                    }
+                    return expect('}');
+                }
+            case '[':
+                value.type = JsonValue::ARRAY;
+                pos++;
+                skipSpaces();
+                if (pos < end && *pos == ']') {
+                    pos++;
+                    return true;
+                }
+                while (true) {
+                    value.items.emplace_back();
+                    if (!parse(value.items.back())) {
+                        return false;
+                    }
+                    skipSpaces();
+                    if (pos < end && *pos == ',') {
+                        pos++;
+                        continue;
+                    }
+                    return expect(']');
+                }
+            case '"':
+                value.type = JsonValue::STRING;
+                return parseString(value.text);
+            case 'n':
+                value.type = JsonValue::NUL;
+                return literal("null");
+            case 't':
+                value.type = JsonValue::NUMBER;
+                value.number = 1;
+                return literal("true");
+            case 'f':
+                value.type = JsonValue::NUMBER;
+                value.number = 0;
+                return literal("false");
+            default:
+                value.type = JsonValue::NUMBER;
+                return parseNumber(value.number);
+        }
+    }
+
+private:
+    const char *pos;
+    const char *end;
+
+    void skipSpaces() {
+        while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) {
+            pos++;
+        }
+    }
+
+    bool expect(char ch) {
+        skipSpaces();
+        if (pos == end || *pos != ch) {
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    bool literal(const char *word) {
+        size_t length = strlen(word);
+        if (static_cast<size_t>(end - pos) < length || memcmp(pos, word, length) != 0) {
+            return false;
+        }
+        pos += length;
+        return true;
+    }
+
+    // No escapes in the test files, a backslash just keeps the next char
+    bool parseString(string &text) {
+        if (pos == end || *pos != '"') {
+            return false;
+        }
+        pos++;
+        while (pos < end && *pos != '"') {
+            if (*pos == '\\' && pos + 1 < end) {
+                pos++;
+            }
+            text += *pos++;
+        }
+        return pos++ < end;
+    }
+
+    bool parseNumber(int64_t &number) {
+        bool negative = pos < end && *pos == '-';
+        if (negative) {
+            pos++;
+        }
+        if (pos == end || *pos < '0' || *pos > '9') {
+            return false;
+        }
+        number = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9') {
+            number = number * 10 + (*pos++ - '0');
+        }
+        if (negative) {
+            number = -number;
+        }
+        return true;
+    }
+};
+
+// Register fields of "initial" and "final", in this order in the cache
+enum Field {
+    PC, SP, A, B, C, D, E, F, H, L, I, R, EI, WZ, IX, IY, AFX, BCX, DEX, HLX,
+    IM, P, Q, IFF1, IFF2, FIELD_COUNT
+};
+
+const char *const fieldNames[FIELD_COUNT] = {
+    "pc", "sp", "a", "b", "c", "d", "e", "f", "h", "l", "i", "r", "ei", "wz",
+    "ix", "iy", "af_", "bc_", "de_", "hl_", "im", "p", "q", "iff1", "iff2"
+};
+
+struct RamByte {
+    uint16_t address;
+    uint8_t value;
+};
+
+struct BusAccess {
+    enum Kind : uint8_t {
+        MEM_READ, MEM_WRITE, IO_READ, IO_WRITE
+    };
+
+    Kind kind;
+    uint8_t value;
+    uint16_t address;
+
+    bool operator==(const BusAccess &other) const {
+        return kind == other.kind && value == other.value && address == other.address;
+    }
+};
+
+// One test, decoded from the JSON or from the cache
+struct Test {
+    string name;
+    uint16_t initial[FIELD_COUNT];
+    uint16_t final[FIELD_COUNT];
+    vector<RamByte> initialRam, finalRam;
+    // Memory and I/O accesses with their data, taken from the cycles
+    vector<BusAccess> accesses;
+    // Port accesses, reads give the value to return
+    vector<BusAccess> ports;
+    uint32_t tstates;
+};
+
+bool readState(const JsonValue &object, uint16_t *fields, vector<RamByte> &ram) {
+    if (object.type != JsonValue::OBJECT) {
+        return false;
+    }
+    for (uint32_t idx = 0; idx < FIELD_COUNT; idx++) {
+        const JsonValue *value = object.get(fieldNames[idx]);
+        fields[idx] = value != nullptr ? static_cast<uint16_t>(value->number) : 0;
+    }
+    const JsonValue *bytes = object.get("ram");
+    if (bytes != nullptr) {
+        for (const JsonValue &entry : bytes->items) {
+            if (entry.items.size() < 2) {
+                return false;
+            }
+            ram.push_back({ static_cast<uint16_t>(entry.items[0].number),
+                    static_cast<uint8_t>(entry.items[1].number) });
+        }
+    }
+    return true;
+}
+
+/*
+ * Every cycle is [address, data or null, "rwmi"] with the active pins. An
+ * access is a run of cycles with the same address and RD or WR plus MREQ or
+ * IORQ; the data is the first one seen in the run. Refresh cycles have no
+ * RD/WR and are skipped.
+ */
+void readCycles(const JsonValue &cycles, Test &test) {
+    test.tstates = static_cast<uint32_t>(cycles.items.size());
+
+    bool inAccess = false;
+    bool hasData = false;
+    string lastPins;
+    int64_t lastAddress = -1;
+    for (const JsonValue &cycle : cycles.items) {
+        if (cycle.items.size() < 3) {
+            inAccess = false;
+            continue;
+        }
+        int64_t address = cycle.items[0].number;
+        const JsonValue &data = cycle.items[1];
+        const string &pins = cycle.items[2].text;
+        bool read = pins.find('r') != string::npos;
+        bool write = pins.find('w') != string::npos;
+        bool memory = pins.find('m') != string::npos;
+        bool io = pins.find('i') != string::npos;
+
+        if (!(read || write) || !(memory || io)) {
+            inAccess = false;
+            continue;
+        }
+        // A new access, or a run that had its data and lost it
+        bool same = inAccess && address == lastAddress && pins == lastPins;
+        if (!same || (hasData && data.type == JsonValue::NUL)) {
+            BusAccess::Kind kind = memory ? (read ? BusAccess::MEM_READ : BusAccess::MEM_WRITE)
+                    : (read ? BusAccess::IO_READ : BusAccess::IO_WRITE);
+            test.accesses.push_back({ kind, 0, static_cast<uint16_t>(address) });
+            hasData = false;
+        }
+        if (!hasData && data.type != JsonValue::NUL) {
+            test.accesses.back().value = static_cast<uint8_t>(data.number);
+            hasData = true;
+        }
+        inAccess = true;
+        lastAddress = address;
+        lastPins = pins;
+    }
+}
+
+bool readTest(const JsonValue &object, Test &test) {
+    const JsonValue *name = object.get("name");
+    const JsonValue *initial = object.get("initial");
+    const JsonValue *final = object.get("final");
+    const JsonValue *cycles = object.get("cycles");
+    if (initial == nullptr || final == nullptr || cycles == nullptr) {
+        return false;
+    }
+
+    test.name = name != nullptr ? name->text : string();
+    if (!readState(*initial, test.initial, test.initialRam)
+            || !readState(*final, test.final, test.finalRam)) {
+        return false;
+    }
+    readCycles(*cycles, test);
+
+    const JsonValue *ports = object.get("ports");
+    if (ports != nullptr) {
+        for (const JsonValue &entry : ports->items) {
+            if (entry.items.size() < 3) {
+                return false;
+            }
+            BusAccess::Kind kind = entry.items[2].text == "w" ? BusAccess::IO_WRITE
+                    : BusAccess::IO_READ;
+            test.ports.push_back({ kind, static_cast<uint8_t>(entry.items[1].number),
+                    static_cast<uint16_t>(entry.items[0].number) });
+        }
+    }
+    return true;
+}
+
+/*
+ * Cache file: "Z80V", version and test count, then every test as
+ *
+ *     name length (u8), name
+ *     initial and final fields (FIELD_COUNT u16 each)
+ *     T-states (u16)
+ *     initial RAM, final RAM, accesses and ports counts (u16 each)
+ *     RAM entries (address u16, value u8)
+ *     accesses and ports (kind u8, value u8, address u16)
+ *
+ * All little endian.
+ */
+const char CACHE_MAGIC[4] = { 'Z', '8', '0', 'V' };
+const uint16_t CACHE_VERSION = 1;
+
+void putWord(string &out, uint16_t value) {
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>(value >> 8);
+}
+
+void writeTest(string &out, const Test &test) {
+    size_t nameLength = min<size_t>(test.name.size(), 255);
+    out += static_cast<char>(nameLength);
+    out.append(test.name, 0, nameLength);
+    for (uint16_t value : test.initial) {
+        putWord(out, value);
+    }
+    for (uint16_t value : test.final) {
+        putWord(out, value);
+    }
+    putWord(out, static_cast<uint16_t>(test.tstates));
+    for (size_t count : { test.initialRam.size(), test.finalRam.size(), test.accesses.size(),
+            test.ports.size() }) {
+        putWord(out, static_cast<uint16_t>(count));
+    }
+    for (const vector<RamByte> *ram : { &test.initialRam, &test.finalRam }) {
+        for (const RamByte &byte : *ram) {
+            putWord(out, byte.address);
+            out += static_cast<char>(byte.value);
+        }
+    }
+    for (const vector<BusAccess> *list : { &test.accesses, &test.ports }) {
+        for (const BusAccess &access : *list) {
+            out += static_cast<char>(access.kind);
+            out += static_cast<char>(access.value);
+            putWord(out, access.address);
+        }
+    }
+}
+
+class CacheReader {
+public:
+    CacheReader(const uint8_t *data, size_t size) : pos(data), end(data + size) {}
+
+    // Test count, 0 if the header is wrong
+    uint32_t header() {
+        if (end - pos < 12 || memcmp(pos, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) {
+            return 0;
+        }
+        pos += sizeof(CACHE_MAGIC);
+        if (word() != CACHE_VERSION) {
+            return 0;
+        }
+        word();
+        uint32_t count = word();
+        return count | static_cast<uint32_t>(word()) << 16;
+    }
+
+    // Fills 'test' reusing its buffers
+    bool next(Test &test) {
+        if (pos == end) {
+            return false;
+        }
+        size_t nameLength = *pos++;
+        if (static_cast<size_t>(end - pos) < nameLength + 2 * (FIELD_COUNT * 2 + 5)) {
+            return false;
+        }
+        test.name.assign(reinterpret_cast<const char *>(pos), nameLength);
+        pos += nameLength;
+        for (uint16_t &value : test.initial) {
+            value = word();
+        }
+        for (uint16_t &value : test.final) {
+            value = word();
+        }
+        test.tstates = word();
+        uint16_t initialCount = word();
+        uint16_t finalCount = word();
+        uint16_t accessCount = word();
+        uint16_t portCount = word();
+        if (static_cast<size_t>(end - pos)
+                < (initialCount + finalCount) * 3u + (accessCount + portCount) * 4u) {
+            return false;
+        }
+        readRam(test.initialRam, initialCount);
+        readRam(test.finalRam, finalCount);
+        readAccesses(test.accesses, accessCount);
+        readAccesses(test.ports, portCount);
+        return true;
+    }
+
+private:
+    const uint8_t *pos;
+    const uint8_t *end;
+
+    uint16_t word() {
+        uint16_t value = pos[0] | pos[1] << 8;
+        pos += 2;
+        return value;
+    }
+
+    void readRam(vector<RamByte> &ram, uint32_t count) {
+        ram.resize(count);
+        for (RamByte &byte : ram) {
+            byte.address = word();
+            byte.value = *pos++;
+        }
+    }
+
+    void readAccesses(vector<BusAccess> &list, uint32_t count) {
+        list.resize(count);
+        for (BusAccess &access : list) {
+            access.kind = static_cast<BusAccess::Kind>(pos[0]);
+            access.value = pos[1];
+            pos += 2;
+            access.address = word();
+        }
+    }
+};
+
+// Read only mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void *area = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (area != MAP_FAILED) {
+                base = static_cast<const uint8_t *>(area);
+                length = static_cast<size_t>(info.st_size);
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (base != nullptr) {
+            munmap(const_cast<uint8_t *>(base), length);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+};
+
+// Converts a JSON file to a cache file, false if it can't be parsed
+bool buildCache(const string &jsonPath, const string &cachePath) {
+    ifstream in(jsonPath, ios::in | ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    JsonValue root;
+    JsonParser parser(text.data(), text.size());
+    if (!parser.parse(root) || root.type != JsonValue::ARRAY) {
+        return false;
+    }
+
+    string out(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    putWord(out, CACHE_VERSION);
+    putWord(out, 0);
+    uint32_t count = static_cast<uint32_t>(root.items.size());
+    putWord(out, static_cast<uint16_t>(count));
+    putWord(out, static_cast<uint16_t>(count >> 16));
+    for (const JsonValue &object : root.items) {
+        Test test;
+        if (!readTest(object, test)) {
+            return false;
+        }
+        writeTest(out, test);
+    }
+
+    // Written aside and renamed, other runs may be reading the old one
+    string tempPath = cachePath + ".tmp" + to_string(getpid());
+    ofstream file(tempPath, ios::out | ios::binary | ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    return file.good() && rename(tempPath.c_str(), cachePath.c_str()) == 0;
+}
+
+/*
+ * Z80 with 64K of RAM and the Z80Machine timing, recording the memory and
+ * I/O accesses. Port reads return the values of the test in order.
+ */
+class StepBus : public Z80operations {
+public:
+    Z80 cpu;
+    uint8_t ram[0x10000] = {};
+    uint64_t tstates = 0;
+    vector<BusAccess> accesses;
+    const vector<BusAccess> *ports = nullptr;
+    size_t nextPort = 0;
+
+    StepBus() : cpu(this) {}
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        tstates += 4;
+        accesses.push_back({ BusAccess::MEM_READ, ram[address], address });
+        return ram[address];
+    }
+
+    uint8_t peek8(uint16_t address) override {
+        tstates += 3;
+        accesses.push_back({ BusAccess::MEM_READ, ram[address], address });
+        return ram[address];
+    }
+
+    void poke8(uint16_t address, uint8_t value) override {
+        tstates += 3;
+        accesses.push_back({ BusAccess::MEM_WRITE, value, address });
+        ram[address] = value;
+    }
+
+    uint16_t peek16(uint16_t address) override {
+        uint8_t lsb = peek8(address);
+        uint8_t msb = peek8(address + 1);
+        return (msb << 8) | lsb;
+    }
+
+    void poke16(uint16_t address, RegisterPair word) override {
+        poke8(address, word.byte8.lo);
+        poke8(address + 1, word.byte8.hi);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        tstates += 4;
+        uint8_t value = 0xff;
+        while (nextPort < ports->size()) {
+            const BusAccess &access = (*ports)[nextPort++];
+            if (access.kind == BusAccess::IO_READ) {
+                value = access.value;
+                break;
+            }
+        }
+        accesses.push_back({ BusAccess::IO_READ, value, port });
+        return value;
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        tstates += 4;
+        accesses.push_back({ BusAccess::IO_WRITE, value, port });
+    }
+
+    void addressOnBus(uint16_t address, int32_t wstates) override { tstates += wstates; }
+    void interruptHandlingTime(int32_t wstates) override { tstates += wstates; }
+    bool isActiveINT() override { return false; }
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+    uint8_t breakpoint(uint16_t address, uint8_t opcode) override { return opcode; }
+#endif
+
+#ifdef WITH_EXEC_DONE
+    void execDone(void) override {}
+#endif
+
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override {}
+#endif
+};
+
+void setState(Z80 &cpu, const uint16_t *fields) {
+    cpu.loadState(Z80State());
+    cpu.setRegPC(fields[PC]);
+    cpu.setRegSP(fields[SP]);
+    cpu.setRegA(static_cast<uint8_t>(fields[A]));
+    cpu.setFlags(static_cast<uint8_t>(fields[F]));
+    cpu.setRegB(static_cast<uint8_t>(fields[B]));
+    cpu.setRegC(static_cast<uint8_t>(fields[C]));
+    cpu.setRegD(static_cast<uint8_t>(fields[D]));
+    cpu.setRegE(static_cast<uint8_t>(fields[E]));
+    cpu.setRegH(static_cast<uint8_t>(fields[H]));
+    cpu.setRegL(static_cast<uint8_t>(fields[L]));
+    cpu.setRegI(static_cast<uint8_t>(fields[I]));
+    cpu.setRegR(static_cast<uint8_t>(fields[R]));
+    cpu.setPendingEI(fields[EI] != 0);
+    cpu.setMemPtr(fields[WZ]);
+    cpu.setRegIX(fields[IX]);
+    cpu.setRegIY(fields[IY]);
+    cpu.setRegAFx(fields[AFX]);
+    cpu.setRegBCx(fields[BCX]);
+    cpu.setRegDEx(fields[DEX]);
+    cpu.setRegHLx(fields[HLX]);
+    cpu.setIM(static_cast<Z80::IntMode>(fields[IM] % 3));
+    // Q holds F when the previous instruction changed it
+    cpu.setFlagQ(fields[Q] != 0);
+    cpu.setIFF1(fields[IFF1] != 0);
+    cpu.setIFF2(fields[IFF2] != 0);
+}
+
+void getState(const Z80 &cpu, uint16_t *fields) {
+    fields[PC] = cpu.getRegPC();
+    fields[SP] = cpu.getRegSP();
+    fields[A] = cpu.getRegA();
+    fields[B] = cpu.getRegB();
+    fields[C] = cpu.getRegC();
+    fields[D] = cpu.getRegD();
+    fields[E] = cpu.getRegE();
+    fields[F] = cpu.getFlags();
+    fields[H] = cpu.getRegH();
+    fields[L] = cpu.getRegL();
+    fields[I] = cpu.getRegI();
+    fields[R] = cpu.getRegR();
+    fields[EI] = cpu.isPendingEI() ? 1 : 0;
+    fields[WZ] = cpu.getMemPtr();
+    fields[IX] = cpu.getRegIX();
+    fields[IY] = cpu.getRegIY();
+    fields[AFX] = cpu.getRegAFx();
+    fields[BCX] = cpu.getRegBCx();
+    fields[DEX] = cpu.getRegDEx();
+    fields[HLX] = cpu.getRegHLx();
+    fields[IM] = static_cast<uint16_t>(cpu.getIM());
+    fields[P] = 0;
+    fields[Q] = cpu.isFlagQ() ? 1 : 0;
+    fields[IFF1] = cpu.isIFF1() ? 1 : 0;
+    fields[IFF2] = cpu.isIFF2() ? 1 : 0;
+}
+
+// Runs one test, returns the differences (empty if it passed)
+string runTest(StepBus &bus, const Test &test) {
+    for (const RamByte &byte : test.initialRam) {
+        bus.ram[byte.address] = byte.value;
+    }
+    setState(bus.cpu, test.initial);
+    bus.tstates = 0;
+    bus.accesses.clear();
+    bus.ports = &test.ports;
+    bus.nextPort = 0;
+
+    // Prefixes are executed one at a time, run to the end of the instruction
+    Z80State state;
+    do {
+        bus.cpu.execute();
+        bus.cpu.saveState(state);
+    } while (state.prefixOpcode != 0);
+
+    string errors;
+    char line[128];
+    uint16_t fields[FIELD_COUNT];
+    getState(bus.cpu, fields);
+    for (uint32_t idx = 0; idx < FIELD_COUNT; idx++) {
+        // P (the LD A,I/R parity latch) isn't emulated. Q is a flag here and
+        // can only be checked when F isn't 0.
+        if (idx == P || (idx == Q && test.final[F] == 0)) {
+            continue;
+        }
+        uint16_t expected = idx == Q ? (test.final[Q] != 0 ? 1 : 0) : test.final[idx];
+        if (fields[idx] != expected) {
+            snprintf(line, sizeof(line), " %s=%04X (expected %04X)", fieldNames[idx],
+                    fields[idx], expected);
+            errors += line;
+        }
+    }
+
+    for (const RamByte &byte : test.finalRam) {
+        if (bus.ram[byte.address] != byte.value) {
+            snprintf(line, sizeof(line), " (%04X)=%02X (expected %02X)", byte.address,
+                    bus.ram[byte.address], byte.value);
+            errors += line;
+        }
+    }
+
+    if (bus.tstates != test.tstates) {
+        snprintf(line, sizeof(line), " T-states %u (expected %u)",
+                static_cast<uint32_t>(bus.tstates), test.tstates);
+        errors += line;
+    }
+
+    if (bus.accesses != test.accesses) {
+        static const char *kinds[] = { "r", "w", "in", "out" };
+        errors += " bus";
+        for (const BusAccess &access : bus.accesses) {
+            snprintf(line, sizeof(line), " %s:%04X=%02X", kinds[access.kind], access.address,
+                    access.value);
+            errors += line;
+        }
+        errors += " (expected";
+        for (const BusAccess &access : test.accesses) {
+            snprintf(line, sizeof(line), " %s:%04X=%02X", kinds[access.kind], access.address,
+                    access.value);
+            errors += line;
+        }
+        errors += ")";
+    }
+
+    vector<BusAccess> ports;
+    for (const BusAccess &access : bus.accesses) {
+        if (access.kind == BusAccess::IO_READ || access.kind == BusAccess::IO_WRITE) {
+            ports.push_back(access);
+        }
+    }
+    if (ports != test.ports) {
+        errors += " ports differ";
+    }
+
+    // Back to a clean RAM for the next test
+    for (const RamByte &byte : test.initialRam) {
+        bus.ram[byte.address] = 0;
+    }
+    for (const BusAccess &access : bus.accesses) {
+        if (access.kind == BusAccess::MEM_WRITE) {
+            bus.ram[access.address] = 0;
+        }
+    }
+    return errors;
+}
+
+bool isNewer(const string &path, const string &than) {
+    struct stat a, b;
+    if (stat(path.c_str(), &a) != 0 || stat(than.c_str(), &b) != 0) {
+        return false;
+    }
+    return a.st_mtime >= b.st_mtime;
+}
+
+string baseName(const string &path) {
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+void addFiles(const string &path, vector<string> &files) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        printf("Can't read %s\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+
+    vector<string> entries;
+    DIR *dir = opendir(path.c_str());
+    if (dir != nullptr) {
+        while (struct dirent *entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) {
+                entries.push_back(path + "/" + name);
+            }
+        }
+        closedir(dir);
+    }
+    sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+}
+
+struct FileResult {
+    uint32_t tests = 0;
+    uint32_t failed = 0;
+    bool converted = false;
+    bool unreadable = false;
+    vector<string> messages;
+};
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t threads = max(1u, thread::hardware_concurrency());
+    string cacheDir = "z80steptest.cache";
+    bool verbose = false;
+    vector<string> files;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-j") == 0 && idx + 1 < argc) {
+            threads = max(1, atoi(argv[++idx]));
+        } else if (strcmp(argv[idx], "-c") == 0 && idx + 1 < argc) {
+            cacheDir = argv[++idx];
+        } else if (strcmp(argv[idx], "-v") == 0) {
+            verbose = true;
+        } else if (argv[idx][0] != '-') {
+            addFiles(argv[idx], files);
+        } else {
+            files.clear();
+            break;
+        }
+    }
+    if (files.empty()) {
+        printf("Usage: %s [-j threads] [-c cachedir] [-v] file|dir...\n", argv[0]);
+        return 2;
+    }
+    mkdir(cacheDir.c_str(), 0777);
+
+    vector<FileResult> results(files.size());
+    atomic<size_t> next(0);
+    auto start = chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        // Big, one per thread and reused
+        unique_ptr<StepBus> bus(new StepBus());
+        Test test;
+        size_t index;
+        while ((index = next++) < files.size()) {
+            FileResult &result = results[index];
+            string cachePath = cacheDir + "/" + baseName(files[index]) + ".z80v";
+            if (!isNewer(cachePath, files[index])) {
+                if (!buildCache(files[index], cachePath)) {
+                    result.unreadable = true;
+                    continue;
+                }
+                result.converted = true;
+            }
+
+            MappedFile cache(cachePath);
+            CacheReader reader(cache.data(), cache.size());
+            uint32_t count = cache.data() != nullptr ? reader.header() : 0;
+            if (count == 0) {
+                result.unreadable = true;
+                continue;
+            }
+            while (result.tests < count && reader.next(test)) {
+                string errors = runTest(*bus, test);
+                if (!errors.empty()) {
+                    if (result.failed == 0 || verbose) {
+                        result.messages.push_back(test.name + ":" + errors);
+                    }
+                    result.failed++;
+                }
+                result.tests++;
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (uint32_t idx = 1; idx < min<size_t>(threads, files.size()); idx++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (thread &th : pool) {
+        th.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t tests = 0, failed = 0;
+    uint32_t converted = 0, badFiles = 0;
+    for (size_t idx = 0; idx < files.size(); idx++) {
+        const FileResult &result = results[idx];
+        tests += result.tests;
+        failed += result.failed;
+        converted += result.converted ? 1 : 0;
+        if (result.unreadable) {
+            printf("%s: can't be read\n", files[idx].c_str());
+            badFiles++;
+        } else if (result.failed != 0) {
+            printf("%s: %u of %u failed\n", files[idx].c_str(), result.failed, result.tests);
+            for (const string &message : result.messages) {
+                printf("    %s\n", message.c_str());
+            }
+        }
+    }
+
+    printf("%zu files (%u converted), %llu tests, %llu failed, %.2f s\n", files.size(), converted,
+            static_cast<unsigned long long>(tests), static_cast<unsigned long long>(failed),
+            seconds);
+    return failed != 0 || badFiles != 0 ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "z80machine.h"
+#include "z80trace.h"
+
+using namespace std;
+
+/*
+ * Round trip of Z80TraceRecorder: events are recorded, written as Chrome
+ * trace JSON (with a flush in the middle) and decoded back, and must come
+ * out as recorded. With a library built with WITH_FLOW_NOTIFY, a short
+ * guest program is traced too, fed by the core.
+ *
+ * The exit status is 1 if any check fails.
+ */
+
+namespace {
+
+const uint32_t CLOCK_HZ = 4000000;
+
+struct TraceEvent {
+    string name;
+    char phase;
+    uint64_t tstates;
+    uint64_t duration;
+    uint32_t track;
+    uint32_t accesses;
+
+    bool operator==(const TraceEvent &other) const {
+        return name == other.name && phase == other.phase && tstates == other.tstates
+                && duration == other.duration && track == other.track
+                && accesses == other.accesses;
+    }
+};
+
+// Text of "key":"value" or "key":value in 'line', empty if not there
+string field(const string &line, const string &key) {
+    size_t start = line.find("\"" + key + "\":");
+    if (start == string::npos) {
+        return "";
+    }
+    start += key.size() + 3;
+    if (line[start] == '"') {
+        start++;
+        return line.substr(start, line.find('"', start) - start);
+    }
+    size_t end = line.find_first_of(",}", start);
+    return line.substr(start, end - start);
+}
+
+// T-states from microseconds with 3 decimals
+uint64_t tstatesOf(const string &micros) {
+    return static_cast<uint64_t>(atof(micros.c_str()) * CLOCK_HZ / 1e6 + 0.5);
+}
+
+// The events of a trace document, without the track names. False if the
+// document isn't framed as expected.
+bool decode(const string &json, vector<TraceEvent> &events) {
+    const string head = "{\"traceEvents\":[";
+    const string tail = "],\"displayTimeUnit\":\"ns\"}\n";
+    if (json.compare(0, head.size(), head) != 0 || json.size() < tail.size()
+            || json.compare(json.size() - tail.size(), tail.size(), tail) != 0) {
+        return false;
+    }
+
+    istringstream in(json);
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, 2, ",{") == 0) {
+            line.erase(0, 1);
+        }
+        if (line.compare(0, 8, "{\"name\":") != 0 || field(line, "ph") == "M") {
+            continue;
+        }
+        string accesses = field(line, "accesses");
+        events.push_back({ field(line, "name"), field(line, "ph")[0],
+                tstatesOf(field(line, "ts")), tstatesOf(field(line, "dur")),
+                static_cast<uint32_t>(atoi(field(line, "tid").c_str())),
+                static_cast<uint32_t>(atoi(accesses.c_str())) });
+    }
+    return true;
+}
+
+bool compare(const char *name, const string &json, const vector<TraceEvent> &expected) {
+    vector<TraceEvent> events;
+    bool ok = decode(json, events) && events == expected;
+    printf("%s: %zu events: %s\n", name, events.size(), ok ? "OK" : "FAIL");
+    if (!ok) {
+        for (const TraceEvent &event : events) {
+            printf("  %-12s %c %8llu %6llu track %u, %u accesses\n", event.name.c_str(),
+                    event.phase, static_cast<unsigned long long>(event.tstates),
+                    static_cast<unsigned long long>(event.duration), event.track,
+                    event.accesses);
+        }
+    }
+    return ok;
+}
+
+// Tracks of the recorder
+const uint32_t CPU = 1, HALT = 2, IO = 3;
+
+bool checkScripted() {
+    Z80TraceRecorder recorder;
+    recorder.setClockHz(CLOCK_HZ);
+    recorder.addLabel(0x8000, "draw");
+    ostringstream out;
+
+    recorder.onFlow(Z80Flow::CALL, 0x8000, 0xEFFE, 100);
+    recorder.onPortIO(0x00FE, true, 200);
+    recorder.onPortIO(0x00FE, true, 300);
+    recorder.onFlow(Z80Flow::INT, 0x0038, 0xEFFC, 400);
+    recorder.onFlow(Z80Flow::RETI, 0x8010, 0xEFFE, 500);
+    recorder.onFlow(Z80Flow::RET, 0x0103, 0xF000, 600);
+    recorder.flush(out);
+    recorder.onHalt(true, 700);
+    recorder.onHalt(false, 1400);
+    // Not labelled, no span
+    recorder.onFlow(Z80Flow::CALL, 0x9000, 0xEFFE, 1500);
+    // Far from the previous access, a new burst
+    recorder.onPortIO(0x00FE, true, 2000);
+    recorder.onPortIO(0x1FFE, false, 2010);
+    recorder.close(out, 3000);
+
+    return compare("Scripted events", out.str(), {
+        { "draw", 'B', 100, 0, CPU, 0 },
+        { "INT 0x0038", 'B', 400, 0, CPU, 0 },
+        { "INT 0x0038", 'E', 500, 0, CPU, 0 },
+        { "draw", 'E', 600, 0, CPU, 0 },
+        { "HALT", 'X', 700, 700, HALT, 0 },
+        { "OUT 0x00FE", 'X', 200, 104, IO, 2 },
+        { "OUT 0x00FE", 'X', 2000, 4, IO, 1 },
+        { "IN 0x1FFE", 'X', 2010, 4, IO, 1 }
+    });
+}
+
+#ifdef WITH_FLOW_NOTIFY
+// The recorder fed by the core
+class TracedMachine : public Z80Machine {
+public:
+    Z80TraceRecorder recorder;
+
+    TracedMachine() {
+        recorder.setClockHz(CLOCK_HZ);
+        recorder.addLabel(0x0110, "beep");
+        cpu.setFlowNotify(true);
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        recorder.onPortIO(port, true, tstates);
+        Z80Machine::outPort(port, value);
+    }
+
+    void flowNotify(Z80Flow event, uint16_t address) override {
+        recorder.onFlow(event, address, cpu.getRegSP(), tstates);
+    }
+};
+
+const uint8_t program[] = {
+    0x31, 0x00, 0xF0,       // 0100: LD SP,F000h
+    0xCD, 0x10, 0x01,       // 0103: CALL beep
+    0x76,                   // 0106: HALT
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x3E, 0x07,             // 0110: beep: LD A,7
+    0xD3, 0xFE,             // 0112: OUT (FEh),A
+    0xD3, 0xFE,             // 0114: OUT (FEh),A
+    0xC9                    // 0116: RET
+};
+
+bool checkGuest() {
+    TracedMachine machine;
+    machine.getMemory().load(0x100, program, sizeof(program));
+    machine.reset();
+    machine.getCpu().setRegPC(0x100);
+
+    // Up to the HALT, then some time in it
+    uint64_t instructions = 0;
+    machine.run(0, 8, instructions);
+    machine.recorder.onHalt(machine.getCpu().isHalted(), machine.getTstates());
+    uint64_t haltStart = machine.getTstates();
+    machine.run(haltStart + 400, 0, instructions);
+    ostringstream out;
+    machine.recorder.close(out, machine.getTstates());
+
+    // LD SP 10, CALL 17, LD A 7, OUT 11 each, RET 10, HALT 4
+    return compare("Guest program", out.str(), {
+        { "beep", 'B', 27, 0, CPU, 0 },
+        { "beep", 'E', 66, 0, CPU, 0 },
+        { "OUT 0x07FE", 'X', 41, 15, IO, 2 },
+        { "HALT", 'X', haltStart, machine.getTstates() - haltStart, HALT, 0 }
+    });
+}
+#endif
+
+}
+
+int main() {
+    bool ok = checkScripted();
+#ifdef WITH_FLOW_NOTIFY
+    ok = checkGuest() && ok;
+#endif
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/*
+ * Parallel ZEXALL/ZEXDOC runner.
+ *
+ * The exercisers walk a zero terminated table of pointers to independent
+ * test cases. Every case is a Z80BatchJob, with the table patched to hold
+ * only that case, and the cases are spread over the batch runner threads.
+ * The full run takes as long as the slowest case.
+ *
+ *     zexpar [-j threads] [zexall.bin]
+ *
+ * The exit status is 0 when every case reports OK.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "z80batch.h"
+
+using namespace std;
+
+namespace {
+
+// CP/M machine, the console output goes to a string
+class ZexMachine : public Z80Machine
+{
+public:
+    string console;
+
+    void reset() override {
+        Z80Machine::reset();
+        console.clear();
+    }
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        if (address == 0x0005) {
+            bdos();
+        }
+        return Z80Machine::fetchOpcode(address);
+    }
+
+private:
+    void bdos() {
+        switch (cpu.getRegC()) {
+            case 0: // BDOS 0 System Reset
+                stop();
+                break;
+            case 2: // BDOS 2 console char output
+                console += static_cast<char>(cpu.getRegE());
+                break;
+            case 9: // BDOS 9 console string output (string terminated by "$")
+            {
+                uint16_t strAddr = cpu.getRegDE();
+                while (memory.read(strAddr) != '$') {
+                    console += static_cast<char>(memory.read(strAddr++));
+                }
+                break;
+            }
+            default:
+                console += "BDOS Call " + to_string(cpu.getRegC()) + "\n";
+                stop();
+        }
+    }
+};
+
+struct TestCase {
+    uint16_t pointer;
+    string report;
+    bool passed;
+    uint64_t tstates;
+    double seconds;
+    chrono::steady_clock::time_point started;
+};
+
+// Address of the test table, looking for the loop that walks it:
+// LD HL,table / LD A,(HL) / INC HL / OR (HL) / JP Z,done
+uint16_t findTestTable(const vector<uint8_t> &image) {
+    static const uint8_t loop[] = { 0x7E, 0x23, 0xB6, 0xCA };
+    for (uint32_t address = 0x100; address + 7 <= image.size(); address++) {
+        if (image[address] == 0x21 && memcmp(&image[address + 3], loop, sizeof(loop)) == 0) {
+            return image[address + 1] | (image[address + 2] << 8);
+        }
+    }
+    return 0;
+}
+
+// Result lines of the case, without the banner and the final message
+string extractReport(const string &console) {
+    string report;
+    size_t start = 0;
+    while (start < console.size()) {
+        size_t end = console.find('\n', start);
+        if (end == string::npos) {
+            end = console.size();
+        }
+        string line = console.substr(start, end - start);
+        start = end + 1;
+
+        line.erase(remove(line.begin(), line.end(), '\r'), line.end());
+        if (line.empty() || line.find("instruction exerciser") != string::npos
+                || line.find("Tests complete") != string::npos) {
+            continue;
+        }
+        report += (report.empty() ? "" : " ") + line;
+    }
+    return report;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t threads = thread::hardware_concurrency();
+    const char *fileName = "zexall.bin";
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-j") == 0 && idx + 1 < argc) {
+            threads = static_cast<uint32_t>(atoi(argv[++idx]));
+        } else if (argv[idx][0] != '-') {
+            fileName = argv[idx];
+        } else {
+            cout << "Usage: " << argv[0] << " [-j threads] [zexall.bin]" << endl;
+            return 2;
+        }
+    }
+
+    ifstream f(fileName, ios::in | ios::binary);
+    if (!f.is_open()) {
+        cout << "Can't open " << fileName << endl;
+        return 2;
+    }
+
+    vector<uint8_t> imageData(0x10000, 0);
+    f.read(reinterpret_cast<char *>(&imageData[0x100]), 0x10000 - 0x100);
+    imageData[0] = 0xC3;
+    imageData[1] = 0x00;
+    imageData[2] = 0x01; // JP 0x100 CP/M TPA
+    imageData[5] = 0xC9; // Return from BDOS call
+
+    uint16_t table = findTestTable(imageData);
+    if (table == 0) {
+        cout << fileName << " doesn't look like ZEXALL or ZEXDOC" << endl;
+        return 2;
+    }
+
+    vector<TestCase> tests;
+    for (uint16_t address = table; ; address += 2) {
+        uint16_t pointer = imageData[address] | (imageData[address + 1] << 8);
+        if (pointer == 0) {
+            break;
+        }
+        tests.push_back({ pointer, "", false, 0, 0.0, {} });
+    }
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    threads = min(threads, static_cast<uint32_t>(tests.size()));
+    cout << fileName << ": " << tests.size() << " tests on " << threads << " threads" << endl;
+
+    auto image = make_shared<const vector<uint8_t>>(move(imageData));
+    size_t done = 0;
+    mutex outputLock;
+
+    auto start = chrono::steady_clock::now();
+    {
+        Z80BatchRunner runner([] { return unique_ptr<Z80Machine>(new ZexMachine()); }, threads);
+
+        for (TestCase &test : tests) {
+            Z80BatchJob job;
+            job.image = image;
+
+            job.setup = [&test, table](Z80Machine &machine) {
+                // Table with only this case
+                Z80Memory &memory = machine.getMemory();
+                memory.write(table, test.pointer & 0xff);
+                memory.write(table + 1, test.pointer >> 8);
+                memory.write(table + 2, 0);
+                memory.write(table + 3, 0);
+                test.started = chrono::steady_clock::now();
+            };
+
+            job.onComplete = [&](const Z80BatchResult &result, Z80Machine &machine) {
+                auto end = chrono::steady_clock::now();
+                test.report = extractReport(static_cast<ZexMachine &>(machine).console);
+                test.passed = test.report.find("OK") != string::npos
+                        && test.report.find("ERROR") == string::npos;
+                test.tstates = result.tstates;
+                test.seconds = chrono::duration<double>(end - test.started).count();
+
+                lock_guard<mutex> lock(outputLock);
+                char line[64];
+                snprintf(line, sizeof(line), "[%2zu/%zu] %8.2fs %12llu T  ", ++done,
+                        tests.size(), test.seconds,
+                        static_cast<unsigned long long>(test.tstates));
+                cout << line << test.report << endl;
+            };
+
+            runner.submit(move(job));
+        }
+        runner.wait();
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint32_t passed = 0;
+    double total = 0.0;
+    const TestCase *slowest = &tests[0];
+    for (const TestCase &test : tests) {
+        passed += test.passed ? 1 : 0;
+        total += test.seconds;
+        if (test.seconds > slowest->seconds) {
+            slowest = &test;
+        }
+    }
+
+    if (passed != tests.size()) {
+        cout << endl << "Failed tests:" << endl;
+        for (const TestCase &test : tests) {
+            if (!test.passed) {
+                cout << "  " << test.report << endl;
+            }
+        }
+    }
+
+    char summary[160];
+    snprintf(summary, sizeof(summary),
+            "%u passed, %zu failed. Wall %.2fs, sum of tests %.2fs, slowest %.2fs",
+            passed, tests.size() - passed, wall, total, slowest->seconds);
+    cout << endl << summary << endl;
+
+    return passed == tests.size() ? 0 : 1;
+}
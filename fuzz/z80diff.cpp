@@ -0,0 +1,663 @@
+/*
+ * Differential fuzzer, checks other execution engines against the plain
+ * decodeOpcode() interpreter.
+ *
+ * Every case is a random CPU state, 64K of random memory and a random run
+ * of opcodes at PC, with plenty of CB, ED, DD/FD, DD/FD CB and chained
+ * prefixes. The reference core and the engine under test run it side by
+ * side on identical buses, and after every step the whole CPU state, the
+ * T-states and the log of bus accesses (when the engine has one) must be
+ * the same. A failing case is minimized (fewer steps, fewer code bytes,
+ * zeroed registers and memory) before it's reported.
+ *
+ * Engines:
+ *
+ *     snapshot   the core, but every step runs on a new Z80 restored from
+ *                the serialized state of the previous one
+ *     lockstep   Z80Lockstep with one lane, until its first unsupported
+ *                instruction. Its cases have only unprefixed and CB opcodes.
+ *
+ *     z80diff [-e engine] [-n cases] [-l steps] [-s seed] [-j threads] [-t seconds]
+ *
+ * By default 10000 cases of 64 steps on every engine, on one thread. With
+ * -t the run lasts that long, for as many cases as it takes (-n 0). Case
+ * N always has the same contents for a given seed, so "-s seed -n N" runs
+ * it again. The exit status is 1 if any case failed.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "z80.h"
+#include "z80lockstep.h"
+#include "z80memory.h"
+#include "z80state.h"
+
+using namespace std;
+
+namespace {
+
+const uint32_t MEMORY_SIZE = Z80Memory::SIZE;
+
+uint64_t splitmix(uint64_t &state) {
+    uint64_t value = (state += UINT64_C(0x9E3779B97F4A7C15));
+    value = (value ^ (value >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    value = (value ^ (value >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return value ^ (value >> 31);
+}
+
+struct Case {
+    uint64_t seed;
+    Z80State start;
+    // Memory contents come from this seed, all zeros when 0
+    uint64_t memorySeed;
+    // Written at the start PC, over the memory contents
+    vector<uint8_t> code;
+    uint32_t steps;
+};
+
+// One opcode with its prefixes and two operand bytes, for the code runs.
+// Without 'indexed', no DD, ED or FD prefixes.
+void generateInstruction(uint64_t &rng, bool indexed, vector<uint8_t> &code) {
+    static const uint8_t prefixes[] = { 0xDD, 0xFD, 0xED, 0xCB };
+    uint64_t value = splitmix(rng);
+
+    switch (indexed ? value % 8 : (value % 4) * 4) {
+        case 0: // CB xx
+            code.push_back(0xCB);
+            break;
+        case 1: // ED xx
+            code.push_back(0xED);
+            break;
+        case 2: // DD/FD xx
+            code.push_back((value & 0x100) != 0 ? 0xFD : 0xDD);
+            break;
+        case 3: // DD/FD CB d xx
+            code.push_back((value & 0x100) != 0 ? 0xFD : 0xDD);
+            code.push_back(0xCB);
+            code.push_back(static_cast<uint8_t>(value >> 16));
+            break;
+        case 4: // Prefix chain
+            for (uint32_t idx = 0; idx < 1 + (value >> 8) % 4; idx++) {
+                code.push_back(prefixes[(value >> (12 + idx * 2)) % 4]);
+            }
+            break;
+        default:
+            break;
+    }
+
+    value = splitmix(rng);
+    code.push_back(static_cast<uint8_t>(value));
+    code.push_back(static_cast<uint8_t>(value >> 8));
+    code.push_back(static_cast<uint8_t>(value >> 16));
+}
+
+Case generateCase(uint64_t seed, uint32_t steps, bool indexed) {
+    Case test;
+    uint64_t rng = seed;
+
+    test.seed = seed;
+    test.steps = steps;
+    test.memorySeed = splitmix(rng) | 1;
+
+    Z80State &state = test.start;
+    state = Z80State();
+    uint64_t value = splitmix(rng);
+    state.regA = static_cast<uint8_t>(value);
+    state.sz5h3pnFlags = static_cast<uint8_t>(value >> 8) & 0xfe;
+    state.carryFlag = (value & 0x100) != 0;
+    state.regBC.word = static_cast<uint16_t>(value >> 16);
+    state.regDE.word = static_cast<uint16_t>(value >> 32);
+    state.regHL.word = static_cast<uint16_t>(value >> 48);
+    value = splitmix(rng);
+    state.regBCx.word = static_cast<uint16_t>(value);
+    state.regDEx.word = static_cast<uint16_t>(value >> 16);
+    state.regHLx.word = static_cast<uint16_t>(value >> 32);
+    state.regAFx.word = static_cast<uint16_t>(value >> 48);
+    value = splitmix(rng);
+    state.regPC.word = static_cast<uint16_t>(value);
+    state.regIX.word = static_cast<uint16_t>(value >> 16);
+    state.regIY.word = static_cast<uint16_t>(value >> 32);
+    state.regSP.word = static_cast<uint16_t>(value >> 48);
+    value = splitmix(rng);
+    state.memptr.word = static_cast<uint16_t>(value);
+    state.regI = static_cast<uint8_t>(value >> 16);
+    state.regR = static_cast<uint8_t>(value >> 24) & 0x7f;
+    state.regRbit7 = (value & (UINT64_C(1) << 32)) != 0;
+    state.ffIFF1 = (value & (UINT64_C(1) << 33)) != 0;
+    state.ffIFF2 = (value & (UINT64_C(1) << 34)) != 0;
+    state.lastFlagQ = state.flagQ = (value & (UINT64_C(1) << 35)) != 0;
+    state.modeINT = static_cast<Z80State::IntMode>((value >> 36) % 3);
+
+    while (test.code.size() < steps * 3) {
+        generateInstruction(rng, indexed, test.code);
+    }
+    return test;
+}
+
+void fillMemory(const Case &test, uint8_t *memory) {
+    if (test.memorySeed == 0) {
+        memset(memory, 0, MEMORY_SIZE);
+    } else {
+        uint64_t rng = test.memorySeed;
+        for (uint32_t address = 0; address < MEMORY_SIZE; address += 8) {
+            uint64_t value = splitmix(rng);
+            memcpy(&memory[address], &value, sizeof(value));
+        }
+    }
+    uint16_t pc = test.start.regPC.word;
+    for (size_t idx = 0; idx < test.code.size(); idx++) {
+        memory[(pc + idx) & 0xffff] = test.code[idx];
+    }
+}
+
+struct Access {
+    enum Kind : uint8_t {
+        FETCH, READ, WRITE, IN, OUT, BUS, INT_TIME
+    };
+
+    Kind kind;
+    uint8_t value;
+    uint16_t address;
+    // T-states at the start of the access
+    uint32_t tstates;
+
+    bool operator==(const Access &other) const {
+        return kind == other.kind && value == other.value && address == other.address
+                && tstates == other.tstates;
+    }
+};
+
+class Engine {
+public:
+    virtual ~Engine() = default;
+
+    virtual void load(const Z80State &state, const uint8_t *memory) = 0;
+
+    // Execute one step, false if the engine can't execute it. The state
+    // is then the one before the step.
+    virtual bool step() = 0;
+
+    virtual void getState(Z80State &state) const = 0;
+    virtual uint64_t getTstates() const = 0;
+
+    // Bus accesses of the last step, nullptr when the engine doesn't log them
+    virtual const vector<Access> *getAccesses() const { return nullptr; }
+
+    // False if the engine stops on every DD, ED and FD opcode
+    virtual bool hasIndexed() const { return true; }
+};
+
+/*
+ * The interpreter with the Z80Machine timing. Every bus access is logged,
+ * port reads return a function of the port and the T-states.
+ */
+class CoreEngine : public Engine, public Z80operations {
+public:
+    CoreEngine() : cpu(new Z80(this)), ram(MEMORY_SIZE), tstates(0) {}
+
+    void load(const Z80State &state, const uint8_t *memory) override {
+        cpu->loadState(state);
+        memcpy(ram.data(), memory, MEMORY_SIZE);
+        tstates = 0;
+    }
+
+    bool step() override {
+        accesses.clear();
+        cpu->execute();
+        return true;
+    }
+
+    void getState(Z80State &state) const override { cpu->saveState(state); }
+    uint64_t getTstates() const override { return tstates; }
+    const vector<Access> *getAccesses() const override { return &accesses; }
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        log(Access::FETCH, address, ram[address]);
+        tstates += 4;
+        return ram[address];
+    }
+
+    uint8_t peek8(uint16_t address) override {
+        log(Access::READ, address, ram[address]);
+        tstates += 3;
+        return ram[address];
+    }
+
+    void poke8(uint16_t address, uint8_t value) override {
+        log(Access::WRITE, address, value);
+        tstates += 3;
+        ram[address] = value;
+    }
+
+    uint16_t peek16(uint16_t address) override {
+        uint8_t lsb = peek8(address);
+        uint8_t msb = peek8(address + 1);
+        return (msb << 8) | lsb;
+    }
+
+    void poke16(uint16_t address, RegisterPair word) override {
+        poke8(address, word.byte8.lo);
+        poke8(address + 1, word.byte8.hi);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        uint8_t value = static_cast<uint8_t>((port * 0x9E3779B1u + tstates) >> 13);
+        log(Access::IN, port, value);
+        tstates += 4;
+        return value;
+    }
+
+    void outPort(uint16_t port, uint8_t value) override {
+        log(Access::OUT, port, value);
+        tstates += 4;
+    }
+
+    void addressOnBus(uint16_t address, int32_t wstates) override {
+        log(Access::BUS, address, static_cast<uint8_t>(wstates));
+        tstates += wstates;
+    }
+
+    void interruptHandlingTime(int32_t wstates) override {
+        log(Access::INT_TIME, 0, static_cast<uint8_t>(wstates));
+        tstates += wstates;
+    }
+
+    bool isActiveINT() override { return false; }
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+    uint8_t breakpoint(uint16_t address, uint8_t opcode) override { return opcode; }
+#endif
+
+#ifdef WITH_EXEC_DONE
+    void execDone(void) override {}
+#endif
+
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override {}
+#endif
+
+protected:
+    unique_ptr<Z80> cpu;
+
+private:
+    vector<uint8_t> ram;
+    vector<Access> accesses;
+    uint64_t tstates;
+
+    void log(Access::Kind kind, uint16_t address, uint8_t value) {
+        accesses.push_back({ kind, value, address, static_cast<uint32_t>(tstates) });
+    }
+};
+
+// Checks that Z80State holds all the CPU state
+class SnapshotEngine : public CoreEngine {
+public:
+    bool step() override {
+        uint8_t image[Z80State::SERIALIZED_SIZE];
+        Z80State state;
+        cpu->saveState(state);
+        state.serialize(image);
+
+        // A refused image leaves the new CPU as reset, a mismatch
+        cpu.reset(new Z80(this));
+        Z80State restored;
+        if (restored.deserialize(image, sizeof(image))) {
+            cpu->loadState(restored);
+        }
+        return CoreEngine::step();
+    }
+};
+
+class LockstepEngine : public Engine {
+public:
+    LockstepEngine() : engine(1), ram(MEMORY_SIZE), shadow(nullptr) {
+        engine.setMemory(ram.data());
+        engine.setStopAddress(-1);
+    }
+
+    void load(const Z80State &state, const uint8_t *memory) override {
+        memcpy(ram.data(), memory, MEMORY_SIZE);
+        shadow.loadState(state);
+        engine.loadLane(0, shadow);
+    }
+
+    bool step() override {
+        engine.run(1);
+        return engine.getLanes().status[0] != Z80Lockstep::UNSUPPORTED;
+    }
+
+    void getState(Z80State &state) const override {
+        engine.storeLane(0, shadow);
+        shadow.saveState(state);
+        // Only the Q of the last instruction is kept by the lanes
+        state.flagQ = state.lastFlagQ;
+    }
+
+    uint64_t getTstates() const override { return engine.getLanes().tstates[0]; }
+    bool hasIndexed() const override { return false; }
+
+private:
+    Z80Lockstep engine;
+    vector<uint8_t> ram;
+    // The registers the lanes don't have
+    mutable Z80 shadow;
+};
+
+unique_ptr<Engine> createEngine(const string &name) {
+    if (name == "snapshot") {
+        return unique_ptr<Engine>(new SnapshotEngine());
+    }
+    if (name == "lockstep") {
+        return unique_ptr<Engine>(new LockstepEngine());
+    }
+    return nullptr;
+}
+
+struct Mismatch {
+    bool found = false;
+    uint32_t step = 0;
+    Z80State before;
+    Z80State expected, actual;
+    uint64_t expectedTstates = 0, actualTstates = 0;
+    vector<Access> expectedAccesses, actualAccesses;
+};
+
+// Per thread engines and buffers
+struct Runner {
+    CoreEngine reference;
+    unique_ptr<Engine> candidate;
+    vector<uint8_t> memory;
+    // Steps compared, over all the cases
+    uint64_t compared = 0;
+
+    explicit Runner(const string &engine) : candidate(createEngine(engine)), memory(MEMORY_SIZE) {}
+
+    // Runs the case, returns true if every step matched
+    bool run(const Case &test, Mismatch &mismatch) {
+        fillMemory(test, memory.data());
+        reference.load(test.start, memory.data());
+        candidate->load(test.start, memory.data());
+
+        uint8_t expected[Z80State::SERIALIZED_SIZE], actual[Z80State::SERIALIZED_SIZE];
+        Z80State before = test.start;
+        for (uint32_t step = 0; step < test.steps; step++) {
+            if (!candidate->step()) {
+                return true;
+            }
+            reference.step();
+            compared++;
+
+            Z80State refState, state;
+            reference.getState(refState);
+            candidate->getState(state);
+            // Only the low 7 bits of the R counter are architectural
+            refState.regR &= 0x7f;
+            state.regR &= 0x7f;
+            refState.serialize(expected);
+            state.serialize(actual);
+
+            const vector<Access> *accesses = candidate->getAccesses();
+            if (memcmp(expected, actual, sizeof(expected)) != 0
+                    || reference.getTstates() != candidate->getTstates()
+                    || (accesses != nullptr && *accesses != *reference.getAccesses())) {
+                mismatch.found = true;
+                mismatch.step = step;
+                mismatch.before = before;
+                mismatch.expected = refState;
+                mismatch.actual = state;
+                mismatch.expectedTstates = reference.getTstates();
+                mismatch.actualTstates = candidate->getTstates();
+                mismatch.expectedAccesses = *reference.getAccesses();
+                mismatch.actualAccesses = accesses != nullptr ? *accesses : vector<Access>();
+                return false;
+            }
+
+            // A halted CPU only repeats the same fetch
+            if (refState.halted) {
+                return true;
+            }
+            before = refState;
+        }
+        return true;
+    }
+};
+
+// Shrinks a failing case while it keeps failing
+Case minimize(Runner &runner, Case test) {
+    auto fails = [&](Case &candidate) {
+        Mismatch found;
+        if (runner.run(candidate, found)) {
+            return false;
+        }
+        candidate.steps = found.step + 1;
+        return true;
+    };
+
+    fails(test);
+
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        // Code bytes, in chunks from half the code down to single bytes
+        for (size_t chunk = max<size_t>(test.code.size() / 2, 1); chunk > 0; chunk /= 2) {
+            for (size_t pos = 0; pos + chunk <= test.code.size();) {
+                Case smaller = test;
+                smaller.code.erase(smaller.code.begin() + pos, smaller.code.begin() + pos + chunk);
+                if (fails(smaller)) {
+                    test = smaller;
+                    progress = true;
+                } else {
+                    pos += chunk;
+                }
+            }
+        }
+
+        if (test.memorySeed != 0) {
+            Case zeroed = test;
+            zeroed.memorySeed = 0;
+            if (fails(zeroed)) {
+                test = zeroed;
+                progress = true;
+            }
+        }
+
+        // Registers, one at a time
+        RegisterPair Z80State::*pairs[] = {
+            &Z80State::regBC, &Z80State::regDE, &Z80State::regHL, &Z80State::regBCx,
+            &Z80State::regDEx, &Z80State::regHLx, &Z80State::regAFx, &Z80State::regIX,
+            &Z80State::regIY, &Z80State::regSP, &Z80State::memptr
+        };
+        for (auto pair : pairs) {
+            if ((test.start.*pair).word != 0) {
+                Case zeroed = test;
+                (zeroed.start.*pair).word = 0;
+                if (fails(zeroed)) {
+                    test = zeroed;
+                    progress = true;
+                }
+            }
+        }
+        uint8_t Z80State::*bytes[] = {
+            &Z80State::regA, &Z80State::sz5h3pnFlags, &Z80State::regI, &Z80State::regR
+        };
+        for (auto byte : bytes) {
+            if (test.start.*byte != 0) {
+                Case zeroed = test;
+                zeroed.start.*byte = 0;
+                if (fails(zeroed)) {
+                    test = zeroed;
+                    progress = true;
+                }
+            }
+        }
+    }
+    return test;
+}
+
+void printState(const char *title, const Z80State &state, uint64_t tstates) {
+    Z80 cpu(nullptr);
+    cpu.loadState(state);
+    printf("%-9s AF=%04X BC=%04X DE=%04X HL=%04X IX=%04X IY=%04X SP=%04X PC=%04X\n",
+            title, cpu.getRegAF(), cpu.getRegBC(), cpu.getRegDE(), cpu.getRegHL(),
+            cpu.getRegIX(), cpu.getRegIY(), cpu.getRegSP(), cpu.getRegPC());
+    printf("          AF'=%04X BC'=%04X DE'=%04X HL'=%04X I=%02X R=%02X WZ=%04X Q=%d "
+            "IFF=%d%d IM=%d HALT=%d prefix=%02X T=%" PRIu64 "\n",
+            cpu.getRegAFx(), cpu.getRegBCx(), cpu.getRegDEx(), cpu.getRegHLx(),
+            cpu.getRegI(), cpu.getRegR(), cpu.getMemPtr(), state.lastFlagQ ? 1 : 0,
+            cpu.isIFF1() ? 1 : 0, cpu.isIFF2() ? 1 : 0, static_cast<int>(cpu.getIM()),
+            cpu.isHalted() ? 1 : 0, state.prefixOpcode, tstates);
+}
+
+void printAccesses(const char *title, const vector<Access> &accesses) {
+    static const char *kinds[] = { "fetch", "read", "write", "in", "out", "bus", "int" };
+    printf("%-9s", title);
+    for (const Access &access : accesses) {
+        printf(" %s:%04X=%02X@%u", kinds[access.kind], access.address, access.value,
+                access.tstates);
+    }
+    printf("\n");
+}
+
+void report(Runner &runner, const Case &test, const string &engine) {
+    Mismatch mismatch;
+    runner.run(test, mismatch);
+
+    printf("FAIL %s, case seed %016" PRIX64 ", step %u\n", engine.c_str(), test.seed,
+            mismatch.step);
+    printf("Memory    %s\n", test.memorySeed == 0 ? "zeros" : "random");
+    printf("Code at %04X:", test.start.regPC.word);
+    for (uint8_t byte : test.code) {
+        printf(" %02X", byte);
+    }
+    printf("\n");
+    printState("Start", test.start, 0);
+    printState("Before", mismatch.before, 0);
+    printState("Expected", mismatch.expected, mismatch.expectedTstates);
+    printState("Actual", mismatch.actual, mismatch.actualTstates);
+    printAccesses("Expected", mismatch.expectedAccesses);
+    if (runner.candidate->getAccesses() != nullptr) {
+        printAccesses("Actual", mismatch.actualAccesses);
+    }
+}
+
+uint64_t caseSeed(uint64_t seed, uint64_t index) {
+    uint64_t state = seed ^ (index * UINT64_C(0xD1B54A32D192ED03));
+    return splitmix(state);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> engines = { "snapshot", "lockstep" };
+    uint64_t cases = 10000;
+    uint32_t steps = 64;
+    uint64_t seed = 1;
+    uint32_t threads = 1;
+    double seconds = 0;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (idx + 1 == argc) {
+            printf("Usage: %s [-e engine] [-n cases] [-l steps] [-s seed] [-j threads] [-t seconds]\n",
+                    argv[0]);
+            return 2;
+        }
+        const char *value = argv[++idx];
+        if (strcmp(argv[idx - 1], "-e") == 0) {
+            if (!createEngine(value)) {
+                printf("Unknown engine %s\n", value);
+                return 2;
+            }
+            engines = { value };
+        } else if (strcmp(argv[idx - 1], "-n") == 0) {
+            cases = strtoull(value, nullptr, 10);
+        } else if (strcmp(argv[idx - 1], "-l") == 0) {
+            steps = max(1, atoi(value));
+        } else if (strcmp(argv[idx - 1], "-s") == 0) {
+            seed = strtoull(value, nullptr, 0);
+        } else if (strcmp(argv[idx - 1], "-j") == 0) {
+            threads = max(1, atoi(value));
+        } else if (strcmp(argv[idx - 1], "-t") == 0) {
+            seconds = atof(value);
+        } else {
+            printf("Unknown option %s\n", argv[idx - 1]);
+            return 2;
+        }
+    }
+    if (seconds > 0 && cases == 10000) {
+        cases = 0;
+    }
+
+    bool failed = false;
+    for (const string &engine : engines) {
+        atomic<uint64_t> next(0);
+        atomic<bool> stop(false);
+        atomic<uint64_t> compared(0);
+        mutex lock;
+        bool found = false;
+        uint64_t failedIndex = 0;
+
+        auto start = chrono::steady_clock::now();
+        auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(seconds));
+
+        auto worker = [&]() {
+            Runner runner(engine);
+            Mismatch mismatch;
+            while (!stop) {
+                uint64_t index = next++;
+                if (cases != 0 && index >= cases) {
+                    break;
+                }
+                if (seconds > 0 && (index & 0xff) == 0 && chrono::steady_clock::now() >= deadline) {
+                    stop = true;
+                    break;
+                }
+                Case test = generateCase(caseSeed(seed, index), steps, runner.candidate->hasIndexed());
+                if (!runner.run(test, mismatch)) {
+                    lock_guard<mutex> guard(lock);
+                    if (!found || index < failedIndex) {
+                        found = true;
+                        failedIndex = index;
+                    }
+                    stop = true;
+                }
+            }
+            compared += runner.compared;
+        };
+
+        vector<thread> pool;
+        for (uint32_t idx = 1; idx < threads; idx++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (thread &th : pool) {
+            th.join();
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (found) {
+            Runner runner(engine);
+            Case test = generateCase(caseSeed(seed, failedIndex), steps,
+                    runner.candidate->hasIndexed());
+            printf("Case %" PRIu64 " failed, minimizing\n", failedIndex);
+            report(runner, minimize(runner, test), engine);
+            failed = true;
+        } else {
+            uint64_t done = min<uint64_t>(next, cases != 0 ? cases : UINT64_MAX);
+            printf("%-9s %" PRIu64 " cases OK, %.1f steps compared per case, %.1f s, %.0f cases/s\n",
+                    engine.c_str(), done, static_cast<double>(compared) / done, elapsed, done / elapsed);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Coverage guided fuzzing harness for guest code. Needs a library built
+ * with Z80CPP_EDGE_COVERAGE.
+ *
+ * The guest image boots once; the machine state at the entry point is the
+ * snapshot every input starts from (only the pages written by the previous
+ * input are restored). Each IN returns the next input byte and the run ends
+ * when the input is exhausted, on HALT or after a T-state limit. The input
+ * can also be copied to guest memory, with HL pointing to it and BC holding
+ * its size. Reaching the crash address is a crash.
+ *
+ * Configuration, from the environment (numbers in hex):
+ *
+ *     Z80FUZZ_IMAGE     guest image (a built-in demo if not set)
+ *     Z80FUZZ_LOAD      load address, 0 by default
+ *     Z80FUZZ_ENTRY     entry point, the load address by default
+ *     Z80FUZZ_INPUT     address to copy the input to, none by default
+ *     Z80FUZZ_SIZE      maximum bytes copied there, 100 by default
+ *     Z80FUZZ_CRASH     crash address, 0666 by default
+ *     Z80FUZZ_TSTATES   T-state limit per input, F4240 (1000000) by default
+ *
+ * Built with clang and Z80CPP_LIBFUZZER, it's a libFuzzer target and the
+ * guest edge map is a libFuzzer extra counters section. Started by afl-fuzz,
+ * the guest edges go to the AFL shared memory map. Otherwise it's a driver:
+ *
+ *     z80fuzz file...             run every file, report edges and crashes
+ *     z80fuzz -fuzz N [file...]   N rounds of a simple mutational loop
+ *
+ * Exit status is 1 if any input crashed.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef Z80CPP_LIBFUZZER
+#include <sys/shm.h>
+#endif
+
+#include "z80machine.h"
+
+#ifndef WITH_EDGE_COVERAGE
+#error "z80fuzz needs the core built with Z80CPP_EDGE_COVERAGE"
+#endif
+
+using namespace std;
+
+namespace {
+
+const uint32_t MAP_SIZE = 65536;
+
+#ifdef Z80CPP_LIBFUZZER
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+uint8_t localMap[MAP_SIZE];
+
+// Checks four input bytes one at a time, a fuzzer has to find "Z80!"
+const uint8_t demo[] = {
+    0x31, 0xFF, 0xFF,       // LD SP,FFFFh
+    0xDB, 0x00,             // IN A,(00h)
+    0xFE, 'Z',              // CP 'Z'
+    0x20, 0x15,             // JR NZ,done
+    0xDB, 0x00,             // IN A,(00h)
+    0xFE, '8',              // CP '8'
+    0x20, 0x0F,             // JR NZ,done
+    0xDB, 0x00,             // IN A,(00h)
+    0xFE, '0',              // CP '0'
+    0x20, 0x09,             // JR NZ,done
+    0xDB, 0x00,             // IN A,(00h)
+    0xFE, '!',              // CP '!'
+    0x20, 0x03,             // JR NZ,done
+    0xC3, 0x66, 0x06,       // JP 0666h
+    0x76                    // done: HALT
+};
+
+enum class Outcome {
+    DONE,
+    CRASH,
+    TIMEOUT
+};
+
+class FuzzMachine : public Z80Machine
+{
+public:
+    uint16_t crashAddress = 0x0666;
+    const uint8_t *input = nullptr;
+    size_t inputSize = 0;
+    size_t inputPos = 0;
+    bool crashed = false;
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        if (address == crashAddress) {
+            crashed = true;
+            stop();
+        } else if (cpu.isHalted()) {
+            stop();
+        }
+        return Z80Machine::fetchOpcode(address);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        Z80Machine::inPort(port);
+        if (inputPos == inputSize) {
+            stop();
+            return 0xff;
+        }
+        return input[inputPos++];
+    }
+};
+
+struct Harness {
+    FuzzMachine machine;
+    Z80State snapshot;
+    vector<uint8_t> memory;
+    uint8_t *map = localMap;
+    int32_t inputAddress = -1;
+    uint32_t inputLimit = 0x100;
+    uint64_t tstateLimit = 1000000;
+};
+
+uint32_t envNumber(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value != nullptr ? static_cast<uint32_t>(strtoul(value, nullptr, 16)) : fallback;
+}
+
+bool readFile(const char *fileName, vector<uint8_t> &data) {
+    ifstream f(fileName, ios::in | ios::binary);
+    if (!f.is_open()) {
+        return false;
+    }
+    data.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    return true;
+}
+
+Harness &harness() {
+    static Harness *instance = nullptr;
+    if (instance != nullptr) {
+        return *instance;
+    }
+    instance = new Harness();
+    Harness &h = *instance;
+
+    vector<uint8_t> image(demo, demo + sizeof(demo));
+    const char *fileName = getenv("Z80FUZZ_IMAGE");
+    if (fileName != nullptr && !readFile(fileName, image)) {
+        fprintf(stderr, "Can't read %s\n", fileName);
+        exit(2);
+    }
+
+    uint16_t load = static_cast<uint16_t>(envNumber("Z80FUZZ_LOAD", 0));
+    h.machine.getMemory().clear();
+    h.machine.getMemory().load(load, image.data(), min(image.size(), size_t(Z80Memory::SIZE)));
+    h.machine.reset();
+    h.machine.getCpu().setRegPC(static_cast<uint16_t>(envNumber("Z80FUZZ_ENTRY", load)));
+    h.machine.crashAddress = static_cast<uint16_t>(envNumber("Z80FUZZ_CRASH", 0x0666));
+    h.inputAddress = getenv("Z80FUZZ_INPUT") != nullptr
+            ? static_cast<int32_t>(envNumber("Z80FUZZ_INPUT", 0) & 0xffff) : -1;
+    h.inputLimit = envNumber("Z80FUZZ_SIZE", 0x100);
+    h.tstateLimit = envNumber("Z80FUZZ_TSTATES", 1000000);
+
+    h.machine.getCpu().saveState(h.snapshot);
+    const uint8_t *ram = h.machine.getMemory().data();
+    h.memory.assign(ram, ram + Z80Memory::SIZE);
+    h.machine.getMemory().clearDirtyPages();
+
+#ifndef Z80CPP_LIBFUZZER
+    // Started by afl-fuzz, edges go to its shared map
+    const char *shmId = getenv("__AFL_SHM_ID");
+    if (shmId != nullptr) {
+        void *area = shmat(atoi(shmId), nullptr, 0);
+        if (area != reinterpret_cast<void *>(-1)) {
+            h.map = static_cast<uint8_t *>(area);
+        }
+    }
+#endif
+    return h;
+}
+
+Outcome runInput(const uint8_t *data, size_t size) {
+    Harness &h = harness();
+    FuzzMachine &machine = h.machine;
+    Z80Memory &memory = machine.getMemory();
+
+    // Back to the snapshot, only the pages written since
+    memory.takeDirtyPages().forEach([&](uint32_t page) {
+        memory.load(page << Z80Memory::PAGE_SHIFT, &h.memory[page << Z80Memory::PAGE_SHIFT],
+                Z80Memory::PAGE_SIZE);
+    });
+    machine.reset();
+    machine.getCpu().loadState(h.snapshot);
+
+    // The input copy goes after clearing the mask, so it's restored too
+    memory.clearDirtyPages();
+    if (h.inputAddress >= 0) {
+        size_t copied = min(size, static_cast<size_t>(h.inputLimit));
+        memory.load(static_cast<uint16_t>(h.inputAddress), data, copied);
+        machine.getCpu().setRegHL(static_cast<uint16_t>(h.inputAddress));
+        machine.getCpu().setRegBC(static_cast<uint16_t>(copied));
+    }
+
+    machine.input = data;
+    machine.inputSize = size;
+    machine.inputPos = 0;
+    machine.crashed = false;
+    machine.getCpu().setCoverageMap(h.map);
+
+    uint64_t instructions = 0;
+    Z80Machine::StopReason reason = machine.run(h.tstateLimit, 0, instructions);
+    if (machine.crashed) {
+        return Outcome::CRASH;
+    }
+    return reason == Z80Machine::StopReason::TSTATES ? Outcome::TIMEOUT : Outcome::DONE;
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (runInput(data, size) == Outcome::CRASH) {
+        fprintf(stderr, "Guest crash at %04X\n", harness().machine.crashAddress);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef Z80CPP_LIBFUZZER
+
+namespace {
+
+// AFL hit count buckets
+uint8_t bucket(uint8_t count) {
+    static const uint8_t limits[] = { 1, 2, 3, 7, 15, 31, 127 };
+    for (uint32_t idx = 0; idx < sizeof(limits); idx++) {
+        if (count <= limits[idx]) {
+            return static_cast<uint8_t>(1 << idx);
+        }
+    }
+    return 0x80;
+}
+
+// Bits of the bucketed map not seen before, added to 'seen'
+uint32_t newCoverage(const uint8_t *map, vector<uint8_t> &seen) {
+    uint32_t found = 0;
+    for (uint32_t idx = 0; idx < MAP_SIZE; idx++) {
+        if (map[idx] != 0) {
+            uint8_t bits = bucket(map[idx]);
+            if ((seen[idx] & bits) == 0) {
+                seen[idx] |= bits;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+uint32_t edges(const vector<uint8_t> &seen) {
+    uint32_t count = 0;
+    for (uint8_t bits : seen) {
+        count += bits != 0 ? 1 : 0;
+    }
+    return count;
+}
+
+void mutate(vector<uint8_t> &data, mt19937 &rng) {
+    uint32_t rounds = 1 + rng() % 4;
+    for (uint32_t round = 0; round < rounds; round++) {
+        size_t pos = data.empty() ? 0 : rng() % data.size();
+        switch (rng() % 5) {
+            case 0: // Flip a bit
+                if (!data.empty()) {
+                    data[pos] ^= static_cast<uint8_t>(1 << (rng() % 8));
+                }
+                break;
+            case 1: // Random byte
+                if (!data.empty()) {
+                    data[pos] = static_cast<uint8_t>(rng());
+                }
+                break;
+            case 2: // Insert
+                data.insert(data.begin() + pos, static_cast<uint8_t>(rng()));
+                break;
+            case 3: // Delete
+                if (!data.empty()) {
+                    data.erase(data.begin() + pos);
+                }
+                break;
+            default: // Append
+                if (data.size() < 4096) {
+                    data.push_back(static_cast<uint8_t>(rng()));
+                }
+                break;
+        }
+    }
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t rounds = 0;
+    vector<vector<uint8_t>> corpus;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (strcmp(argv[idx], "-fuzz") == 0 && idx + 1 < argc) {
+            rounds = strtoull(argv[++idx], nullptr, 10);
+        } else if (argv[idx][0] != '-') {
+            corpus.emplace_back();
+            if (!readFile(argv[idx], corpus.back())) {
+                printf("Can't read %s\n", argv[idx]);
+                return 2;
+            }
+        } else {
+            printf("Usage: %s [-fuzz rounds] [file...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    Harness &h = harness();
+    vector<uint8_t> seen(MAP_SIZE, 0);
+    bool crashed = false;
+
+    auto run = [&](const vector<uint8_t> &input, uint32_t &found) {
+        memset(h.map, 0, MAP_SIZE);
+        Outcome outcome = runInput(input.data(), input.size());
+        found = newCoverage(h.map, seen);
+        return outcome;
+    };
+
+    for (size_t idx = 0; idx < corpus.size(); idx++) {
+        uint32_t found;
+        Outcome outcome = run(corpus[idx], found);
+        if (outcome == Outcome::CRASH) {
+            printf("Crash at %04X with input %zu\n", h.machine.crashAddress, idx);
+            crashed = true;
+        } else if (outcome == Outcome::TIMEOUT) {
+            printf("Timeout with input %zu\n", idx);
+        }
+    }
+    if (rounds == 0) {
+        printf("%zu inputs, %u edges\n", corpus.size(), edges(seen));
+        return crashed ? 1 : 0;
+    }
+
+    if (corpus.empty()) {
+        corpus.emplace_back();
+    }
+
+    mt19937 rng(1);
+    auto start = chrono::steady_clock::now();
+    uint64_t round;
+    for (round = 0; round < rounds && !crashed; round++) {
+        vector<uint8_t> input = corpus[rng() % corpus.size()];
+        mutate(input, rng);
+
+        uint32_t found;
+        Outcome outcome = run(input, found);
+        if (outcome == Outcome::CRASH) {
+            printf("Crash at %04X after %llu rounds, input:", h.machine.crashAddress,
+                    static_cast<unsigned long long>(round + 1));
+            for (uint8_t byte : input) {
+                printf(" %02X", byte);
+            }
+            printf("\n");
+            crashed = true;
+        } else if (found != 0) {
+            corpus.push_back(move(input));
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("%llu rounds, %.0f execs/s, corpus %zu, %u edges\n",
+            static_cast<unsigned long long>(round), round / seconds, corpus.size(), edges(seen));
+    return crashed ? 1 : 0;
+}
+
+#endif
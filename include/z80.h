@@ -12,21 +12,11 @@
 
 #include <cstdint>
 
-/* Union allowing a register pair to be accessed as bytes or as a word */
-typedef union {
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-    struct {
-        uint8_t hi, lo;
-    } byte8;
-#else
-    struct {
-        uint8_t lo, hi;
-    } byte8;
-#endif
-    uint16_t word;
-} RegisterPair;
-
+#include "z80state.h"
 #include "z80operations.h"
+#ifdef WITH_OPCODE_STATS
+#include "z80stats.h"
+#endif
 
 #define REG_B   regBC.byte8.hi
 #define REG_C   regBC.byte8.lo
@@ -73,26 +63,23 @@ typedef union {
 #define REG_Z   memptr.byte8.lo
 #define REG_WZ  memptr.word
 
-class Z80 {
+class Z80 : private Z80State {
 public:
     // Modos de interrupción
-    enum IntMode {
-        IM0, IM1, IM2
-    };
+    using Z80State::IntMode;
+    using Z80State::IM0;
+    using Z80State::IM1;
+    using Z80State::IM2;
 private:
     Z80operations *Z80opsImpl;
     // Código de instrucción a ejecutar
     // Poner esta variable como local produce peor rendimiento
     // ZEXALL test: (local) 1:54 vs 1:47 (visitante)
     uint8_t m_opCode;
-    // Se está ejecutando una instrucción prefijada con DD, ED o FD
-    // Los valores permitidos son [0x00, 0xDD, 0xED, 0xFD]
-    // El prefijo 0xCB queda al margen porque, detrás de 0xCB, siempre
-    // viene un código de instrucción válido, tanto si delante va un
-    // 0xDD o 0xFD como si no.
-    uint8_t prefixOpcode = { 0x00 };
     // Subsistema de notificaciones
     bool execDone;
+    // INIR/INDR/OTIR/OTDR through Z80operations::inBlock()/outBlock()
+    bool blockIO {false};
     // Posiciones de los flags
     const static uint8_t CARRY_MASK = 0x01;
     const static uint8_t ADDSUB_MASK = 0x02;
@@ -109,80 +96,6 @@ private:
     const static uint8_t FLAG_SZHN_MASK = FLAG_SZ_MASK | HALFCARRY_MASK | ADDSUB_MASK;
     const static uint8_t FLAG_SZP_MASK = FLAG_SZ_MASK | PARITY_MASK;
     const static uint8_t FLAG_SZHP_MASK = FLAG_SZP_MASK | HALFCARRY_MASK;
-    // Acumulador y resto de registros de 8 bits
-    uint8_t regA;
-    // Flags sIGN, zERO, 5, hALFCARRY, 3, pARITY y ADDSUB (n)
-    uint8_t sz5h3pnFlags;
-    // El flag Carry es el único que se trata aparte
-    bool carryFlag;
-    // Registros principales y alternativos
-    RegisterPair regBC, regBCx, regDE, regDEx, regHL, regHLx;
-    /* Flags para indicar la modificación del registro F en la instrucción actual
-     * y en la anterior.
-     * Son necesarios para emular el comportamiento de los bits 3 y 5 del
-     * registro F con las instrucciones CCF/SCF.
-     *
-     * http://www.worldofspectrum.org/forums/showthread.php?t=41834
-     * http://www.worldofspectrum.org/forums/showthread.php?t=41704
-     *
-     * Thanks to Patrik Rak for his tests and investigations.
-     */
-    bool flagQ, lastFlagQ;
-
-    // Acumulador alternativo y flags -- 8 bits
-    RegisterPair regAFx;
-
-    // Registros de propósito específico
-    // *PC -- Program Counter -- 16 bits*
-    RegisterPair regPC;
-    // *IX -- Registro de índice -- 16 bits*
-    RegisterPair regIX;
-    // *IY -- Registro de índice -- 16 bits*
-    RegisterPair regIY;
-    // *SP -- Stack Pointer -- 16 bits*
-    RegisterPair regSP;
-    // *I -- Vector de interrupción -- 8 bits*
-    uint8_t regI;
-    // *R -- Refresco de memoria -- 7 bits*
-    uint8_t regR;
-    // *R7 -- Refresco de memoria -- 1 bit* (bit superior de R)
-    bool regRbit7;
-    //Flip-flops de interrupción
-    bool ffIFF1 = false;
-    bool ffIFF2 = false;
-    // EI solo habilita las interrupciones DESPUES de ejecutar la
-    // siguiente instrucción (excepto si la siguiente instrucción es un EI...)
-    bool pendingEI = false;
-    // Estado de la línea NMI
-    bool activeNMI = false;
-    // Modo de interrupción
-    IntMode modeINT = IntMode::IM0;
-    // halted == true cuando la CPU está ejecutando un HALT (28/03/2010)
-    bool halted = false;
-    // pinReset == true, se ha producido un reset a través de la patilla
-    bool pinReset = false;
-    /*
-     * Registro interno que usa la CPU de la siguiente forma
-     *
-     * ADD HL,xx      = Valor del registro H antes de la suma
-     * LD r,(IX/IY+d) = Byte superior de la suma de IX/IY+d
-     * JR d           = Byte superior de la dirección de destino del salto
-     *
-     * 04/12/2008     No se vayan todavía, aún hay más. Con lo que se ha
-     *                implementado hasta ahora parece que funciona. El resto de
-     *                la historia está contada en:
-     *                http://zx.pk.ru/attachment.php?attachmentid=2989
-     *
-     * 25/09/2009     Se ha completado la emulación de MEMPTR. A señalar que
-     *                no se puede comprobar si MEMPTR se ha emulado bien hasta
-     *                que no se emula el comportamiento del registro en las
-     *                instrucciones CPI y CPD. Sin ello, todos los tests de
-     *                z80tests.tap fallarán aunque se haya emulado bien al
-     *                registro en TODAS las otras instrucciones.
-     *                Shit yourself, little parrot.
-     */
-
-    RegisterPair memptr;
     // I and R registers
     inline RegisterPair getPairIR() const;
 
@@ -206,9 +119,25 @@ private:
     // ejecutar la instrucción que está en esa direción.
 #ifdef WITH_BREAKPOINT_SUPPORT
     bool breakpointEnabled {false};
+#endif
+#ifdef WITH_FLOW_NOTIFY
+    bool flowNotify {false};
+#endif
+#ifdef WITH_EDGE_COVERAGE
+    uint8_t *coverageMap {nullptr};
+    uint16_t coveragePrev {0};
+#endif
+#ifdef WITH_OPCODE_STATS
+    // Contadores de ejecución por tabla de decodificación
+    // Execution counters for every decode table
+    Z80OpcodeStats opcodeStats {};
 #endif
     void copyToRegister(uint8_t opCode, uint8_t value);
     void adjustINxROUTxRFlags();
+    // INIR/INDR y OTIR/OTDR en bloque
+    // Block path of INIR/INDR (input) and OTIR/OTDR, 'opCode' is the one
+    // after ED
+    bool blockTransfer(uint8_t opCode, bool input, int32_t step);
 
 public:
     // Constructor de la clase
@@ -315,6 +244,11 @@ public:
     uint16_t getMemPtr() const { return REG_WZ; }
     void setMemPtr(uint16_t word) { REG_WZ = word; }
 
+    // Acceso al estado oculto Q (la instrucción anterior modificó F)
+    // Hidden Q state, F was modified by the previous instruction (SCF/CCF)
+    bool isFlagQ() const { return lastFlagQ; }
+    void setFlagQ(bool state) { lastFlagQ = state; }
+
     // Acceso a los flags uno a uno
     // Access to single flags from F register
     bool isCarryFlag() const { return carryFlag; }
@@ -376,12 +310,21 @@ public:
     bool isPendingEI() const { return pendingEI; }
     void setPendingEI(bool state) { pendingEI = state; }
 
+    // Whole CPU state, a plain copy
+    void saveState(Z80State &state) const { state = *this; }
+    void loadState(const Z80State &state) { static_cast<Z80State &>(*this) = state; }
+
     // Reset
     void reset();
 
     // Execute one instruction
     void execute();
 
+    // Let the bus move the repeated INIR/INDR/OTIR/OTDR iterations at once.
+    // Breakpoints and execDone() notifications turn the block path off.
+    bool isBlockIO() const { return blockIO; }
+    void setBlockIO(bool state) { blockIO = state; }
+
 #ifdef WITH_BREAKPOINT_SUPPORT
     bool isBreakpoint() { return breakpointEnabled; }
     void setBreakpoint(bool state) { breakpointEnabled = state; }
@@ -391,6 +334,21 @@ public:
     void setExecDone(bool status) { execDone = status; }
 #endif
 
+#ifdef WITH_FLOW_NOTIFY
+    void setFlowNotify(bool state) { flowNotify = state; }
+#endif
+
+#ifdef WITH_EDGE_COVERAGE
+    // AFL compatible map of 65536 edge hit counters, nullptr to disable.
+    // Also forgets the previous location, call it before every input.
+    void setCoverageMap(uint8_t *map) { coverageMap = map; coveragePrev = 0; }
+#endif
+
+#ifdef WITH_OPCODE_STATS
+    const Z80OpcodeStats &getOpcodeStats() const { return opcodeStats; }
+    void resetOpcodeStats() { opcodeStats = Z80OpcodeStats {}; }
+#endif
+
 private:
     // Rota a la izquierda el valor del argumento
     inline void rlc(uint8_t &oper8);
@@ -494,9 +452,39 @@ private:
     // OUTD
     void outd();
 
+    // Flags de INI/IND y OUTI/OUTD
+    // Flags of INI/IND ('port' is C + 1 or C - 1) and OUTI/OUTD
+    inline void inxFlags(uint8_t work8, uint8_t port);
+    inline void outxFlags(uint8_t work8);
+
     // BIT n,r
     inline void bitTest(uint8_t mask, uint8_t reg);
 
+    // Notifica CALL/RST/RET/RETI/RETN/INT/NMI
+    // Notify calls, returns and interrupts to the host
+    inline void notifyFlow(Z80Flow event, uint16_t address) {
+        coverEdge(address);
+#ifdef WITH_FLOW_NOTIFY
+        if (flowNotify) {
+            Z80opsImpl->flowNotify(event, address);
+        }
+#endif
+    }
+
+    // Cobertura de aristas al estilo AFL: el destino de cada salto, llamada,
+    // retorno, interrupción o repetición de instrucción de bloque (y la
+    // siguiente instrucción cuando un salto condicional no se toma) se
+    // mezcla con el anterior para indexar un mapa de 64K contadores
+    inline void coverEdge(uint16_t address) {
+#ifdef WITH_EDGE_COVERAGE
+        if (coverageMap != nullptr) {
+            uint16_t location = static_cast<uint16_t>((address * 0x9E3779B1u) >> 16);
+            coverageMap[location ^ coveragePrev]++;
+            coveragePrev = location >> 1;
+        }
+#endif
+    }
+
     //Interrupción
     void interrupt();
 
@@ -0,0 +1,111 @@
+#ifndef Z80BATCH_H
+#define Z80BATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "z80machine.h"
+
+struct Z80BatchResult {
+    uint64_t id;
+    Z80Machine::StopReason reason;
+    uint64_t tstates;
+    uint64_t instructions;
+    uint16_t pc;
+};
+
+/*
+ * One guest run. The RAM is cleared, 'image' is copied at 'loadAddress',
+ * the CPU is reset with PC at 'entry' and SP at 'sp', 'setup' can set up
+ * anything else and the machine runs until it calls stop() or reaches a
+ * limit (0 = no limit).
+ */
+struct Z80BatchJob {
+    // Shared by all the jobs that run the same program
+    std::shared_ptr<const std::vector<uint8_t>> image;
+    uint16_t loadAddress = 0x0000;
+    uint16_t entry = 0x0000;
+    uint16_t sp = 0xFFFF;
+    uint64_t maxTstates = 0;
+    uint64_t maxInstructions = 0;
+    // Copied to the result
+    uint64_t id = 0;
+    // Called on the worker thread before the run
+    std::function<void(Z80Machine &)> setup;
+    // Called on the worker thread after the run, while the machine can
+    // still be inspected, before the future is ready
+    std::function<void(const Z80BatchResult &, Z80Machine &)> onComplete;
+};
+
+/*
+ * Work-stealing pool of threads running Z80BatchJobs. Every thread owns one
+ * machine, built by the factory when the runner starts and reused for all
+ * the jobs it runs, so there's no allocation of CPU or memory per job.
+ *
+ * Jobs are distributed round robin over the thread queues. An idle thread
+ * takes work from the front of its queue, or steals it from the back of
+ * another one.
+ */
+class Z80BatchRunner {
+public:
+    using MachineFactory = std::function<std::unique_ptr<Z80Machine>()>;
+
+    // A plain Z80Machine when there isn't a factory, one thread per core
+    // when 'threads' is 0
+    explicit Z80BatchRunner(MachineFactory factory = nullptr, uint32_t threads = 0);
+
+    // Waits for the submitted jobs
+    ~Z80BatchRunner();
+
+    Z80BatchRunner(const Z80BatchRunner &) = delete;
+    Z80BatchRunner &operator=(const Z80BatchRunner &) = delete;
+
+    uint32_t getThreads() const { return static_cast<uint32_t>(workers.size()); }
+
+    // An exception thrown by the machine or the callbacks is stored in
+    // the future
+    std::future<Z80BatchResult> submit(Z80BatchJob job);
+
+    // Block until every submitted job has finished
+    void wait();
+
+private:
+    struct Task {
+        Z80BatchJob job;
+        std::promise<Z80BatchResult> promise;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> queue;
+        std::unique_ptr<Z80Machine> machine;
+        std::thread thread;
+    };
+
+    MachineFactory factory;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<uint32_t> nextWorker;
+    // Tasks in the queues, not taken yet
+    std::atomic<uint64_t> queued;
+    // Tasks submitted and not finished
+    std::atomic<uint64_t> unfinished;
+    bool shutdown;
+    std::mutex idleLock;
+    std::condition_variable workAvailable;
+    std::mutex doneLock;
+    std::condition_variable allDone;
+
+    bool take(uint32_t self, Task &task);
+    void execute(Z80Machine &machine, Task &task);
+    void workerLoop(uint32_t self);
+};
+
+#endif // Z80BATCH_H
@@ -0,0 +1,123 @@
+#ifndef Z80DIRTYMAP_H
+#define Z80DIRTYMAP_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * One bit per page of the 64K address space, set when the page is written.
+ * The page size is a template parameter, so marking a store is a shift and
+ * one OR (with 64 pages or less, the bits fit in one word).
+ *
+ * Renderers, snapshots and hashes read the map to work only on the pages
+ * written since they last looked, with forEach() and then clear(), or
+ * take() to do both at once.
+ */
+template <uint32_t SHIFT>
+class Z80DirtyMap {
+public:
+    static_assert(SHIFT >= 6 && SHIFT <= 16, "Pages from 64 bytes to 64K");
+
+    static const uint32_t PAGE_SHIFT = SHIFT;
+    static const uint32_t PAGE_SIZE = 1 << SHIFT;
+    static const uint32_t PAGES = 0x10000 >> SHIFT;
+    static const uint32_t WORDS = (PAGES + 63) / 64;
+
+    Z80DirtyMap() { clear(); }
+
+    void mark(uint16_t address) {
+        uint32_t page = address >> SHIFT;
+        bits[page / 64] |= UINT64_C(1) << (page % 64);
+    }
+
+    // 'size' bytes from 'address', wrapping around 0xFFFF
+    void markRange(uint16_t address, size_t size) {
+        if (size >= 0x10000) {
+            markAll();
+            return;
+        }
+        uint32_t first = address >> SHIFT;
+        uint32_t last = ((address + size - 1) & 0xffff) >> SHIFT;
+        for (uint32_t page = first; size != 0; page = (page + 1) % PAGES) {
+            bits[page / 64] |= UINT64_C(1) << (page % 64);
+            if (page == last) {
+                break;
+            }
+        }
+    }
+
+    void markAll() {
+        for (uint32_t idx = 0; idx < WORDS; idx++) {
+            bits[idx] = PAGES >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << (PAGES % 64)) - 1;
+        }
+    }
+
+    void clear() {
+        for (uint32_t idx = 0; idx < WORDS; idx++) {
+            bits[idx] = 0;
+        }
+    }
+
+    // Get and clear
+    Z80DirtyMap take() {
+        Z80DirtyMap map = *this;
+        clear();
+        return map;
+    }
+
+    bool isDirty(uint32_t page) const { return (bits[page / 64] >> (page % 64)) & 1; }
+
+    bool any() const {
+        uint64_t all = 0;
+        for (uint32_t idx = 0; idx < WORDS; idx++) {
+            all |= bits[idx];
+        }
+        return all != 0;
+    }
+
+    uint32_t count() const {
+        uint32_t pages = 0;
+        forEach([&pages](uint32_t) { pages++; });
+        return pages;
+    }
+
+    // Bits of pages 64 * index to 64 * index + 63
+    uint64_t getWord(uint32_t index) const { return bits[index]; }
+
+    // Calls f(page) for every dirty page, in ascending order
+    template <typename F>
+    void forEach(F f) const {
+        for (uint32_t idx = 0; idx < WORDS; idx++) {
+            uint64_t word = bits[idx];
+            while (word != 0) {
+                f(idx * 64 + lowestBit(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    Z80DirtyMap &operator|=(const Z80DirtyMap &other) {
+        for (uint32_t idx = 0; idx < WORDS; idx++) {
+            bits[idx] |= other.bits[idx];
+        }
+        return *this;
+    }
+
+private:
+    uint64_t bits[WORDS];
+
+    static uint32_t lowestBit(uint64_t word) {
+#if defined(__GNUC__)
+        return static_cast<uint32_t>(__builtin_ctzll(word));
+#else
+        uint32_t bit = 0;
+        while ((word & 1) == 0) {
+            word >>= 1;
+            bit++;
+        }
+        return bit;
+#endif
+    }
+};
+
+#endif // Z80DIRTYMAP_H
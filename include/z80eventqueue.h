@@ -0,0 +1,117 @@
+#ifndef Z80EVENTQUEUE_H
+#define Z80EVENTQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "z80portmap.h"
+
+// A port write and the machine T-state it happened at
+struct Z80PortEvent {
+    uint64_t tstates;
+    uint16_t port;
+    uint8_t value;
+};
+
+/*
+ * Lock-free ring of port events from one producer thread, the one running
+ * the machine, to one consumer thread (audio, video...). Neither side
+ * takes a lock or waits: push() fails when the ring is full and pop()
+ * returns 0 when it's empty. The consumer drains the events in batches:
+ *
+ *     Z80PortEvent events[256];
+ *     size_t count = queue.pop(events, 256);
+ *
+ * Each side keeps a copy of the other side's index and reads the shared
+ * one only when its copy says the ring is full or empty, so most pushes
+ * and pops touch no cache line written by the other thread.
+ */
+class Z80EventQueue {
+public:
+    // 'capacity' is rounded up to a power of two
+    explicit Z80EventQueue(uint32_t capacity = 4096);
+
+    Z80EventQueue(const Z80EventQueue &) = delete;
+    Z80EventQueue &operator=(const Z80EventQueue &) = delete;
+
+    uint32_t getCapacity() const { return static_cast<uint32_t>(ring.size()); }
+
+    // Producer side. False if the ring is full, the event isn't queued.
+    bool push(const Z80PortEvent &event) {
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        if (position - headCopy == ring.size()) {
+            headCopy = head.load(std::memory_order_acquire);
+            if (position - headCopy == ring.size()) {
+                return false;
+            }
+        }
+        ring[position & mask] = event;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, as many events as fit, published at once.
+    // Returns the number queued.
+    size_t push(const Z80PortEvent *events, size_t count);
+
+    // Consumer side, up to 'max' events, oldest first. Returns the number
+    // copied to 'events'.
+    size_t pop(Z80PortEvent *events, size_t max);
+
+    // Events queued, exact only on the consumer side with the producer idle
+    size_t size() const {
+        return static_cast<size_t>(tail.load(std::memory_order_acquire)
+                - head.load(std::memory_order_acquire));
+    }
+
+private:
+    std::vector<Z80PortEvent> ring;
+    uint64_t mask;
+
+    // Producer and consumer data on cache lines of their own. Before C++17
+    // operator new doesn't honour the alignment, so a queue on the heap
+    // may start mid-line; the sizes still keep the two sides 64 bytes apart.
+    alignas(64) std::atomic<uint64_t> tail;
+    uint64_t headCopy;
+    alignas(64) std::atomic<uint64_t> head;
+    uint64_t tailCopy;
+};
+
+/*
+ * Port device that posts the writes it decodes to a Z80EventQueue, for a
+ * peripheral emulated on another thread. Reads are left to other devices.
+ *
+ * When the consumer is a whole ring behind, the device either yields the
+ * CPU until there is room (the default, no event is lost) or drops the
+ * event; both cases are counted.
+ */
+class Z80QueuedPort : public Z80PortDevice {
+public:
+    // The queue isn't owned, it must outlive the device
+    explicit Z80QueuedPort(Z80EventQueue &queue, bool dropWhenFull = false);
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) override {
+        if (!queue.push({ tstates, port, value })) {
+            full({ tstates, port, value });
+        }
+    }
+
+    void outBlock(uint16_t port, const uint8_t *data, size_t size, uint64_t tstates,
+            uint32_t step) override;
+
+    // Writes that found the ring full, and those of them that were lost
+    uint64_t getStalls() const { return stalls; }
+    uint64_t getDropped() const { return dropped; }
+
+private:
+    Z80EventQueue &queue;
+    bool dropWhenFull;
+    uint64_t stalls;
+    uint64_t dropped;
+
+    void full(const Z80PortEvent &event);
+};
+
+#endif // Z80EVENTQUEUE_H
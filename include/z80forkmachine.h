@@ -0,0 +1,119 @@
+#ifndef Z80FORKMACHINE_H
+#define Z80FORKMACHINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "z80machinebase.h"
+#include "z80memory.h"
+
+/*
+ * 64K of guest RAM as a table of pages shared copy-on-write. Copying a
+ * Z80PagedMemory only copies the table; a page is duplicated on the first
+ * write to it from either copy.
+ *
+ * Every page records the memory that created it, its owner, by a unique
+ * id. Only the owner writes a page in place, and copying gives both the
+ * copy and the source new ids, so neither owns any page until it writes
+ * it. Ownership doesn't depend on reference counts, which other threads
+ * may be changing; a page whose other holders are gone is still copied
+ * once. The pages themselves are freed with atomic reference counts, so
+ * copies can live on different threads. A given object must not be
+ * copied while it's in use elsewhere.
+ */
+class Z80PagedMemory {
+public:
+    static const uint32_t SIZE = Z80Memory::SIZE;
+    static const uint32_t PAGE_SHIFT = Z80Memory::PAGE_SHIFT;
+    static const uint32_t PAGE_SIZE = Z80Memory::PAGE_SIZE;
+    static const uint32_t PAGES = Z80Memory::PAGES;
+
+    // All the pages share one zeroed page until written
+    Z80PagedMemory();
+    Z80PagedMemory(const Z80PagedMemory &other);
+    Z80PagedMemory &operator=(const Z80PagedMemory &other);
+
+    uint8_t read(uint16_t address) const {
+        return readMap[address >> PAGE_SHIFT][address & (PAGE_SIZE - 1)];
+    }
+
+    void write(uint16_t address, uint8_t value) {
+        uint8_t *page = writeMap[address >> PAGE_SHIFT];
+        if (page == nullptr) {
+            page = unshare(address >> PAGE_SHIFT);
+        }
+        page[address & (PAGE_SIZE - 1)] = value;
+        dirtyPages.mark(address);
+    }
+
+    // Copy 'size' bytes at/from 'address', wrapping around 0xFFFF
+    void load(uint16_t address, const uint8_t *data, size_t size);
+    void save(uint16_t address, uint8_t *data, size_t size) const;
+
+    const uint8_t *page(uint32_t number) const { return readMap[number]; }
+
+    // True if page 'number' is written in place, without a copy
+    bool isPrivate(uint32_t number) const { return pages[number]->owner == owner; }
+
+    // Pages duplicated by writes since this object was created or copied to
+    uint32_t getCopiedPages() const { return copiedPages; }
+
+    // Pages written since the last clearDirtyPages() or takeDirtyPages(),
+    // a copy starts with the map of its source
+    const Z80Memory::DirtyMap &getDirtyPages() const { return dirtyPages; }
+    Z80Memory::DirtyMap takeDirtyPages() { return dirtyPages.take(); }
+    void clearDirtyPages() { dirtyPages.clear(); }
+
+private:
+    struct Page {
+        // Id of the memory that created the page, 0 for the zeroed page.
+        // Set before the page is published and never changed.
+        uint64_t owner;
+        uint8_t data[PAGE_SIZE];
+    };
+
+    std::shared_ptr<Page> pages[PAGES];
+    const uint8_t *readMap[PAGES];
+    // nullptr until the page is owned. Copying clears it in the source
+    // too, that's why it's mutable.
+    mutable uint8_t *writeMap[PAGES];
+    // Renewed by every copy, in the source too
+    mutable uint64_t owner;
+    uint32_t copiedPages;
+    Z80Memory::DirtyMap dirtyPages;
+
+    uint8_t *unshare(uint32_t number);
+    void share(const Z80PagedMemory &other);
+};
+
+extern template class Z80MachineBase<Z80PagedMemory>;
+
+/*
+ * A Z80 with page-mapped copy-on-write RAM and the Z80MachineBase timing
+ * and ports, that can be forked: the fork gets the CPU state and T-state
+ * counter and shares every memory page, so forking costs the pages written
+ * afterwards instead of a 64K copy. Forks are independent machines and can
+ * run on different threads, as long as none of them is forked meanwhile.
+ * The notification switches of the CPU (setBreakpoint() and the like)
+ * start off in the fork, and so does its port map.
+ *
+ * Subclasses with devices override fork() to copy them, usually through
+ * their copy constructor, and map the copies:
+ *
+ *     std::unique_ptr<Z80ForkMachine> fork() override {
+ *         return std::unique_ptr<Z80ForkMachine>(new MyMachine(*this));
+ *     }
+ */
+class Z80ForkMachine : public Z80MachineBase<Z80PagedMemory> {
+public:
+    Z80ForkMachine();
+    Z80ForkMachine(const Z80ForkMachine &other);
+    ~Z80ForkMachine() override;
+
+    Z80ForkMachine &operator=(const Z80ForkMachine &) = delete;
+
+    virtual std::unique_ptr<Z80ForkMachine> fork();
+};
+
+#endif // Z80FORKMACHINE_H
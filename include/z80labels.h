@@ -0,0 +1,31 @@
+#ifndef Z80LABELS_H
+#define Z80LABELS_H
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <unordered_map>
+
+/* Guest address symbols used by the profiling and tracing tools */
+class Z80Labels {
+public:
+    // Load "name address" or "address name" lines, also "name: equ addr"
+    // and "name = addr". Addresses can be written as 1234, 0x1234, $1234
+    // or 1234h. Returns the number of labels loaded.
+    uint32_t load(std::istream &in);
+
+    void add(uint16_t address, const std::string &name) { labels[address] = name; }
+
+    bool empty() const { return labels.empty(); }
+
+    // nullptr if there isn't a label at 'address'
+    const std::string *find(uint16_t address) const;
+
+    // Label at 'address' or its hex form (0x1234)
+    std::string nameOf(uint16_t address) const;
+
+private:
+    std::unordered_map<uint16_t, std::string> labels;
+};
+
+#endif // Z80LABELS_H
@@ -0,0 +1,104 @@
+#ifndef Z80LOCKSTEP_H
+#define Z80LOCKSTEP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "z80.h"
+
+/*
+ * Experimental engine that runs one program on many Z80 states at once.
+ * Every state is a lane and the registers are stored as structure of
+ * arrays, so each instruction is a loop over the lanes that the compiler
+ * vectorizes (build with Z80CPP_LOCKSTEP_AVX2 to use AVX2).
+ *
+ * Every step executes the instruction at the lowest PC among the running
+ * lanes, masked to the lanes that are at that PC. Lanes that take another
+ * path on a branch wait until the others reach them, which reconverges
+ * loops and if/else blocks.
+ *
+ * Only a subset of the instruction set is supported: register loads and
+ * arithmetic, ALU with immediate or memory operands, rotations, BIT/SET/RES
+ * on registers, ADD HL,rr, INC/DEC rr, JR/JP/DJNZ and HALT. Memory is
+ * shared by all the lanes and read only. A lane that reaches any other
+ * instruction stops as UNSUPPORTED, with its state before it, and can be
+ * moved to the scalar core with storeLane() to finish there.
+ *
+ * The flags follow the same rules as the scalar core, including Q and
+ * MEMPTR, and the timing is the Z80Machine one.
+ */
+class Z80Lockstep {
+public:
+    enum LaneStatus : uint8_t {
+        RUNNING,
+        HALTED,         // Executed a HALT, PC points after it
+        STOPPED,        // Reached the stop address
+        UNSUPPORTED     // PC points to an unsupported instruction
+    };
+
+    // Register file, one entry per lane. F holds all the flags, Q is
+    // 0xFF when the last instruction modified F.
+    struct Lanes {
+        std::vector<uint8_t> a, f, b, c, d, e, h, l, r, q, status;
+        std::vector<uint16_t> pc, sp, wz;
+        std::vector<uint64_t> tstates;
+    };
+
+    explicit Z80Lockstep(uint32_t lanes);
+
+    uint32_t getLaneCount() const { return count; }
+    Lanes &getLanes() { return regs; }
+    const Lanes &getLanes() const { return regs; }
+
+    // 64K of code and data shared by all the lanes. Not copied, it must
+    // outlive the engine.
+    void setMemory(const uint8_t *memory) { ram = memory; }
+
+    // Lanes reaching 'address' stop there, -1 to disable
+    void setStopAddress(int32_t address) { stopAddress = address; }
+
+    // Copy the main registers, PC, SP, MEMPTR, R, Q and HALT state from/to
+    // the scalar core. The T-state counter of the lane is cleared on load.
+    void loadLane(uint32_t lane, const Z80 &cpu);
+    void storeLane(uint32_t lane, Z80 &cpu) const;
+
+    // Run until no lane is running or 'maxSteps' steps, returns the steps
+    uint64_t run(uint64_t maxSteps = UINT64_MAX);
+
+    // Instructions executed, added over all the lanes. Divided by the
+    // steps it gives the mean number of lanes doing useful work.
+    uint64_t getLaneInstructions() const { return laneInstructions; }
+
+private:
+    uint32_t count;
+    const uint8_t *ram;
+    int32_t stopAddress;
+    uint64_t laneInstructions;
+    Lanes regs;
+    // 0xFF for the lanes executing the current step
+    std::vector<uint8_t> mask;
+    // Operand of the current instruction, for the memory and immediate forms
+    std::vector<uint8_t> operand;
+
+    uint8_t *reg8(uint32_t index);
+    bool step(uint16_t address);
+    bool stepCB(uint16_t address, uint8_t opCode);
+    void retire(uint16_t next, uint32_t tstates, uint32_t fetches, bool flags);
+    void retireFetch(uint32_t fetches, bool flags);
+    void addTstates(uint32_t tstates, uint32_t taken);
+    void fillOperand(uint8_t value);
+    void gatherOperand(const uint8_t *hi, const uint8_t *lo);
+    void copy(uint8_t *dst, const uint8_t *src);
+    void alu(uint32_t op, const uint8_t *src);
+    void incDec(uint8_t *dst, bool dec);
+    void accumulator(uint32_t op);
+    void shift(uint32_t op, uint8_t *dst);
+    void bit(uint32_t bit, const uint8_t *src);
+    void incDec16(uint32_t pair, bool dec);
+    void addHL(uint32_t pair);
+    void djnz(uint16_t address);
+    void jumpRelative(uint16_t address, uint32_t condition);
+    void jumpAbsolute(uint16_t address, uint32_t condition);
+};
+
+#endif // Z80LOCKSTEP_H
@@ -0,0 +1,73 @@
+#ifndef Z80MACHINE_H
+#define Z80MACHINE_H
+
+#include <cstdint>
+
+#include "z80machinebase.h"
+#include "z80memory.h"
+
+/*
+ * Handler for the writes to a range of guest addresses (video memory, ROM,
+ * memory mapped devices), registered with Z80Machine::setWriteHook().
+ */
+class Z80WriteHook {
+public:
+    virtual ~Z80WriteHook() = default;
+
+    // Called before the byte is stored, 'tstates' is the machine counter
+    // at the start of the write. Return false to drop the write (ROM).
+    virtual bool write(uint16_t address, uint8_t value, uint64_t tstates) = 0;
+};
+
+extern template class Z80MachineBase<Z80Memory>;
+
+/*
+ * A Z80 with 64K of RAM and the Z80sim timing of Z80MachineBase: 4
+ * T-states per opcode fetch, 3 per memory access and 4 per I/O access.
+ * Ports go to the devices mapped in getPorts(), the others read 0xFF and
+ * ignore writes. INT is never active.
+ *
+ * Subclasses add devices overriding the Z80operations methods (and
+ * reset(), to clear their own state) and end the run with stop():
+ *
+ *     uint8_t fetchOpcode(uint16_t address) override {
+ *         if (address == 0x0005) {
+ *             bdos();
+ *         }
+ *         return Z80Machine::fetchOpcode(address);
+ *     }
+ *
+ * Writes to a few ranges are better left to a Z80WriteHook than to a
+ * poke8() override: the hooks are kept in a table by RAM page, so the
+ * writes to every other page don't pay for them.
+ *
+ * With getCpu().setBlockIO(true), INIR/INDR/OTIR/OTDR bursts go to the
+ * port map in one call per device instead of one execute() per byte;
+ * memory still goes through peek8()/poke8(). Subclasses overriding
+ * inPort()/outPort() or raising INT must leave it off, or override
+ * inBlock()/outBlock() too.
+ */
+class Z80Machine : public Z80MachineBase<Z80Memory> {
+public:
+    Z80Machine();
+    ~Z80Machine() override;
+
+    // Send the writes to 'first'..'last' to 'hook' (not owned), nullptr
+    // removes it. A page has a single hook, the newest one covering it.
+    // load() and Z80Memory writes don't go through the hooks.
+    void setWriteHook(uint16_t first, uint16_t last, Z80WriteHook *hook);
+
+    void poke8(uint16_t address, uint8_t value) override;
+
+private:
+    // Hook of a page and the part of the page it covers
+    struct WriteHookEntry {
+        Z80WriteHook *hook;
+        uint16_t first;
+        uint16_t last;
+    };
+
+    WriteHookEntry writeHooks[Z80Memory::PAGES];
+};
+
+#endif // Z80MACHINE_H
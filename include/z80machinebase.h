@@ -0,0 +1,293 @@
+#ifndef Z80MACHINEBASE_H
+#define Z80MACHINEBASE_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "z80.h"
+#include "z80portmap.h"
+
+// Why Z80MachineBase::run() returned
+enum class Z80StopReason : uint8_t {
+    STOPPED,        // stop() was called
+    TSTATES,        // T-state limit reached
+    INSTRUCTIONS    // Instruction limit reached
+};
+
+/*
+ * The bus of Z80Machine and Z80ForkMachine, on any 'Memory' with
+ * read(address) and write(address, value): the Z80sim timing (4 T-states
+ * per opcode fetch, 3 per memory access, 4 per I/O access), the port map,
+ * the run loop and the INIR/INDR/OTIR/OTDR bursts. INT is never active.
+ *
+ * A burst moves all its bytes through the devices at once and reads or
+ * writes RAM before (OTIR/OTDR) or after (INIR/INDR) them, so a device
+ * that switches memory banks would see stale data. Bursts that reach a
+ * device whose changesMemory() is true run one iteration per execute().
+ */
+template <class Memory>
+class Z80MachineBase : public Z80operations {
+public:
+    using StopReason = Z80StopReason;
+
+    Z80MachineBase();
+    ~Z80MachineBase() override = default;
+
+    Z80 &getCpu() { return cpu; }
+    const Z80 &getCpu() const { return cpu; }
+    Memory &getMemory() { return memory; }
+    const Memory &getMemory() const { return memory; }
+    Z80PortMap &getPorts() { return ports; }
+
+    uint64_t getTstates() const { return tstates; }
+    // For restoring snapshots
+    void setTstates(uint64_t value) { tstates = value; }
+
+    // Reset the CPU and the T-state counter, the memory is left untouched
+    virtual void reset();
+
+    // End run() after the current instruction
+    void stop() { stopRequested = true; }
+
+    // Execute until stop(), or until 'maxTstates' T-states or
+    // 'maxInstructions' calls to Z80::execute() (0 = no limit).
+    // 'instructions' is increased with the executed ones.
+    StopReason run(uint64_t maxTstates, uint64_t maxInstructions, uint64_t &instructions);
+
+    uint8_t fetchOpcode(uint16_t address) override;
+    uint8_t peek8(uint16_t address) override;
+    void poke8(uint16_t address, uint8_t value) override;
+    uint16_t peek16(uint16_t address) override;
+    void poke16(uint16_t address, RegisterPair word) override;
+    uint8_t inPort(uint16_t port) override;
+    void outPort(uint16_t port, uint8_t value) override;
+    void addressOnBus(uint16_t address, int32_t wstates) override;
+    void interruptHandlingTime(int32_t wstates) override;
+    bool isActiveINT() override;
+    uint32_t inBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override;
+    uint32_t outBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override;
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+    uint8_t breakpoint(uint16_t address, uint8_t opcode) override;
+#endif
+
+#ifdef WITH_EXEC_DONE
+    void execDone(void) override;
+#endif
+
+#ifdef WITH_FLOW_NOTIFY
+    void flowNotify(Z80Flow event, uint16_t address) override;
+#endif
+
+protected:
+    uint64_t tstates;
+    bool stopRequested;
+    Memory memory;
+    Z80 cpu;
+    Z80PortMap ports;
+
+    // CPU state, T-states and memory of 'other'. The port map starts
+    // empty, the devices of 'other' aren't ours.
+    Z80MachineBase(const Z80MachineBase &other);
+
+private:
+    // T-states of an INIR/INDR/OTIR/OTDR iteration that repeats
+    static const uint32_t BLOCK_ITERATION_TSTATES = 21;
+
+    // Limits and count of the current run(), so block transfers stop
+    // where the iterations one by one would
+    uint64_t tstateLimit;
+    uint64_t instructionLimit;
+    uint64_t executed;
+
+    uint32_t blockSize(uint32_t size) const;
+};
+
+template <class Memory>
+Z80MachineBase<Memory>::Z80MachineBase() : tstates(0), stopRequested(false), cpu(this),
+    tstateLimit(UINT64_MAX), instructionLimit(UINT64_MAX), executed(0) {
+}
+
+template <class Memory>
+Z80MachineBase<Memory>::Z80MachineBase(const Z80MachineBase &other) :
+    Z80operations(), tstates(other.tstates), stopRequested(other.stopRequested),
+    memory(other.memory), cpu(this), tstateLimit(UINT64_MAX), instructionLimit(UINT64_MAX),
+    executed(0) {
+    Z80State state;
+    other.cpu.saveState(state);
+    cpu.loadState(state);
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::reset() {
+    cpu.reset();
+    tstates = 0;
+    stopRequested = false;
+}
+
+template <class Memory>
+Z80StopReason Z80MachineBase<Memory>::run(uint64_t maxTstates, uint64_t maxInstructions,
+        uint64_t &instructions) {
+    StopReason reason = StopReason::STOPPED;
+    tstateLimit = maxTstates != 0 ? maxTstates : UINT64_MAX;
+    instructionLimit = maxInstructions != 0 ? maxInstructions : UINT64_MAX;
+    executed = 0;
+
+    while (!stopRequested) {
+        if (tstates >= tstateLimit) {
+            reason = StopReason::TSTATES;
+            break;
+        }
+        if (executed >= instructionLimit) {
+            reason = StopReason::INSTRUCTIONS;
+            break;
+        }
+        cpu.execute();
+        executed++;
+    }
+
+    instructions += executed;
+    tstateLimit = instructionLimit = UINT64_MAX;
+    return reason;
+}
+
+template <class Memory>
+uint8_t Z80MachineBase<Memory>::fetchOpcode(uint16_t address) {
+    tstates += 4;
+    return memory.read(address);
+}
+
+template <class Memory>
+uint8_t Z80MachineBase<Memory>::peek8(uint16_t address) {
+    tstates += 3;
+    return memory.read(address);
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::poke8(uint16_t address, uint8_t value) {
+    tstates += 3;
+    memory.write(address, value);
+}
+
+template <class Memory>
+uint16_t Z80MachineBase<Memory>::peek16(uint16_t address) {
+    // Order matters, first read lsb, then read msb
+    uint8_t lsb = peek8(address);
+    uint8_t msb = peek8(address + 1);
+    return (msb << 8) | lsb;
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::poke16(uint16_t address, RegisterPair word) {
+    // Order matters, first write lsb, then write msb
+    poke8(address, word.byte8.lo);
+    poke8(address + 1, word.byte8.hi);
+}
+
+template <class Memory>
+uint8_t Z80MachineBase<Memory>::inPort(uint16_t port) {
+    uint8_t value = ports.in(port, tstates);
+    tstates += 4;
+    return value;
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::outPort(uint16_t port, uint8_t value) {
+    ports.out(port, value, tstates);
+    tstates += 4;
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::addressOnBus(uint16_t address, int32_t wstates) {
+    tstates += wstates;
+}
+
+template <class Memory>
+void Z80MachineBase<Memory>::interruptHandlingTime(int32_t wstates) {
+    tstates += wstates;
+}
+
+template <class Memory>
+bool Z80MachineBase<Memory>::isActiveINT() {
+    return false;
+}
+
+template <class Memory>
+uint32_t Z80MachineBase<Memory>::blockSize(uint32_t size) const {
+    // The opcode fetches of the first iteration are already counted, run()
+    // would start iteration i at 'start + i * 21' and as call 'executed + i'
+    uint64_t start = tstates - 8;
+    if (tstateLimit != UINT64_MAX) {
+        size = static_cast<uint32_t>(std::min<uint64_t>(size,
+                (tstateLimit - start - 1) / BLOCK_ITERATION_TSTATES + 1));
+    }
+    if (instructionLimit != UINT64_MAX) {
+        size = static_cast<uint32_t>(std::min<uint64_t>(size, instructionLimit - executed));
+    }
+    return size;
+}
+
+template <class Memory>
+uint32_t Z80MachineBase<Memory>::inBlock(uint16_t port, uint16_t address, int32_t step,
+        uint8_t *data, uint32_t size) {
+    // Per iteration: IR on the bus 1, IN 4, write 3, repeat 5, fetches 8
+    uint32_t count = blockSize(size);
+    if (ports.changesMemory(port, count)) {
+        return 0;
+    }
+    uint64_t start = tstates;
+    ports.inBlock(port, data, count, start + 1, BLOCK_ITERATION_TSTATES);
+    for (uint32_t idx = 0; idx < count; idx++) {
+        tstates = start + 5 + idx * BLOCK_ITERATION_TSTATES;
+        poke8(address, data[idx]);
+        address += step;
+    }
+    if (count != 0) {
+        tstates = start + count * BLOCK_ITERATION_TSTATES - 8;
+        executed += count - 1;
+    }
+    return count;
+}
+
+template <class Memory>
+uint32_t Z80MachineBase<Memory>::outBlock(uint16_t port, uint16_t address, int32_t step,
+        uint8_t *data, uint32_t size) {
+    // Per iteration: IR on the bus 1, read 3, OUT 4, repeat 5, fetches 8
+    uint32_t count = blockSize(size);
+    if (ports.changesMemory(port, count)) {
+        return 0;
+    }
+    uint64_t start = tstates;
+    for (uint32_t idx = 0; idx < count; idx++) {
+        tstates = start + 1 + idx * BLOCK_ITERATION_TSTATES;
+        data[idx] = peek8(address);
+        address += step;
+    }
+    ports.outBlock(port, data, count, start + 4, BLOCK_ITERATION_TSTATES);
+    if (count != 0) {
+        tstates = start + count * BLOCK_ITERATION_TSTATES - 8;
+        executed += count - 1;
+    }
+    return count;
+}
+
+#ifdef WITH_BREAKPOINT_SUPPORT
+template <class Memory>
+uint8_t Z80MachineBase<Memory>::breakpoint(uint16_t address, uint8_t opcode) {
+    return opcode;
+}
+#endif
+
+#ifdef WITH_EXEC_DONE
+template <class Memory>
+void Z80MachineBase<Memory>::execDone(void) {}
+#endif
+
+#ifdef WITH_FLOW_NOTIFY
+template <class Memory>
+void Z80MachineBase<Memory>::flowNotify(Z80Flow event, uint16_t address) {}
+#endif
+
+#endif // Z80MACHINEBASE_H
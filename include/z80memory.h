@@ -0,0 +1,63 @@
+#ifndef Z80MEMORY_H
+#define Z80MEMORY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "z80dirtymap.h"
+
+// Page size of the guest RAM, 1K by default (Z80CPP_PAGE_SHIFT in CMake)
+#ifndef Z80CPP_PAGE_SHIFT
+#define Z80CPP_PAGE_SHIFT 10
+#endif
+
+/*
+ * 64K of guest RAM, split in pages of PAGE_SIZE bytes for the tools that
+ * work page by page. The storage is a single block owned by the object, so
+ * a Z80Memory can be reused between runs without allocating.
+ *
+ * Every write marks its page in a dirty map. The map is meant for a single
+ * consumer (e.g. Z80Rewind), that clears it when it has seen it; others can
+ * keep their own DirtyMap and merge into it what they take from this one.
+ */
+class Z80Memory {
+public:
+    typedef Z80DirtyMap<Z80CPP_PAGE_SHIFT> DirtyMap;
+
+    static const uint32_t SIZE = 0x10000;
+    static const uint32_t PAGE_SHIFT = DirtyMap::PAGE_SHIFT;
+    static const uint32_t PAGE_SIZE = DirtyMap::PAGE_SIZE;
+    static const uint32_t PAGES = DirtyMap::PAGES;
+
+    Z80Memory() { clear(); }
+
+    uint8_t read(uint16_t address) const { return ram[address]; }
+    void write(uint16_t address, uint8_t value) {
+        ram[address] = value;
+        dirtyPages.mark(address);
+    }
+
+    // Fill the whole RAM with 'value'
+    void clear(uint8_t value = 0);
+
+    // Copy 'size' bytes at 'address', wrapping around 0xFFFF
+    void load(uint16_t address, const uint8_t *data, size_t size);
+
+    // Copy 'size' bytes from 'address', wrapping around 0xFFFF
+    void save(uint16_t address, uint8_t *data, size_t size) const;
+
+    // Raw 64K view, for side effect free inspection (samplers, debuggers)
+    const uint8_t *data() const { return ram; }
+    const uint8_t *page(uint32_t number) const { return &ram[number << PAGE_SHIFT]; }
+
+    // Pages written since the last clearDirtyPages() or takeDirtyPages()
+    const DirtyMap &getDirtyPages() const { return dirtyPages; }
+    DirtyMap takeDirtyPages() { return dirtyPages.take(); }
+    void clearDirtyPages() { dirtyPages.clear(); }
+
+private:
+    uint8_t ram[SIZE];
+    DirtyMap dirtyPages;
+};
+
+#endif // Z80MEMORY_H
@@ -3,6 +3,17 @@
 
 #include <cstdint>
 
+/* Control transfers notified through flowNotify */
+enum class Z80Flow : uint8_t {
+    CALL,   // CALL nn / CALL cc,nn taken
+    RST,    // RST p
+    RET,    // RET / RET cc taken
+    RETI,
+    RETN,
+    INT,    // Maskable interrupt accepted
+    NMI     // Non maskable interrupt accepted
+};
+
 class Z80operations {
 public:
     Z80operations() = default;
@@ -33,6 +44,22 @@ public:
     /* Callback to know when the INT signal is active */
     virtual bool isActiveINT() = 0;
 
+    /* Block transfers of INIR/INDR (inBlock) and OTIR/OTDR (outBlock),
+     * asked for when the CPU has setBlockIO(true). The bus does up to
+     * 'size' iterations that repeat the instruction at once and returns
+     * how many it did, 0 to go on one iteration per execute(). Iteration i
+     * moves data[i] between port 'port - i * 0x100' (B counts down) and
+     * address 'address + i * step', and the bus accounts its T-states and
+     * those of the opcode fetches of the next one as if they had run one
+     * by one. INT must not become active in between. With IFF1 set, the
+     * CPU calls isActiveINT() once more before asking, at the start of the
+     * first iteration, and goes one by one if INT is active; the
+     * iterations one by one don't make that call. */
+    virtual uint32_t inBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) { return 0; }
+    virtual uint32_t outBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) { return 0; }
+
 #ifdef WITH_BREAKPOINT_SUPPORT
     /* Callback for notify at PC address */
     virtual uint8_t breakpoint(uint16_t address, uint8_t opcode) = 0;
@@ -42,6 +69,12 @@ public:
     /* Callback to notify that one instruction has ended */
     virtual void execDone(void) = 0;
 #endif
+
+#ifdef WITH_FLOW_NOTIFY
+    /* Callback to notify a call, return or interrupt, once PC and SP
+     * hold their new values. 'address' is the new PC. */
+    virtual void flowNotify(Z80Flow event, uint16_t address) = 0;
+#endif
 };
 
 #endif // Z80OPERATIONS_H
@@ -0,0 +1,131 @@
+#ifndef Z80PORTMAP_H
+#define Z80PORTMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * A device on the I/O bus. 'tstates' is the machine counter at the start
+ * of the access.
+ */
+class Z80PortDevice {
+public:
+    virtual ~Z80PortDevice() = default;
+
+    virtual uint8_t in(uint16_t port, uint64_t tstates) { return 0xff; }
+    virtual void out(uint16_t port, uint8_t value, uint64_t tstates) {}
+
+    // Bursts of INIR/INDR/OTIR/OTDR, 'step' T-states apart: byte i goes
+    // to port 'port - i * 0x100', as B counts down. Devices that can move
+    // a block at once override them.
+    virtual void inBlock(uint16_t port, uint8_t *data, size_t size, uint64_t tstates,
+            uint32_t step);
+    virtual void outBlock(uint16_t port, const uint8_t *data, size_t size, uint64_t tstates,
+            uint32_t step);
+
+    // True if in() or out() can change the memory the CPU sees (bank
+    // switching). The block path of the machines moves all the bytes of a
+    // burst to or from RAM before or after the device calls, so bursts
+    // that reach such a device go one iteration at a time. Asked when the
+    // map is rebuilt, after map() or unmap().
+    virtual bool changesMemory() const { return false; }
+};
+
+/*
+ * Port decoding the way the hardware does it: a device answers every port
+ * with (port & mask) == value, so the Spectrum ULA is mask 0x0001, value
+ * 0x0000 (A0 low) and a fully decoded 8-bit port is mask 0x00FF.
+ *
+ * The rules are compiled into a 64K table of device sets, so an access is
+ * one table lookup and one call. When several devices decode the same
+ * port, all of them see the writes and the reads get the AND of their
+ * values, like an open collector bus. Unmapped ports read 'floating'.
+ */
+class Z80PortMap {
+public:
+    Z80PortMap();
+
+    // Not owned, must outlive the map. Later rules can overlap earlier ones.
+    void map(uint16_t mask, uint16_t value, Z80PortDevice *device);
+    void unmap(Z80PortDevice *device);
+    void clear();
+
+    // Value of the reads that no device answers, 0xFF by default
+    void setFloatingBus(uint8_t value) { floating = value; }
+
+    // Device answering 'port', the first one if there are several, or nullptr
+    Z80PortDevice *getDevice(uint16_t port);
+
+    uint8_t in(uint16_t port, uint64_t tstates) {
+        const DeviceSet &set = lookup(port);
+        if (set.count == 1) {
+            return devices[set.first]->in(port, tstates);
+        }
+        return set.count == 0 ? floating : inShared(set, port, tstates);
+    }
+
+    void out(uint16_t port, uint8_t value, uint64_t tstates) {
+        const DeviceSet &set = lookup(port);
+        for (uint32_t idx = set.first; idx < set.first + set.count; idx++) {
+            devices[idx]->out(port, value, tstates);
+        }
+    }
+
+    // True if some port of a burst of 'size' bytes from 'port' goes to a
+    // device that changesMemory()
+    bool changesMemory(uint16_t port, size_t size) {
+        if (!compiled) {
+            compile();
+        }
+        return paging && pagingBurst(port, size);
+    }
+
+    // Bursts as in Z80PortDevice, one call per device for every run of
+    // bytes whose ports are decoded by the same devices
+    void inBlock(uint16_t port, uint8_t *data, size_t size, uint64_t tstates, uint32_t step);
+    void outBlock(uint16_t port, const uint8_t *data, size_t size, uint64_t tstates,
+            uint32_t step);
+
+private:
+    struct Rule {
+        uint16_t mask;
+        uint16_t value;
+        Z80PortDevice *device;
+    };
+
+    // Devices of a set, devices[first] to devices[first + count - 1]
+    struct DeviceSet {
+        uint32_t first;
+        uint32_t count;
+        // Some device changesMemory()
+        bool paging;
+    };
+
+    std::vector<Rule> rules;
+    // Set 0 is the empty one
+    std::vector<DeviceSet> sets;
+    std::vector<Z80PortDevice *> devices;
+    // Set of every port. Built on the first access after a change, and
+    // only if some device is mapped.
+    std::vector<uint16_t> table;
+    bool compiled;
+    // Some set is paging
+    bool paging;
+    uint8_t floating;
+
+    const DeviceSet &lookup(uint16_t port) {
+        if (!compiled) {
+            compile();
+        }
+        return table.empty() ? sets[0] : sets[table[port]];
+    }
+
+    void compile();
+    // Bytes from 'first' on whose ports go to the same devices as its port
+    size_t sameSet(uint16_t port, size_t first, size_t size);
+    uint8_t inShared(const DeviceSet &set, uint16_t port, uint64_t tstates);
+    bool pagingBurst(uint16_t port, size_t size);
+};
+
+#endif // Z80PORTMAP_H
@@ -0,0 +1,90 @@
+#ifndef Z80PROFILER_H
+#define Z80PROFILER_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "z80.h"
+#include "z80labels.h"
+
+/*
+ * Guest call-graph profiler.
+ *
+ * Keeps a shadow stack of the guest calls fed from the flowNotify callback
+ * (library built with WITH_FLOW_NOTIFY) and accumulates inclusive and
+ * exclusive T-states for every call path.
+ *
+ * Frames are matched by the SP value left after pushing the return address,
+ * not by the return address itself. A frame is closed as soon as SP moves
+ * above it, so routines that drop their return address (POP + JP (HL),
+ * LD SP,nn, ...) are unwound at the next event instead of growing the
+ * shadow stack forever, and a RET used as a computed jump (PUSH nn / RET)
+ * doesn't close any frame.
+ */
+class Z80CallProfiler {
+public:
+    // Maximum shadow stack depth, deeper calls are not tracked
+    static const uint32_t MAX_DEPTH = 1024;
+
+    Z80CallProfiler();
+
+    // Clear all the data and open the root frame at 'tstates'
+    void reset(uint64_t tstates);
+
+    // Feed one flowNotify event. 'sp' is the SP after the event.
+    void onFlow(Z80Flow event, uint16_t address, uint16_t sp, uint64_t tstates);
+
+    // Close frames released by SP changes not notified as returns.
+    // Calling it from execDone gives exact attribution with stack tricks.
+    void sync(uint16_t sp, uint64_t tstates);
+
+    // Close every open frame at 'tstates'
+    void finish(uint64_t tstates);
+
+    // Symbols for the call targets, see Z80Labels::load
+    uint32_t loadLabels(std::istream &in) { return labels.load(in); }
+    void addLabel(uint16_t address, const std::string &name) { labels.add(address, name); }
+
+    // Folded stacks (flamegraph.pl input) with exclusive T-states
+    void writeFolded(std::ostream &out) const;
+
+    // One line per call path: calls, inclusive and exclusive T-states
+    void writeReport(std::ostream &out) const;
+
+    uint64_t getDroppedCalls() const { return droppedCalls; }
+
+private:
+    struct Node {
+        uint32_t parent;
+        uint16_t address;
+        Z80Flow kind;
+        uint64_t calls;
+        uint64_t inclusive;
+        uint64_t exclusive;
+    };
+
+    struct Frame {
+        uint32_t node;
+        uint16_t sp;
+        uint64_t entry;
+    };
+
+    std::vector<Node> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::vector<Frame> stack;
+    Z80Labels labels;
+    uint64_t lastTstates;
+    uint64_t droppedCalls;
+
+    void charge(uint64_t tstates);
+    void enter(Z80Flow kind, uint16_t address, uint16_t sp, uint64_t tstates);
+    void leave(uint64_t tstates);
+    std::string nodeName(const Node &node) const;
+    std::string pathOf(uint32_t node) const;
+};
+
+#endif // Z80PROFILER_H
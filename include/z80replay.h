@@ -0,0 +1,212 @@
+#ifndef Z80REPLAY_H
+#define Z80REPLAY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "z80machine.h"
+
+/*
+ * Append-only log of the inputs that make a run nondeterministic: values
+ * read from ports, changes of the INT line and NMIs, each one with the
+ * T-state it happened at.
+ *
+ * Events are encoded as a tag byte, the T-states since the previous event
+ * as a LEB128 number and the payload (port and value for IN, the port is
+ * left out when it's the same as in the previous IN). A port read usually
+ * takes 3 or 4 bytes.
+ */
+class Z80InputLog {
+public:
+    enum class Kind : uint8_t {
+        IN,     // 'port' read 'value'
+        INT,    // INT line changed to 'value' (0 or 1)
+        NMI
+    };
+
+    struct Event {
+        Kind kind;
+        uint64_t tstates;
+        uint16_t port;
+        uint8_t value;
+    };
+
+    // Read position, for any number of readers
+    struct Reader {
+        size_t pos = 0;
+        uint64_t tstates = 0;
+        uint16_t port = 0;
+    };
+
+    Z80InputLog() { clear(); }
+
+    void append(const Event &event);
+
+    // Next event for 'reader', false at the end of the log
+    bool next(Reader &reader, Event &event) const;
+
+    void clear();
+    size_t getSize() const { return bytes.size(); }
+    uint64_t getEventCount() const { return events; }
+
+    // Versioned file image, load() returns false if it isn't valid
+    void save(std::ostream &out) const;
+    bool load(std::istream &in);
+
+private:
+    std::vector<uint8_t> bytes;
+    uint64_t events;
+    uint64_t lastTstates;
+    uint16_t lastPort;
+};
+
+/*
+ * Records the inputs of a machine (Z80Machine or a subclass with the same
+ * getTstates()/getCpu() interface) while it runs with its real devices:
+ *
+ *     Z80Recorder<MyMachine> machine;
+ *     ...
+ *     machine.triggerNMI();   // instead of getCpu().triggerNMI()
+ *
+ * NMIs must be raised through triggerNMI() and between instructions.
+ */
+template <class Machine>
+class Z80Recorder : public Machine {
+public:
+    template <typename... Args>
+    explicit Z80Recorder(Args &&... args) :
+        Machine(std::forward<Args>(args)...), intLevel(false) {
+    }
+
+    Z80InputLog &getLog() { return log; }
+
+    void reset() override {
+        Machine::reset();
+        intLevel = false;
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        uint8_t value = Machine::inPort(port);
+        log.append({ Z80InputLog::Kind::IN, this->getTstates(), port, value });
+        return value;
+    }
+
+    bool isActiveINT() override {
+        bool level = Machine::isActiveINT();
+        if (level != intLevel) {
+            intLevel = level;
+            log.append({ Z80InputLog::Kind::INT, this->getTstates(), 0, level ? uint8_t(1) : uint8_t(0) });
+        }
+        return level;
+    }
+
+    // The log is kept per access, block transfers go byte by byte
+    uint32_t inBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override { return 0; }
+    uint32_t outBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override { return 0; }
+
+    void triggerNMI() {
+        log.append({ Z80InputLog::Kind::NMI, this->getTstates(), 0, 0 });
+        this->getCpu().triggerNMI();
+    }
+
+private:
+    Z80InputLog log;
+    bool intLevel;
+};
+
+/*
+ * Feeds a recorded log back. The machine should have the timing of the
+ * recorded one but no devices: Machine::inPort() is still called, for its
+ * timing, but the value returned is the logged one.
+ *
+ * Every event has to come at the same T-state it was recorded at. When
+ * one doesn't the run has diverged (different code, memory or timing);
+ * the rest of the log is ignored and isDiverged() returns true.
+ */
+template <class Machine>
+class Z80Replayer : public Machine {
+public:
+    template <typename... Args>
+    // The log isn't copied, it must outlive the machine
+    explicit Z80Replayer(const Z80InputLog &log, Args &&... args) :
+        Machine(std::forward<Args>(args)...), log(log) {
+        rewind();
+    }
+
+    // Start again from the first event
+    void rewind() {
+        reader = Z80InputLog::Reader();
+        pending = log.next(reader, event);
+        intLevel = false;
+        diverged = false;
+    }
+
+    bool isDiverged() const { return diverged; }
+
+    // True when every event has been replayed
+    bool isFinished() const { return !pending; }
+
+    uint8_t fetchOpcode(uint16_t address) override {
+        if (pending && event.kind == Z80InputLog::Kind::NMI) {
+            if (event.tstates == this->getTstates()) {
+                this->getCpu().triggerNMI();
+                advance();
+            } else if (event.tstates < this->getTstates()) {
+                diverge();
+            }
+        }
+        return Machine::fetchOpcode(address);
+    }
+
+    uint8_t inPort(uint16_t port) override {
+        uint8_t value = Machine::inPort(port);
+        if (pending && event.kind == Z80InputLog::Kind::IN
+                && event.tstates == this->getTstates() && event.port == port) {
+            value = event.value;
+            advance();
+        } else {
+            diverge();
+        }
+        return value;
+    }
+
+    bool isActiveINT() override {
+        if (pending && event.kind == Z80InputLog::Kind::INT) {
+            if (event.tstates == this->getTstates()) {
+                intLevel = event.value != 0;
+                advance();
+            } else if (event.tstates < this->getTstates()) {
+                diverge();
+            }
+        }
+        return intLevel;
+    }
+
+    uint32_t inBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override { return 0; }
+    uint32_t outBlock(uint16_t port, uint16_t address, int32_t step, uint8_t *data,
+            uint32_t size) override { return 0; }
+
+private:
+    const Z80InputLog &log;
+    Z80InputLog::Reader reader;
+    Z80InputLog::Event event;
+    bool pending;
+    bool intLevel;
+    bool diverged;
+
+    void advance() { pending = log.next(reader, event); }
+
+    void diverge() {
+        diverged = true;
+        pending = false;
+    }
+};
+
+#endif // Z80REPLAY_H
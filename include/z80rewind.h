@@ -0,0 +1,88 @@
+#ifndef Z80REWIND_H
+#define Z80REWIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "z80machine.h"
+
+/*
+ * Rewind buffer for a Z80Machine.
+ *
+ * Every capture() stores the CPU state, the T-state counter and the RAM
+ * pages written since the previous capture, as the XOR with their previous
+ * contents compressed with RLE. Its cost depends on the dirty pages, not
+ * on the whole 64K. Every 'keyframeInterval' captures the whole RAM is
+ * stored too, so a snapshot can be rebuilt forward from the nearest full
+ * one or backward from the newest one, whichever is closer.
+ *
+ * The oldest snapshots are dropped when the buffer grows past its budget.
+ * Restoring a snapshot drops the ones after it, the run continues from
+ * there as a new timeline.
+ *
+ * The buffer uses the dirty page map of the machine memory, nothing else
+ * may clear it. Devices of the machine subclasses aren't captured; to
+ * re-execute to the same state they must be deterministic or restored by
+ * the host along with the snapshot.
+ */
+class Z80Rewind {
+public:
+    Z80Rewind(Z80Machine &machine, size_t budget = 16 << 20, uint32_t keyframeInterval = 64);
+
+    // Take a snapshot of the machine as it is now
+    void capture();
+
+    uint32_t getSnapshotCount() const { return static_cast<uint32_t>(snapshots.size()); }
+    // 'index' must be below getSnapshotCount()
+    uint64_t getSnapshotTstates(uint32_t index) const { return snapshots[index].tstates; }
+
+    // Bytes used by the stored snapshots
+    size_t getMemoryUsed() const { return used; }
+
+    // Put the machine back to snapshot 'index', 0 is the oldest. Returns
+    // false, leaving the machine untouched, if there isn't such a snapshot.
+    bool restore(uint32_t index);
+
+    // Restore the newest snapshot at or before 'tstates' and run the machine
+    // until it gets there, ending on the first instruction boundary at or
+    // after it. Returns false if it's older than every snapshot, or if the
+    // machine is stopped before getting there.
+    bool seek(uint64_t tstates);
+
+    // Drop all the snapshots
+    void clear();
+
+private:
+    struct Snapshot {
+        Z80State cpu;
+        uint64_t tstates;
+        // Pages in 'delta'
+        Z80Memory::DirtyMap pages;
+        // XOR of every page in 'pages' with its contents at the previous
+        // snapshot, RLE encoded one after another
+        std::vector<uint8_t> delta;
+        // Whole RAM RLE encoded, only in keyframes
+        std::vector<uint8_t> full;
+    };
+
+    Z80Machine &machine;
+    size_t budget;
+    uint32_t keyframeInterval;
+    uint32_t sinceKeyframe;
+    size_t used;
+    std::deque<Snapshot> snapshots;
+    // RAM at the newest snapshot
+    std::vector<uint8_t> shadow;
+    // Scratch for rebuilding RAM
+    std::vector<uint8_t> work;
+
+    static size_t sizeOf(const Snapshot &snapshot);
+    static void encode(const uint8_t *xorData, size_t size, std::vector<uint8_t> &out);
+    static const uint8_t *decodeXor(const uint8_t *in, uint8_t *data, size_t size);
+    static void applyDelta(const Snapshot &snapshot, uint8_t *ram);
+    void trim();
+};
+
+#endif // Z80REWIND_H
@@ -0,0 +1,78 @@
+#ifndef Z80SAMPLER_H
+#define Z80SAMPLER_H
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "z80.h"
+
+/*
+ * Statistical sampling profiler driven by the host T-state counter.
+ *
+ * The host run loop compares its T-state counter against the next
+ * deadline after every instruction and only calls sample() when it's due:
+ *
+ *     while (!finish) {
+ *         cpu.execute();
+ *         if (tstates >= sampler.getDeadline()) {
+ *             sampler.sample(cpu, ram, tstates);
+ *         }
+ *     }
+ *
+ * Samples go to a buffer allocated at construction and are folded into the
+ * hot address/caller counters only when it fills up or on flush().
+ */
+class Z80Sampler {
+public:
+    // Stack words recorded with every sample
+    static const uint32_t STACK_WORDS = 4;
+
+    struct Sample {
+        uint64_t tstates;
+        uint16_t pc;
+        uint16_t sp;
+        uint16_t stack[STACK_WORDS];
+        // First stack word that looks like a return address
+        // (follows a CALL or RST), 0xFF if none
+        uint8_t caller;
+    };
+
+    explicit Z80Sampler(uint32_t period = 10000, uint32_t capacity = 65536);
+
+    // Clear all the data and schedule the first sample
+    void start(uint64_t tstates);
+
+    uint64_t getDeadline() const { return deadline; }
+
+    // Record one sample. 'memory' is the 64K view of the guest address
+    // space, read without side effects.
+    void sample(const Z80 &cpu, const uint8_t *memory, uint64_t tstates);
+
+    // Fold the pending samples into the aggregated counters
+    void flush();
+
+    const std::vector<Sample> &getPendingSamples() const { return buffer; }
+    uint64_t getTotalSamples() const { return totalSamples; }
+
+    // "samples,percent,address" sorted by samples, 'limit' lines at most
+    void writeHotAddresses(std::ostream &out, uint32_t limit = 50);
+
+    // Same for the return addresses found in the stack
+    void writeHotCallers(std::ostream &out, uint32_t limit = 50);
+
+private:
+    uint32_t period;
+    uint32_t capacity;
+    uint64_t deadline;
+    uint64_t totalSamples;
+    std::vector<Sample> buffer;
+    std::unordered_map<uint16_t, uint64_t> hotAddresses;
+    std::unordered_map<uint16_t, uint64_t> hotCallers;
+
+    void writeHot(std::ostream &out, const std::unordered_map<uint16_t, uint64_t> &hot,
+            uint32_t limit);
+};
+
+#endif // Z80SAMPLER_H
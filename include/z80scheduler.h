@@ -0,0 +1,174 @@
+#ifndef Z80SCHEDULER_H
+#define Z80SCHEDULER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "z80machine.h"
+
+/*
+ * Resource shared by the CPUs of a Z80Scheduler.
+ *
+ * During a quantum every CPU works on its own view: its writes are
+ * buffered and the other CPUs only see them after the scheduler calls
+ * commit() at the end of the quantum, with all the CPUs stopped. The
+ * writes are committed in CPU order, and in program order for each CPU.
+ * So the results depend on the quantum, but not on the order the CPUs
+ * run inside it or on whether they run on separate threads.
+ *
+ * The guarantee is that a CPU never sees a write of another CPU in the
+ * quantum the write was made, and always sees it from the first
+ * instruction of the next quantum on. A CPU polling for another one sees
+ * its answer up to a quantum late, so guests that expect a faster
+ * handshake need a shorter quantum.
+ *
+ * The resources aren't Z80operations: each machine puts them on its bus by
+ * overriding peek8()/poke8() or inPort()/outPort() of Z80Machine, with its
+ * CPU index (see example/z80dual.cpp).
+ */
+class Z80SharedResource {
+public:
+    virtual ~Z80SharedResource() = default;
+
+    virtual void commit() = 0;
+};
+
+/*
+ * Shared RAM. Reads return the contents at the start of the quantum plus
+ * the writes of the same CPU.
+ */
+class Z80SharedMemory : public Z80SharedResource {
+public:
+    Z80SharedMemory(uint32_t size, uint32_t cpus);
+
+    uint32_t getSize() const { return static_cast<uint32_t>(committed.size()); }
+
+    uint8_t read(uint32_t cpu, uint32_t offset) const {
+        const View &view = views[cpu];
+        return view.written[offset] ? view.overlay[offset] : committed[offset];
+    }
+
+    void write(uint32_t cpu, uint32_t offset, uint8_t value);
+
+    // Committed contents, stable while the CPUs are stopped
+    const uint8_t *data() const { return committed.data(); }
+
+    void commit() override;
+
+private:
+    struct Write {
+        uint32_t offset;
+        uint8_t value;
+    };
+
+    struct View {
+        std::vector<uint8_t> overlay;
+        std::vector<bool> written;
+        std::vector<Write> log;
+    };
+
+    std::vector<uint8_t> committed;
+    std::vector<View> views;
+};
+
+/*
+ * One way FIFO of bytes from one CPU to another, like the sound latch of
+ * many arcade boards. Bytes sent during a quantum are received from the
+ * next one on.
+ */
+class Z80Mailbox : public Z80SharedResource {
+public:
+    // Sender side
+    void send(uint8_t value) { outbox.push_back(value); }
+
+    // Receiver side
+    bool available() const { return !inbox.empty(); }
+
+    // Next byte, or 'empty' when there isn't any
+    uint8_t receive(uint8_t empty = 0xff);
+
+    void commit() override;
+
+private:
+    std::vector<uint8_t> outbox;
+    std::deque<uint8_t> inbox;
+};
+
+/*
+ * Runs several machines in quanta of T-states. Every quantum each machine
+ * runs until its own T-state counter reaches the end of the quantum (the
+ * overshoot of the last instruction is kept), then the shared resources
+ * are committed. Machines can run one after another on the calling thread
+ * or each one on its own thread, with the same results.
+ *
+ * Each machine may have its own clock. Time is counted in T-states of the
+ * reference clock, the T-states of the first machine by default.
+ */
+class Z80Scheduler {
+public:
+    explicit Z80Scheduler(uint32_t quantum = 1000);
+    ~Z80Scheduler();
+
+    Z80Scheduler(const Z80Scheduler &) = delete;
+    Z80Scheduler &operator=(const Z80Scheduler &) = delete;
+
+    // Returns the CPU index of the machine, used with the shared resources.
+    // 'clockHz' is relative to 'referenceHz', 0 for the reference clock.
+    uint32_t addMachine(std::unique_ptr<Z80Machine> machine, uint32_t clockHz = 0);
+
+    // Not owned, must outlive the scheduler
+    void addResource(Z80SharedResource &resource) { resources.push_back(&resource); }
+
+    Z80Machine &getMachine(uint32_t index) { return *machines[index].machine; }
+    uint32_t getMachineCount() const { return static_cast<uint32_t>(machines.size()); }
+
+    // Calls to Z80::execute() of the machine under the scheduler
+    uint64_t getInstructions(uint32_t index) const { return machines[index].instructions; }
+
+    void setQuantum(uint32_t tstates) { quantum = tstates != 0 ? tstates : 1; }
+    void setReferenceClock(uint32_t hz) { referenceHz = hz; }
+
+    // One thread per machine. Can't change while running.
+    void setThreaded(bool state);
+
+    // Reference T-states elapsed, always at a quantum boundary
+    uint64_t getTime() const { return time; }
+
+    // Run for at least 'tstates' reference T-states, in whole quanta
+    void run(uint64_t tstates);
+
+private:
+    struct Core {
+        std::unique_ptr<Z80Machine> machine;
+        uint32_t clockHz;
+        uint64_t instructions;
+    };
+
+    uint32_t quantum;
+    uint32_t referenceHz;
+    uint64_t time;
+    std::vector<Core> machines;
+    std::vector<Z80SharedResource *> resources;
+
+    // Thread pool, workers[idx] runs machines[idx]
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable startQuantum;
+    std::condition_variable endQuantum;
+    uint64_t generation;
+    uint64_t quantumEnd;
+    uint32_t running;
+    bool shutdown;
+
+    uint64_t deadline(const Core &core, uint64_t end) const;
+    void runCore(uint32_t index, uint64_t end);
+    void workerLoop(uint32_t index, uint64_t seen);
+    void stopThreads();
+};
+
+#endif // Z80SCHEDULER_H
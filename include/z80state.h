@@ -0,0 +1,129 @@
+#ifndef Z80STATE_H
+#define Z80STATE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Union allowing a register pair to be accessed as bytes or as a word */
+typedef union {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    struct {
+        uint8_t hi, lo;
+    } byte8;
+#else
+    struct {
+        uint8_t lo, hi;
+    } byte8;
+#endif
+    uint16_t word;
+} RegisterPair;
+
+/*
+ * Complete state of a Z80 between two calls to Z80::execute(), including
+ * the internal flip-flops that have no getter (Q, pending prefix, bit 7 of
+ * R as written). It's a POD: Z80::saveState() and Z80::loadState() copy it
+ * in one go, and it can be copied around with memcpy.
+ *
+ * The in-memory layout depends on the compiler and the host. serialize()
+ * writes a fixed, versioned little-endian image for files and the network.
+ */
+struct Z80State {
+    // Modos de interrupción
+    enum IntMode : uint8_t {
+        IM0, IM1, IM2
+    };
+
+    // Bytes written by serialize()
+    static const uint32_t SERIALIZED_SIZE = 40;
+    static const uint16_t VERSION = 1;
+
+    // Acumulador y resto de registros de 8 bits
+    uint8_t regA;
+    // Flags sIGN, zERO, 5, hALFCARRY, 3, pARITY y ADDSUB (n)
+    uint8_t sz5h3pnFlags;
+    // El flag Carry es el único que se trata aparte
+    bool carryFlag;
+    // Registros principales y alternativos
+    RegisterPair regBC, regBCx, regDE, regDEx, regHL, regHLx;
+    /* Flags para indicar la modificación del registro F en la instrucción actual
+     * y en la anterior.
+     * Son necesarios para emular el comportamiento de los bits 3 y 5 del
+     * registro F con las instrucciones CCF/SCF.
+     *
+     * http://www.worldofspectrum.org/forums/showthread.php?t=41834
+     * http://www.worldofspectrum.org/forums/showthread.php?t=41704
+     *
+     * Thanks to Patrik Rak for his tests and investigations.
+     */
+    bool flagQ, lastFlagQ;
+
+    // Acumulador alternativo y flags -- 8 bits
+    RegisterPair regAFx;
+
+    // Registros de propósito específico
+    // *PC -- Program Counter -- 16 bits*
+    RegisterPair regPC;
+    // *IX -- Registro de índice -- 16 bits*
+    RegisterPair regIX;
+    // *IY -- Registro de índice -- 16 bits*
+    RegisterPair regIY;
+    // *SP -- Stack Pointer -- 16 bits*
+    RegisterPair regSP;
+    // *I -- Vector de interrupción -- 8 bits*
+    uint8_t regI;
+    // *R -- Refresco de memoria -- 7 bits*
+    uint8_t regR;
+    // *R7 -- Refresco de memoria -- 1 bit* (bit superior de R)
+    bool regRbit7;
+    //Flip-flops de interrupción
+    bool ffIFF1;
+    bool ffIFF2;
+    // EI solo habilita las interrupciones DESPUES de ejecutar la
+    // siguiente instrucción (excepto si la siguiente instrucción es un EI...)
+    bool pendingEI;
+    // Estado de la línea NMI
+    bool activeNMI;
+    // Modo de interrupción
+    IntMode modeINT;
+    // halted == true cuando la CPU está ejecutando un HALT (28/03/2010)
+    bool halted;
+    // pinReset == true, se ha producido un reset a través de la patilla
+    bool pinReset;
+    /*
+     * Registro interno que usa la CPU de la siguiente forma
+     *
+     * ADD HL,xx      = Valor del registro H antes de la suma
+     * LD r,(IX/IY+d) = Byte superior de la suma de IX/IY+d
+     * JR d           = Byte superior de la dirección de destino del salto
+     *
+     * 04/12/2008     No se vayan todavía, aún hay más. Con lo que se ha
+     *                implementado hasta ahora parece que funciona. El resto de
+     *                la historia está contada en:
+     *                http://zx.pk.ru/attachment.php?attachmentid=2989
+     *
+     * 25/09/2009     Se ha completado la emulación de MEMPTR. A señalar que
+     *                no se puede comprobar si MEMPTR se ha emulado bien hasta
+     *                que no se emula el comportamiento del registro en las
+     *                instrucciones CPI y CPD. Sin ello, todos los tests de
+     *                z80tests.tap fallarán aunque se haya emulado bien al
+     *                registro en TODAS las otras instrucciones.
+     *                Shit yourself, little parrot.
+     */
+
+    RegisterPair memptr;
+    // Se está ejecutando una instrucción prefijada con DD, ED o FD
+    // Los valores permitidos son [0x00, 0xDD, 0xED, 0xFD]
+    // El prefijo 0xCB queda al margen porque, detrás de 0xCB, siempre
+    // viene un código de instrucción válido, tanto si delante va un
+    // 0xDD o 0xFD como si no.
+    uint8_t prefixOpcode;
+
+    // Write SERIALIZED_SIZE bytes to 'buffer'
+    void serialize(uint8_t *buffer) const;
+
+    // Read an image written by serialize(), of this or an older version.
+    // Returns false, leaving the state untouched, if it isn't valid.
+    bool deserialize(const uint8_t *buffer, size_t size);
+};
+
+#endif // Z80STATE_H
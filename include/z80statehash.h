@@ -0,0 +1,89 @@
+#ifndef Z80STATEHASH_H
+#define Z80STATEHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "z80machine.h"
+
+/*
+ * 64-bit hash of a whole machine: CPU state plus 64K of RAM.
+ *
+ * Every RAM page keeps its own hash and the RAM hash combines them, so
+ * only the pages written since the previous call are hashed again: the
+ * cost of a hash is O(dirty pages). The T-state counter isn't part of the
+ * state, and R counts only for its 7 bit counter and bit 7, like the CPU.
+ *
+ * hash(machine) consumes the dirty page map of the machine memory (it
+ * clears it, like Z80Rewind). When something else owns the map, the host
+ * passes the dirty pages to update() and calls combine() instead.
+ */
+class Z80StateHash {
+public:
+    Z80StateHash();
+
+    // Hash of the CPU and RAM of 'machine' as they are now
+    uint64_t hash(Z80Machine &machine);
+
+    // Rehash the pages in 'dirtyPages' (all of them on the first call or
+    // after invalidate())
+    void update(const Z80Memory &memory, const Z80Memory::DirtyMap &dirtyPages);
+
+    // Hash of the CPU state with the RAM of the last update()
+    uint64_t combine(const Z80 &cpu) const;
+
+    uint64_t getMemoryHash() const { return memoryHash; }
+
+    // Every page is hashed again on the next update
+    void invalidate() { valid = false; }
+
+    // Pages hashed so far, for statistics
+    uint64_t getPagesHashed() const { return pagesHashed; }
+
+    static uint64_t hashCpu(const Z80 &cpu);
+    static uint64_t hashBytes(const uint8_t *data, size_t size, uint64_t seed);
+
+private:
+    uint64_t pageHash[Z80Memory::PAGES];
+    uint64_t memoryHash;
+    uint64_t pagesHashed;
+    bool valid;
+};
+
+/*
+ * Detects a machine in an infinite loop: the same state hash seen twice.
+ *
+ * The states must be sampled where the rest of the run depends only on the
+ * state, e.g. every N instructions (run() with an instruction limit and no
+ * T-state limit) and with deterministic devices, whose state the host adds
+ * to the hash. A slice of T-states ends after a variable overshoot that
+ * isn't part of the state.
+ *
+ * The loop is found on its first repeated sample, so the period must fit
+ * in 'capacity' samples; when full, the table is cleared and the loop is
+ * found again a period later.
+ */
+class Z80LoopDetector {
+public:
+    explicit Z80LoopDetector(size_t capacity = 1 << 20);
+
+    // Record the hash of sample 'time' (T-states, instructions...). True
+    // if that state was already seen: the machine loops forever.
+    bool check(uint64_t hash, uint64_t time);
+
+    // Time of the first sample of the loop and its length, after check()
+    // returned true
+    uint64_t getLoopStart() const { return loopStart; }
+    uint64_t getLoopPeriod() const { return loopPeriod; }
+
+    void clear();
+
+private:
+    size_t capacity;
+    std::unordered_map<uint64_t, uint64_t> seen;
+    uint64_t loopStart;
+    uint64_t loopPeriod;
+};
+
+#endif // Z80STATEHASH_H
@@ -0,0 +1,38 @@
+#ifndef Z80STATS_H
+#define Z80STATS_H
+
+#include <cstdint>
+#include <ostream>
+
+/*
+ * Opcode execution histograms, one per decode table of the core.
+ * Filled by the Z80 class when the library is built with WITH_OPCODE_STATS.
+ *
+ * main   -> decodeOpcode (unprefixed opcodes, prefix bytes included)
+ * cb     -> decodeCB     (CB xx)
+ * ddfd   -> decodeDDFD   (DD xx / FD xx)
+ * ddfdcb -> decodeDDFDCB (DD CB d xx / FD CB d xx)
+ * ed     -> decodeED     (ED xx)
+ *
+ * An opcode that follows a DD/FD prefix without using IX/IY is counted in
+ * ddfd AND in main, because the core executes it through decodeOpcode.
+ */
+struct Z80OpcodeStats {
+    uint64_t main[256];
+    uint64_t cb[256];
+    uint64_t ddfd[256];
+    uint64_t ddfdcb[256];
+    uint64_t ed[256];
+    // DD/FD prefix followed by another DD, ED or FD (the first one is ignored)
+    uint64_t redundantPrefixes;
+    // DD/FD prefix followed by an opcode that doesn't involve IX/IY
+    uint64_t ddfdFallbacks;
+};
+
+// Export as CSV: one "table,opcode,count" row per non-zero counter
+void writeOpcodeStatsCSV(const Z80OpcodeStats &stats, std::ostream &out);
+
+// Export as JSON: one 256 entries array per table plus prefix counters
+void writeOpcodeStatsJSON(const Z80OpcodeStats &stats, std::ostream &out);
+
+#endif // Z80STATS_H
@@ -0,0 +1,120 @@
+#ifndef Z80TRACE_H
+#define Z80TRACE_H
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "z80.h"
+#include "z80labels.h"
+
+/*
+ * Timeline recorder of guest activity in Chrome trace-event JSON, loadable
+ * by chrome://tracing and the Perfetto UI:
+ *
+ *  - interrupt service routines, from INT/NMI acceptance to RETI/RETN
+ *    (or to the RET that releases its stack frame)
+ *  - routine spans for calls to labelled addresses (or every call)
+ *  - HALT idle periods
+ *  - port I/O bursts: accesses to the same port and direction closer
+ *    than the burst gap are merged in a single span
+ *
+ * Events are stored in a buffer allocated at construction, so recording
+ * never touches the output stream. The host writes them with flush(),
+ * periodically or at the end of the run, and finishes with close().
+ */
+class Z80TraceRecorder {
+public:
+    explicit Z80TraceRecorder(uint32_t capacity = 1 << 20);
+
+    // Guest clock used to turn T-states into microseconds (3.5 MHz)
+    void setClockHz(uint32_t hz) { clockHz = hz; }
+
+    // Merge I/O accesses closer than 'tstates' (1000 by default)
+    void setBurstGap(uint32_t tstates) { burstGap = tstates; }
+
+    // Open a span for every call, not only for the labelled ones
+    void setTraceAllCalls(bool state) { traceAllCalls = state; }
+
+    uint32_t loadLabels(std::istream &in) { return labels.load(in); }
+    void addLabel(uint16_t address, const std::string &name) { labels.add(address, name); }
+
+    // Feed one flowNotify event. 'sp' is the SP after the event.
+    void onFlow(Z80Flow event, uint16_t address, uint16_t sp, uint64_t tstates);
+
+    // Call after every instruction, or whenever the HALT state may change
+    void onHalt(bool halted, uint64_t tstates) {
+        if (halted != inHalt) {
+            haltChange(halted, tstates);
+        }
+    }
+
+    // Call from inPort/outPort
+    void onPortIO(uint16_t port, bool output, uint64_t tstates);
+
+    // Buffer at 80% or more, time to flush
+    bool needsFlush() const { return events.size() >= capacity - capacity / 5; }
+
+    // Events lost because the buffer was full
+    uint64_t getDroppedEvents() const { return droppedEvents; }
+
+    // Write the buffered events and empty the buffer
+    void flush(std::ostream &out);
+
+    // Close all open spans at 'tstates', flush and end the JSON document
+    void close(std::ostream &out, uint64_t tstates);
+
+private:
+    enum Track : uint8_t {
+        TRACK_CPU = 1, TRACK_HALT, TRACK_IO
+    };
+
+    enum Kind : uint8_t {
+        KIND_CALL, KIND_INT, KIND_NMI, KIND_HALT, KIND_IN, KIND_OUT
+    };
+
+    struct Event {
+        uint64_t tstates;
+        uint64_t duration;      // Only for complete ('X') events
+        uint32_t count;         // I/O accesses in the burst
+        uint16_t address;       // Routine, vector or port
+        char phase;             // 'B', 'E' or 'X'
+        Kind kind;
+    };
+
+    struct Frame {
+        uint16_t sp;
+        bool span;              // A 'B' event was recorded for it
+        Kind kind;
+        uint16_t address;
+    };
+
+    struct Burst {
+        uint64_t start;
+        uint64_t last;
+        uint32_t count;
+        uint16_t port;
+        Kind kind;
+    };
+
+    uint32_t capacity;
+    uint32_t clockHz;
+    uint32_t burstGap;
+    bool traceAllCalls;
+    bool inHalt;
+    bool started;
+    uint64_t haltStart;
+    uint64_t droppedEvents;
+    std::vector<Event> events;
+    std::vector<Frame> stack;
+    Burst burst;
+    Z80Labels labels;
+
+    void record(const Event &event);
+    void sync(uint16_t sp, uint64_t tstates);
+    void haltChange(bool halted, uint64_t tstates);
+    void closeBurst();
+    void writeEvent(std::ostream &out, const Event &event);
+};
+
+#endif // Z80TRACE_H
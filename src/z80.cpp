@@ -5,42 +5,59 @@
 //... v1.0.0 (13/02/2017)
 //    quick & dirty conversion by dddddd (AKA deesix)
 
+#include <cstring>
+
 #include "z80.h"
 
 // Constructor de la clase
-Z80::Z80(Z80operations *ops) {
+Z80::Z80(Z80operations *ops) : Z80State() {
 
-    bool evenBits;
+    // Las tablas son iguales en todas las instancias: se calculan una sola
+    // vez y se copian, así crear una CPU (forks, lotes) es barato.
+    struct FlagTables {
+        uint8_t sz53n_add[256], sz53pn_add[256], sz53n_sub[256], sz53pn_sub[256];
+    };
 
-    for (uint32_t idx = 0; idx < 256; idx++) {
+    static const FlagTables tables = [] {
+        FlagTables t {};
+        bool evenBits;
 
-        if (idx > 0x7f) {
-            sz53n_addTable[idx] |= SIGN_MASK;
-        }
+        for (uint32_t idx = 0; idx < 256; idx++) {
 
-        evenBits = true;
-        for (uint8_t mask = 0x01; mask != 0; mask <<= 1) {
-            if ((idx & mask) != 0) {
-                evenBits = !evenBits;
+            if (idx > 0x7f) {
+                t.sz53n_add[idx] |= SIGN_MASK;
+            }
+
+            evenBits = true;
+            for (uint8_t mask = 0x01; mask != 0; mask <<= 1) {
+                if ((idx & mask) != 0) {
+                    evenBits = !evenBits;
+                }
             }
-        }
 
-        sz53n_addTable[idx] |= (idx & FLAG_53_MASK);
-        sz53n_subTable[idx] = sz53n_addTable[idx] | ADDSUB_MASK;
+            t.sz53n_add[idx] |= (idx & FLAG_53_MASK);
+            t.sz53n_sub[idx] = t.sz53n_add[idx] | ADDSUB_MASK;
 
-        if (evenBits) {
-            sz53pn_addTable[idx] = sz53n_addTable[idx] | PARITY_MASK;
-            sz53pn_subTable[idx] = sz53n_subTable[idx] | PARITY_MASK;
-        } else {
-            sz53pn_addTable[idx] = sz53n_addTable[idx];
-            sz53pn_subTable[idx] = sz53n_subTable[idx];
+            if (evenBits) {
+                t.sz53pn_add[idx] = t.sz53n_add[idx] | PARITY_MASK;
+                t.sz53pn_sub[idx] = t.sz53n_sub[idx] | PARITY_MASK;
+            } else {
+                t.sz53pn_add[idx] = t.sz53n_add[idx];
+                t.sz53pn_sub[idx] = t.sz53n_sub[idx];
+            }
         }
-    }
 
-    sz53n_addTable[0] |= ZERO_MASK;
-    sz53pn_addTable[0] |= ZERO_MASK;
-    sz53n_subTable[0] |= ZERO_MASK;
-    sz53pn_subTable[0] |= ZERO_MASK;
+        t.sz53n_add[0] |= ZERO_MASK;
+        t.sz53pn_add[0] |= ZERO_MASK;
+        t.sz53n_sub[0] |= ZERO_MASK;
+        t.sz53pn_sub[0] |= ZERO_MASK;
+        return t;
+    }();
+
+    memcpy(sz53n_addTable, tables.sz53n_add, sizeof(sz53n_addTable));
+    memcpy(sz53pn_addTable, tables.sz53pn_add, sizeof(sz53pn_addTable));
+    memcpy(sz53n_subTable, tables.sz53n_sub, sizeof(sz53n_subTable));
+    memcpy(sz53pn_subTable, tables.sz53pn_sub, sizeof(sz53pn_subTable));
 
     Z80opsImpl = ops;
     execDone = false;
@@ -664,23 +681,14 @@ void Z80::cpd() {
     flagQ = true;
 }
 
-// INI
-void Z80::ini() {
-    REG_WZ = REG_BC;
-    Z80opsImpl->addressOnBus(getPairIR().word, 1);
-    uint8_t work8 = Z80opsImpl->inPort(REG_WZ++);
-    Z80opsImpl->poke8(REG_HL, work8);
-
-    REG_B--;
-    REG_HL++;
-
+void Z80::inxFlags(uint8_t work8, uint8_t port) {
     sz5h3pnFlags = sz53pn_addTable[REG_B];
     if (work8 > 0x7f) {
         sz5h3pnFlags |= ADDSUB_MASK;
     }
 
     carryFlag = false;
-    uint16_t tmp = work8 + ((REG_C + 1) & 0xff);
+    uint16_t tmp = work8 + port;
     if (tmp > 0xff) {
         sz5h3pnFlags |= HALFCARRY_MASK;
         carryFlag = true;
@@ -695,37 +703,52 @@ void Z80::ini() {
     flagQ = true;
 }
 
-// IND
-void Z80::ind() {
-    REG_WZ = REG_BC;
-    Z80opsImpl->addressOnBus(getPairIR().word, 1);
-    uint8_t work8 = Z80opsImpl->inPort(REG_WZ--);
-    Z80opsImpl->poke8(REG_HL, work8);
-
-    REG_B--;
-    REG_HL--;
-
-    sz5h3pnFlags = sz53pn_addTable[REG_B];
+void Z80::outxFlags(uint8_t work8) {
+    carryFlag = false;
     if (work8 > 0x7f) {
-        sz5h3pnFlags |= ADDSUB_MASK;
+        sz5h3pnFlags = sz53n_subTable[REG_B];
+    } else {
+        sz5h3pnFlags = sz53n_addTable[REG_B];
     }
 
-    carryFlag = false;
-    uint16_t tmp = work8 + ((REG_C - 1) & 0xff);
-    if (tmp > 0xff) {
+    if ((REG_L + work8) > 0xff) {
         sz5h3pnFlags |= HALFCARRY_MASK;
         carryFlag = true;
     }
 
-    if ((sz53pn_addTable[((tmp & 0x07) ^ REG_B)]
+    if ((sz53pn_addTable[(((REG_L + work8) & 0x07) ^ REG_B)]
             & PARITY_MASK) == PARITY_MASK) {
         sz5h3pnFlags |= PARITY_MASK;
-    } else {
-        sz5h3pnFlags &= ~PARITY_MASK;
     }
     flagQ = true;
 }
 
+// INI
+void Z80::ini() {
+    REG_WZ = REG_BC;
+    Z80opsImpl->addressOnBus(getPairIR().word, 1);
+    uint8_t work8 = Z80opsImpl->inPort(REG_WZ++);
+    Z80opsImpl->poke8(REG_HL, work8);
+
+    REG_B--;
+    REG_HL++;
+
+    inxFlags(work8, REG_C + 1);
+}
+
+// IND
+void Z80::ind() {
+    REG_WZ = REG_BC;
+    Z80opsImpl->addressOnBus(getPairIR().word, 1);
+    uint8_t work8 = Z80opsImpl->inPort(REG_WZ--);
+    Z80opsImpl->poke8(REG_HL, work8);
+
+    REG_B--;
+    REG_HL--;
+
+    inxFlags(work8, REG_C - 1);
+}
+
 // OUTI
 void Z80::outi() {
 
@@ -739,23 +762,7 @@ void Z80::outi() {
 
     REG_HL++;
 
-    carryFlag = false;
-    if (work8 > 0x7f) {
-        sz5h3pnFlags = sz53n_subTable[REG_B];
-    } else {
-        sz5h3pnFlags = sz53n_addTable[REG_B];
-    }
-
-    if ((REG_L + work8) > 0xff) {
-        sz5h3pnFlags |= HALFCARRY_MASK;
-        carryFlag = true;
-    }
-
-    if ((sz53pn_addTable[(((REG_L + work8) & 0x07) ^ REG_B)]
-            & PARITY_MASK) == PARITY_MASK) {
-        sz5h3pnFlags |= PARITY_MASK;
-    }
-    flagQ = true;
+    outxFlags(work8);
 }
 
 // OUTD
@@ -771,23 +778,7 @@ void Z80::outd() {
 
     REG_HL--;
 
-    carryFlag = false;
-    if (work8 > 0x7f) {
-        sz5h3pnFlags = sz53n_subTable[REG_B];
-    } else {
-        sz5h3pnFlags = sz53n_addTable[REG_B];
-    }
-
-    if ((REG_L + work8) > 0xff) {
-        sz5h3pnFlags |= HALFCARRY_MASK;
-        carryFlag = true;
-    }
-
-    if ((sz53pn_addTable[(((REG_L + work8) & 0x07) ^ REG_B)]
-            & PARITY_MASK) == PARITY_MASK) {
-        sz5h3pnFlags |= PARITY_MASK;
-    }
-    flagQ = true;
+    outxFlags(work8);
 }
 
 // Pone a 1 el Flag Z si el bit b del registro
@@ -849,6 +840,7 @@ void Z80::interrupt() {
         REG_PC = 0x0038;
     }
     REG_WZ = REG_PC;
+    notifyFlow(Z80Flow::INT, REG_PC);
 }
 
 //Interrupción NMI, no utilizado por ahora
@@ -868,6 +860,7 @@ void Z80::nmi() {
     ffIFF1 = false;
     push(REG_PC); // 3+3 t-estados + contended si procede
     REG_PC = REG_WZ = 0x0066;
+    notifyFlow(Z80Flow::NMI, REG_PC);
 }
 
 void Z80::execute() {
@@ -937,6 +930,9 @@ void Z80::execute() {
 }
 
 void Z80::decodeOpcode(uint8_t opCode) {
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.main[opCode]++;
+#endif
 
     switch (opCode) {
         case 0x00:
@@ -1053,8 +1049,10 @@ void Z80::decodeOpcode(uint8_t opCode) {
             if (--REG_B != 0) {
                 Z80opsImpl->addressOnBus(REG_PC, 5);
                 REG_PC = REG_WZ = REG_PC + offset + 1;
+                coverEdge(REG_PC);
             } else {
                 REG_PC++;
+                coverEdge(REG_PC);
             }
             break;
         }
@@ -1111,6 +1109,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             auto offset = static_cast<int8_t>(Z80opsImpl->peek8(REG_PC));
             Z80opsImpl->addressOnBus(REG_PC, 5);
             REG_PC = REG_WZ = REG_PC + offset + 1;
+            coverEdge(REG_PC);
             break;
         }
         case 0x19:
@@ -1168,6 +1167,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 REG_WZ = REG_PC + 1;
             }
             REG_PC++;
+            coverEdge(REG_PC);
             break;
         }
         case 0x21:
@@ -1220,6 +1220,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 REG_WZ = REG_PC + 1;
             }
             REG_PC++;
+            coverEdge(REG_PC);
             break;
         }
         case 0x29:
@@ -1275,6 +1276,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 REG_WZ = REG_PC + 1;
             }
             REG_PC++;
+            coverEdge(REG_PC);
             break;
         }
         case 0x31:
@@ -1336,6 +1338,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 REG_WZ = REG_PC + 1;
             }
             REG_PC++;
+            coverEdge(REG_PC);
             break;
         }
         case 0x39:
@@ -2016,6 +2019,9 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if ((sz5h3pnFlags & ZERO_MASK) == 0) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         }
@@ -2029,14 +2035,17 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if ((sz5h3pnFlags & ZERO_MASK) == 0) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xC3:
         { /* JP nn */
             REG_WZ = REG_PC = Z80opsImpl->peek16(REG_PC);
+            coverEdge(REG_PC);
             break;
         }
         case 0xC4:
@@ -2046,9 +2055,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xC5:
@@ -2068,6 +2079,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x00;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         }
         case 0xC8:
@@ -2075,12 +2087,16 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if ((sz5h3pnFlags & ZERO_MASK) != 0) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         }
         case 0xC9:
         { /* RET */
             REG_PC = REG_WZ = pop();
+            notifyFlow(Z80Flow::RET, REG_PC);
             break;
         }
         case 0xCA:
@@ -2088,9 +2104,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if ((sz5h3pnFlags & ZERO_MASK) != 0) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xCB:
@@ -2105,9 +2123,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xCD:
@@ -2116,6 +2136,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(REG_PC + 1, 1);
             push(REG_PC + 2);
             REG_PC = REG_WZ;
+            notifyFlow(Z80Flow::CALL, REG_PC);
             break;
         }
         case 0xCE:
@@ -2129,6 +2150,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x08;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         }
         case 0xD0:
@@ -2136,6 +2158,9 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if (!carryFlag) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         }
@@ -2149,9 +2174,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if (!carryFlag) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xD3:
@@ -2170,9 +2197,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xD5:
@@ -2192,6 +2221,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x10;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         }
         case 0xD8:
@@ -2199,6 +2229,9 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if (carryFlag) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         }
@@ -2223,9 +2256,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if (carryFlag) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xDB:
@@ -2245,9 +2280,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         }
         case 0xDD:
@@ -2268,12 +2305,16 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x18;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         }
         case 0xE0: /* RET PO */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if ((sz5h3pnFlags & PARITY_MASK) == 0) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         case 0xE1: /* POP HL */
@@ -2283,9 +2324,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if ((sz5h3pnFlags & PARITY_MASK) == 0) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xE3:
         { /* EX (SP),HL */
@@ -2306,9 +2349,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xE5: /* PUSH HL */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
@@ -2322,23 +2367,30 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x20;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         case 0xE8: /* RET PE */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if ((sz5h3pnFlags & PARITY_MASK) != 0) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         case 0xE9: /* JP (HL) */
             REG_PC = REG_HL;
+            coverEdge(REG_PC);
             break;
         case 0xEA: /* JP PE,nn */
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if ((sz5h3pnFlags & PARITY_MASK) != 0) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xEB:
         { /* EX DE,HL */
@@ -2353,9 +2405,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xED: /*Subconjunto de instrucciones*/
             opCode = Z80opsImpl->fetchOpcode(REG_PC++);
@@ -2370,11 +2424,15 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x28;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         case 0xF0: /* RET P */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if (sz5h3pnFlags < SIGN_MASK) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         case 0xF1: /* POP AF */
@@ -2384,9 +2442,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if (sz5h3pnFlags < SIGN_MASK) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xF3: /* DI */
             ffIFF1 = ffIFF2 = false;
@@ -2397,9 +2457,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xF5: /* PUSH AF */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
@@ -2413,11 +2475,15 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x30;
+            notifyFlow(Z80Flow::RST, REG_PC);
             break;
         case 0xF8: /* RET M */
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             if (sz5h3pnFlags > 0x7f) {
                 REG_PC = REG_WZ = pop();
+                notifyFlow(Z80Flow::RET, REG_PC);
+            } else {
+                coverEdge(REG_PC);
             }
             break;
         case 0xF9: /* LD SP,HL */
@@ -2428,9 +2494,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
             REG_WZ = Z80opsImpl->peek16(REG_PC);
             if (sz5h3pnFlags > 0x7f) {
                 REG_PC = REG_WZ;
+                coverEdge(REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xFB: /* EI */
             ffIFF1 = ffIFF2 = true;
@@ -2442,9 +2510,11 @@ void Z80::decodeOpcode(uint8_t opCode) {
                 Z80opsImpl->addressOnBus(REG_PC + 1, 1);
                 push(REG_PC + 2);
                 REG_PC = REG_WZ;
+                notifyFlow(Z80Flow::CALL, REG_PC);
                 break;
             }
             REG_PC = REG_PC + 2;
+            coverEdge(REG_PC);
             break;
         case 0xFD: /* Subconjunto de instrucciones */
             opCode = Z80opsImpl->fetchOpcode(REG_PC++);
@@ -2459,6 +2529,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
             Z80opsImpl->addressOnBus(getPairIR().word, 1);
             push(REG_PC);
             REG_PC = REG_WZ = 0x38;
+            notifyFlow(Z80Flow::RST, REG_PC);
     } /* del switch( codigo ) */
 }
 
@@ -2467,6 +2538,9 @@ void Z80::decodeOpcode(uint8_t opCode) {
 void Z80::decodeCB() {
     uint8_t opCode = Z80opsImpl->fetchOpcode(REG_PC++);
     regR++;
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.cb[opCode]++;
+#endif
 
     switch (opCode) {
         case 0x00:
@@ -3843,6 +3917,9 @@ void Z80::decodeCB() {
  * interrupciones entre cada prefijo.
  */
 void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.ddfd[opCode]++;
+#endif
     switch (opCode) {
         case 0x09:
         { /* ADD IX,BC */
@@ -4349,6 +4426,9 @@ void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
             break;
         }
         case 0xDD:
+#ifdef WITH_OPCODE_STATS
+            opcodeStats.redundantPrefixes++;
+#endif
             prefixOpcode = 0xDD;
             break;
         case 0xE1:
@@ -4379,10 +4459,14 @@ void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
         case 0xE9:
         { /* JP (IX) */
             REG_PC = regIXY.word;
+            coverEdge(REG_PC);
             break;
         }
         case 0xED:
         {
+#ifdef WITH_OPCODE_STATS
+            opcodeStats.redundantPrefixes++;
+#endif
             prefixOpcode = 0xED;
             break;
         }
@@ -4394,6 +4478,9 @@ void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
         }
         case 0xFD:
         {
+#ifdef WITH_OPCODE_STATS
+            opcodeStats.redundantPrefixes++;
+#endif
             prefixOpcode = 0xFD;
             break;
         }
@@ -4404,6 +4491,9 @@ void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
             // IX o IY. Se trata como si fuera un código normal.
             // Sin esto, además de emular mal, falla el test
             // ld <bcdexya>,<bcdexya> de ZEXALL.
+#ifdef WITH_OPCODE_STATS
+            opcodeStats.ddfdFallbacks++;
+#endif
 #ifdef WITH_BREAKPOINT_SUPPORT
             if (breakpointEnabled && prefixOpcode == 0) {
                 opCode = Z80opsImpl->breakpoint(REG_PC, opCode);
@@ -4417,6 +4507,9 @@ void Z80::decodeDDFD(uint8_t opCode, RegisterPair& regIXY) {
 
 // Subconjunto de instrucciones 0xDDCB
 void Z80::decodeDDFDCB(uint8_t opCode, uint16_t address) {
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.ddfdcb[opCode]++;
+#endif
 
     switch (opCode) {
         case 0x00: /* RLC (IX+d),B */
@@ -4913,6 +5006,9 @@ void Z80::decodeDDFDCB(uint8_t opCode, uint16_t address) {
 //Subconjunto de instrucciones 0xED
 
 void Z80::decodeED(uint8_t opCode) {
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.ed[opCode]++;
+#endif
     switch (opCode) {
         case 0x40:
         { /* IN B,(C) */
@@ -4970,6 +5066,7 @@ void Z80::decodeED(uint8_t opCode) {
         { /* RETN */
             ffIFF1 = ffIFF2;
             REG_PC = REG_WZ = pop();
+            notifyFlow(opCode == 0x4D ? Z80Flow::RETI : Z80Flow::RETN, REG_PC);
             break;
         }
         case 0x46:
@@ -5308,6 +5405,7 @@ void Z80::decodeED(uint8_t opCode) {
             ldi();
             if (REG_BC != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_DE - 1, 5);
                 sz5h3pnFlags &= ~FLAG_53_MASK;
@@ -5321,6 +5419,7 @@ void Z80::decodeED(uint8_t opCode) {
             if ((sz5h3pnFlags & PARITY_MASK) == PARITY_MASK
                     && (sz5h3pnFlags & ZERO_MASK) == 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_HL - 1, 5);
                 sz5h3pnFlags &= ~FLAG_53_MASK;
@@ -5330,9 +5429,13 @@ void Z80::decodeED(uint8_t opCode) {
         }
         case 0xB2:
         { /* INIR */
+            if (blockIO && blockTransfer(opCode, true, 1)) {
+                break;
+            }
             ini();
             if (REG_B != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_HL - 1, 5);
                 adjustINxROUTxRFlags();
@@ -5341,9 +5444,13 @@ void Z80::decodeED(uint8_t opCode) {
         }
         case 0xB3:
         { /* OTIR */
+            if (blockIO && blockTransfer(opCode, false, 1)) {
+                break;
+            }
             outi();
             if (REG_B != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_BC, 5);
                 adjustINxROUTxRFlags();
@@ -5355,6 +5462,7 @@ void Z80::decodeED(uint8_t opCode) {
             ldd();
             if (REG_BC != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_DE + 1, 5);
                 sz5h3pnFlags &= ~FLAG_53_MASK;
@@ -5368,6 +5476,7 @@ void Z80::decodeED(uint8_t opCode) {
             if ((sz5h3pnFlags & PARITY_MASK) == PARITY_MASK
                     && (sz5h3pnFlags & ZERO_MASK) == 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_HL + 1, 5);
                 sz5h3pnFlags &= ~FLAG_53_MASK;
@@ -5377,9 +5486,13 @@ void Z80::decodeED(uint8_t opCode) {
         }
         case 0xBA:
         { /* INDR */
+            if (blockIO && blockTransfer(opCode, true, -1)) {
+                break;
+            }
             ind();
             if (REG_B != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_HL + 1, 5);
                 adjustINxROUTxRFlags();
@@ -5388,9 +5501,13 @@ void Z80::decodeED(uint8_t opCode) {
         }
         case 0xBB:
         { /* OTDR */
+            if (blockIO && blockTransfer(opCode, false, -1)) {
+                break;
+            }
             outd();
             if (REG_B != 0) {
                 REG_PC = REG_PC - 2;
+                coverEdge(REG_PC);
                 REG_WZ = REG_PC + 1;
                 Z80opsImpl->addressOnBus(REG_BC, 5);
                 adjustINxROUTxRFlags();
@@ -5465,4 +5582,63 @@ void Z80::adjustINxROUTxRFlags()
         sz5h3pnFlags |= PARITY_MASK;
     else
         sz5h3pnFlags &= ~PARITY_MASK;
-}
\ No newline at end of file
+}
+
+// El bus hace de una vez las iteraciones que repiten la instrucción y el
+// estado queda como tras la última de ellas
+// The bus does the iterations that repeat the instruction at once, the
+// state is left as after the last one of them
+bool Z80::blockTransfer(uint8_t opCode, bool input, int32_t step)
+{
+    // With B = 0 there are 256 iterations, the last one never repeats
+    uint32_t size = static_cast<uint8_t>(REG_B - 1);
+    if (size == 0 || activeNMI)
+        return false;
+#ifdef WITH_BREAKPOINT_SUPPORT
+    if (breakpointEnabled)
+        return false;
+#endif
+#ifdef WITH_EXEC_DONE
+    if (execDone)
+        return false;
+#endif
+    // Muestreo adicional de INT, ver Z80operations::inBlock
+    // An extra sampling of INT, see Z80operations::inBlock
+    if (ffIFF1 && Z80opsImpl->isActiveINT())
+        return false;
+
+    uint8_t data[255];
+    uint32_t count;
+    if (input) {
+        count = Z80opsImpl->inBlock(REG_BC, REG_HL, step, data, size);
+    } else {
+        // OUTI/OUTD decrement B before the write
+        count = Z80opsImpl->outBlock(REG_BC - 0x100, REG_HL, step, data, size);
+    }
+    if (count == 0)
+        return false;
+
+    // Two opcode fetches for every iteration after the first one
+    regR += 2 * (count - 1);
+    REG_B -= count;
+    REG_HL += step * static_cast<int32_t>(count);
+    if (input) {
+        inxFlags(data[count - 1], REG_C + step);
+    } else {
+        outxFlags(data[count - 1]);
+    }
+
+    REG_PC = REG_PC - 2;
+    REG_WZ = REG_PC + 1;
+    adjustINxROUTxRFlags();
+#ifdef WITH_EDGE_COVERAGE
+    for (uint32_t idx = 0; idx < count; idx++) {
+        coverEdge(REG_PC);
+    }
+#endif
+#ifdef WITH_OPCODE_STATS
+    opcodeStats.main[0xED] += count - 1;
+    opcodeStats.ed[opCode] += count - 1;
+#endif
+    return true;
+}
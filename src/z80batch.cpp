@@ -0,0 +1,140 @@
+#include <algorithm>
+
+#include "z80batch.h"
+
+Z80BatchRunner::Z80BatchRunner(MachineFactory factory, uint32_t threads) :
+    factory(std::move(factory)), nextWorker(0), queued(0), unfinished(0), shutdown(false) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers.reserve(threads);
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        workers.emplace_back(new Worker());
+        Worker &worker = *workers.back();
+        worker.machine = this->factory ? this->factory()
+                : std::unique_ptr<Z80Machine>(new Z80Machine());
+    }
+
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        workers[idx]->thread = std::thread(&Z80BatchRunner::workerLoop, this, idx);
+    }
+}
+
+Z80BatchRunner::~Z80BatchRunner() {
+    wait();
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        shutdown = true;
+    }
+    workAvailable.notify_all();
+
+    for (auto &worker : workers) {
+        worker->thread.join();
+    }
+}
+
+std::future<Z80BatchResult> Z80BatchRunner::submit(Z80BatchJob job) {
+    Task task { std::move(job), std::promise<Z80BatchResult>() };
+    std::future<Z80BatchResult> future = task.promise.get_future();
+
+    unfinished++;
+    // Counted before queueing, no thread can take a task not counted yet.
+    // Under the lock, an idle thread can't miss it between its check and
+    // its wait.
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        queued++;
+    }
+
+    Worker &worker = *workers[nextWorker++ % workers.size()];
+    {
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.queue.push_back(std::move(task));
+    }
+    workAvailable.notify_one();
+    return future;
+}
+
+void Z80BatchRunner::wait() {
+    std::unique_lock<std::mutex> guard(doneLock);
+    allDone.wait(guard, [this] { return unfinished == 0; });
+}
+
+bool Z80BatchRunner::take(uint32_t self, Task &task) {
+    uint32_t count = static_cast<uint32_t>(workers.size());
+    for (uint32_t idx = 0; idx < count; idx++) {
+        Worker &victim = *workers[(self + idx) % count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.queue.empty()) {
+            continue;
+        }
+
+        if (idx == 0) {
+            task = std::move(victim.queue.front());
+            victim.queue.pop_front();
+        } else {
+            task = std::move(victim.queue.back());
+            victim.queue.pop_back();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void Z80BatchRunner::execute(Z80Machine &machine, Task &task) {
+    const Z80BatchJob &job = task.job;
+    try {
+        Z80Memory &memory = machine.getMemory();
+        memory.clear();
+        if (job.image) {
+            memory.load(job.loadAddress, job.image->data(), job.image->size());
+        }
+
+        machine.reset();
+        machine.getCpu().setRegPC(job.entry);
+        machine.getCpu().setRegSP(job.sp);
+        if (job.setup) {
+            job.setup(machine);
+        }
+
+        Z80BatchResult result;
+        result.id = job.id;
+        result.instructions = 0;
+        result.reason = machine.run(job.maxTstates, job.maxInstructions, result.instructions);
+        result.tstates = machine.getTstates();
+        result.pc = machine.getCpu().getRegPC();
+
+        if (job.onComplete) {
+            job.onComplete(result, machine);
+        }
+        task.promise.set_value(result);
+    } catch (...) {
+        task.promise.set_exception(std::current_exception());
+    }
+}
+
+void Z80BatchRunner::workerLoop(uint32_t self) {
+    Z80Machine &machine = *workers[self]->machine;
+    Task task;
+
+    while (true) {
+        if (take(self, task)) {
+            execute(machine, task);
+            task = Task();
+
+            if (--unfinished == 0) {
+                std::lock_guard<std::mutex> guard(doneLock);
+                allDone.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(idleLock);
+        workAvailable.wait(guard, [this] { return queued != 0 || shutdown; });
+        if (shutdown && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <thread>
+
+#include "z80eventqueue.h"
+
+Z80EventQueue::Z80EventQueue(uint32_t capacity) : tail(0), headCopy(0), head(0), tailCopy(0) {
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring.resize(size);
+    mask = size - 1;
+}
+
+size_t Z80EventQueue::push(const Z80PortEvent *events, size_t count) {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    if (position - headCopy + count > ring.size()) {
+        headCopy = head.load(std::memory_order_acquire);
+    }
+    count = std::min<size_t>(count, ring.size() - (position - headCopy));
+    for (size_t idx = 0; idx < count; idx++) {
+        ring[(position + idx) & mask] = events[idx];
+    }
+    tail.store(position + count, std::memory_order_release);
+    return count;
+}
+
+size_t Z80EventQueue::pop(Z80PortEvent *events, size_t max) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if (tailCopy - position < max) {
+        tailCopy = tail.load(std::memory_order_acquire);
+    }
+    size_t count = std::min<size_t>(max, tailCopy - position);
+    for (size_t idx = 0; idx < count; idx++) {
+        events[idx] = ring[(position + idx) & mask];
+    }
+    head.store(position + count, std::memory_order_release);
+    return count;
+}
+
+Z80QueuedPort::Z80QueuedPort(Z80EventQueue &queue, bool dropWhenFull) :
+    queue(queue), dropWhenFull(dropWhenFull), stalls(0), dropped(0) {
+}
+
+void Z80QueuedPort::outBlock(uint16_t port, const uint8_t *data, size_t size,
+        uint64_t tstates, uint32_t step) {
+    // Sent in chunks, one publication for each
+    const size_t CHUNK = 64;
+    Z80PortEvent events[CHUNK];
+    for (size_t first = 0; first < size; first += CHUNK) {
+        size_t count = std::min(CHUNK, size - first);
+        for (size_t idx = 0; idx < count; idx++) {
+            events[idx] = { tstates + (first + idx) * step,
+                    static_cast<uint16_t>(port - (first + idx) * 0x100), data[first + idx] };
+        }
+        size_t queued = queue.push(events, count);
+        for (size_t idx = queued; idx < count; idx++) {
+            out(events[idx].port, events[idx].value, events[idx].tstates);
+        }
+    }
+}
+
+void Z80QueuedPort::full(const Z80PortEvent &event) {
+    stalls++;
+    if (dropWhenFull) {
+        dropped++;
+        return;
+    }
+    while (!queue.push(event)) {
+        std::this_thread::yield();
+    }
+}
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "z80forkmachine.h"
+
+namespace {
+
+// Ids of the memories, 0 owns the zeroed page only
+std::atomic<uint64_t> nextOwner(1);
+
+}
+
+Z80PagedMemory::Z80PagedMemory() : owner(nextOwner++), copiedPages(0) {
+    static const std::shared_ptr<Page> zeroPage = std::make_shared<Page>(Page {});
+    for (uint32_t idx = 0; idx < PAGES; idx++) {
+        pages[idx] = zeroPage;
+        readMap[idx] = zeroPage->data;
+        writeMap[idx] = nullptr;
+    }
+    dirtyPages.markAll();
+}
+
+Z80PagedMemory::Z80PagedMemory(const Z80PagedMemory &other) {
+    share(other);
+}
+
+Z80PagedMemory &Z80PagedMemory::operator=(const Z80PagedMemory &other) {
+    if (this != &other) {
+        share(other);
+    }
+    return *this;
+}
+
+void Z80PagedMemory::share(const Z80PagedMemory &other) {
+    for (uint32_t idx = 0; idx < PAGES; idx++) {
+        pages[idx] = other.pages[idx];
+        readMap[idx] = other.readMap[idx];
+        writeMap[idx] = nullptr;
+        other.writeMap[idx] = nullptr;
+    }
+    // Neither side owns the pages any more
+    owner = nextOwner++;
+    other.owner = nextOwner++;
+    copiedPages = 0;
+    dirtyPages = other.dirtyPages;
+}
+
+uint8_t *Z80PagedMemory::unshare(uint32_t number) {
+    std::shared_ptr<Page> &page = pages[number];
+    if (page->owner != owner) {
+        std::shared_ptr<Page> copy = std::make_shared<Page>(*page);
+        copy->owner = owner;
+        page = copy;
+        readMap[number] = page->data;
+        copiedPages++;
+    }
+    writeMap[number] = page->data;
+    return page->data;
+}
+
+void Z80PagedMemory::load(uint16_t address, const uint8_t *data, size_t size) {
+    while (size != 0) {
+        uint32_t offset = address & (PAGE_SIZE - 1);
+        size_t chunk = std::min(size, static_cast<size_t>(PAGE_SIZE - offset));
+        uint8_t *page = writeMap[address >> PAGE_SHIFT];
+        if (page == nullptr) {
+            page = unshare(address >> PAGE_SHIFT);
+        }
+        memcpy(&page[offset], data, chunk);
+        dirtyPages.markRange(address, chunk);
+        data += chunk;
+        size -= chunk;
+        address = static_cast<uint16_t>(address + chunk);
+    }
+}
+
+void Z80PagedMemory::save(uint16_t address, uint8_t *data, size_t size) const {
+    while (size != 0) {
+        uint32_t offset = address & (PAGE_SIZE - 1);
+        size_t chunk = std::min(size, static_cast<size_t>(PAGE_SIZE - offset));
+        memcpy(data, &readMap[address >> PAGE_SHIFT][offset], chunk);
+        data += chunk;
+        size -= chunk;
+        address = static_cast<uint16_t>(address + chunk);
+    }
+}
+
+template class Z80MachineBase<Z80PagedMemory>;
+
+Z80ForkMachine::Z80ForkMachine() = default;
+
+Z80ForkMachine::Z80ForkMachine(const Z80ForkMachine &other) : Z80MachineBase(other) {
+}
+
+Z80ForkMachine::~Z80ForkMachine() = default;
+
+std::unique_ptr<Z80ForkMachine> Z80ForkMachine::fork() {
+    return std::unique_ptr<Z80ForkMachine>(new Z80ForkMachine(*this));
+}
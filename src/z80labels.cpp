@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#include "z80labels.h"
+
+namespace {
+
+// Accepts 1234, 0x1234, $1234 and 1234h
+bool parseAddress(const std::string &text, uint16_t &address) {
+    std::string digits = text;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        digits = digits.substr(2);
+    } else if (digits.size() > 1 && digits[0] == '$') {
+        digits = digits.substr(1);
+    } else if (digits.size() > 1 && (digits.back() == 'h' || digits.back() == 'H')) {
+        digits.pop_back();
+    }
+
+    if (digits.empty() || digits.size() > 4) {
+        return false;
+    }
+
+    char *end;
+    unsigned long value = std::strtoul(digits.c_str(), &end, 16);
+    if (*end != '\0') {
+        return false;
+    }
+    address = static_cast<uint16_t>(value);
+    return true;
+}
+
+}
+
+uint32_t Z80Labels::load(std::istream &in) {
+    uint32_t loaded = 0;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string first, second;
+        if (!(fields >> first >> second) || first[0] == ';' || first[0] == '#') {
+            continue;
+        }
+
+        // Assemblers usually emit "name: equ $1234" or "name = $1234"
+        if (first.back() == ':') {
+            first.pop_back();
+        }
+        if (second == "equ" || second == "EQU" || second == "=") {
+            fields >> second;
+        }
+
+        uint16_t address;
+        if (parseAddress(second, address)) {
+            add(address, first);
+        } else if (parseAddress(first, address)) {
+            add(address, second);
+        } else {
+            continue;
+        }
+        loaded++;
+    }
+    return loaded;
+}
+
+const std::string *Z80Labels::find(uint16_t address) const {
+    auto it = labels.find(address);
+    return it == labels.end() ? nullptr : &it->second;
+}
+
+std::string Z80Labels::nameOf(uint16_t address) const {
+    const std::string *label = find(address);
+    if (label != nullptr) {
+        return *label;
+    }
+
+    char hex[8];
+    std::snprintf(hex, sizeof(hex), "0x%04X", address);
+    return hex;
+}
@@ -0,0 +1,806 @@
+#include "z80lockstep.h"
+
+namespace {
+
+const uint8_t CARRY_MASK = 0x01;
+const uint8_t ADDSUB_MASK = 0x02;
+const uint8_t PARITY_MASK = 0x04;
+const uint8_t BIT3_MASK = 0x08;
+const uint8_t HALFCARRY_MASK = 0x10;
+const uint8_t BIT5_MASK = 0x20;
+const uint8_t ZERO_MASK = 0x40;
+const uint8_t SIGN_MASK = 0x80;
+const uint8_t FLAG_53_MASK = BIT5_MASK | BIT3_MASK;
+const uint8_t FLAG_SZP_MASK = SIGN_MASK | ZERO_MASK | PARITY_MASK;
+
+// No tables, the lookups would stop the vectorization
+
+// S, Z, 5 and 3 of a result
+inline uint8_t sz53(uint8_t value) {
+    return (value & (SIGN_MASK | FLAG_53_MASK)) | (value == 0 ? ZERO_MASK : 0);
+}
+
+// P/V set for an even number of bits
+inline uint8_t parity(uint8_t value) {
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return (~value & 1) << 2;
+}
+
+inline uint8_t blend(uint8_t mask, uint8_t value, uint8_t old) {
+    return (value & mask) | (old & ~mask);
+}
+
+inline uint16_t blend16(uint8_t mask, uint16_t value, uint16_t old) {
+    uint16_t mask16 = mask * 0x0101;
+    return (value & mask16) | (old & ~mask16);
+}
+
+// Flag tested by each condition code (NZ, Z, NC, C, PO, PE, P, M)
+const uint8_t conditionMask[] = {
+    ZERO_MASK, ZERO_MASK, CARRY_MASK, CARRY_MASK,
+    PARITY_MASK, PARITY_MASK, SIGN_MASK, SIGN_MASK
+};
+
+// Always taken
+const uint32_t ALWAYS = 8;
+
+// RLCA, RRCA, RLA, RRA, -, CPL, SCF, CCF. A template, so the switch is
+// resolved at compile time and the loop can be vectorized.
+template <uint32_t OP>
+void accumulatorKernel(uint8_t *a, uint8_t *f, const uint8_t *q, const uint8_t *active,
+        uint32_t count) {
+    for (uint32_t idx = 0; idx < count; idx++) {
+        uint8_t res8 = a[idx];
+        uint8_t carry = f[idx] & CARRY_MASK;
+        // Bits 3 and 5 of SCF/CCF depend on Q
+        uint8_t regQ = f[idx] & q[idx];
+        uint8_t flags;
+
+        switch (OP) {
+            case 0: // RLCA
+                carry = res8 >> 7;
+                res8 = (res8 << 1) | carry;
+                break;
+            case 1: // RRCA
+                carry = res8 & CARRY_MASK;
+                res8 = (res8 >> 1) | (carry << 7);
+                break;
+            case 2: // RLA
+                res8 = (res8 << 1) | carry;
+                carry = a[idx] >> 7;
+                break;
+            case 3: // RRA
+                res8 = (res8 >> 1) | (carry << 7);
+                carry = a[idx] & CARRY_MASK;
+                break;
+            case 5: // CPL
+                res8 = ~res8;
+                break;
+        }
+
+        switch (OP) {
+            case 5:
+                flags = (f[idx] & (FLAG_SZP_MASK | CARRY_MASK)) | HALFCARRY_MASK
+                        | ADDSUB_MASK | (res8 & FLAG_53_MASK);
+                break;
+            case 6: // SCF
+                flags = (f[idx] & FLAG_SZP_MASK) | (((regQ ^ f[idx]) | res8) & FLAG_53_MASK)
+                        | CARRY_MASK;
+                break;
+            case 7: // CCF
+                flags = (f[idx] & FLAG_SZP_MASK) | (((regQ ^ f[idx]) | res8) & FLAG_53_MASK)
+                        | (carry != 0 ? HALFCARRY_MASK : 0) | (carry ^ CARRY_MASK);
+                break;
+            default:
+                flags = (f[idx] & FLAG_SZP_MASK) | (res8 & FLAG_53_MASK) | carry;
+                break;
+        }
+
+        a[idx] = blend(active[idx], res8, a[idx]);
+        f[idx] = blend(active[idx], flags, f[idx]);
+    }
+}
+
+// RLC, RRC, RL, RR, SLA, SRA, SLL, SRL
+template <uint32_t OP>
+void shiftKernel(uint8_t *dst, uint8_t *f, const uint8_t *active, uint32_t count) {
+    for (uint32_t idx = 0; idx < count; idx++) {
+        uint8_t value = dst[idx];
+        uint8_t carry = f[idx] & CARRY_MASK;
+        uint8_t res8 = 0;
+
+        switch (OP) {
+            case 0: // RLC
+                res8 = (value << 1) | (value >> 7);
+                carry = value >> 7;
+                break;
+            case 1: // RRC
+                res8 = (value >> 1) | (value << 7);
+                carry = value & CARRY_MASK;
+                break;
+            case 2: // RL
+                res8 = (value << 1) | carry;
+                carry = value >> 7;
+                break;
+            case 3: // RR
+                res8 = (value >> 1) | (carry << 7);
+                carry = value & CARRY_MASK;
+                break;
+            case 4: // SLA
+                res8 = value << 1;
+                carry = value >> 7;
+                break;
+            case 5: // SRA
+                res8 = (value >> 1) | (value & SIGN_MASK);
+                carry = value & CARRY_MASK;
+                break;
+            case 6: // SLL
+                res8 = (value << 1) | CARRY_MASK;
+                carry = value >> 7;
+                break;
+            case 7: // SRL
+                res8 = value >> 1;
+                carry = value & CARRY_MASK;
+                break;
+        }
+
+        uint8_t flags = sz53(res8) | parity(res8) | carry;
+        dst[idx] = blend(active[idx], res8, dst[idx]);
+        f[idx] = blend(active[idx], flags, f[idx]);
+    }
+}
+
+// ADD HL,rr, from the register pair 'hi'/'lo' or from SP
+template <bool SP>
+void addHLKernel(uint8_t *h, uint8_t *l, uint8_t *f, uint16_t *wz, const uint8_t *hi,
+        const uint8_t *lo, const uint16_t *sp, const uint8_t *active, uint32_t count) {
+    for (uint32_t idx = 0; idx < count; idx++) {
+        uint16_t hl = (h[idx] << 8) | l[idx];
+        uint16_t oper16 = SP ? sp[idx] : static_cast<uint16_t>((hi[idx] << 8) | lo[idx]);
+        uint32_t tmp = hl + oper16;
+        uint16_t res = static_cast<uint16_t>(tmp);
+        uint8_t flags = (f[idx] & FLAG_SZP_MASK) | ((res >> 8) & FLAG_53_MASK)
+                | ((res & 0x0fff) < (oper16 & 0x0fff) ? HALFCARRY_MASK : 0)
+                | static_cast<uint8_t>(tmp >> 16);
+        wz[idx] = blend16(active[idx], hl + 1, wz[idx]);
+        h[idx] = blend(active[idx], res >> 8, h[idx]);
+        l[idx] = blend(active[idx], res & 0xff, l[idx]);
+        f[idx] = blend(active[idx], flags, f[idx]);
+    }
+}
+
+// SUB, SBC and CP
+template <bool CARRY, bool COMPARE>
+void subKernel(uint8_t *a, uint8_t *f, const uint8_t *src, const uint8_t *active,
+        uint32_t count) {
+    for (uint32_t idx = 0; idx < count; idx++) {
+        uint8_t oper8 = src[idx];
+        uint16_t res = static_cast<uint16_t>(a[idx] - oper8 - (CARRY ? f[idx] & CARRY_MASK : 0));
+        uint8_t res8 = static_cast<uint8_t>(res);
+        uint8_t flags = ((a[idx] ^ oper8 ^ res8) & HALFCARRY_MASK)
+                | ((((a[idx] ^ oper8) & (a[idx] ^ res8)) & 0x80) >> 5)
+                | ADDSUB_MASK | ((res >> 8) & CARRY_MASK);
+        if (COMPARE) {
+            // CP takes bits 3 and 5 from the operand
+            flags |= (res8 & SIGN_MASK) | (res8 == 0 ? ZERO_MASK : 0) | (oper8 & FLAG_53_MASK);
+        } else {
+            flags |= sz53(res8);
+            a[idx] = blend(active[idx], res8, a[idx]);
+        }
+        f[idx] = blend(active[idx], flags, f[idx]);
+    }
+}
+
+}
+
+Z80Lockstep::Z80Lockstep(uint32_t lanes) :
+    count(lanes), ram(nullptr), stopAddress(-1), laneInstructions(0) {
+    for (auto *array : { &regs.a, &regs.f, &regs.b, &regs.c, &regs.d, &regs.e,
+            &regs.h, &regs.l, &regs.r, &regs.q, &regs.status, &mask, &operand }) {
+        array->assign(lanes, 0);
+    }
+    regs.pc.assign(lanes, 0);
+    regs.sp.assign(lanes, 0);
+    regs.wz.assign(lanes, 0);
+    regs.tstates.assign(lanes, 0);
+}
+
+void Z80Lockstep::loadLane(uint32_t lane, const Z80 &cpu) {
+    regs.a[lane] = cpu.getRegA();
+    regs.f[lane] = cpu.getFlags();
+    regs.b[lane] = cpu.getRegB();
+    regs.c[lane] = cpu.getRegC();
+    regs.d[lane] = cpu.getRegD();
+    regs.e[lane] = cpu.getRegE();
+    regs.h[lane] = cpu.getRegH();
+    regs.l[lane] = cpu.getRegL();
+    regs.r[lane] = cpu.getRegR();
+    regs.q[lane] = cpu.isFlagQ() ? 0xff : 0x00;
+    regs.pc[lane] = cpu.getRegPC();
+    regs.sp[lane] = cpu.getRegSP();
+    regs.wz[lane] = cpu.getMemPtr();
+    regs.tstates[lane] = 0;
+    regs.status[lane] = cpu.isHalted() ? HALTED : RUNNING;
+}
+
+void Z80Lockstep::storeLane(uint32_t lane, Z80 &cpu) const {
+    cpu.setRegA(regs.a[lane]);
+    cpu.setFlags(regs.f[lane]);
+    cpu.setRegB(regs.b[lane]);
+    cpu.setRegC(regs.c[lane]);
+    cpu.setRegD(regs.d[lane]);
+    cpu.setRegE(regs.e[lane]);
+    cpu.setRegH(regs.h[lane]);
+    cpu.setRegL(regs.l[lane]);
+    cpu.setRegR(regs.r[lane]);
+    cpu.setFlagQ(regs.q[lane] != 0);
+    cpu.setRegPC(regs.pc[lane]);
+    cpu.setRegSP(regs.sp[lane]);
+    cpu.setMemPtr(regs.wz[lane]);
+    cpu.setHalted(regs.status[lane] == HALTED);
+}
+
+uint64_t Z80Lockstep::run(uint64_t maxSteps) {
+    uint8_t *status = regs.status.data();
+    const uint16_t *pc = regs.pc.data();
+    uint8_t *active = mask.data();
+
+    uint64_t steps = 0;
+    while (steps < maxSteps) {
+        // Branchless, so it vectorizes like the instructions
+        uint32_t lowest = 0x10000;
+        uint32_t stop = static_cast<uint32_t>(stopAddress);
+        for (uint32_t idx = 0, end = count; idx < end; idx++) {
+            uint8_t running = status[idx] == RUNNING ? 0xff : 0x00;
+            uint8_t stopped = running & (pc[idx] == stop ? 0xff : 0x00);
+            status[idx] = blend(stopped, STOPPED, status[idx]);
+            uint32_t candidate = (running & ~stopped) != 0 ? pc[idx] : 0x10000;
+            lowest = candidate < lowest ? candidate : lowest;
+        }
+
+        if (lowest == 0x10000) {
+            break;
+        }
+
+        uint32_t lanes = 0;
+        for (uint32_t idx = 0, end = count; idx < end; idx++) {
+            active[idx] = (status[idx] == RUNNING ? 0xff : 0x00)
+                    & (pc[idx] == lowest ? 0xff : 0x00);
+            lanes += active[idx] & 1;
+        }
+
+        if (step(static_cast<uint16_t>(lowest))) {
+            laneInstructions += lanes;
+        } else {
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                status[idx] = blend(active[idx], UNSUPPORTED, status[idx]);
+            }
+        }
+        steps++;
+    }
+    return steps;
+}
+
+uint8_t *Z80Lockstep::reg8(uint32_t index) {
+    switch (index) {
+        case 0: return regs.b.data();
+        case 1: return regs.c.data();
+        case 2: return regs.d.data();
+        case 3: return regs.e.data();
+        case 4: return regs.h.data();
+        case 5: return regs.l.data();
+        case 7: return regs.a.data();
+        default: return nullptr;    // (HL)
+    }
+}
+
+void Z80Lockstep::retire(uint16_t next, uint32_t tstates, uint32_t fetches, bool flags) {
+    uint16_t *pc = regs.pc.data();
+    const uint8_t *active = mask.data();
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        pc[idx] = blend16(active[idx], next, pc[idx]);
+    }
+    addTstates(tstates, 0);
+    retireFetch(fetches, flags);
+}
+
+void Z80Lockstep::addTstates(uint32_t tstates, uint32_t taken) {
+    // In its own loop, the 64 bit counters would stop the vectorization of
+    // the 8 and 16 bit registers. 'operand' is 0xFF for the lanes that took
+    // a branch, they take 'taken' T-states more.
+    uint64_t *clock = regs.tstates.data();
+    const uint8_t *branch = operand.data();
+    const uint8_t *active = mask.data();
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint64_t cycles = tstates + (taken & -static_cast<uint32_t>(branch[idx] & 1));
+        clock[idx] += cycles & -static_cast<uint64_t>(active[idx] & 1);
+    }
+}
+
+void Z80Lockstep::retireFetch(uint32_t fetches, bool flags) {
+    uint8_t *r = regs.r.data();
+    uint8_t *q = regs.q.data();
+    const uint8_t *active = mask.data();
+    uint8_t newQ = flags ? 0xff : 0x00;
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint8_t refresh = (r[idx] & 0x80) | ((r[idx] + fetches) & 0x7f);
+        r[idx] = blend(active[idx], refresh, r[idx]);
+        q[idx] = blend(active[idx], newQ, q[idx]);
+    }
+}
+
+void Z80Lockstep::fillOperand(uint8_t value) {
+    uint8_t *dst = operand.data();
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        dst[idx] = value;
+    }
+}
+
+void Z80Lockstep::gatherOperand(const uint8_t *hi, const uint8_t *lo) {
+    // Inactive lanes read too, harmless with the whole 64K mapped
+    uint8_t *dst = operand.data();
+    const uint8_t *memory = ram;
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        dst[idx] = memory[(hi[idx] << 8) | lo[idx]];
+    }
+}
+
+void Z80Lockstep::copy(uint8_t *dst, const uint8_t *src) {
+    const uint8_t *active = mask.data();
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        dst[idx] = blend(active[idx], src[idx], dst[idx]);
+    }
+}
+
+void Z80Lockstep::alu(uint32_t op, const uint8_t *src) {
+    uint8_t *a = regs.a.data();
+    uint8_t *f = regs.f.data();
+    const uint8_t *active = mask.data();
+    // ADC uses the carry, ADD doesn't
+    uint8_t carryIn = op == 1 ? CARRY_MASK : 0;
+
+    switch (op) {
+        case 0: // ADD
+        case 1: // ADC
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                uint8_t oper8 = src[idx];
+                uint16_t res = a[idx] + oper8 + (f[idx] & carryIn);
+                uint8_t res8 = static_cast<uint8_t>(res);
+                uint8_t flags = sz53(res8) | ((a[idx] ^ oper8 ^ res8) & HALFCARRY_MASK)
+                        | ((((a[idx] ^ ~oper8) & (a[idx] ^ res8)) & 0x80) >> 5)
+                        | static_cast<uint8_t>(res >> 8);
+                a[idx] = blend(active[idx], res8, a[idx]);
+                f[idx] = blend(active[idx], flags, f[idx]);
+            }
+            break;
+        case 2: // SUB
+            subKernel<false, false>(a, f, src, active, count);
+            break;
+        case 3: // SBC
+            subKernel<true, false>(a, f, src, active, count);
+            break;
+        case 7: // CP
+            subKernel<false, true>(a, f, src, active, count);
+            break;
+        case 4: // AND
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                uint8_t res8 = a[idx] & src[idx];
+                uint8_t flags = sz53(res8) | parity(res8) | HALFCARRY_MASK;
+                a[idx] = blend(active[idx], res8, a[idx]);
+                f[idx] = blend(active[idx], flags, f[idx]);
+            }
+            break;
+        case 5: // XOR
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                uint8_t res8 = a[idx] ^ src[idx];
+                uint8_t flags = sz53(res8) | parity(res8);
+                a[idx] = blend(active[idx], res8, a[idx]);
+                f[idx] = blend(active[idx], flags, f[idx]);
+            }
+            break;
+        case 6: // OR
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                uint8_t res8 = a[idx] | src[idx];
+                uint8_t flags = sz53(res8) | parity(res8);
+                a[idx] = blend(active[idx], res8, a[idx]);
+                f[idx] = blend(active[idx], flags, f[idx]);
+            }
+            break;
+    }
+}
+
+void Z80Lockstep::incDec(uint8_t *dst, bool dec) {
+    uint8_t *f = regs.f.data();
+    const uint8_t *active = mask.data();
+
+    if (dec) {
+        for (uint32_t idx = 0, end = count; idx < end; idx++) {
+            uint8_t res8 = dst[idx] - 1;
+            uint8_t flags = (f[idx] & CARRY_MASK) | sz53(res8) | ADDSUB_MASK
+                    | ((res8 & 0x0f) == 0x0f ? HALFCARRY_MASK : 0)
+                    | (res8 == 0x7f ? PARITY_MASK : 0);
+            dst[idx] = blend(active[idx], res8, dst[idx]);
+            f[idx] = blend(active[idx], flags, f[idx]);
+        }
+    } else {
+        for (uint32_t idx = 0, end = count; idx < end; idx++) {
+            uint8_t res8 = dst[idx] + 1;
+            uint8_t flags = (f[idx] & CARRY_MASK) | sz53(res8)
+                    | ((res8 & 0x0f) == 0x00 ? HALFCARRY_MASK : 0)
+                    | (res8 == 0x80 ? PARITY_MASK : 0);
+            dst[idx] = blend(active[idx], res8, dst[idx]);
+            f[idx] = blend(active[idx], flags, f[idx]);
+        }
+    }
+}
+
+void Z80Lockstep::accumulator(uint32_t op) {
+    uint8_t *a = regs.a.data();
+    uint8_t *f = regs.f.data();
+    const uint8_t *q = regs.q.data();
+    const uint8_t *active = mask.data();
+
+    switch (op) {
+        case 0: accumulatorKernel<0>(a, f, q, active, count); break;
+        case 1: accumulatorKernel<1>(a, f, q, active, count); break;
+        case 2: accumulatorKernel<2>(a, f, q, active, count); break;
+        case 3: accumulatorKernel<3>(a, f, q, active, count); break;
+        case 5: accumulatorKernel<5>(a, f, q, active, count); break;
+        case 6: accumulatorKernel<6>(a, f, q, active, count); break;
+        case 7: accumulatorKernel<7>(a, f, q, active, count); break;
+    }
+}
+
+void Z80Lockstep::shift(uint32_t op, uint8_t *dst) {
+    uint8_t *f = regs.f.data();
+    const uint8_t *active = mask.data();
+
+    switch (op) {
+        case 0: shiftKernel<0>(dst, f, active, count); break;
+        case 1: shiftKernel<1>(dst, f, active, count); break;
+        case 2: shiftKernel<2>(dst, f, active, count); break;
+        case 3: shiftKernel<3>(dst, f, active, count); break;
+        case 4: shiftKernel<4>(dst, f, active, count); break;
+        case 5: shiftKernel<5>(dst, f, active, count); break;
+        case 6: shiftKernel<6>(dst, f, active, count); break;
+        case 7: shiftKernel<7>(dst, f, active, count); break;
+    }
+}
+
+void Z80Lockstep::bit(uint32_t bit, const uint8_t *src) {
+    uint8_t *f = regs.f.data();
+    const uint8_t *active = mask.data();
+    uint8_t bitMask = 1 << bit;
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint8_t value = src[idx];
+        bool zero = (value & bitMask) == 0;
+        uint8_t flags = (value & FLAG_53_MASK) | HALFCARRY_MASK | (f[idx] & CARRY_MASK)
+                | (zero ? (PARITY_MASK | ZERO_MASK) : 0)
+                | (bit == 7 && !zero ? SIGN_MASK : 0);
+        f[idx] = blend(active[idx], flags, f[idx]);
+    }
+}
+
+void Z80Lockstep::incDec16(uint32_t pair, bool dec) {
+    const uint8_t *active = mask.data();
+    uint16_t delta = dec ? 0xffff : 0x0001;
+
+    if (pair == 3) {
+        uint16_t *sp = regs.sp.data();
+        for (uint32_t idx = 0, end = count; idx < end; idx++) {
+            sp[idx] = blend16(active[idx], sp[idx] + delta, sp[idx]);
+        }
+        return;
+    }
+
+    uint8_t *hi = reg8(pair * 2);
+    uint8_t *lo = reg8(pair * 2 + 1);
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint16_t res = ((hi[idx] << 8) | lo[idx]) + delta;
+        hi[idx] = blend(active[idx], res >> 8, hi[idx]);
+        lo[idx] = blend(active[idx], res & 0xff, lo[idx]);
+    }
+}
+
+void Z80Lockstep::addHL(uint32_t pair) {
+    uint8_t *h = regs.h.data();
+    uint8_t *l = regs.l.data();
+    uint8_t *f = regs.f.data();
+    uint16_t *wz = regs.wz.data();
+    const uint8_t *active = mask.data();
+
+    if (pair == 3) {
+        addHLKernel<true>(h, l, f, wz, nullptr, nullptr, regs.sp.data(), active, count);
+    } else {
+        addHLKernel<false>(h, l, f, wz, reg8(pair * 2), reg8(pair * 2 + 1), nullptr,
+                active, count);
+    }
+}
+
+void Z80Lockstep::djnz(uint16_t address) {
+    uint8_t *b = regs.b.data();
+    uint16_t *pc = regs.pc.data();
+    uint16_t *wz = regs.wz.data();
+    uint8_t *branch = operand.data();
+    const uint8_t *active = mask.data();
+    uint16_t target = address + 2 + static_cast<int8_t>(ram[static_cast<uint16_t>(address + 1)]);
+    uint16_t next = address + 2;
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint8_t counter = b[idx] - 1;
+        uint8_t taken = counter != 0 ? active[idx] : 0x00;
+        b[idx] = blend(active[idx], counter, b[idx]);
+        pc[idx] = blend16(active[idx], blend16(taken, target, next), pc[idx]);
+        wz[idx] = blend16(taken, target, wz[idx]);
+        branch[idx] = taken;
+    }
+    addTstates(8, 5);
+    retireFetch(1, false);
+}
+
+void Z80Lockstep::jumpRelative(uint16_t address, uint32_t condition) {
+    const uint8_t *f = regs.f.data();
+    uint16_t *pc = regs.pc.data();
+    uint16_t *wz = regs.wz.data();
+    uint8_t *branch = operand.data();
+    const uint8_t *active = mask.data();
+    uint16_t target = address + 2 + static_cast<int8_t>(ram[static_cast<uint16_t>(address + 1)]);
+    uint16_t next = address + 2;
+    uint8_t flag = condition == ALWAYS ? 0 : conditionMask[condition];
+    uint8_t expected = condition == ALWAYS ? 0 : (condition & 1) * flag;
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint8_t taken = (f[idx] & flag) == expected ? active[idx] : 0x00;
+        pc[idx] = blend16(active[idx], blend16(taken, target, next), pc[idx]);
+        wz[idx] = blend16(taken, target, wz[idx]);
+        branch[idx] = taken;
+    }
+    addTstates(7, 5);
+    retireFetch(1, false);
+}
+
+void Z80Lockstep::jumpAbsolute(uint16_t address, uint32_t condition) {
+    const uint8_t *f = regs.f.data();
+    uint16_t *pc = regs.pc.data();
+    uint16_t *wz = regs.wz.data();
+    const uint8_t *active = mask.data();
+    uint16_t target = ram[static_cast<uint16_t>(address + 1)]
+            | (ram[static_cast<uint16_t>(address + 2)] << 8);
+    uint16_t next = address + 3;
+    uint8_t flag = condition == ALWAYS ? 0 : conditionMask[condition];
+    uint8_t expected = condition == ALWAYS ? 0 : (condition & 1) * flag;
+
+    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+        uint8_t taken = (f[idx] & flag) == expected ? active[idx] : 0x00;
+        pc[idx] = blend16(active[idx], blend16(taken, target, next), pc[idx]);
+        wz[idx] = blend16(active[idx], target, wz[idx]);
+    }
+    addTstates(10, 0);
+    retireFetch(1, false);
+}
+
+bool Z80Lockstep::step(uint16_t address) {
+    uint8_t opCode = ram[address];
+    uint8_t value = ram[static_cast<uint16_t>(address + 1)];
+    uint16_t word = value | (ram[static_cast<uint16_t>(address + 2)] << 8);
+
+    if (opCode >= 0x40 && opCode < 0x80) {
+        // LD r,r' / LD r,(HL) / HALT
+        if (opCode == 0x76) {
+            uint8_t *status = regs.status.data();
+            const uint8_t *active = mask.data();
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                status[idx] = blend(active[idx], HALTED, status[idx]);
+            }
+            retire(address + 1, 4, 1, false);
+            return true;
+        }
+
+        uint8_t *dst = reg8((opCode >> 3) & 0x07);
+        if (dst == nullptr) {
+            return false;   // LD (HL),r
+        }
+
+        const uint8_t *src = reg8(opCode & 0x07);
+        if (src == nullptr) {
+            gatherOperand(regs.h.data(), regs.l.data());
+            src = operand.data();
+        }
+        copy(dst, src);
+        retire(address + 1, src == operand.data() ? 7 : 4, 1, false);
+        return true;
+    }
+
+    if (opCode >= 0x80 && opCode < 0xC0) {
+        // ALU A,r / ALU A,(HL)
+        const uint8_t *src = reg8(opCode & 0x07);
+        if (src == nullptr) {
+            gatherOperand(regs.h.data(), regs.l.data());
+            src = operand.data();
+        }
+        alu((opCode >> 3) & 0x07, src);
+        retire(address + 1, src == operand.data() ? 7 : 4, 1, true);
+        return true;
+    }
+
+    if (opCode < 0x40) {
+        uint32_t pair = opCode >> 4;
+        switch (opCode & 0x0f) {
+            case 0x01: // LD rr,nn
+                if (pair == 3) {
+                    uint16_t *sp = regs.sp.data();
+                    const uint8_t *active = mask.data();
+                    for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                        sp[idx] = blend16(active[idx], word, sp[idx]);
+                    }
+                } else {
+                    fillOperand(word >> 8);
+                    copy(reg8(pair * 2), operand.data());
+                    fillOperand(word & 0xff);
+                    copy(reg8(pair * 2 + 1), operand.data());
+                }
+                retire(address + 3, 10, 1, false);
+                return true;
+            case 0x03: // INC rr
+            case 0x0B: // DEC rr
+                incDec16(pair, (opCode & 0x08) != 0);
+                retire(address + 1, 6, 1, false);
+                return true;
+            case 0x09: // ADD HL,rr
+                addHL(pair);
+                retire(address + 1, 11, 1, true);
+                return true;
+        }
+
+        uint32_t index = (opCode >> 3) & 0x07;
+        switch (opCode & 0x07) {
+            case 0x04: // INC r
+            case 0x05: // DEC r
+                if (index == 6) {
+                    return false;   // INC/DEC (HL)
+                }
+                incDec(reg8(index), (opCode & 0x01) != 0);
+                retire(address + 1, 4, 1, true);
+                return true;
+            case 0x06: // LD r,n
+                if (index == 6) {
+                    return false;   // LD (HL),n
+                }
+                fillOperand(value);
+                copy(reg8(index), operand.data());
+                retire(address + 2, 7, 1, false);
+                return true;
+            case 0x07: // RLCA, RRCA, RLA, RRA, DAA, CPL, SCF, CCF
+                if (index == 4) {
+                    return false;   // DAA
+                }
+                accumulator(index);
+                retire(address + 1, 4, 1, true);
+                return true;
+        }
+
+        switch (opCode) {
+            case 0x00: // NOP
+                retire(address + 1, 4, 1, false);
+                return true;
+            case 0x0A: // LD A,(BC)
+            case 0x1A: // LD A,(DE)
+            {
+                const uint8_t *hi = reg8(pair * 2);
+                const uint8_t *lo = reg8(pair * 2 + 1);
+                uint16_t *wz = regs.wz.data();
+                const uint8_t *active = mask.data();
+                gatherOperand(hi, lo);
+                copy(regs.a.data(), operand.data());
+                for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                    uint16_t next = ((hi[idx] << 8) | lo[idx]) + 1;
+                    wz[idx] = blend16(active[idx], next, wz[idx]);
+                }
+                retire(address + 1, 7, 1, false);
+                return true;
+            }
+            case 0x3A: // LD A,(nn)
+            {
+                uint16_t *wz = regs.wz.data();
+                const uint8_t *active = mask.data();
+                fillOperand(ram[word]);
+                copy(regs.a.data(), operand.data());
+                for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                    wz[idx] = blend16(active[idx], word + 1, wz[idx]);
+                }
+                retire(address + 3, 13, 1, false);
+                return true;
+            }
+            case 0x10: // DJNZ e
+                djnz(address);
+                return true;
+            case 0x18: // JR e
+                jumpRelative(address, ALWAYS);
+                return true;
+            case 0x20: // JR NZ,e
+            case 0x28: // JR Z,e
+            case 0x30: // JR NC,e
+            case 0x38: // JR C,e
+                jumpRelative(address, (opCode - 0x20) >> 3);
+                return true;
+        }
+        return false;
+    }
+
+    switch (opCode) {
+        case 0xC3: // JP nn
+            jumpAbsolute(address, ALWAYS);
+            return true;
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        case 0xE2: case 0xEA: case 0xF2: case 0xFA: // JP cc,nn
+            jumpAbsolute(address, (opCode >> 3) & 0x07);
+            return true;
+        case 0xE9: // JP (HL)
+        {
+            const uint8_t *h = regs.h.data();
+            const uint8_t *l = regs.l.data();
+            uint16_t *pc = regs.pc.data();
+            const uint8_t *active = mask.data();
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                uint16_t hl = (h[idx] << 8) | l[idx];
+                pc[idx] = blend16(active[idx], hl, pc[idx]);
+            }
+            addTstates(4, 0);
+            retireFetch(1, false);
+            return true;
+        }
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE: // ALU A,n
+            fillOperand(value);
+            alu((opCode >> 3) & 0x07, operand.data());
+            retire(address + 2, 7, 1, true);
+            return true;
+        case 0xCB:
+            return stepCB(address, value);
+    }
+    return false;
+}
+
+bool Z80Lockstep::stepCB(uint16_t address, uint8_t opCode) {
+    uint8_t *reg = reg8(opCode & 0x07);
+    if (reg == nullptr) {
+        return false;   // (HL) forms
+    }
+
+    uint32_t index = (opCode >> 3) & 0x07;
+    const uint8_t *active = mask.data();
+    switch (opCode >> 6) {
+        case 0: // Rotations and shifts
+            shift(index, reg);
+            retire(address + 2, 8, 2, true);
+            return true;
+        case 1: // BIT b,r
+            bit(index, reg);
+            retire(address + 2, 8, 2, true);
+            return true;
+        case 2: // RES b,r
+        {
+            uint8_t clear = ~(1 << index);
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                reg[idx] = blend(active[idx], reg[idx] & clear, reg[idx]);
+            }
+            break;
+        }
+        default: // SET b,r
+        {
+            uint8_t set = 1 << index;
+            for (uint32_t idx = 0, end = count; idx < end; idx++) {
+                reg[idx] = blend(active[idx], reg[idx] | set, reg[idx]);
+            }
+            break;
+        }
+    }
+    retire(address + 2, 8, 2, false);
+    return true;
+}
@@ -0,0 +1,32 @@
+#include <algorithm>
+
+#include "z80machine.h"
+
+template class Z80MachineBase<Z80Memory>;
+
+Z80Machine::Z80Machine() : writeHooks() {
+}
+
+Z80Machine::~Z80Machine() = default;
+
+void Z80Machine::poke8(uint16_t address, uint8_t value) {
+    // One test for the pages without a hook, nearly all of them
+    const WriteHookEntry &entry = writeHooks[address >> Z80Memory::PAGE_SHIFT];
+    bool store = entry.hook == nullptr || address < entry.first || address > entry.last
+            || entry.hook->write(address, value, tstates);
+    tstates += 3;
+    if (store) {
+        memory.write(address, value);
+    }
+}
+
+void Z80Machine::setWriteHook(uint16_t first, uint16_t last, Z80WriteHook *hook) {
+    for (uint32_t page = first >> Z80Memory::PAGE_SHIFT; page <= last >> Z80Memory::PAGE_SHIFT;
+            page++) {
+        uint32_t base = page << Z80Memory::PAGE_SHIFT;
+        WriteHookEntry &entry = writeHooks[page];
+        entry.hook = hook;
+        entry.first = static_cast<uint16_t>(std::max<uint32_t>(first, base));
+        entry.last = static_cast<uint16_t>(std::min<uint32_t>(last, base + Z80Memory::PAGE_SIZE - 1));
+    }
+}
@@ -0,0 +1,30 @@
+#include <algorithm>
+#include <cstring>
+
+#include "z80memory.h"
+
+void Z80Memory::clear(uint8_t value) {
+    memset(ram, value, sizeof(ram));
+    dirtyPages.markAll();
+}
+
+void Z80Memory::load(uint16_t address, const uint8_t *data, size_t size) {
+    while (size != 0) {
+        size_t chunk = std::min(size, static_cast<size_t>(SIZE - address));
+        memcpy(&ram[address], data, chunk);
+        dirtyPages.markRange(address, chunk);
+        data += chunk;
+        size -= chunk;
+        address = static_cast<uint16_t>(address + chunk);
+    }
+}
+
+void Z80Memory::save(uint16_t address, uint8_t *data, size_t size) const {
+    while (size != 0) {
+        size_t chunk = std::min(size, static_cast<size_t>(SIZE - address));
+        memcpy(data, &ram[address], chunk);
+        data += chunk;
+        size -= chunk;
+        address = static_cast<uint16_t>(address + chunk);
+    }
+}
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <map>
+
+#include "z80portmap.h"
+
+void Z80PortDevice::inBlock(uint16_t port, uint8_t *data, size_t size, uint64_t tstates,
+        uint32_t step) {
+    for (size_t idx = 0; idx < size; idx++) {
+        data[idx] = in(port, tstates);
+        port -= 0x100;
+        tstates += step;
+    }
+}
+
+void Z80PortDevice::outBlock(uint16_t port, const uint8_t *data, size_t size, uint64_t tstates,
+        uint32_t step) {
+    for (size_t idx = 0; idx < size; idx++) {
+        out(port, data[idx], tstates);
+        port -= 0x100;
+        tstates += step;
+    }
+}
+
+Z80PortMap::Z80PortMap() : compiled(false), paging(false), floating(0xff) {
+}
+
+void Z80PortMap::map(uint16_t mask, uint16_t value, Z80PortDevice *device) {
+    rules.push_back({ mask, static_cast<uint16_t>(value & mask), device });
+    compiled = false;
+}
+
+void Z80PortMap::unmap(Z80PortDevice *device) {
+    rules.erase(std::remove_if(rules.begin(), rules.end(),
+            [device](const Rule &rule) { return rule.device == device; }), rules.end());
+    compiled = false;
+}
+
+void Z80PortMap::clear() {
+    rules.clear();
+    compiled = false;
+}
+
+Z80PortDevice *Z80PortMap::getDevice(uint16_t port) {
+    const DeviceSet &set = lookup(port);
+    return set.count != 0 ? devices[set.first] : nullptr;
+}
+
+void Z80PortMap::compile() {
+    sets.assign(1, DeviceSet { 0, 0, false });
+    devices.clear();
+    table.clear();
+    compiled = true;
+    paging = false;
+    if (rules.empty()) {
+        return;
+    }
+
+    // Every distinct list of matching devices becomes a set. A device with
+    // several matching rules is in the list once.
+    std::map<std::vector<Z80PortDevice *>, uint16_t> known;
+    std::vector<Z80PortDevice *> matching;
+    table.resize(0x10000);
+    for (uint32_t port = 0; port < 0x10000; port++) {
+        matching.clear();
+        for (const Rule &rule : rules) {
+            if ((port & rule.mask) == rule.value
+                    && std::find(matching.begin(), matching.end(), rule.device) == matching.end()) {
+                matching.push_back(rule.device);
+            }
+        }
+        if (matching.empty()) {
+            table[port] = 0;
+            continue;
+        }
+
+        auto found = known.find(matching);
+        if (found == known.end()) {
+            uint16_t index = static_cast<uint16_t>(sets.size());
+            bool pages = std::any_of(matching.begin(), matching.end(),
+                    [](const Z80PortDevice *device) { return device->changesMemory(); });
+            sets.push_back({ static_cast<uint32_t>(devices.size()),
+                    static_cast<uint32_t>(matching.size()), pages });
+            paging = paging || pages;
+            devices.insert(devices.end(), matching.begin(), matching.end());
+            found = known.emplace(matching, index).first;
+        }
+        table[port] = found->second;
+    }
+}
+
+uint8_t Z80PortMap::inShared(const DeviceSet &set, uint16_t port, uint64_t tstates) {
+    uint8_t value = 0xff;
+    for (uint32_t idx = set.first; idx < set.first + set.count; idx++) {
+        value &= devices[idx]->in(port, tstates);
+    }
+    return value;
+}
+
+bool Z80PortMap::pagingBurst(uint16_t port, size_t size) {
+    // B wraps around after 256 iterations, so do the ports
+    for (size_t idx = 0; idx < std::min<size_t>(size, 0x100); idx++) {
+        if (lookup(port - idx * 0x100).paging) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Z80PortMap::sameSet(uint16_t port, size_t first, size_t size) {
+    const DeviceSet &set = lookup(port - first * 0x100);
+    size_t last = first + 1;
+    while (last < size && &lookup(port - last * 0x100) == &set) {
+        last++;
+    }
+    return last - first;
+}
+
+void Z80PortMap::inBlock(uint16_t port, uint8_t *data, size_t size, uint64_t tstates,
+        uint32_t step) {
+    for (size_t first = 0; first < size;) {
+        size_t run = sameSet(port, first, size);
+        uint16_t runPort = port - first * 0x100;
+        const DeviceSet &set = lookup(runPort);
+        if (set.count == 1) {
+            devices[set.first]->inBlock(runPort, data + first, run, tstates + first * step, step);
+        } else {
+            for (size_t idx = first; idx < first + run; idx++) {
+                data[idx] = set.count == 0 ? floating
+                        : inShared(set, port - idx * 0x100, tstates + idx * step);
+            }
+        }
+        first += run;
+    }
+}
+
+void Z80PortMap::outBlock(uint16_t port, const uint8_t *data, size_t size, uint64_t tstates,
+        uint32_t step) {
+    for (size_t first = 0; first < size;) {
+        size_t run = sameSet(port, first, size);
+        uint16_t runPort = port - first * 0x100;
+        const DeviceSet &set = lookup(runPort);
+        for (uint32_t idx = set.first; idx < set.first + set.count; idx++) {
+            devices[idx]->outBlock(runPort, data + first, run, tstates + first * step, step);
+        }
+        first += run;
+    }
+}
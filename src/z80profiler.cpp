@@ -0,0 +1,136 @@
+#include "z80profiler.h"
+
+Z80CallProfiler::Z80CallProfiler() {
+    reset(0);
+}
+
+void Z80CallProfiler::reset(uint64_t tstates) {
+    nodes.clear();
+    children.clear();
+    stack.clear();
+    droppedCalls = 0;
+    lastTstates = tstates;
+
+    nodes.push_back({ 0, 0, Z80Flow::CALL, 1, 0, 0 });
+    stack.push_back({ 0, 0, tstates });
+}
+
+void Z80CallProfiler::charge(uint64_t tstates) {
+    nodes[stack.back().node].exclusive += tstates - lastTstates;
+    lastTstates = tstates;
+}
+
+void Z80CallProfiler::enter(Z80Flow kind, uint16_t address, uint16_t sp, uint64_t tstates) {
+    if (stack.size() >= MAX_DEPTH) {
+        droppedCalls++;
+        return;
+    }
+
+    uint32_t parent = stack.back().node;
+    uint64_t key = (static_cast<uint64_t>(parent) << 24)
+            | (static_cast<uint64_t>(kind) << 16) | address;
+
+    uint32_t node;
+    auto it = children.find(key);
+    if (it == children.end()) {
+        node = static_cast<uint32_t>(nodes.size());
+        nodes.push_back({ parent, address, kind, 0, 0, 0 });
+        children.emplace(key, node);
+    } else {
+        node = it->second;
+    }
+
+    nodes[node].calls++;
+    stack.push_back({ node, sp, tstates });
+}
+
+void Z80CallProfiler::leave(uint64_t tstates) {
+    const Frame &frame = stack.back();
+    nodes[frame.node].inclusive += tstates - frame.entry;
+    stack.pop_back();
+}
+
+void Z80CallProfiler::sync(uint16_t sp, uint64_t tstates) {
+    // The root frame is never closed here. Signed distance, because the
+    // stack can wrap around 0x0000
+    if (stack.size() == 1 || static_cast<int16_t>(sp - stack.back().sp) <= 0) {
+        return;
+    }
+
+    charge(tstates);
+    while (stack.size() > 1 && static_cast<int16_t>(sp - stack.back().sp) > 0) {
+        leave(tstates);
+    }
+}
+
+void Z80CallProfiler::onFlow(Z80Flow event, uint16_t address, uint16_t sp, uint64_t tstates) {
+    sync(sp, tstates);
+
+    switch (event) {
+        case Z80Flow::CALL:
+        case Z80Flow::RST:
+        case Z80Flow::INT:
+        case Z80Flow::NMI:
+            charge(tstates);
+            enter(event, address, sp, tstates);
+            break;
+        default:
+            // Returns were already handled by sync. A RET that doesn't
+            // release any frame is a computed jump.
+            break;
+    }
+}
+
+void Z80CallProfiler::finish(uint64_t tstates) {
+    charge(tstates);
+    while (stack.size() > 1) {
+        leave(tstates);
+    }
+    nodes[0].inclusive = tstates - stack.back().entry;
+}
+
+std::string Z80CallProfiler::nodeName(const Node &node) const {
+    if (&node == &nodes[0]) {
+        return "[root]";
+    }
+
+    std::string name;
+    if (node.kind == Z80Flow::INT) {
+        name = "[int]";
+    } else if (node.kind == Z80Flow::NMI) {
+        name = "[nmi]";
+    }
+
+    return name + labels.nameOf(node.address);
+}
+
+std::string Z80CallProfiler::pathOf(uint32_t node) const {
+    std::vector<uint32_t> path;
+    for (uint32_t idx = node; idx != 0; idx = nodes[idx].parent) {
+        path.push_back(idx);
+    }
+
+    std::string folded = nodeName(nodes[0]);
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        folded += ';';
+        folded += nodeName(nodes[*it]);
+    }
+    return folded;
+}
+
+void Z80CallProfiler::writeFolded(std::ostream &out) const {
+    for (uint32_t idx = 0; idx < nodes.size(); idx++) {
+        if (nodes[idx].exclusive != 0) {
+            out << pathOf(idx) << ' ' << nodes[idx].exclusive << '\n';
+        }
+    }
+}
+
+void Z80CallProfiler::writeReport(std::ostream &out) const {
+    out << "calls,inclusive,exclusive,path\n";
+    for (uint32_t idx = 0; idx < nodes.size(); idx++) {
+        const Node &node = nodes[idx];
+        out << node.calls << ',' << node.inclusive << ',' << node.exclusive
+            << ',' << pathOf(idx) << '\n';
+    }
+}
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "z80replay.h"
+
+namespace {
+
+// Tag byte of each event
+enum : uint8_t {
+    TAG_IN,
+    TAG_IN_SAME_PORT,
+    TAG_INT_LOW,
+    TAG_INT_HIGH,
+    TAG_NMI
+};
+
+const char MAGIC[4] = { 'Z', '8', '0', 'I' };
+const uint8_t VERSION = 1;
+
+void putNumber(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool getNumber(const std::vector<uint8_t> &in, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        if (pos == in.size()) {
+            return false;
+        }
+        uint8_t byte = in[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+void Z80InputLog::clear() {
+    bytes.clear();
+    events = 0;
+    lastTstates = 0;
+    lastPort = 0;
+}
+
+void Z80InputLog::append(const Event &event) {
+    uint8_t tag = TAG_NMI;
+    switch (event.kind) {
+        case Kind::IN:
+            tag = event.port == lastPort ? TAG_IN_SAME_PORT : TAG_IN;
+            break;
+        case Kind::INT:
+            tag = event.value != 0 ? TAG_INT_HIGH : TAG_INT_LOW;
+            break;
+        case Kind::NMI:
+            break;
+    }
+
+    bytes.push_back(tag);
+    putNumber(bytes, event.tstates - lastTstates);
+    lastTstates = event.tstates;
+
+    if (tag == TAG_IN) {
+        bytes.push_back(event.port & 0xff);
+        bytes.push_back(event.port >> 8);
+        lastPort = event.port;
+    }
+    if (event.kind == Kind::IN) {
+        bytes.push_back(event.value);
+    }
+    events++;
+}
+
+bool Z80InputLog::next(Reader &reader, Event &event) const {
+    if (reader.pos >= bytes.size()) {
+        return false;
+    }
+
+    size_t pos = reader.pos;
+    uint8_t tag = bytes[pos++];
+    uint64_t delta;
+    if (!getNumber(bytes, pos, delta)) {
+        return false;
+    }
+    event.tstates = reader.tstates + delta;
+    event.port = 0;
+    event.value = 0;
+
+    switch (tag) {
+        case TAG_IN:
+            if (pos + 2 > bytes.size()) {
+                return false;
+            }
+            reader.port = bytes[pos] | (bytes[pos + 1] << 8);
+            pos += 2;
+            // Fall through
+        case TAG_IN_SAME_PORT:
+            if (pos == bytes.size()) {
+                return false;
+            }
+            event.kind = Kind::IN;
+            event.port = reader.port;
+            event.value = bytes[pos++];
+            break;
+        case TAG_INT_LOW:
+        case TAG_INT_HIGH:
+            event.kind = Kind::INT;
+            event.value = tag == TAG_INT_HIGH ? 1 : 0;
+            break;
+        case TAG_NMI:
+            event.kind = Kind::NMI;
+            break;
+        default:
+            return false;
+    }
+
+    reader.pos = pos;
+    reader.tstates = event.tstates;
+    return true;
+}
+
+void Z80InputLog::save(std::ostream &out) const {
+    out.write(MAGIC, sizeof(MAGIC));
+    out.put(static_cast<char>(VERSION));
+
+    std::vector<uint8_t> header;
+    putNumber(header, events);
+    putNumber(header, bytes.size());
+    out.write(reinterpret_cast<const char *>(header.data()), header.size());
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
+
+bool Z80InputLog::load(std::istream &in) {
+    char magic[sizeof(MAGIC)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MAGIC)
+            || in.get() != VERSION) {
+        return false;
+    }
+
+    // The header numbers, read a byte at a time
+    uint64_t header[2];
+    for (uint64_t &value : header) {
+        std::vector<uint8_t> number;
+        int byte;
+        do {
+            byte = in.get();
+            if (byte == EOF || number.size() == 10) {
+                return false;
+            }
+            number.push_back(static_cast<uint8_t>(byte));
+        } while (byte & 0x80);
+
+        size_t pos = 0;
+        if (!getNumber(number, pos, value)) {
+            return false;
+        }
+    }
+
+    // The size comes from the file, so the buffer only grows as the bytes
+    // arrive: a damaged size fails at the end of the stream instead of
+    // allocating it up front
+    const uint64_t CHUNK = 1 << 16;
+    std::vector<uint8_t> data;
+    while (data.size() < header[1]) {
+        size_t start = data.size();
+        data.resize(start + std::min(CHUNK, header[1] - start));
+        if (!in.read(reinterpret_cast<char *>(data.data() + start), data.size() - start)) {
+            return false;
+        }
+    }
+
+    // Replay the writer to know its last T-state and port, so that more
+    // events can be appended
+    Z80InputLog loaded;
+    loaded.bytes.swap(data);
+    Reader reader;
+    Event event;
+    uint64_t count = 0;
+    while (loaded.next(reader, event)) {
+        count++;
+    }
+    if (reader.pos != loaded.bytes.size() || count != header[0]) {
+        return false;
+    }
+
+    bytes.swap(loaded.bytes);
+    events = count;
+    lastTstates = reader.tstates;
+    lastPort = reader.port;
+    return true;
+}
@@ -0,0 +1,193 @@
+#include <cstring>
+
+#include "z80rewind.h"
+
+/*
+ * RLE of XOR data: a byte with a run of zeros, a byte with a count of
+ * literal bytes and the literals, repeated until the data is covered.
+ */
+void Z80Rewind::encode(const uint8_t *xorData, size_t size, std::vector<uint8_t> &out) {
+    size_t pos = 0;
+    while (pos < size) {
+        size_t zeros = 0;
+        while (pos + zeros < size && zeros < 255 && xorData[pos + zeros] == 0) {
+            zeros++;
+        }
+        pos += zeros;
+
+        // Literals end at a pair of zeros, a single one is cheaper inline
+        size_t literals = 0;
+        while (pos + literals < size && literals < 255
+                && !(xorData[pos + literals] == 0
+                    && (pos + literals + 1 == size || xorData[pos + literals + 1] == 0))) {
+            literals++;
+        }
+
+        out.push_back(static_cast<uint8_t>(zeros));
+        out.push_back(static_cast<uint8_t>(literals));
+        out.insert(out.end(), xorData + pos, xorData + pos + literals);
+        pos += literals;
+    }
+}
+
+const uint8_t *Z80Rewind::decodeXor(const uint8_t *in, uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        pos += *in++;
+        uint8_t literals = *in++;
+        for (uint32_t idx = 0; idx < literals; idx++) {
+            data[pos++] ^= *in++;
+        }
+    }
+    return in;
+}
+
+void Z80Rewind::applyDelta(const Snapshot &snapshot, uint8_t *ram) {
+    const uint8_t *in = snapshot.delta.data();
+    snapshot.pages.forEach([&](uint32_t page) {
+        in = decodeXor(in, &ram[page << Z80Memory::PAGE_SHIFT], Z80Memory::PAGE_SIZE);
+    });
+}
+
+size_t Z80Rewind::sizeOf(const Snapshot &snapshot) {
+    return sizeof(Snapshot) + snapshot.delta.capacity() + snapshot.full.capacity();
+}
+
+Z80Rewind::Z80Rewind(Z80Machine &machine, size_t budget, uint32_t keyframeInterval) :
+    machine(machine), budget(budget), keyframeInterval(keyframeInterval), sinceKeyframe(0),
+    used(0), shadow(Z80Memory::SIZE), work(Z80Memory::SIZE) {
+}
+
+void Z80Rewind::clear() {
+    snapshots.clear();
+    used = 0;
+    sinceKeyframe = 0;
+}
+
+void Z80Rewind::capture() {
+    Z80Memory &memory = machine.getMemory();
+    const uint8_t *ram = memory.data();
+    Z80Memory::DirtyMap dirty = memory.takeDirtyPages();
+
+    snapshots.emplace_back();
+    Snapshot &snapshot = snapshots.back();
+    machine.getCpu().saveState(snapshot.cpu);
+    snapshot.tstates = machine.getTstates();
+    snapshot.pages.clear();
+
+    if (snapshots.size() == 1) {
+        // Nothing to be relative to
+        memcpy(shadow.data(), ram, Z80Memory::SIZE);
+        sinceKeyframe = keyframeInterval;
+    } else {
+        uint8_t xorPage[Z80Memory::PAGE_SIZE];
+        dirty.forEach([&](uint32_t page) {
+            uint32_t base = page << Z80Memory::PAGE_SHIFT;
+            uint8_t changed = 0;
+            for (uint32_t idx = 0; idx < Z80Memory::PAGE_SIZE; idx++) {
+                xorPage[idx] = ram[base + idx] ^ shadow[base + idx];
+                changed |= xorPage[idx];
+            }
+
+            // Written with the same values
+            if (changed == 0) {
+                return;
+            }
+
+            snapshot.pages.mark(static_cast<uint16_t>(base));
+            encode(xorPage, Z80Memory::PAGE_SIZE, snapshot.delta);
+            memcpy(&shadow[base], &ram[base], Z80Memory::PAGE_SIZE);
+        });
+        snapshot.delta.shrink_to_fit();
+    }
+
+    if (sinceKeyframe >= keyframeInterval) {
+        encode(ram, Z80Memory::SIZE, snapshot.full);
+        snapshot.full.shrink_to_fit();
+        sinceKeyframe = 0;
+    }
+    sinceKeyframe++;
+
+    used += sizeOf(snapshot);
+    trim();
+}
+
+void Z80Rewind::trim() {
+    // The newest one is always kept. The deltas only go backward, so
+    // dropping from the front doesn't break any other.
+    while (used > budget && snapshots.size() > 1) {
+        used -= sizeOf(snapshots.front());
+        snapshots.pop_front();
+    }
+}
+
+bool Z80Rewind::restore(uint32_t index) {
+    if (index >= snapshots.size()) {
+        return false;
+    }
+    uint32_t last = static_cast<uint32_t>(snapshots.size() - 1);
+
+    // Cost of each way, in encoded bytes to walk through
+    size_t backward = 0;
+    for (uint32_t idx = index + 1; idx <= last; idx++) {
+        backward += snapshots[idx].delta.size();
+    }
+
+    int64_t keyframe = index;
+    while (keyframe >= 0 && snapshots[keyframe].full.empty()) {
+        keyframe--;
+    }
+
+    size_t forward = SIZE_MAX;
+    if (keyframe >= 0) {
+        forward = snapshots[keyframe].full.size();
+        for (uint32_t idx = keyframe + 1; idx <= index; idx++) {
+            forward += snapshots[idx].delta.size();
+        }
+    }
+
+    if (forward < backward) {
+        memset(work.data(), 0, Z80Memory::SIZE);
+        decodeXor(snapshots[keyframe].full.data(), work.data(), Z80Memory::SIZE);
+        for (uint32_t idx = keyframe + 1; idx <= index; idx++) {
+            applyDelta(snapshots[idx], work.data());
+        }
+    } else {
+        work = shadow;
+        for (uint32_t idx = last; idx > index; idx--) {
+            applyDelta(snapshots[idx], work.data());
+        }
+    }
+
+    // New timeline from here
+    while (snapshots.size() > index + 1) {
+        used -= sizeOf(snapshots.back());
+        snapshots.pop_back();
+    }
+    sinceKeyframe = keyframe >= 0 ? index - keyframe + 1 : keyframeInterval;
+
+    shadow.swap(work);
+    Z80Memory &memory = machine.getMemory();
+    memory.load(0, shadow.data(), Z80Memory::SIZE);
+    memory.clearDirtyPages();
+    machine.getCpu().loadState(snapshots[index].cpu);
+    machine.setTstates(snapshots[index].tstates);
+    return true;
+}
+
+bool Z80Rewind::seek(uint64_t tstates) {
+    uint32_t index = static_cast<uint32_t>(snapshots.size());
+    while (index > 0 && snapshots[index - 1].tstates > tstates) {
+        index--;
+    }
+    if (index == 0) {
+        return false;
+    }
+
+    restore(index - 1);
+    if (machine.getTstates() < tstates) {
+        uint64_t instructions = 0;
+        machine.run(tstates, 0, instructions);
+    }
+    return machine.getTstates() >= tstates;
+}
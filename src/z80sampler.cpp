@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "z80sampler.h"
+
+namespace {
+
+// True when 'address' is just behind a CALL nn, CALL cc,nn or RST p
+bool isReturnAddress(const uint8_t *memory, uint16_t address) {
+    uint8_t rst = memory[static_cast<uint16_t>(address - 1)];
+    if ((rst & 0xC7) == 0xC7) {
+        return true;
+    }
+
+    uint8_t call = memory[static_cast<uint16_t>(address - 3)];
+    return call == 0xCD || (call & 0xC7) == 0xC4;
+}
+
+}
+
+Z80Sampler::Z80Sampler(uint32_t period, uint32_t capacity) :
+    period(period), capacity(capacity) {
+    buffer.reserve(capacity);
+    start(0);
+}
+
+void Z80Sampler::start(uint64_t tstates) {
+    buffer.clear();
+    hotAddresses.clear();
+    hotCallers.clear();
+    totalSamples = 0;
+    deadline = tstates + period;
+}
+
+void Z80Sampler::sample(const Z80 &cpu, const uint8_t *memory, uint64_t tstates) {
+    if (buffer.size() == capacity) {
+        flush();
+    }
+
+    Sample smp;
+    smp.tstates = tstates;
+    smp.pc = cpu.getRegPC();
+    smp.sp = cpu.getRegSP();
+    smp.caller = 0xFF;
+
+    uint16_t address = smp.sp;
+    for (uint32_t idx = 0; idx < STACK_WORDS; idx++) {
+        smp.stack[idx] = memory[address] | (memory[static_cast<uint16_t>(address + 1)] << 8);
+        if (smp.caller == 0xFF && isReturnAddress(memory, smp.stack[idx])) {
+            smp.caller = idx;
+        }
+        address += 2;
+    }
+
+    buffer.push_back(smp);
+    totalSamples++;
+
+    deadline += period;
+    if (deadline <= tstates) {
+        deadline = tstates + period;
+    }
+}
+
+void Z80Sampler::flush() {
+    for (const Sample &smp : buffer) {
+        hotAddresses[smp.pc]++;
+        if (smp.caller != 0xFF) {
+            hotCallers[smp.stack[smp.caller]]++;
+        }
+    }
+    buffer.clear();
+}
+
+void Z80Sampler::writeHot(std::ostream &out, const std::unordered_map<uint16_t, uint64_t> &hot,
+        uint32_t limit) {
+    std::vector<std::pair<uint16_t, uint64_t>> sorted(hot.begin(), hot.end());
+    std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<uint16_t, uint64_t> &a, const std::pair<uint16_t, uint64_t> &b) {
+                return a.second != b.second ? a.second > b.second : a.first < b.first;
+            });
+
+    if (sorted.size() > limit) {
+        sorted.resize(limit);
+    }
+
+    out << "samples,percent,address\n";
+    for (const auto &entry : sorted) {
+        char line[48];
+        std::snprintf(line, sizeof(line), "%llu,%.2f,0x%04X\n",
+                static_cast<unsigned long long>(entry.second),
+                totalSamples == 0 ? 0.0 : 100.0 * entry.second / totalSamples,
+                entry.first);
+        out << line;
+    }
+}
+
+void Z80Sampler::writeHotAddresses(std::ostream &out, uint32_t limit) {
+    flush();
+    writeHot(out, hotAddresses, limit);
+}
+
+void Z80Sampler::writeHotCallers(std::ostream &out, uint32_t limit) {
+    flush();
+    writeHot(out, hotCallers, limit);
+}
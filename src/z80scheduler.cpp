@@ -0,0 +1,159 @@
+#include "z80scheduler.h"
+
+Z80SharedMemory::Z80SharedMemory(uint32_t size, uint32_t cpus) : committed(size, 0), views(cpus) {
+    for (View &view : views) {
+        view.overlay.resize(size);
+        view.written.resize(size);
+    }
+}
+
+void Z80SharedMemory::write(uint32_t cpu, uint32_t offset, uint8_t value) {
+    View &view = views[cpu];
+    view.overlay[offset] = value;
+    view.written[offset] = true;
+    view.log.push_back({ offset, value });
+}
+
+void Z80SharedMemory::commit() {
+    for (View &view : views) {
+        for (const Write &write : view.log) {
+            committed[write.offset] = write.value;
+            view.written[write.offset] = false;
+        }
+        view.log.clear();
+    }
+}
+
+uint8_t Z80Mailbox::receive(uint8_t empty) {
+    if (inbox.empty()) {
+        return empty;
+    }
+
+    uint8_t value = inbox.front();
+    inbox.pop_front();
+    return value;
+}
+
+void Z80Mailbox::commit() {
+    inbox.insert(inbox.end(), outbox.begin(), outbox.end());
+    outbox.clear();
+}
+
+Z80Scheduler::Z80Scheduler(uint32_t quantum) :
+    quantum(quantum != 0 ? quantum : 1), referenceHz(0), time(0), generation(0), quantumEnd(0), running(0),
+    shutdown(false) {
+}
+
+Z80Scheduler::~Z80Scheduler() {
+    stopThreads();
+}
+
+uint32_t Z80Scheduler::addMachine(std::unique_ptr<Z80Machine> machine, uint32_t clockHz) {
+    bool threaded = !workers.empty();
+    stopThreads();
+
+    if (machines.empty() && referenceHz == 0) {
+        referenceHz = clockHz;
+    }
+    machines.push_back({ std::move(machine), clockHz, 0 });
+
+    setThreaded(threaded);
+    return static_cast<uint32_t>(machines.size() - 1);
+}
+
+void Z80Scheduler::setThreaded(bool state) {
+    if (!state) {
+        stopThreads();
+        return;
+    }
+
+    if (!workers.empty()) {
+        return;
+    }
+
+    shutdown = false;
+    workers.reserve(machines.size());
+    for (uint32_t idx = 0; idx < machines.size(); idx++) {
+        workers.emplace_back(&Z80Scheduler::workerLoop, this, idx, generation);
+    }
+}
+
+void Z80Scheduler::stopThreads() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        shutdown = true;
+    }
+    startQuantum.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+uint64_t Z80Scheduler::deadline(const Core &core, uint64_t end) const {
+    if (core.clockHz == 0 || referenceHz == 0 || core.clockHz == referenceHz) {
+        return end;
+    }
+
+    // Split to avoid the overflow of end * clockHz
+    return end / referenceHz * core.clockHz + end % referenceHz * core.clockHz / referenceHz;
+}
+
+void Z80Scheduler::runCore(uint32_t index, uint64_t end) {
+    Core &core = machines[index];
+    uint64_t limit = deadline(core, end);
+    // 0 means no limit for run(), nothing to do yet
+    if (limit != 0) {
+        core.machine->run(limit, 0, core.instructions);
+    }
+}
+
+void Z80Scheduler::workerLoop(uint32_t index, uint64_t seen) {
+    for (;;) {
+        uint64_t end;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            startQuantum.wait(guard, [this, seen] { return shutdown || generation != seen; });
+            if (shutdown) {
+                return;
+            }
+            seen = generation;
+            end = quantumEnd;
+        }
+
+        runCore(index, end);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--running == 0) {
+            endQuantum.notify_one();
+        }
+    }
+}
+
+void Z80Scheduler::run(uint64_t tstates) {
+    uint64_t goal = time + tstates;
+
+    while (time < goal) {
+        uint64_t end = time + quantum;
+
+        if (workers.empty()) {
+            for (uint32_t idx = 0; idx < machines.size(); idx++) {
+                runCore(idx, end);
+            }
+        } else {
+            std::unique_lock<std::mutex> guard(lock);
+            quantumEnd = end;
+            running = static_cast<uint32_t>(workers.size());
+            generation++;
+            startQuantum.notify_all();
+            endQuantum.wait(guard, [this] { return running == 0; });
+        }
+
+        // Every CPU is stopped here, in the same order every time
+        for (Z80SharedResource *resource : resources) {
+            resource->commit();
+        }
+        time = end;
+    }
+}
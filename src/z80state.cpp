@@ -0,0 +1,109 @@
+#include <cstring>
+#include <initializer_list>
+
+#include "z80state.h"
+
+/*
+ * Image layout, every word little-endian:
+ *
+ *   0  "Z80S"
+ *   4  version
+ *   6  size of the whole image
+ *   8  A F
+ *  10  BC DE HL AF' BC' DE' HL' IX IY SP PC WZ
+ *  34  I R
+ *  36  interrupt mode, pending prefix
+ *  38  IFF1 IFF2 pendingEI NMI halted pinReset Q bit7(R), from bit 0
+ *  39  flagQ of the instruction in progress (bit 0)
+ *
+ * F holds the carry flag in bit 0. R is stored as held, with its bit 7
+ * apart from the one written to the register.
+ */
+namespace {
+
+const uint8_t MAGIC[4] = { 'Z', '8', '0', 'S' };
+
+void putWord(uint8_t *&out, uint16_t word) {
+    *out++ = word & 0xff;
+    *out++ = word >> 8;
+}
+
+uint16_t getWord(const uint8_t *&in) {
+    uint16_t word = in[0] | (in[1] << 8);
+    in += 2;
+    return word;
+}
+
+}
+
+void Z80State::serialize(uint8_t *buffer) const {
+    uint8_t *out = buffer;
+    memcpy(out, MAGIC, sizeof(MAGIC));
+    out += sizeof(MAGIC);
+    putWord(out, VERSION);
+    putWord(out, SERIALIZED_SIZE);
+
+    *out++ = regA;
+    *out++ = carryFlag ? sz5h3pnFlags | 0x01 : sz5h3pnFlags;
+    for (const RegisterPair *pair : { &regBC, &regDE, &regHL, &regAFx, &regBCx, &regDEx,
+            &regHLx, &regIX, &regIY, &regSP, &regPC, &memptr }) {
+        putWord(out, pair->word);
+    }
+    *out++ = regI;
+    *out++ = regR;
+    *out++ = modeINT;
+    *out++ = prefixOpcode;
+
+    uint8_t flags = 0;
+    const bool bits[] = { ffIFF1, ffIFF2, pendingEI, activeNMI, halted, pinReset,
+        lastFlagQ, regRbit7 };
+    for (uint32_t bit = 0; bit < 8; bit++) {
+        flags |= bits[bit] ? 1 << bit : 0;
+    }
+    *out++ = flags;
+    *out++ = flagQ ? 0x01 : 0x00;
+}
+
+bool Z80State::deserialize(const uint8_t *buffer, size_t size) {
+    // Later versions may only append fields, so the fields read here keep
+    // their offsets. Images of a later version are refused all the same,
+    // what they append can't be restored.
+    if (size < 8 || memcmp(buffer, MAGIC, sizeof(MAGIC)) != 0) {
+        return false;
+    }
+
+    const uint8_t *in = buffer + sizeof(MAGIC);
+    uint16_t version = getWord(in);
+    uint16_t length = getWord(in);
+    if (version == 0 || version > VERSION || length < SERIALIZED_SIZE || length > size) {
+        return false;
+    }
+
+    Z80State state;
+    state.regA = *in++;
+    state.sz5h3pnFlags = *in & 0xfe;
+    state.carryFlag = (*in++ & 0x01) != 0;
+    for (RegisterPair *pair : { &state.regBC, &state.regDE, &state.regHL, &state.regAFx,
+            &state.regBCx, &state.regDEx, &state.regHLx, &state.regIX, &state.regIY,
+            &state.regSP, &state.regPC, &state.memptr }) {
+        pair->word = getWord(in);
+    }
+    state.regI = *in++;
+    state.regR = *in++;
+    if (*in > IM2) {
+        return false;
+    }
+    state.modeINT = static_cast<IntMode>(*in++);
+    state.prefixOpcode = *in++;
+
+    uint8_t flags = *in++;
+    bool *bits[] = { &state.ffIFF1, &state.ffIFF2, &state.pendingEI, &state.activeNMI,
+        &state.halted, &state.pinReset, &state.lastFlagQ, &state.regRbit7 };
+    for (uint32_t bit = 0; bit < 8; bit++) {
+        *bits[bit] = (flags & (1 << bit)) != 0;
+    }
+    state.flagQ = (*in & 0x01) != 0;
+
+    *this = state;
+    return true;
+}
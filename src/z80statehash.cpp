@@ -0,0 +1,107 @@
+#include <cstring>
+
+#include "z80statehash.h"
+
+namespace {
+
+const uint64_t PRIME1 = UINT64_C(0x9E3779B185EBCA87);
+const uint64_t PRIME2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+
+inline uint64_t rotl(uint64_t value, uint32_t bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Final avalanche, every input bit changes half the output bits
+inline uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= UINT64_C(0xFF51AFD7ED558CCD);
+    value ^= value >> 33;
+    value *= UINT64_C(0xC4CEB9FE1A85EC53);
+    return value ^ (value >> 33);
+}
+
+}
+
+Z80StateHash::Z80StateHash() : pageHash(), memoryHash(0), pagesHashed(0), valid(false) {
+}
+
+uint64_t Z80StateHash::hashBytes(const uint8_t *data, size_t size, uint64_t seed) {
+    uint64_t hash = seed * PRIME1 ^ size;
+    size_t pos = 0;
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        memcpy(&word, data + pos, sizeof(word));
+        hash = rotl(hash ^ (word * PRIME2), 31) * PRIME1;
+    }
+    for (; pos < size; pos++) {
+        hash = rotl(hash ^ (data[pos] * PRIME2), 31) * PRIME1;
+    }
+    return mix(hash);
+}
+
+uint64_t Z80StateHash::hashCpu(const Z80 &cpu) {
+    Z80State state;
+    cpu.saveState(state);
+    // Bit 7 of the counter is kept apart, the CPU never sees it
+    state.regR &= 0x7f;
+
+    uint8_t image[Z80State::SERIALIZED_SIZE];
+    state.serialize(image);
+    return hashBytes(image, sizeof(image), 0);
+}
+
+void Z80StateHash::update(const Z80Memory &memory, const Z80Memory::DirtyMap &dirtyPages) {
+    Z80Memory::DirtyMap pages = dirtyPages;
+    if (!valid) {
+        pages.markAll();
+        memoryHash = 0;
+        for (uint64_t &hash : pageHash) {
+            hash = 0;
+        }
+        valid = true;
+    }
+
+    // XOR of the page hashes, each seeded with its page number so equal
+    // pages don't cancel each other
+    pages.forEach([&](uint32_t page) {
+        uint64_t hash = hashBytes(memory.page(page), Z80Memory::PAGE_SIZE, page + 1);
+        memoryHash ^= pageHash[page] ^ hash;
+        pageHash[page] = hash;
+        pagesHashed++;
+    });
+}
+
+uint64_t Z80StateHash::combine(const Z80 &cpu) const {
+    return mix(hashCpu(cpu) ^ rotl(memoryHash, 17) * PRIME2);
+}
+
+uint64_t Z80StateHash::hash(Z80Machine &machine) {
+    Z80Memory &memory = machine.getMemory();
+    update(memory, memory.takeDirtyPages());
+    return combine(machine.getCpu());
+}
+
+Z80LoopDetector::Z80LoopDetector(size_t capacity)
+    : capacity(capacity != 0 ? capacity : 1), loopStart(0), loopPeriod(0) {
+}
+
+bool Z80LoopDetector::check(uint64_t hash, uint64_t time) {
+    auto found = seen.find(hash);
+    if (found != seen.end()) {
+        loopStart = found->second;
+        loopPeriod = time - found->second;
+        return true;
+    }
+
+    if (seen.size() >= capacity) {
+        seen.clear();
+    }
+    seen.emplace(hash, time);
+    return false;
+}
+
+void Z80LoopDetector::clear() {
+    seen.clear();
+    loopStart = 0;
+    loopPeriod = 0;
+}
@@ -0,0 +1,64 @@
+#include <iomanip>
+
+#include "z80stats.h"
+
+namespace {
+
+struct StatsTable {
+    const char *name;
+    const uint64_t *counters;
+};
+
+void tablesOf(const Z80OpcodeStats &stats, StatsTable (&tables)[5]) {
+    tables[0] = { "main", stats.main };
+    tables[1] = { "cb", stats.cb };
+    tables[2] = { "ddfd", stats.ddfd };
+    tables[3] = { "ddfdcb", stats.ddfdcb };
+    tables[4] = { "ed", stats.ed };
+}
+
+}
+
+void writeOpcodeStatsCSV(const Z80OpcodeStats &stats, std::ostream &out) {
+    StatsTable tables[5];
+    tablesOf(stats, tables);
+
+    // setfill() isn't part of the flags, both are restored at the end
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+    out << "table,opcode,count\n";
+    for (const StatsTable &table : tables) {
+        for (uint32_t opCode = 0; opCode < 256; opCode++) {
+            if (table.counters[opCode] == 0) {
+                continue;
+            }
+            out << table.name << ",0x" << std::hex << std::uppercase
+                << std::setw(2) << std::setfill('0') << opCode
+                << std::dec << "," << table.counters[opCode] << "\n";
+        }
+    }
+    out << "prefix,redundant," << stats.redundantPrefixes << "\n";
+    out << "prefix,fallback," << stats.ddfdFallbacks << "\n";
+    out.flags(flags);
+    out.fill(fill);
+}
+
+void writeOpcodeStatsJSON(const Z80OpcodeStats &stats, std::ostream &out) {
+    StatsTable tables[5];
+    tablesOf(stats, tables);
+
+    out << "{\n";
+    for (const StatsTable &table : tables) {
+        out << "  \"" << table.name << "\": [";
+        for (uint32_t opCode = 0; opCode < 256; opCode++) {
+            if (opCode != 0) {
+                out << (opCode % 16 == 0 ? ",\n    " : ", ");
+            }
+            out << table.counters[opCode];
+        }
+        out << "],\n";
+    }
+    out << "  \"redundantPrefixes\": " << stats.redundantPrefixes << ",\n";
+    out << "  \"ddfdFallbacks\": " << stats.ddfdFallbacks << "\n";
+    out << "}\n";
+}
@@ -0,0 +1,194 @@
+#include <cstdio>
+
+#include "z80trace.h"
+
+namespace {
+
+// Shadow stack depth limit, deeper calls get no span
+const uint32_t MAX_DEPTH = 1024;
+
+// T-states of an I/O cycle, minimum length of a burst span
+const uint32_t IO_CYCLE = 4;
+
+void writeString(std::ostream &out, const std::string &text) {
+    out << '"';
+    for (char chr : text) {
+        if (chr == '"' || chr == '\\') {
+            out << '\\';
+        }
+        out << chr;
+    }
+    out << '"';
+}
+
+}
+
+Z80TraceRecorder::Z80TraceRecorder(uint32_t capacity) :
+    capacity(capacity), clockHz(3500000), burstGap(1000), traceAllCalls(false),
+    inHalt(false), started(false), haltStart(0), droppedEvents(0) {
+    events.reserve(capacity);
+    stack.reserve(MAX_DEPTH);
+    burst.count = 0;
+}
+
+void Z80TraceRecorder::record(const Event &event) {
+    if (events.size() == capacity) {
+        droppedEvents++;
+        return;
+    }
+    events.push_back(event);
+}
+
+void Z80TraceRecorder::sync(uint16_t sp, uint64_t tstates) {
+    // Signed distance, the stack can wrap around 0x0000
+    while (!stack.empty() && static_cast<int16_t>(sp - stack.back().sp) > 0) {
+        const Frame &frame = stack.back();
+        if (frame.span) {
+            record({ tstates, 0, 0, frame.address, 'E', frame.kind });
+        }
+        stack.pop_back();
+    }
+}
+
+void Z80TraceRecorder::onFlow(Z80Flow event, uint16_t address, uint16_t sp, uint64_t tstates) {
+    sync(sp, tstates);
+
+    Kind kind;
+    switch (event) {
+        case Z80Flow::CALL:
+        case Z80Flow::RST:
+            kind = KIND_CALL;
+            break;
+        case Z80Flow::INT:
+            kind = KIND_INT;
+            break;
+        case Z80Flow::NMI:
+            kind = KIND_NMI;
+            break;
+        default:
+            return;
+    }
+
+    if (stack.size() == MAX_DEPTH) {
+        return;
+    }
+
+    bool span = kind != KIND_CALL || traceAllCalls || labels.find(address) != nullptr;
+    stack.push_back({ sp, span, kind, address });
+    if (span) {
+        record({ tstates, 0, 0, address, 'B', kind });
+    }
+}
+
+void Z80TraceRecorder::haltChange(bool halted, uint64_t tstates) {
+    inHalt = halted;
+    if (halted) {
+        haltStart = tstates;
+    } else {
+        record({ haltStart, tstates - haltStart, 0, 0, 'X', KIND_HALT });
+    }
+}
+
+void Z80TraceRecorder::closeBurst() {
+    if (burst.count != 0) {
+        record({ burst.start, burst.last - burst.start + IO_CYCLE, burst.count,
+                burst.port, 'X', burst.kind });
+        burst.count = 0;
+    }
+}
+
+void Z80TraceRecorder::onPortIO(uint16_t port, bool output, uint64_t tstates) {
+    Kind kind = output ? KIND_OUT : KIND_IN;
+    if (burst.count != 0 && burst.port == port && burst.kind == kind
+            && tstates - burst.last <= burstGap) {
+        burst.count++;
+        burst.last = tstates;
+        return;
+    }
+
+    closeBurst();
+    burst = { tstates, tstates, 1, port, kind };
+}
+
+void Z80TraceRecorder::writeEvent(std::ostream &out, const Event &event) {
+    static const char *const trackNames[] = { "", "CPU", "HALT", "I/O" };
+    static const char *const categories[] = { "call", "int", "nmi", "halt", "in", "out" };
+
+    Track track;
+    std::string name;
+    char port[8];
+    switch (event.kind) {
+        case KIND_CALL:
+            track = TRACK_CPU;
+            name = labels.nameOf(event.address);
+            break;
+        case KIND_INT:
+        case KIND_NMI:
+            track = TRACK_CPU;
+            name = (event.kind == KIND_INT ? "INT " : "NMI ") + labels.nameOf(event.address);
+            break;
+        case KIND_HALT:
+            track = TRACK_HALT;
+            name = "HALT";
+            break;
+        default:
+            track = TRACK_IO;
+            std::snprintf(port, sizeof(port), "0x%04X", event.address);
+            name = (event.kind == KIND_IN ? "IN " : "OUT ") + std::string(port);
+            break;
+    }
+
+    if (!started) {
+        started = true;
+        out << "{\"traceEvents\":[\n";
+        for (uint32_t tid = TRACK_CPU; tid <= TRACK_IO; tid++) {
+            out << (tid == TRACK_CPU ? "" : ",\n")
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                << ",\"args\":{\"name\":\"" << trackNames[tid] << "\"}}";
+        }
+    }
+
+    char number[32];
+    out << ",\n{\"name\":";
+    writeString(out, name);
+    std::snprintf(number, sizeof(number), "%.3f", event.tstates * 1e6 / clockHz);
+    out << ",\"cat\":\"" << categories[event.kind] << "\",\"ph\":\"" << event.phase
+        << "\",\"ts\":" << number << ",\"pid\":1,\"tid\":" << static_cast<int>(track);
+
+    if (event.phase == 'X') {
+        std::snprintf(number, sizeof(number), "%.3f", event.duration * 1e6 / clockHz);
+        out << ",\"dur\":" << number;
+        if (event.count != 0) {
+            out << ",\"args\":{\"accesses\":" << event.count << "}";
+        }
+    }
+    out << '}';
+}
+
+void Z80TraceRecorder::flush(std::ostream &out) {
+    for (const Event &event : events) {
+        writeEvent(out, event);
+    }
+    events.clear();
+}
+
+void Z80TraceRecorder::close(std::ostream &out, uint64_t tstates) {
+    closeBurst();
+    if (inHalt) {
+        haltChange(false, tstates);
+    }
+
+    while (!stack.empty()) {
+        if (stack.back().span) {
+            record({ tstates, 0, 0, stack.back().address, 'E', stack.back().kind });
+        }
+        stack.pop_back();
+    }
+
+    flush(out);
+    if (!started) {
+        out << "{\"traceEvents\":[";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    started = false;
+}